@@ -10,6 +10,7 @@
 #include <limits>
 #include <memory>
 #include <random>
+#include <atomic>
 #include <cmath>
 
 extern std::ostream& operator<<(std::ostream& o, const glm::mat4& m);
@@ -26,18 +27,24 @@ namespace glm
 const float pi = glm::pi<float>();
 const float infinity = std::numeric_limits<float>::infinity();
 
+// Each thread gets its own generator; the first one uses the default seed
+inline std::mt19937& random_generator()
+{
+   static std::atomic<unsigned int> next_seed(std::mt19937::default_seed);
+   thread_local std::mt19937 generator(next_seed++);
+   return generator;
+}
+
 inline float random_float() 
 {
-   static std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-   static std::mt19937 generator;
-   return distribution(generator); 
+   std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+   return distribution(random_generator()); 
 }
 
 inline float random_float(float min, float max) 
 {
-   static std::uniform_real_distribution<float> distribution(min, max);
-   static std::mt19937 generator;
-   return distribution(generator);
+   std::uniform_real_distribution<float> distribution(min, max);
+   return distribution(random_generator());
 }
 
 inline glm::vec3 random_unit_cube() 
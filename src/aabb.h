@@ -0,0 +1,77 @@
+// aabb.h, axis-aligned bounding box, after https://raytracing.github.io (The Next Week)
+
+#ifndef AABB_H_
+#define AABB_H_
+
+#include "AGLM.h"
+#include "ray.h"
+
+class aabb {
+public:
+   aabb() : minimum(infinity), maximum(-infinity) {}
+   aabb(const glm::point3& a, const glm::point3& b) : minimum(a), maximum(b) {}
+
+   glm::point3 min() const { return minimum; }
+   glm::point3 max() const { return maximum; }
+
+   bool empty() const {
+      return minimum.x > maximum.x || minimum.y > maximum.y || minimum.z > maximum.z;
+   }
+
+   glm::point3 centroid() const { return 0.5f * (minimum + maximum); }
+   glm::vec3 extent() const { return maximum - minimum; }
+
+   float surface_area() const {
+      if (empty()) return 0.0f;
+      glm::vec3 d = extent();
+      return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+   }
+
+   int longest_axis() const {
+      glm::vec3 d = extent();
+      if (d.x > d.y && d.x > d.z) return 0;
+      return d.y > d.z ? 1 : 2;
+   }
+
+   void grow(const glm::point3& p) {
+      minimum = glm::min(minimum, p);
+      maximum = glm::max(maximum, p);
+   }
+
+   void grow(const aabb& b) {
+      minimum = glm::min(minimum, b.minimum);
+      maximum = glm::max(maximum, b.maximum);
+   }
+
+   // slab test; inv_dir is 1 / r.direction() computed once per ray
+   bool hit(const glm::point3& origin, const glm::vec3& inv_dir,
+      float min_t, float max_t, float& t_enter) const
+   {
+      glm::vec3 t0 = (minimum - origin) * inv_dir;
+      glm::vec3 t1 = (maximum - origin) * inv_dir;
+      glm::vec3 tsmall = glm::min(t0, t1);
+      glm::vec3 tbig = glm::max(t0, t1);
+      float tmin = std::max(std::max(tsmall.x, tsmall.y), std::max(tsmall.z, min_t));
+      float tmax = std::min(std::min(tbig.x, tbig.y), std::min(tbig.z, max_t));
+      t_enter = tmin;
+      return tmin <= tmax;
+   }
+
+   bool hit(const ray& r, float min_t, float max_t) const {
+      float t_enter;
+      return hit(r.origin(), 1.0f / r.direction(), min_t, max_t, t_enter);
+   }
+
+public:
+   glm::point3 minimum;
+   glm::point3 maximum;
+};
+
+inline aabb surrounding_box(const aabb& a, const aabb& b)
+{
+   aabb box = a;
+   box.grow(b);
+   return box;
+}
+
+#endif
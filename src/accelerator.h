@@ -0,0 +1,17 @@
+// accelerator.h, common interface of the structures that find the closest hit in a scene
+
+#ifndef ACCELERATOR_H_
+#define ACCELERATOR_H_
+
+#include "ray.h"
+#include "hittable.h"
+#include <string>
+
+class accelerator {
+public:
+   virtual bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const = 0;
+   virtual std::string name() const = 0;
+   virtual ~accelerator() {}
+};
+
+#endif
@@ -0,0 +1,94 @@
+// accelerators.h, builds the acceleration structure for a scene, either the
+// one requested or one picked from the primitive count and size distribution
+
+#ifndef ACCELERATORS_H_
+#define ACCELERATORS_H_
+
+#include "accelerator.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "grid.h"
+#include <chrono>
+#include <sstream>
+
+enum class accelerator_type { automatic, brute_force, grid, bvh, bvh4, bvh8 };
+
+struct accelerator_report {
+   std::string name;
+   std::string reason; // why it was chosen
+   double build_seconds = 0;
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "accelerator: " << name << " (" << reason << "), built in "
+         << build_seconds * 1000.0 << " ms" << std::endl;
+      return ss.str();
+   }
+};
+
+// Few primitives: testing them all is cheapest. Many primitives of similar
+// size spread over the scene (particles, the helix in materials.cpp): a
+// uniform grid builds in linear time and its cells stay evenly filled.
+// Otherwise (mixed sizes, large and small objects together): a BVH.
+inline accelerator_type choose_accelerator(const std::vector<std::shared_ptr<hittable>>& objects,
+   std::string& reason)
+{
+   std::vector<float> sizes;
+   aabb scene;
+   for (size_t i = 0; i < objects.size(); i++) {
+      aabb box;
+      if (objects[i]->bounding_box(box)) {
+         sizes.push_back(glm::length(box.extent()));
+         scene.grow(box);
+      }
+   }
+
+   std::ostringstream ss;
+   int n = (int) sizes.size();
+   if (n <= 16) {
+      ss << n << " bounded primitives";
+      reason = ss.str();
+      return accelerator_type::brute_force;
+   }
+
+   double mean = 0, mean_sqr = 0;
+   for (int i = 0; i < n; i++) {
+      mean += sizes[i];
+      mean_sqr += double(sizes[i]) * sizes[i];
+   }
+   mean /= n;
+   mean_sqr /= n;
+   double variation = mean > 0 ? std::sqrt(std::max(0.0, mean_sqr - mean * mean)) / mean : 0.0;
+   double relative_size = mean / std::max(1e-12f, glm::length(scene.extent()));
+
+   ss << n << " primitives, size variation " << variation << ", mean size " << relative_size << " of scene";
+   reason = ss.str();
+   if (variation < 0.5 && relative_size < 0.1) return accelerator_type::grid;
+   return n < 1024 ? accelerator_type::bvh : accelerator_type::bvh8;
+}
+
+// The accelerator shares the world's arena, so it may outlive the world
+inline std::shared_ptr<accelerator> build_accelerator(const hittable_list& world,
+   accelerator_type type, accelerator_report& report)
+{
+   report.reason = "requested";
+   if (type == accelerator_type::automatic) {
+      type = choose_accelerator(world.objects, report.reason);
+   }
+
+   auto start = std::chrono::steady_clock::now();
+   std::shared_ptr<accelerator> accel;
+   switch (type) {
+   case accelerator_type::brute_force: accel = std::make_shared<hittable_list>(world); break;
+   case accelerator_type::grid: accel = std::make_shared<grid>(world.objects, 4.0f, world.arena); break;
+   case accelerator_type::bvh4: accel = std::make_shared<wide_bvh<4>>(world.objects, world.arena); break;
+   case accelerator_type::bvh8: accel = std::make_shared<wide_bvh<8>>(world.objects, world.arena); break;
+   default: accel = std::make_shared<bvh>(world.objects, 4, world.arena); break;
+   }
+   report.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   report.name = accel->name();
+   return accel;
+}
+
+#endif
@@ -0,0 +1,136 @@
+// aov.h, arbitrary output variables of a render, from its camera rays
+//
+// Compositing and denoising need more than the image: what the camera saw
+// first, per pixel. render (render.h) sums it into a feature_buffer from
+// the same camera rays as the image, so no second pass is traced. Each
+// variable can be read as linear floats, for float images (.pfm), or
+// mapped to [0, 1] for 8-bit ones: the image with the gamma of the
+// materials renderer, normals as 0.5 * (n + 1), depth and sample counts
+// over their largest value, ids as distinct colors. Ids number objects and
+// materials from 1 in the order they first appear in the image, row by
+// row; 0 is nothing.
+
+#ifndef AOV_H_
+#define AOV_H_
+
+#include "AGLM.h"
+#include "ppm_image.h"
+#include "render.h"
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum class aov_type { beauty, normal, depth, albedo, object_id, material_id, sample_count };
+
+inline const char* aov_name(aov_type which)
+{
+   switch (which) {
+   case aov_type::beauty: return "beauty";
+   case aov_type::normal: return "normal";
+   case aov_type::depth: return "depth";
+   case aov_type::albedo: return "albedo";
+   case aov_type::object_id: return "object_id";
+   case aov_type::material_id: return "material_id";
+   case aov_type::sample_count: return "sample_count";
+   }
+   return "";
+}
+
+// A color for id, the same for every image; black for 0
+inline glm::color id_color(int id)
+{
+   if (id == 0) return glm::color(0);
+   uint32_t h = uint32_t(id) * 2654435761u;
+   h ^= h >> 15;
+   return glm::color(float(h & 255), float((h >> 8) & 255), float((h >> 16) & 255)) / 255.0f * 0.8f + 0.2f;
+}
+
+// Ids from 1 for the pointers of ids, by first appearance; 0 for null
+template <class T>
+std::vector<int> number_ids(const std::vector<T*>& ids)
+{
+   std::unordered_map<T*, int> found;
+   std::vector<int> numbers(ids.size(), 0);
+   for (size_t k = 0; k < ids.size(); k++) {
+      if (!ids[k]) continue;
+      auto it = found.insert(std::make_pair(ids[k], int(found.size()) + 1)).first;
+      numbers[k] = it->second;
+   }
+   return numbers;
+}
+
+// The values of which per pixel, row by row from the top: linear, or in
+// [0, 1] for 8-bit images with display. image and features come from the
+// same render.
+inline std::vector<glm::vec3> aov_pixels(aov_type which, const framebuffer& image, const feature_buffer& features,
+   bool display)
+{
+   size_t n = image.radiance.size();
+   std::vector<glm::vec3> pixels(n, glm::vec3(0));
+   std::vector<int> ids;
+   if (which == aov_type::object_id) ids = number_ids(features.object);
+   if (which == aov_type::material_id) ids = number_ids(features.mat);
+   float depth_scale = 0.0f;
+   int most_samples = 0;
+   for (size_t k = 0; k < n; k++) {
+      if (features.samples[k] > 0) depth_scale = std::max(depth_scale, features.depth[k] / features.samples[k]);
+      most_samples = std::max(most_samples, features.samples[k]);
+   }
+   depth_scale = depth_scale > 0 ? 1.0f / depth_scale : 0.0f;
+
+   for (size_t k = 0; k < n; k++) {
+      int count = features.samples[k];
+      float scale = count > 0 ? 1.0f / count : 0.0f;
+      glm::vec3& out = pixels[k];
+      switch (which) {
+      case aov_type::beauty:
+         out = image.radiance[k] * scale;
+         if (display) out = glm::sqrt(glm::clamp(out, glm::vec3(0), glm::vec3(0.999f)));
+         break;
+      case aov_type::normal: {
+         glm::vec3 normal = features.normal[k];
+         float length = glm::length(normal);
+         if (length <= 0) break;
+         out = normal / length;
+         if (display) out = 0.5f * (out + glm::vec3(1));
+         break;
+      }
+      case aov_type::depth:
+         out = glm::vec3(features.depth[k] * scale);
+         if (display) out *= depth_scale;
+         break;
+      case aov_type::albedo:
+         out = features.albedo[k] * scale;
+         if (display) out = glm::clamp(out, glm::vec3(0), glm::vec3(1));
+         break;
+      case aov_type::object_id:
+      case aov_type::material_id:
+         out = display ? id_color(ids[k]) : glm::vec3(float(ids[k]));
+         break;
+      case aov_type::sample_count:
+         out = glm::vec3(float(count));
+         if (display && most_samples > 0) out /= float(most_samples);
+         break;
+      }
+   }
+   return pixels;
+}
+
+// Writes which as a float image if filename ends in .pfm, as an 8-bit png
+// otherwise; returns false if the file cannot be written
+inline bool write_aov(const std::string& filename, aov_type which, const framebuffer& image,
+   const feature_buffer& features)
+{
+   bool floating = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".pfm") == 0;
+   std::vector<glm::vec3> pixels = aov_pixels(which, image, features, !floating);
+   if (floating) return agl::save_pfm(filename, image.width, image.height, pixels);
+   agl::ppm_image out(image.width, image.height);
+   for (int j = 0; j < image.height; j++) {
+      for (int i = 0; i < image.width; i++) out.set_vec3(j, i, glm::min(pixels[j * image.width + i], glm::vec3(0.999f)));
+   }
+   return out.save(filename);
+}
+
+#endif
@@ -0,0 +1,476 @@
+// bvh.h, bounding volume hierarchy built with binned SAH in parallel
+
+#ifndef BVH_H_
+#define BVH_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "accelerator.h"
+#include "hittable.h"
+#include "scene_arena.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+struct bvh_node {
+   aabb box;
+   int first; // interior: index of the left child (right is first + 1); leaf: first primitive
+   int count; // number of primitives in a leaf, 0 for interior nodes
+};
+
+struct bvh_stats {
+   double build_seconds = 0;
+   float sah_cost = 0; // expected cost of a random ray, relative to the root
+   int depth = 0;
+   int nodes = 0;
+   int leaves = 0;
+   std::vector<int> leaf_histogram; // leaf_histogram[k] = number of leaves with k primitives
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "bvh: " << nodes << " nodes, " << leaves << " leaves, depth " << depth
+         << ", SAH cost " << sah_cost << ", built in " << build_seconds * 1000.0 << " ms" << std::endl;
+      ss << "leaf sizes:";
+      for (size_t k = 0; k < leaf_histogram.size(); k++) {
+         if (leaf_histogram[k] > 0) ss << " " << k << ":" << leaf_histogram[k];
+      }
+      ss << std::endl;
+      return ss.str();
+   }
+};
+
+class bvh : public accelerator {
+public:
+   bvh() {}
+   // arena holds the objects made in it (hittable_list::make), if any
+   bvh(const std::vector<std::shared_ptr<hittable>>& objects, int max_leaf_size = 4,
+      std::shared_ptr<scene_arena> objects_arena = std::shared_ptr<scene_arena>()) : arena(objects_arena) {
+      build(objects, max_leaf_size);
+   }
+
+   void build(const std::vector<std::shared_ptr<hittable>>& objects, int max_leaf_size = 4);
+
+   virtual bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const override;
+   virtual std::string name() const override { return "bvh"; }
+
+   const bvh_stats& stats() const { return build_stats; }
+
+public:
+   std::vector<bvh_node> nodes;
+   std::vector<std::shared_ptr<hittable>> primitives; // bounded objects, in leaf order
+   std::vector<std::shared_ptr<hittable>> unbounded; // tested against every ray
+   std::shared_ptr<scene_arena> arena; // keeps arena objects alive: their shared_ptrs do not
+
+private:
+   void compute_stats();
+
+   bvh_stats build_stats;
+};
+
+// Builds the node array for a set of primitive bounds. Large nodes bin and
+// partition their primitives in parallel; below that, subtrees are built as
+// independent tasks on the shared thread_pool.
+class bvh_builder {
+public:
+   static const int num_bins = 16;
+   static const int parallel_threshold = 1 << 15; // bin/partition in parallel above this
+   static const int task_threshold = 1 << 10; // spawn subtree tasks above this
+   static const int max_depth = 100;
+
+   bvh_builder(const std::vector<aabb>& bounds, int leaf_size) :
+      prim_bounds(bounds), max_leaf_size(leaf_size), node_count(0)
+   {
+      int n = (int) bounds.size();
+      centroids.resize(n);
+      indices.resize(n);
+      scratch.resize(n);
+      parallel_for(0, n, 1 << 14, [this](int begin, int end) {
+         for (int i = begin; i < end; i++) {
+            centroids[i] = prim_bounds[i].centroid();
+            indices[i] = i;
+         }
+      });
+   }
+
+   // returns the nodes; indices holds the primitive order of the leaves
+   std::vector<bvh_node> build() {
+      int n = (int) prim_bounds.size();
+      nodes.clear();
+      if (n == 0) return nodes;
+      nodes.resize(2 * n);
+      node_count = 1;
+      build_node(0, 0, n, 0);
+      nodes.resize(node_count);
+      return nodes;
+   }
+
+public:
+   std::vector<int> indices;
+
+private:
+   struct bin {
+      aabb box;
+      int count = 0;
+   };
+
+   struct range_info {
+      aabb box; // bounds of the primitives
+      aabb centroid_box; // bounds of their centroids
+      bin bins[3][num_bins];
+   };
+
+   void accumulate_bounds(int begin, int end, range_info& info) const {
+      for (int i = begin; i < end; i++) {
+         int prim = indices[i];
+         info.box.grow(prim_bounds[prim]);
+         info.centroid_box.grow(centroids[prim]);
+      }
+   }
+
+   void accumulate_bins(int begin, int end, range_info& info) const {
+      glm::vec3 lo = info.centroid_box.min();
+      glm::vec3 scale = bin_scale(info.centroid_box);
+      for (int i = begin; i < end; i++) {
+         int prim = indices[i];
+         for (int axis = 0; axis < 3; axis++) {
+            int b = bin_index(centroids[prim][axis], lo[axis], scale[axis]);
+            info.bins[axis][b].box.grow(prim_bounds[prim]);
+            info.bins[axis][b].count++;
+         }
+      }
+   }
+
+   static glm::vec3 bin_scale(const aabb& centroid_box) {
+      glm::vec3 extent = centroid_box.extent();
+      glm::vec3 scale(0);
+      for (int axis = 0; axis < 3; axis++) {
+         if (extent[axis] > 0) scale[axis] = num_bins / extent[axis];
+      }
+      return scale;
+   }
+
+   static int bin_index(float c, float lo, float scale) {
+      int b = (int) ((c - lo) * scale);
+      return std::min(num_bins - 1, std::max(0, b));
+   }
+
+   // bounds and bins of indices[begin, end), in parallel for large ranges
+   void gather(int begin, int end, range_info& info) const {
+      int count = end - begin;
+      int chunks = count > parallel_threshold ? 4 * thread_pool::instance().size() : 1;
+      if (chunks <= 1) {
+         accumulate_bounds(begin, end, info);
+         accumulate_bins(begin, end, info);
+         return;
+      }
+
+      int grain = (count + chunks - 1) / chunks;
+      std::vector<range_info> partial(chunks);
+      parallel_for(0, chunks, 1, [&](int c0, int c1) {
+         for (int c = c0; c < c1; c++) {
+            accumulate_bounds(begin + c * grain, std::min(end, begin + (c + 1) * grain), partial[c]);
+         }
+      });
+      for (int c = 0; c < chunks; c++) {
+         info.box.grow(partial[c].box);
+         info.centroid_box.grow(partial[c].centroid_box);
+         partial[c].centroid_box = info.centroid_box; // bins must share one mapping
+      }
+      parallel_for(0, chunks, 1, [&](int c0, int c1) {
+         for (int c = c0; c < c1; c++) {
+            accumulate_bins(begin + c * grain, std::min(end, begin + (c + 1) * grain), partial[c]);
+         }
+      });
+      for (int c = 0; c < chunks; c++) {
+         for (int axis = 0; axis < 3; axis++) {
+            for (int b = 0; b < num_bins; b++) {
+               info.bins[axis][b].box.grow(partial[c].bins[axis][b].box);
+               info.bins[axis][b].count += partial[c].bins[axis][b].count;
+            }
+         }
+      }
+   }
+
+   // Move primitives whose centroid falls in a bin <= split to the front of
+   // indices[begin, end). Returns the first index of the right half.
+   int partition(int begin, int end, int axis, int split, const aabb& centroid_box) {
+      float lo = centroid_box.min()[axis];
+      float scale = bin_scale(centroid_box)[axis];
+      int count = end - begin;
+      int chunks = count > parallel_threshold ? 4 * thread_pool::instance().size() : 1;
+      if (chunks <= 1) {
+         int* mid = std::partition(&indices[0] + begin, &indices[0] + end, [&](int prim) {
+            return bin_index(centroids[prim][axis], lo, scale) <= split;
+         });
+         return (int) (mid - &indices[0]);
+      }
+
+      // count left primitives per chunk, then scatter both sides to scratch
+      int grain = (count + chunks - 1) / chunks;
+      std::vector<int> left_counts(chunks, 0);
+      parallel_for(0, chunks, 1, [&](int c0, int c1) {
+         for (int c = c0; c < c1; c++) {
+            int chunk_end = std::min(end, begin + (c + 1) * grain);
+            for (int i = begin + c * grain; i < chunk_end; i++) {
+               if (bin_index(centroids[indices[i]][axis], lo, scale) <= split) left_counts[c]++;
+            }
+         }
+      });
+      std::vector<int> left_offsets(chunks), right_offsets(chunks);
+      int total_left = 0;
+      for (int c = 0; c < chunks; c++) {
+         left_offsets[c] = begin + total_left;
+         total_left += left_counts[c];
+      }
+      int right_start = begin + total_left;
+      for (int c = 0; c < chunks; c++) {
+         right_offsets[c] = right_start + (c * grain - (left_offsets[c] - begin));
+      }
+      parallel_for(0, chunks, 1, [&](int c0, int c1) {
+         for (int c = c0; c < c1; c++) {
+            int chunk_end = std::min(end, begin + (c + 1) * grain);
+            int l = left_offsets[c];
+            int r = right_offsets[c];
+            for (int i = begin + c * grain; i < chunk_end; i++) {
+               int prim = indices[i];
+               if (bin_index(centroids[prim][axis], lo, scale) <= split) scratch[l++] = prim;
+               else scratch[r++] = prim;
+            }
+         }
+      });
+      parallel_for(begin, end, 1 << 14, [&](int b, int e) {
+         std::copy(scratch.begin() + b, scratch.begin() + e, indices.begin() + b);
+      });
+      return right_start;
+   }
+
+   void make_leaf(int node, int begin, int end, const aabb& box) {
+      nodes[node].box = box;
+      nodes[node].first = begin;
+      nodes[node].count = end - begin;
+   }
+
+   void build_node(int node, int begin, int end, int depth) {
+      int count = end - begin;
+      range_info info;
+      gather(begin, end, info);
+
+      if (count == 1 || depth >= max_depth) {
+         make_leaf(node, begin, end, info.box);
+         return;
+      }
+
+      // evaluate the SAH at every bin boundary along each axis
+      const float traversal_cost = 1.0f;
+      float best_cost = infinity;
+      int best_axis = -1;
+      int best_split = -1;
+      glm::vec3 centroid_extent = info.centroid_box.extent();
+      for (int axis = 0; axis < 3; axis++) {
+         if (centroid_extent[axis] <= 0) continue;
+
+         float right_area[num_bins];
+         int right_count[num_bins];
+         aabb right_box;
+         int right_n = 0;
+         for (int b = num_bins - 1; b > 0; b--) {
+            right_box.grow(info.bins[axis][b].box);
+            right_n += info.bins[axis][b].count;
+            right_area[b] = right_box.surface_area();
+            right_count[b] = right_n;
+         }
+
+         aabb left_box;
+         int left_n = 0;
+         for (int b = 0; b < num_bins - 1; b++) {
+            left_box.grow(info.bins[axis][b].box);
+            left_n += info.bins[axis][b].count;
+            if (left_n == 0 || right_count[b + 1] == 0) continue;
+            float cost = left_n * left_box.surface_area() + right_count[b + 1] * right_area[b + 1];
+            if (cost < best_cost) {
+               best_cost = cost;
+               best_axis = axis;
+               best_split = b;
+            }
+         }
+      }
+
+      float area = info.box.surface_area();
+      float split_cost = best_axis >= 0 && area > 0 ? traversal_cost + best_cost / area : infinity;
+      if (count <= max_leaf_size && split_cost >= (float) count) {
+         make_leaf(node, begin, end, info.box);
+         return;
+      }
+
+      int mid;
+      if (best_axis >= 0) {
+         mid = partition(begin, end, best_axis, best_split, info.centroid_box);
+      }
+      else {
+         mid = begin + count / 2; // all centroids coincide
+      }
+
+      int left = node_count.fetch_add(2);
+      nodes[node].box = info.box;
+      nodes[node].first = left;
+      nodes[node].count = 0;
+
+      if (count > task_threshold) {
+         task_group group;
+         group.run([this, left, begin, mid, depth]() { build_node(left, begin, mid, depth + 1); });
+         build_node(left + 1, mid, end, depth + 1);
+         group.wait();
+      }
+      else {
+         build_node(left, begin, mid, depth + 1);
+         build_node(left + 1, mid, end, depth + 1);
+      }
+   }
+
+   const std::vector<aabb>& prim_bounds;
+   std::vector<glm::vec3> centroids;
+   std::vector<int> scratch;
+   std::vector<bvh_node> nodes;
+   int max_leaf_size;
+   std::atomic<int> node_count;
+};
+
+inline void bvh::build(const std::vector<std::shared_ptr<hittable>>& objects, int max_leaf_size)
+{
+   auto start = std::chrono::steady_clock::now();
+
+   nodes.clear();
+   primitives.clear();
+   unbounded.clear();
+
+   std::vector<aabb> bounds;
+   std::vector<std::shared_ptr<hittable>> bounded;
+   bounds.reserve(objects.size());
+   bounded.reserve(objects.size());
+   for (size_t i = 0; i < objects.size(); i++) {
+      aabb box;
+      if (objects[i]->bounding_box(box)) {
+         bounds.push_back(box);
+         bounded.push_back(objects[i]);
+      }
+      else {
+         unbounded.push_back(objects[i]);
+      }
+   }
+
+   bvh_builder builder(bounds, max_leaf_size);
+   nodes = builder.build();
+   primitives.resize(bounded.size());
+   for (size_t i = 0; i < bounded.size(); i++) {
+      primitives[i] = bounded[builder.indices[i]];
+   }
+
+   build_stats = bvh_stats();
+   build_stats.build_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+   compute_stats();
+}
+
+inline void bvh::compute_stats()
+{
+   build_stats.nodes = (int) nodes.size();
+   if (nodes.empty()) return;
+
+   const float traversal_cost = 1.0f;
+   float root_area = std::max(nodes[0].box.surface_area(), 1e-12f);
+   float cost = 0;
+   std::vector<std::pair<int, int>> stack; // node, depth
+   stack.push_back(std::make_pair(0, 1));
+   while (!stack.empty()) {
+      int node = stack.back().first;
+      int depth = stack.back().second;
+      stack.pop_back();
+      build_stats.depth = std::max(build_stats.depth, depth);
+
+      const bvh_node& n = nodes[node];
+      float relative_area = n.box.surface_area() / root_area;
+      if (n.count > 0) {
+         cost += relative_area * n.count;
+         build_stats.leaves++;
+         if ((int) build_stats.leaf_histogram.size() <= n.count) {
+            build_stats.leaf_histogram.resize(n.count + 1, 0);
+         }
+         build_stats.leaf_histogram[n.count]++;
+      }
+      else {
+         cost += relative_area * traversal_cost;
+         stack.push_back(std::make_pair(n.first, depth + 1));
+         stack.push_back(std::make_pair(n.first + 1, depth + 1));
+      }
+   }
+   build_stats.sah_cost = cost;
+}
+
+inline bool bvh::hit(const ray& r, float min_t, float max_t, hit_record& rec) const
+{
+   hit_record temp_rec;
+   bool hit_anything = false;
+   float closest_so_far = max_t;
+
+   for (size_t i = 0; i < unbounded.size(); i++) {
+      if (unbounded[i]->hit_interval(r, min_t, closest_so_far, temp_rec)) {
+         hit_anything = true;
+         closest_so_far = temp_rec.t;
+         rec = temp_rec;
+      }
+   }
+   if (nodes.empty()) return hit_anything;
+
+   glm::point3 origin = r.origin();
+   glm::vec3 inv_dir = 1.0f / r.direction();
+
+   // visit children near to far; skip popped nodes that start past the closest hit
+   struct entry { int node; float t; };
+   entry stack[bvh_builder::max_depth + 2];
+   int top = 0;
+
+   float t_root;
+   if (!nodes[0].box.hit(origin, inv_dir, min_t, closest_so_far, t_root)) return hit_anything;
+   stack[top++] = { 0, t_root };
+
+   while (top > 0) {
+      entry e = stack[--top];
+      if (e.t > closest_so_far) continue;
+
+      const bvh_node* n = &nodes[e.node];
+      while (n->count == 0) {
+         int left = n->first;
+         float t_left, t_right;
+         bool hit_left = nodes[left].box.hit(origin, inv_dir, min_t, closest_so_far, t_left);
+         bool hit_right = nodes[left + 1].box.hit(origin, inv_dir, min_t, closest_so_far, t_right);
+         if (hit_left && hit_right) {
+            if (t_left <= t_right) {
+               stack[top++] = { left + 1, t_right };
+               n = &nodes[left];
+            }
+            else {
+               stack[top++] = { left, t_left };
+               n = &nodes[left + 1];
+            }
+         }
+         else if (hit_left) n = &nodes[left];
+         else if (hit_right) n = &nodes[left + 1];
+         else break;
+      }
+      if (n->count == 0) continue;
+
+      for (int i = n->first; i < n->first + n->count; i++) {
+         if (primitives[i]->hit_interval(r, min_t, closest_so_far, temp_rec)) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+         }
+      }
+   }
+   return hit_anything;
+}
+
+#endif
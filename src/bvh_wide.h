@@ -0,0 +1,461 @@
+// bvh_wide.h, 4-wide and 8-wide BVH collapsed from the binary bvh, with
+// SIMD box tests over all children of a node and packet leaf tests
+
+#ifndef BVH_WIDE_H_
+#define BVH_WIDE_H_
+
+#include "AGLM.h"
+#include "bvh.h"
+#include "simd.h"
+#include "sphere.h"
+#include "triangle.h"
+#include <sstream>
+
+// Children bounds are stored per axis (SoA), so one SIMD slab test covers
+// every child. Slots past num_children are unused.
+// child[k] >= 0 is an interior node, child[k] < 0 is leaf ~child[k].
+template <int N>
+struct alignas(64) wide_bvh_node {
+   float lo_x[N], lo_y[N], lo_z[N];
+   float hi_x[N], hi_y[N], hi_z[N];
+   int child[N];
+   int num_children;
+};
+
+// up to four spheres, tested together in a leaf
+struct alignas(16) sphere_packet {
+   float cx[4], cy[4], cz[4], radius[4];
+   int prim[4];
+   int count;
+};
+
+// up to four triangles as vertex + edges, tested together in a leaf
+struct alignas(16) triangle_packet {
+   float v0x[4], v0y[4], v0z[4];
+   float e1x[4], e1y[4], e1z[4];
+   float e2x[4], e2y[4], e2z[4];
+   int prim[4];
+   int count;
+};
+
+struct wide_bvh_leaf {
+   int sphere_first, sphere_count; // packets
+   int triangle_first, triangle_count; // packets
+   int other_first, other_count; // primitives tested one at a time
+};
+
+// broadcast ray data used by the SIMD tests
+struct simd_ray {
+   simd_ray(const ray& r) :
+      ox(r.origin().x), oy(r.origin().y), oz(r.origin().z),
+      dx(r.direction().x), dy(r.direction().y), dz(r.direction().z),
+      idx(1.0f / r.direction().x), idy(1.0f / r.direction().y), idz(1.0f / r.direction().z)
+   {
+      glm::vec3 n = glm::normalize(r.direction());
+      nx = float4(n.x);
+      ny = float4(n.y);
+      nz = float4(n.z);
+      inv_length = 1.0f / glm::length(r.direction());
+   }
+
+   float4 ox, oy, oz;
+   float4 dx, dy, dz;
+   float4 idx, idy, idz;
+   float4 nx, ny, nz; // normalized direction
+   float inv_length;
+};
+
+// slab test of the children of a node; returns a bit per child hit and
+// stores the entry distances in t_near
+template <int N>
+inline int intersect_children(const wide_bvh_node<N>& node, const simd_ray& r,
+   float min_t, float max_t, float* t_near)
+{
+   int mask = 0;
+   float4 tmin_limit(min_t);
+   float4 tmax_limit(max_t);
+   for (int g = 0; g < N; g += 4) {
+      float4 t0x = (float4::load(node.lo_x + g) - r.ox) * r.idx;
+      float4 t1x = (float4::load(node.hi_x + g) - r.ox) * r.idx;
+      float4 t0y = (float4::load(node.lo_y + g) - r.oy) * r.idy;
+      float4 t1y = (float4::load(node.hi_y + g) - r.oy) * r.idy;
+      float4 t0z = (float4::load(node.lo_z + g) - r.oz) * r.idz;
+      float4 t1z = (float4::load(node.hi_z + g) - r.oz) * r.idz;
+      float4 tmin = max(max(min(t0x, t1x), min(t0y, t1y)), max(min(t0z, t1z), tmin_limit));
+      float4 tmax = min(min(max(t0x, t1x), max(t0y, t1y)), min(max(t0z, t1z), tmax_limit));
+      tmin.store(t_near + g);
+      mask |= movemask(tmin <= tmax) << g;
+   }
+   return mask;
+}
+
+#ifdef RT_AVX
+template <>
+inline int intersect_children<8>(const wide_bvh_node<8>& node, const simd_ray& r,
+   float min_t, float max_t, float* t_near)
+{
+   __m256 ox = _mm256_set1_ps(_mm_cvtss_f32(r.ox.v));
+   __m256 oy = _mm256_set1_ps(_mm_cvtss_f32(r.oy.v));
+   __m256 oz = _mm256_set1_ps(_mm_cvtss_f32(r.oz.v));
+   __m256 idx = _mm256_set1_ps(_mm_cvtss_f32(r.idx.v));
+   __m256 idy = _mm256_set1_ps(_mm_cvtss_f32(r.idy.v));
+   __m256 idz = _mm256_set1_ps(_mm_cvtss_f32(r.idz.v));
+   __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lo_x), ox), idx);
+   __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.hi_x), ox), idx);
+   __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lo_y), oy), idy);
+   __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.hi_y), oy), idy);
+   __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lo_z), oz), idz);
+   __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.hi_z), oz), idz);
+   __m256 tmin = _mm256_max_ps(
+      _mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+      _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_set1_ps(min_t)));
+   __m256 tmax = _mm256_min_ps(
+      _mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+      _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(max_t)));
+   _mm256_storeu_ps(t_near, tmin);
+   return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+}
+#endif
+
+template <int N>
+class wide_bvh : public accelerator {
+public:
+   wide_bvh() {}
+   // arena holds the objects made in it (hittable_list::make), if any
+   wide_bvh(const std::vector<std::shared_ptr<hittable>>& objects,
+      std::shared_ptr<scene_arena> arena = std::shared_ptr<scene_arena>()) : binary(objects, N, arena) {
+      collapse();
+   }
+
+   virtual bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const override;
+   virtual std::string name() const override { return N == 8 ? "bvh8" : "bvh4"; }
+
+   const bvh_stats& stats() const { return binary.stats(); }
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "bvh" << N << ": " << nodes.size() << " nodes of " << sizeof(wide_bvh_node<N>)
+         << " bytes, " << leaves.size() << " leaves, " << spheres.size() << " sphere and "
+         << triangles.size() << " triangle packets" << std::endl;
+      return ss.str();
+   }
+
+public:
+   aligned_vector<wide_bvh_node<N>> nodes;
+   std::vector<wide_bvh_leaf> leaves;
+   aligned_vector<sphere_packet> spheres;
+   aligned_vector<triangle_packet> triangles;
+   std::vector<const hittable*> others;
+
+private:
+   void collapse();
+   int collapse_node(int binary_node);
+   int make_leaf(int binary_node);
+   bool hit_leaf(const wide_bvh_leaf& leaf, const ray& r, const simd_ray& sr,
+      float min_t, float& closest_so_far, hit_record& rec) const;
+   bool hit_candidates(int mask, const float* t, const int* prim, const ray& r,
+      float min_t, float& closest_so_far, hit_record& rec) const;
+
+   bvh binary; // source hierarchy; owns the primitives and their arena
+};
+
+template <int N>
+void wide_bvh<N>::collapse()
+{
+   nodes.clear();
+   leaves.clear();
+   spheres.clear();
+   triangles.clear();
+   others.clear();
+   if (binary.nodes.empty()) return;
+
+   if (binary.nodes[0].count > 0) {
+      // a single leaf still gets a root node so traversal has one entry point
+      nodes.push_back(wide_bvh_node<N>());
+      wide_bvh_node<N>& root = nodes[0];
+      for (int k = 0; k < N; k++) {
+         root.lo_x[k] = root.lo_y[k] = root.lo_z[k] = infinity;
+         root.hi_x[k] = root.hi_y[k] = root.hi_z[k] = infinity;
+         root.child[k] = 0;
+      }
+      const aabb& box = binary.nodes[0].box;
+      root.lo_x[0] = box.minimum.x; root.lo_y[0] = box.minimum.y; root.lo_z[0] = box.minimum.z;
+      root.hi_x[0] = box.maximum.x; root.hi_y[0] = box.maximum.y; root.hi_z[0] = box.maximum.z;
+      root.child[0] = ~make_leaf(0);
+      root.num_children = 1;
+      return;
+   }
+   collapse_node(0);
+}
+
+// Pull up to N descendants of an interior binary node into one wide node,
+// always opening the child with the largest surface area first.
+template <int N>
+int wide_bvh<N>::collapse_node(int binary_node)
+{
+   int index = (int) nodes.size();
+   nodes.push_back(wide_bvh_node<N>());
+
+   int first = binary.nodes[binary_node].first;
+   std::vector<int> kids;
+   kids.push_back(first);
+   kids.push_back(first + 1);
+   while ((int) kids.size() < N) {
+      int widest = -1;
+      float widest_area = -1;
+      for (size_t k = 0; k < kids.size(); k++) {
+         const bvh_node& n = binary.nodes[kids[k]];
+         if (n.count == 0 && n.box.surface_area() > widest_area) {
+            widest = (int) k;
+            widest_area = n.box.surface_area();
+         }
+      }
+      if (widest < 0) break;
+      int open = binary.nodes[kids[widest]].first;
+      kids[widest] = open;
+      kids.push_back(open + 1);
+   }
+
+   wide_bvh_node<N> node;
+   for (int k = 0; k < N; k++) {
+      if (k < (int) kids.size()) {
+         const bvh_node& n = binary.nodes[kids[k]];
+         node.lo_x[k] = n.box.minimum.x; node.lo_y[k] = n.box.minimum.y; node.lo_z[k] = n.box.minimum.z;
+         node.hi_x[k] = n.box.maximum.x; node.hi_y[k] = n.box.maximum.y; node.hi_z[k] = n.box.maximum.z;
+         node.child[k] = n.count > 0 ? ~make_leaf(kids[k]) : collapse_node(kids[k]);
+      }
+      else {
+         node.lo_x[k] = node.lo_y[k] = node.lo_z[k] = infinity;
+         node.hi_x[k] = node.hi_y[k] = node.hi_z[k] = infinity;
+         node.child[k] = 0;
+      }
+   }
+   node.num_children = (int) kids.size();
+   nodes[index] = node;
+   return index;
+}
+
+// Sort the primitives of a binary leaf into sphere and triangle packets
+template <int N>
+int wide_bvh<N>::make_leaf(int binary_node)
+{
+   const bvh_node& n = binary.nodes[binary_node];
+   wide_bvh_leaf leaf;
+   leaf.sphere_first = (int) spheres.size();
+   leaf.triangle_first = (int) triangles.size();
+   leaf.other_first = (int) others.size();
+
+   sphere_packet* sp = 0;
+   triangle_packet* tp = 0;
+   for (int i = n.first; i < n.first + n.count; i++) {
+      const hittable* prim = binary.primitives[i].get();
+      if (const sphere* s = dynamic_cast<const sphere*>(prim)) {
+         if (!sp || sp->count == 4) {
+            spheres.push_back(sphere_packet());
+            sp = &spheres.back();
+            sp->count = 0;
+         }
+         int lane = sp->count++;
+         sp->cx[lane] = s->center.x;
+         sp->cy[lane] = s->center.y;
+         sp->cz[lane] = s->center.z;
+         sp->radius[lane] = s->radius;
+         sp->prim[lane] = i;
+      }
+      else if (const triangle* t = dynamic_cast<const triangle*>(prim)) {
+         if (!tp || tp->count == 4) {
+            triangles.push_back(triangle_packet());
+            tp = &triangles.back();
+            tp->count = 0;
+         }
+         int lane = tp->count++;
+         glm::vec3 e1 = t->b - t->a;
+         glm::vec3 e2 = t->c - t->a;
+         tp->v0x[lane] = t->a.x; tp->v0y[lane] = t->a.y; tp->v0z[lane] = t->a.z;
+         tp->e1x[lane] = e1.x; tp->e1y[lane] = e1.y; tp->e1z[lane] = e1.z;
+         tp->e2x[lane] = e2.x; tp->e2y[lane] = e2.y; tp->e2z[lane] = e2.z;
+         tp->prim[lane] = i;
+      }
+      else {
+         others.push_back(prim);
+      }
+   }
+
+   // pad partially filled packets by repeating their first lane
+   for (int p = leaf.sphere_first; p < (int) spheres.size(); p++) {
+      sphere_packet& packet = spheres[p];
+      for (int lane = packet.count; lane < 4; lane++) {
+         packet.cx[lane] = packet.cx[0]; packet.cy[lane] = packet.cy[0]; packet.cz[lane] = packet.cz[0];
+         packet.radius[lane] = packet.radius[0];
+         packet.prim[lane] = packet.prim[0];
+      }
+   }
+   for (int p = leaf.triangle_first; p < (int) triangles.size(); p++) {
+      triangle_packet& packet = triangles[p];
+      for (int lane = packet.count; lane < 4; lane++) {
+         packet.v0x[lane] = packet.v0x[0]; packet.v0y[lane] = packet.v0y[0]; packet.v0z[lane] = packet.v0z[0];
+         packet.e1x[lane] = packet.e1x[0]; packet.e1y[lane] = packet.e1y[0]; packet.e1z[lane] = packet.e1z[0];
+         packet.e2x[lane] = packet.e2x[0]; packet.e2y[lane] = packet.e2y[0]; packet.e2z[lane] = packet.e2z[0];
+         packet.prim[lane] = packet.prim[0];
+      }
+   }
+
+   leaf.sphere_count = (int) spheres.size() - leaf.sphere_first;
+   leaf.triangle_count = (int) triangles.size() - leaf.triangle_first;
+   leaf.other_count = (int) others.size() - leaf.other_first;
+   leaves.push_back(leaf);
+   return (int) leaves.size() - 1;
+}
+
+// The packet tests only find candidates; the primitive's own hit() fills the
+// record, so shading is identical to testing the primitives one by one.
+template <int N>
+bool wide_bvh<N>::hit_candidates(int mask, const float* t, const int* prim, const ray& r,
+   float min_t, float& closest_so_far, hit_record& rec) const
+{
+   bool hit_anything = false;
+   while (mask) {
+      int lane = first_lane(mask);
+      for (int k = lane + 1; k < 4; k++) {
+         if ((mask & (1 << k)) && t[k] < t[lane]) lane = k;
+      }
+      mask &= ~(1 << lane);
+      if (t[lane] > closest_so_far) break;
+
+      hit_record temp_rec;
+      if (binary.primitives[prim[lane]]->hit_interval(r, min_t, closest_so_far, temp_rec)) {
+         hit_anything = true;
+         closest_so_far = temp_rec.t;
+         rec = temp_rec;
+      }
+   }
+   return hit_anything;
+}
+
+template <int N>
+bool wide_bvh<N>::hit_leaf(const wide_bvh_leaf& leaf, const ray& r, const simd_ray& sr,
+   float min_t, float& closest_so_far, hit_record& rec) const
+{
+   bool hit_anything = false;
+   alignas(16) float t[4];
+   const float4 zero(0.0f);
+
+   for (int p = leaf.sphere_first; p < leaf.sphere_first + leaf.sphere_count; p++) {
+      // geometric method, as in sphere::hit
+      const sphere_packet& packet = spheres[p];
+      float4 elx = float4::load(packet.cx) - sr.ox;
+      float4 ely = float4::load(packet.cy) - sr.oy;
+      float4 elz = float4::load(packet.cz) - sr.oz;
+      float4 radius = float4::load(packet.radius);
+      float4 s = elx * sr.nx + ely * sr.ny + elz * sr.nz;
+      float4 el_sqr = elx * elx + ely * ely + elz * elz;
+      float4 r_sqr = radius * radius;
+      float4 m_sqr = el_sqr - s * s;
+      float4 outside = el_sqr > r_sqr;
+      float4 miss = ((s < zero) & outside) | (m_sqr > r_sqr);
+      float4 q = sqrt(max(r_sqr - m_sqr, zero));
+      float4 tt = select(outside, s - q, s + q) * float4(sr.inv_length);
+      float4 ok = andnot(miss, (tt >= float4(min_t)) & (tt <= float4(closest_so_far)));
+      int mask = movemask(ok) & ((1 << packet.count) - 1);
+      if (mask) {
+         tt.store(t);
+         hit_anything |= hit_candidates(mask, t, packet.prim, r, min_t, closest_so_far, rec);
+      }
+   }
+
+   for (int p = leaf.triangle_first; p < leaf.triangle_first + leaf.triangle_count; p++) {
+      // Moller-Trumbore, as in triangle::hit
+      const triangle_packet& packet = triangles[p];
+      float4 e1x = float4::load(packet.e1x), e1y = float4::load(packet.e1y), e1z = float4::load(packet.e1z);
+      float4 e2x = float4::load(packet.e2x), e2y = float4::load(packet.e2y), e2z = float4::load(packet.e2z);
+      float4 px = sr.dy * e2z - sr.dz * e2y;
+      float4 py = sr.dz * e2x - sr.dx * e2z;
+      float4 pz = sr.dx * e2y - sr.dy * e2x;
+      float4 a1 = e1x * px + e1y * py + e1z * pz;
+      float4 f = float4(1.0f) / a1;
+      float4 sx = sr.ox - float4::load(packet.v0x);
+      float4 sy = sr.oy - float4::load(packet.v0y);
+      float4 sz = sr.oz - float4::load(packet.v0z);
+      float4 u = f * (sx * px + sy * py + sz * pz);
+      float4 qx = sy * e1z - sz * e1y;
+      float4 qy = sz * e1x - sx * e1z;
+      float4 qz = sx * e1y - sy * e1x;
+      float4 v = f * (sr.dx * qx + sr.dy * qy + sr.dz * qz);
+      float4 tt = f * (e2x * qx + e2y * qy + e2z * qz);
+      float4 one(1.0f);
+      float4 ok = (abs(a1) >= float4(0.0001f)) & (u >= zero) & (u <= one) &
+         (v >= zero) & (u + v <= one) & (tt >= float4(min_t)) & (tt <= float4(closest_so_far));
+      int mask = movemask(ok) & ((1 << packet.count) - 1);
+      if (mask) {
+         tt.store(t);
+         hit_anything |= hit_candidates(mask, t, packet.prim, r, min_t, closest_so_far, rec);
+      }
+   }
+
+   hit_record temp_rec;
+   for (int i = leaf.other_first; i < leaf.other_first + leaf.other_count; i++) {
+      if (others[i]->hit_interval(r, min_t, closest_so_far, temp_rec)) {
+         hit_anything = true;
+         closest_so_far = temp_rec.t;
+         rec = temp_rec;
+      }
+   }
+   return hit_anything;
+}
+
+template <int N>
+bool wide_bvh<N>::hit(const ray& r, float min_t, float max_t, hit_record& rec) const
+{
+   hit_record temp_rec;
+   bool hit_anything = false;
+   float closest_so_far = max_t;
+
+   for (size_t i = 0; i < binary.unbounded.size(); i++) {
+      if (binary.unbounded[i]->hit_interval(r, min_t, closest_so_far, temp_rec)) {
+         hit_anything = true;
+         closest_so_far = temp_rec.t;
+         rec = temp_rec;
+      }
+   }
+   if (nodes.empty()) return hit_anything;
+
+   simd_ray sr(r);
+   struct entry { int child; float t; };
+   entry stack[(bvh_builder::max_depth + 2) * N];
+   int top = 0;
+   stack[top++] = { 0, -infinity };
+
+   alignas(32) float t_near[N];
+   entry hits[N];
+   while (top > 0) {
+      entry e = stack[--top];
+      if (e.t > closest_so_far) continue;
+
+      if (e.child < 0) {
+         hit_anything |= hit_leaf(leaves[~e.child], r, sr, min_t, closest_so_far, rec);
+         continue;
+      }
+
+      const wide_bvh_node<N>& node = nodes[e.child];
+      int mask = intersect_children<N>(node, sr, min_t, closest_so_far, t_near);
+      mask &= (1 << node.num_children) - 1;
+      if (!mask) continue;
+
+      // push far children first so the nearest is visited next
+      int count = 0;
+      for (int k = 0; k < N; k++) {
+         if (!(mask & (1 << k))) continue;
+         entry h = { node.child[k], t_near[k] };
+         int pos = count++;
+         while (pos > 0 && hits[pos - 1].t < h.t) {
+            hits[pos] = hits[pos - 1];
+            pos--;
+         }
+         hits[pos] = h;
+      }
+      for (int k = 0; k < count; k++) stack[top++] = hits[k];
+   }
+   return hit_anything;
+}
+
+#endif
@@ -52,6 +52,11 @@ public:
        return ray(origin, lower_left_corner + u*horizontal + v*vertical - origin);
    }
 
+   const glm::point3& get_origin() const { return origin; }
+   const glm::point3& get_lower_left_corner() const { return lower_left_corner; }
+   const glm::vec3& get_horizontal() const { return horizontal; }
+   const glm::vec3& get_vertical() const { return vertical; }
+
 protected:
   glm::point3 origin;
   glm::point3 lower_left_corner;
@@ -0,0 +1,323 @@
+// compressed_mesh.h, triangle mesh with quantized vertices, decoded in the leaves
+//
+// The mesh is stored as clusters of up to 64 triangles, each a subtree of the
+// mesh BVH. A cluster keeps its own vertices as 16-bit offsets per axis from
+// its corner (6 bytes instead of 12), and its triangles index those vertices
+// with one byte per corner (3 bytes instead of 12). Triangles are decoded
+// when a leaf is tested. Every cluster quantizes to one grid for the whole
+// mesh: the step is a power of two and cluster corners lie on the grid, so
+// corner + step * offset is exact in float and a vertex shared by several
+// clusters decodes to the same position in each, leaving no cracks between
+// them. Decoded vertices are within half a step of the input; the step is
+// the smallest that spans the largest cluster in 65535 steps.
+
+#ifndef COMPRESSED_MESH_H_
+#define COMPRESSED_MESH_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "triangle.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+class compressed_mesh : public hittable {
+public:
+   static const int max_leaf_size = 8;
+   static const int max_cluster_size = 64; // triangles; at most 192 vertices, so a byte addresses them
+
+   struct node {
+      aabb box;
+      int first; // interior: index of the left child (right is first + 1); leaf: first triangle
+      int cluster_count; // leaf: cluster << 4 | triangle count; 0 for interior nodes
+
+      int count() const { return cluster_count & 15; }
+      int cluster() const { return cluster_count >> 4; }
+   };
+
+   struct cluster {
+      glm::point3 origin; // vertex = origin + scale * quantized; a grid point
+      glm::vec3 scale; // the mesh's grid step
+      int first_vertex;
+   };
+
+   // positions and three indices per triangle, as in an indexed mesh
+   compressed_mesh(const std::vector<glm::point3>& positions, const std::vector<int>& indices,
+      std::shared_ptr<material> m);
+
+   virtual bool hit(const ray& r, hit_record& rec) const override {
+      return hit_interval(r, 0.0f, infinity, rec);
+   }
+   virtual bool hit_interval(const ray& r, float min_t, float max_t, hit_record& rec) const override;
+
+   virtual bool bounding_box(aabb& output_box) const override {
+      if (nodes.empty()) return false;
+      output_box = nodes[0].box;
+      return true;
+   }
+
+   glm::point3 vertex(const cluster& c, int v) const {
+      const uint16_t* q = &vertices[3 * (c.first_vertex + v)];
+      return c.origin + c.scale * glm::vec3(q[0], q[1], q[2]);
+   }
+
+   size_t bytes() const {
+      return nodes.size() * sizeof(node) + clusters.size() * sizeof(cluster) +
+         vertices.size() * sizeof(uint16_t) + corners.size();
+   }
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "compressed mesh: " << num_triangles << " triangles, " << clusters.size() << " clusters, "
+         << bytes() / 1024 << " KB (indexed with a bvh: " << indexed_bytes / 1024 << " KB)" << std::endl;
+      return ss.str();
+   }
+
+public:
+   std::vector<node> nodes;
+   std::vector<cluster> clusters;
+   std::vector<uint16_t> vertices; // x, y, z per cluster vertex
+   std::vector<uint8_t> corners; // three per triangle, in leaf order, indexing the cluster's vertices
+   std::shared_ptr<material> mat_ptr;
+   int num_triangles;
+   size_t indexed_bytes; // float vertices, int indices and the uncompressed tree, for comparison
+
+private:
+   struct encoder;
+};
+
+// Turns the tree from bvh_builder into clusters and mesh nodes
+struct compressed_mesh::encoder {
+   compressed_mesh& mesh;
+   const std::vector<glm::point3>& positions;
+   const std::vector<int>& indices;
+   std::vector<bvh_node> tree;
+   std::vector<int> order; // leaf order of the triangles
+   std::vector<int> range_begin, range_end; // triangles under each tree node
+   std::vector<int> cluster_vertices; // mesh vertex of each cluster vertex
+   std::vector<aabb> cluster_bounds;
+
+   encoder(compressed_mesh& m, const std::vector<glm::point3>& p, const std::vector<int>& i) :
+      mesh(m), positions(p), indices(i) {}
+
+   void run() {
+      std::vector<aabb> bounds(mesh.num_triangles);
+      for (int t = 0; t < mesh.num_triangles; t++) {
+         for (int k = 0; k < 3; k++) bounds[t].grow(positions[indices[3 * t + k]]);
+      }
+      bvh_builder builder(bounds, max_leaf_size);
+      tree = builder.build();
+      order = builder.indices;
+      mesh.indexed_bytes = positions.size() * sizeof(glm::point3) + indices.size() * sizeof(int) +
+         tree.size() * sizeof(bvh_node);
+      if (tree.empty()) return;
+
+      // children always come after their parent
+      range_begin.resize(tree.size());
+      range_end.resize(tree.size());
+      for (int n = (int) tree.size() - 1; n >= 0; n--) {
+         if (tree[n].count > 0) {
+            range_begin[n] = tree[n].first;
+            range_end[n] = tree[n].first + tree[n].count;
+         }
+         else {
+            range_begin[n] = range_begin[tree[n].first];
+            range_end[n] = range_end[tree[n].first + 1];
+         }
+      }
+
+      mesh.corners.resize(3 * mesh.num_triangles);
+      mesh.nodes.resize(1);
+      emit_node(0, 0, -1);
+      quantize();
+      refit();
+   }
+
+   void emit_node(int tree_node, int dst, int cluster) {
+      int begin = range_begin[tree_node];
+      int end = range_end[tree_node];
+      if (cluster < 0 && end - begin <= max_cluster_size) cluster = encode_cluster(begin, end);
+
+      // small subtrees become one leaf (fewer nodes to store), large leaves are split
+      const bvh_node& n = tree[tree_node];
+      if (n.count > 0 || end - begin <= max_leaf_size) {
+         emit_range(begin, end, dst, cluster);
+         return;
+      }
+      int left = (int) mesh.nodes.size();
+      mesh.nodes.resize(left + 2);
+      mesh.nodes[dst].first = left;
+      mesh.nodes[dst].cluster_count = 0;
+      emit_node(n.first, left, cluster);
+      emit_node(n.first + 1, left + 1, cluster);
+   }
+
+   void emit_range(int begin, int end, int dst, int cluster) {
+      if (cluster < 0 && end - begin <= max_cluster_size) cluster = encode_cluster(begin, end);
+      if (end - begin <= max_leaf_size) {
+         mesh.nodes[dst].first = begin;
+         mesh.nodes[dst].cluster_count = cluster << 4 | (end - begin);
+         return;
+      }
+      int mid = begin + (end - begin) / 2;
+      int left = (int) mesh.nodes.size();
+      mesh.nodes.resize(left + 2);
+      mesh.nodes[dst].first = left;
+      mesh.nodes[dst].cluster_count = 0;
+      emit_range(begin, mid, left, cluster);
+      emit_range(mid, end, left + 1, cluster);
+   }
+
+   // gather the vertices of triangles [begin, end) in leaf order; they are
+   // quantized once every cluster is known
+   int encode_cluster(int begin, int end) {
+      int first = (int) cluster_vertices.size();
+      aabb box;
+      for (int t = begin; t < end; t++) {
+         for (int k = 0; k < 3; k++) {
+            int v = indices[3 * order[t] + k];
+            std::vector<int>::iterator local = std::find(cluster_vertices.begin() + first, cluster_vertices.end(), v);
+            int slot = (int) (local - cluster_vertices.begin()) - first;
+            if (local == cluster_vertices.end()) {
+               cluster_vertices.push_back(v);
+               box.grow(positions[v]);
+            }
+            mesh.corners[3 * t + k] = (uint8_t) slot;
+         }
+      }
+
+      cluster c;
+      c.first_vertex = first;
+      mesh.clusters.push_back(c);
+      cluster_bounds.push_back(box);
+      return (int) mesh.clusters.size() - 1;
+   }
+
+   // Picks the grid step of each axis, a power of two, then snaps every
+   // cluster corner to the grid and stores its vertices as offsets in steps
+   void quantize() {
+      glm::vec3 largest(0), farthest(0);
+      for (size_t i = 0; i < cluster_bounds.size(); i++) {
+         largest = glm::max(largest, cluster_bounds[i].extent());
+         farthest = glm::max(farthest, glm::max(glm::abs(cluster_bounds[i].minimum), glm::abs(cluster_bounds[i].maximum)));
+      }
+      glm::vec3 step;
+      for (int axis = 0; axis < 3; axis++) {
+         // a corner can sit a step below the cluster: 65534 steps for the extent;
+         // grid coordinates stay below 2^24 so corners and vertices are exact floats
+         float needed = std::max(largest[axis] / 65534.0f, farthest[axis] / 8388608.0f);
+         step[axis] = needed > 0 ? std::ldexp(1.0f, (int) std::ceil(std::log2(needed))) : 1.0f;
+         while (largest[axis] / step[axis] > 65534.0f || farthest[axis] / step[axis] >= 8388608.0f) step[axis] *= 2;
+      }
+
+      mesh.vertices.resize(3 * cluster_vertices.size());
+      for (size_t i = 0; i < mesh.clusters.size(); i++) {
+         cluster& c = mesh.clusters[i];
+         c.origin = glm::floor(cluster_bounds[i].minimum / step) * step;
+         c.scale = step;
+         int end = i + 1 < mesh.clusters.size() ? mesh.clusters[i + 1].first_vertex : (int) cluster_vertices.size();
+         for (int v = c.first_vertex; v < end; v++) {
+            // the same grid point in every cluster: round from the vertex, not the corner
+            glm::vec3 grid = glm::floor(positions[cluster_vertices[v]] / step + 0.5f);
+            glm::vec3 q = grid - c.origin / step;
+            for (int axis = 0; axis < 3; axis++) mesh.vertices[3 * v + axis] = (uint16_t) glm::clamp(q[axis], 0.0f, 65535.0f);
+         }
+      }
+   }
+
+   // node bounds from the decoded triangles, so that they contain exactly what is tested
+   void refit() {
+      for (int n = (int) mesh.nodes.size() - 1; n >= 0; n--) {
+         node& dst = mesh.nodes[n];
+         dst.box = aabb();
+         if (dst.cluster_count == 0) {
+            dst.box.grow(mesh.nodes[dst.first].box);
+            dst.box.grow(mesh.nodes[dst.first + 1].box);
+            continue;
+         }
+         const cluster& c = mesh.clusters[dst.cluster()];
+         for (int t = dst.first; t < dst.first + dst.count(); t++) {
+            for (int k = 0; k < 3; k++) dst.box.grow(mesh.vertex(c, mesh.corners[3 * t + k]));
+         }
+      }
+   }
+};
+
+inline compressed_mesh::compressed_mesh(const std::vector<glm::point3>& positions,
+   const std::vector<int>& indices, std::shared_ptr<material> m) :
+   mat_ptr(m), num_triangles((int) indices.size() / 3), indexed_bytes(0)
+{
+   encoder(*this, positions, indices).run();
+}
+
+inline bool compressed_mesh::hit_interval(const ray& r, float min_t, float max_t, hit_record& rec) const
+{
+   if (nodes.empty()) return false;
+
+   hit_record temp_rec;
+   bool hit_anything = false;
+   float closest_so_far = max_t;
+   glm::point3 origin = r.origin();
+   glm::vec3 inv_dir = 1.0f / r.direction();
+
+   // oversized builder leaves are split in halves: at most 32 levels below the builder's depth
+   struct entry { int node; float t; };
+   entry stack[bvh_builder::max_depth + 34];
+   int top = 0;
+
+   float t_root;
+   if (!nodes[0].box.hit(origin, inv_dir, min_t, closest_so_far, t_root)) return false;
+   stack[top++] = { 0, t_root };
+
+   while (top > 0) {
+      entry e = stack[--top];
+      if (e.t > closest_so_far) continue;
+
+      const node* n = &nodes[e.node];
+      while (n->cluster_count == 0) {
+         int left = n->first;
+         float t_left, t_right;
+         bool hit_left = nodes[left].box.hit(origin, inv_dir, min_t, closest_so_far, t_left);
+         bool hit_right = nodes[left + 1].box.hit(origin, inv_dir, min_t, closest_so_far, t_right);
+         if (hit_left && hit_right) {
+            if (t_left <= t_right) {
+               stack[top++] = { left + 1, t_right };
+               n = &nodes[left];
+            }
+            else {
+               stack[top++] = { left, t_left };
+               n = &nodes[left + 1];
+            }
+         }
+         else if (hit_left) n = &nodes[left];
+         else if (hit_right) n = &nodes[left + 1];
+         else break;
+      }
+      if (n->cluster_count == 0) continue;
+
+      // decode each triangle and test it as a triangle primitive would
+      const cluster& c = clusters[n->cluster()];
+      for (int t = n->first; t < n->first + n->count(); t++) {
+         const uint8_t* corner = &corners[3 * t];
+         triangle tri(vertex(c, corner[0]), vertex(c, corner[1]), vertex(c, corner[2]), 0);
+         if (tri.hit_interval(r, min_t, closest_so_far, temp_rec)) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+         }
+      }
+   }
+
+   if (hit_anything) {
+      rec.mat_ptr = mat_ptr;
+      rec.object = this;
+   }
+   return hit_anything;
+}
+
+#endif
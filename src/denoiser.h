@@ -0,0 +1,222 @@
+// denoiser.h, an edge-aware a-trous filter for images of few samples
+//
+// At 10 to 20 samples per pixel, indirect light is the noise of the image,
+// while the surfaces the camera sees are known precisely. The filter is
+// the spatial part of SVGF (Schied et al. 2017): the light of every pixel
+// is divided by the albedo of its first hits, then smoothed by passes of a
+// 5 x 5 B-spline kernel whose taps are 1, 2, 4, 8 ... pixels apart (a
+// trous, with holes). A neighbor counts less the more its normal differs,
+// its depth differs beyond what the local depth slope explains, and its
+// luminance differs relative to the noise of the estimate. That noise is
+// the variance of the pixel's samples (render.h), filtered along with the
+// light. Texture detail survives in the albedo, multiplied back at the end.
+// Pixels are stored as planes of floats with a border wide enough for the
+// farthest tap, filtered four at a time (simd.h), tiles in parallel.
+
+#ifndef DENOISER_H_
+#define DENOISER_H_
+
+#include "AGLM.h"
+#include "render.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <vector>
+
+struct denoise_settings {
+   int iterations = 5; // passes; the last one's taps are 2^(iterations - 1) pixels apart
+   float sigma_luminance = 4.0f; // luminance differences allowed, in standard deviations
+   int normal_power = 128; // neighbors weigh the cosine between normals to this power of two
+   float sigma_depth = 1.0f; // depth differences allowed, in multiples of the depth slope
+};
+
+class atrous_filter {
+public:
+   explicit atrous_filter(const denoise_settings& s = denoise_settings()) : settings(s) {}
+
+   // Replaces the radiance sums of image, samples_per_pixel samples each,
+   // with filtered ones; features are those of the same render
+   void denoise(framebuffer& image, const feature_buffer& features, int samples_per_pixel);
+
+private:
+   // e^-x for x >= 0 as (1 - x / 256)^256: within 0.2% up to x = 1, 0 past 256
+   static float4 exp_neg(float4 x) {
+      float4 y = max(float4(1.0f) - x * float4(1.0f / 256.0f), float4(0.0f));
+      for (int k = 0; k < 8; k++) y = y * y;
+      return y;
+   }
+
+   static float4 luminance(float4 r, float4 g, float4 b) {
+      return float4(0.2126f) * r + float4(0.7152f) * g + float4(0.0722f) * b;
+   }
+
+   // one pass with taps step pixels apart, from the first four planes into the second four
+   void pass(int step);
+
+   size_t index(int i, int j) const { return size_t(j + pad) * stride + (i + pad); }
+
+private:
+   denoise_settings settings;
+   int width = 0, height = 0;
+   int pad = 0; // border around the image, a multiple of 4
+   int stride = 0; // floats per padded row, a multiple of 4
+   // demodulated light and the variance of its luminance, and their next values
+   aligned_vector<float> r, g, b, variance, next_r, next_g, next_b, next_variance;
+   aligned_vector<float> nx, ny, nz, depth, slope; // zero outside the image
+};
+
+inline void atrous_filter::denoise(framebuffer& image, const feature_buffer& features, int samples_per_pixel)
+{
+   width = image.width;
+   height = image.height;
+   int iterations = glm::clamp(settings.iterations, 0, 10);
+   if (width <= 0 || height <= 0 || samples_per_pixel <= 0 || iterations == 0) return;
+   int reach = 2 << (iterations - 1); // farthest tap
+   pad = (reach + 1 + 3) & ~3; // the variance is blurred one pixel further
+   stride = pad + ((width + 3) & ~3) + pad;
+   size_t n = size_t(stride) * (pad + height + pad);
+   aligned_vector<float>* planes[] = { &r, &g, &b, &variance, &next_r, &next_g, &next_b, &next_variance,
+      &nx, &ny, &nz, &depth, &slope };
+   for (aligned_vector<float>* plane : planes) plane->assign(n, 0.0f);
+
+   // averages of the samples, light divided by albedo where there is one
+   float scale = 1.0f / samples_per_pixel;
+   std::vector<glm::color> albedo(size_t(width) * height);
+   parallel_for(0, height, 8, [&](int first, int last) {
+      for (int j = first; j < last; j++) {
+         for (int i = 0; i < width; i++) {
+            int pixel = j * width + i;
+            size_t k = index(i, j);
+            glm::color a = features.albedo[pixel] * scale;
+            for (int c = 0; c < 3; c++) a[c] = a[c] > 0.01f ? a[c] : 1.0f;
+            albedo[pixel] = a;
+            glm::color light = image.at(j, i) * scale / a;
+            r[k] = light.r;
+            g[k] = light.g;
+            b[k] = light.b;
+            // variance of the mean luminance, from the samples' squares
+            glm::color sum = image.at(j, i) * scale;
+            float mean = 0.2126f * sum.r + 0.7152f * sum.g + 0.0722f * sum.b;
+            float a_luminance = 0.2126f * a.r + 0.7152f * a.g + 0.0722f * a.b;
+            float v = samples_per_pixel > 1 ?
+               std::max(0.0f, features.luminance_sqr[pixel] * scale - mean * mean) / (samples_per_pixel - 1) :
+               mean * mean;
+            variance[k] = v / (a_luminance * a_luminance);
+            glm::vec3 normal = features.normal[pixel];
+            float length = glm::length(normal);
+            // samples seeing different surfaces (edges, misses) keep their mean
+            if (length > 0.9f * samples_per_pixel) normal /= length;
+            else normal = glm::vec3(0);
+            nx[k] = normal.x;
+            ny[k] = normal.y;
+            nz[k] = normal.z;
+            depth[k] = features.depth[pixel] * scale;
+         }
+      }
+   });
+   // the depth slope per pixel, from the smaller difference to either
+   // side so that silhouettes do not count
+   parallel_for(0, height, 8, [&](int first, int last) {
+      for (int j = first; j < last; j++) {
+         for (int i = 0; i < width; i++) {
+            size_t k = index(i, j);
+            float dx = std::min(std::fabs(depth[k + 1] - depth[k]), std::fabs(depth[k] - depth[k - 1]));
+            float dy = std::min(std::fabs(depth[k + stride] - depth[k]), std::fabs(depth[k] - depth[k - stride]));
+            slope[k] = std::sqrt(dx * dx + dy * dy);
+         }
+      }
+   });
+
+   for (int it = 0; it < iterations; it++) {
+      pass(1 << it);
+      r.swap(next_r);
+      g.swap(next_g);
+      b.swap(next_b);
+      variance.swap(next_variance);
+   }
+
+   for (int j = 0; j < height; j++) {
+      for (int i = 0; i < width; i++) {
+         size_t k = index(i, j);
+         image.at(j, i) = glm::color(r[k], g[k], b[k]) * albedo[j * width + i] * float(samples_per_pixel);
+      }
+   }
+}
+
+inline void atrous_filter::pass(int step)
+{
+   const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+   int squarings = 0;
+   while ((2 << squarings) <= settings.normal_power) squarings++;
+   const int tile_width = 64, tile_height = 16;
+   int tiles_x = (width + tile_width - 1) / tile_width;
+   int tiles_y = (height + tile_height - 1) / tile_height;
+
+   parallel_for(0, tiles_x * tiles_y, 1, [&](int first, int last) {
+      for (int tile = first; tile < last; tile++) {
+         int i0 = (tile % tiles_x) * tile_width;
+         int j0 = (tile / tiles_x) * tile_height;
+         int i1 = std::min(width, i0 + tile_width);
+         int j1 = std::min(height, j0 + tile_height);
+         for (int j = j0; j < j1; j++) {
+            // past the last column, lanes see the zero border: they keep zero
+            for (int i = i0; i < i1; i += 4) {
+               size_t k = index(i, j);
+               float4 rp = float4::load(&r[k]), gp = float4::load(&g[k]), bp = float4::load(&b[k]);
+               float4 lp = luminance(rp, gp, bp);
+               float4 nxp = float4::load(&nx[k]), nyp = float4::load(&ny[k]), nzp = float4::load(&nz[k]);
+               float4 zp = float4::load(&depth[k]), slope_p = float4::load(&slope[k]);
+               // the noise allowed: the variance blurred over 3 x 3 pixels
+               float4 v(0.0f);
+               for (int dy = -1; dy <= 1; dy++) {
+                  for (int dx = -1; dx <= 1; dx++) {
+                     float h = (dx ? 0.25f : 0.5f) * (dy ? 0.25f : 0.5f);
+                     v = v + float4(h) * float4::loadu(&variance[k + dy * stride + dx]);
+                  }
+               }
+               float4 noise = float4(settings.sigma_luminance) * sqrt(max(v, float4(0.0f))) + float4(1e-6f);
+
+               float4 sum_w(0.0f), sum_r(0.0f), sum_g(0.0f), sum_b(0.0f), sum_v(0.0f);
+               for (int dy = -2; dy <= 2; dy++) {
+                  for (int dx = -2; dx <= 2; dx++) {
+                     size_t q = k + (dy * stride + dx) * step;
+                     float4 rq = float4::loadu(&r[q]), gq = float4::loadu(&g[q]), bq = float4::loadu(&b[q]);
+                     float4 vq = float4::loadu(&variance[q]);
+                     float4 w(kernel[dx + 2] * kernel[dy + 2]);
+                     if (dx || dy) {
+                        float4 cosine = max(nxp * float4::loadu(&nx[q]) + nyp * float4::loadu(&ny[q]) +
+                           nzp * float4::loadu(&nz[q]), float4(0.0f));
+                        for (int s = 0; s < squarings; s++) cosine = cosine * cosine;
+                        float distance = settings.sigma_depth * step * std::sqrt(float(dx * dx + dy * dy));
+                        float4 w_depth = abs(zp - float4::loadu(&depth[q])) /
+                           (float4(distance) * slope_p + float4(1e-3f) * zp + float4(1e-6f));
+                        float4 w_luminance = abs(lp - luminance(rq, gq, bq)) / noise;
+                        w = w * cosine * exp_neg(w_depth + w_luminance);
+                     }
+                     sum_w = sum_w + w;
+                     sum_r = sum_r + w * rq;
+                     sum_g = sum_g + w * gq;
+                     sum_b = sum_b + w * bq;
+                     sum_v = sum_v + w * w * vq;
+                  }
+               }
+               (sum_r / sum_w).store(&next_r[k]);
+               (sum_g / sum_w).store(&next_g[k]);
+               (sum_b / sum_w).store(&next_b[k]);
+               (sum_v / (sum_w * sum_w)).store(&next_variance[k]);
+            }
+         }
+      }
+   });
+}
+
+// Filters image, a render's sums of samples_per_pixel samples, guided by
+// the features of the same render
+inline void denoise(framebuffer& image, const feature_buffer& features, int samples_per_pixel,
+   const denoise_settings& settings = denoise_settings())
+{
+   atrous_filter filter(settings);
+   filter.denoise(image, features, samples_per_pixel);
+}
+
+#endif
@@ -0,0 +1,533 @@
+// dynamic_bvh.h, a BVH that follows edits of the scene one object at a time
+//
+// A layout tool inserts, removes and moves a few objects between frames,
+// and rebuilding a BVH over 100k objects takes tens of milliseconds per
+// edit. dynamic_bvh keeps one object per leaf in a pool of nodes with
+// parent links, so an edit only touches the path from its leaf to the root.
+// An object that moves a little is refit: the boxes on its path are
+// recomputed. One that moves farther is taken out and inserted again as
+// the sibling of the node that adds the least surface area, found by branch
+// and bound (Catto 2019, "Dynamic Bounding Volume Hierarchies"). On the way
+// back up, tree rotations swap a child with a grandchild wherever that
+// shrinks the node in between (Kopta et al. 2012). Edits degrade the tree
+// slowly; its SAH cost is kept up to date, and optimize() rebuilds it with
+// the binned SAH builder (bvh.h) when the cost passes rebuild_ratio times
+// its cost after the last build, keeping the old tree if the new one is
+// not cheaper. The tree must not be edited while rays are traced through it.
+
+#ifndef DYNAMIC_BVH_H_
+#define DYNAMIC_BVH_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "accelerator.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+class dynamic_bvh : public accelerator {
+public:
+   static const int max_height = 2 * bvh_builder::max_depth;
+
+   // Indexes the objects of world, which insert, remove and transform edit
+   // along with the tree
+   explicit dynamic_bvh(hittable_list& world, float rebuild_ratio = 1.3f);
+
+   void insert(const std::shared_ptr<hittable>& object);
+   // false if the world does not hold object
+   bool remove(const hittable* object);
+   // Moves object by m (hittable::transform) and its leaf with it; false
+   // if the world does not hold it or it cannot be moved
+   bool transform(const hittable* object, const glm::mat4& m);
+   // follows an object whose bounds the caller changed in place
+   bool update(const hittable* object);
+
+   // Rebuilds the tree if edits made its cost rebuild_ratio times what it
+   // was after the last build; returns true if the rebuilt tree is cheaper
+   // and replaced it, false if it kept the tree it had
+   bool optimize();
+   void rebuild();
+
+   // expected cost of a random ray, relative to the root, as in bvh_stats
+   float sah_cost() const {
+      if (root < 0) return 0.0f;
+      return float(area_sum / std::max(1e-12f, nodes[root].box.surface_area()));
+   }
+
+   virtual bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const override;
+   virtual std::string name() const override { return "dynamic bvh"; }
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "dynamic bvh: " << bounded_count + unbounded.size() << " objects, SAH cost " << sah_cost()
+         << " (" << built_cost << " when built), " << refits << " refits, " << reinsertions << " reinsertions, "
+         << rotations << " rotations, " << builds << " builds" << std::endl;
+      return ss.str();
+   }
+
+private:
+   struct node {
+      aabb box;
+      int parent;
+      int child[2]; // -1 for leaves
+      int height; // 0 for leaves
+      const hittable* object; // leaves only
+   };
+
+   // where an object of the world is: its leaf, -1 when unbounded, and its
+   // index in the world's list
+   struct place {
+      int leaf;
+      size_t index;
+   };
+
+   int allocate();
+   void release(int n);
+   void set_box(int n, const aabb& box);
+   aabb merged(int a, int b) const {
+      aabb box = nodes[a].box;
+      box.grow(nodes[b].box);
+      return box;
+   }
+   bool is_leaf(int n) const { return nodes[n].child[0] < 0; }
+   void insert_leaf(int leaf);
+   void remove_leaf(int leaf);
+   void refit_from(int n);
+   void rotate(int n);
+   int build_range(const std::vector<bvh_node>& flat, int flat_node, const std::vector<int>& order,
+      const std::vector<const hittable*>& objects, int parent);
+   int build_list(const std::vector<int>& order, int begin, int end, const std::vector<const hittable*>& objects,
+      int parent);
+
+   hittable_list& world;
+   float rebuild_ratio;
+   std::vector<node> nodes;
+   std::vector<int> free_nodes;
+   int root = -1;
+   double area_sum = 0; // of every node's box: the SAH cost times the root's area
+   float built_cost = 0;
+   std::unordered_map<const hittable*, place> places;
+   size_t bounded_count = 0;
+   std::vector<const hittable*> unbounded;
+   std::vector<std::pair<float, int>> queue; // branch and bound candidates, a heap
+   int refits = 0, reinsertions = 0, rotations = 0, builds = 0;
+};
+
+//-----------------------------------------------------------------------------
+
+inline dynamic_bvh::dynamic_bvh(hittable_list& w, float ratio) : world(w), rebuild_ratio(ratio)
+{
+   rebuild();
+}
+
+inline int dynamic_bvh::allocate()
+{
+   int n;
+   if (!free_nodes.empty()) {
+      n = free_nodes.back();
+      free_nodes.pop_back();
+   }
+   else {
+      n = (int) nodes.size();
+      nodes.push_back(node());
+   }
+   node& x = nodes[n];
+   x.box = aabb();
+   x.parent = -1;
+   x.child[0] = x.child[1] = -1;
+   x.height = 0;
+   x.object = 0;
+   return n;
+}
+
+inline void dynamic_bvh::release(int n)
+{
+   area_sum -= nodes[n].box.surface_area();
+   nodes[n].box = aabb();
+   free_nodes.push_back(n);
+}
+
+inline void dynamic_bvh::set_box(int n, const aabb& box)
+{
+   area_sum += box.surface_area() - nodes[n].box.surface_area();
+   nodes[n].box = box;
+}
+
+inline void dynamic_bvh::rebuild()
+{
+   nodes.clear();
+   free_nodes.clear();
+   places.clear();
+   bounded_count = 0;
+   unbounded.clear();
+   root = -1;
+   area_sum = 0;
+
+   std::vector<aabb> bounds;
+   std::vector<const hittable*> bounded;
+   for (size_t i = 0; i < world.objects.size(); i++) {
+      const hittable* object = world.objects[i].get();
+      aabb box;
+      place p = { -1, i };
+      if (object->bounding_box(box)) {
+         bounds.push_back(box);
+         bounded.push_back(object);
+      }
+      else {
+         unbounded.push_back(object);
+      }
+      places[object] = p;
+   }
+   if (!bounded.empty()) {
+      bvh_builder builder(bounds, 1);
+      std::vector<bvh_node> flat = builder.build();
+      nodes.reserve(2 * bounded.size());
+      root = build_range(flat, 0, builder.indices, bounded, -1);
+   }
+   built_cost = sah_cost();
+   builds++;
+}
+
+// copies the subtree of flat at flat_node into the pool
+inline int dynamic_bvh::build_range(const std::vector<bvh_node>& flat, int flat_node, const std::vector<int>& order,
+   const std::vector<const hittable*>& objects, int parent)
+{
+   const bvh_node& f = flat[flat_node];
+   if (f.count > 0) {
+      return build_list(order, f.first, f.first + f.count, objects, parent);
+   }
+   int n = allocate();
+   nodes[n].parent = parent;
+   int left = build_range(flat, f.first, order, objects, n);
+   int right = build_range(flat, f.first + 1, order, objects, n);
+   nodes[n].child[0] = left;
+   nodes[n].child[1] = right;
+   nodes[n].height = 1 + std::max(nodes[left].height, nodes[right].height);
+   set_box(n, merged(left, right));
+   return n;
+}
+
+// a balanced subtree over order[begin, end), for leaves the builder could not split
+inline int dynamic_bvh::build_list(const std::vector<int>& order, int begin, int end,
+   const std::vector<const hittable*>& objects, int parent)
+{
+   int n = allocate();
+   nodes[n].parent = parent;
+   if (end - begin == 1) {
+      const hittable* object = objects[order[begin]];
+      aabb box;
+      object->bounding_box(box);
+      nodes[n].object = object;
+      set_box(n, box);
+      places[object].leaf = n;
+      bounded_count++;
+      return n;
+   }
+   int mid = (begin + end) / 2;
+   int left = build_list(order, begin, mid, objects, n);
+   int right = build_list(order, mid, end, objects, n);
+   nodes[n].child[0] = left;
+   nodes[n].child[1] = right;
+   nodes[n].height = 1 + std::max(nodes[left].height, nodes[right].height);
+   set_box(n, merged(left, right));
+   return n;
+}
+
+inline void dynamic_bvh::insert(const std::shared_ptr<hittable>& object)
+{
+   place p = { -1, world.objects.size() };
+   world.add(object);
+   aabb box;
+   if (!object->bounding_box(box)) {
+      unbounded.push_back(object.get());
+      places[object.get()] = p;
+      return;
+   }
+   int leaf = allocate();
+   nodes[leaf].object = object.get();
+   set_box(leaf, box);
+   p.leaf = leaf;
+   places[object.get()] = p;
+   bounded_count++;
+   insert_leaf(leaf);
+   if (nodes[root].height > max_height) rebuild();
+}
+
+inline bool dynamic_bvh::remove(const hittable* object)
+{
+   std::unordered_map<const hittable*, place>::iterator it = places.find(object);
+   if (it == places.end()) return false;
+   place p = it->second;
+   places.erase(it);
+   if (p.leaf >= 0) {
+      remove_leaf(p.leaf);
+      release(p.leaf);
+      bounded_count--;
+   }
+   else {
+      *std::find(unbounded.begin(), unbounded.end(), object) = unbounded.back();
+      unbounded.pop_back();
+   }
+   // the world's last object takes the removed one's index
+   world.remove_at(p.index);
+   if (p.index < world.objects.size()) places[world.objects[p.index].get()].index = p.index;
+   return true;
+}
+
+inline bool dynamic_bvh::transform(const hittable* object, const glm::mat4& m)
+{
+   std::unordered_map<const hittable*, place>::iterator it = places.find(object);
+   if (it == places.end() || !world.objects[it->second.index]->transform(m)) return false;
+   return update(object);
+}
+
+inline bool dynamic_bvh::update(const hittable* object)
+{
+   std::unordered_map<const hittable*, place>::iterator it = places.find(object);
+   if (it == places.end()) return false;
+   int leaf = it->second.leaf;
+   aabb box;
+   if (leaf < 0 || !object->bounding_box(box)) return leaf < 0; // unbounded objects stay unbounded
+
+   int parent = nodes[leaf].parent;
+   aabb grown = parent >= 0 ? nodes[parent].box : box;
+   grown.grow(box);
+   // a small motion barely grows the parent: refit the path, else move the leaf
+   if (parent < 0 || grown.surface_area() <= 1.25f * nodes[parent].box.surface_area()) {
+      set_box(leaf, box);
+      refit_from(parent);
+      refits++;
+   }
+   else {
+      remove_leaf(leaf);
+      set_box(leaf, box);
+      insert_leaf(leaf);
+      reinsertions++;
+   }
+   if (root >= 0 && nodes[root].height > max_height) rebuild();
+   return true;
+}
+
+inline bool dynamic_bvh::optimize()
+{
+   float cost = sah_cost();
+   if (root < 0 || cost <= rebuild_ratio * built_cost) return false;
+
+   // set the edited tree aside; rebuild starts from empty members anyway
+   std::vector<node> old_nodes;
+   std::vector<int> old_free_nodes;
+   std::unordered_map<const hittable*, place> old_places;
+   std::vector<const hittable*> old_unbounded;
+   old_nodes.swap(nodes);
+   old_free_nodes.swap(free_nodes);
+   old_places.swap(places);
+   old_unbounded.swap(unbounded);
+   int old_root = root;
+   double old_area_sum = area_sum;
+   size_t old_bounded_count = bounded_count;
+
+   rebuild();
+   if (sah_cost() < cost) return true;
+
+   // the builder's tree is no better: keep the edited one, and measure the
+   // next edits against it
+   nodes.swap(old_nodes);
+   free_nodes.swap(old_free_nodes);
+   places.swap(old_places);
+   unbounded.swap(old_unbounded);
+   root = old_root;
+   area_sum = old_area_sum;
+   bounded_count = old_bounded_count;
+   built_cost = cost;
+   return false;
+}
+
+// Makes leaf the sibling of the node whose box grows the tree the least
+inline void dynamic_bvh::insert_leaf(int leaf)
+{
+   nodes[leaf].parent = -1;
+   if (root < 0) {
+      root = leaf;
+      return;
+   }
+
+   // a candidate's cost is its merged area plus the growth of its
+   // ancestors; its children cost at least the leaf's area plus that growth
+   const aabb& box = nodes[leaf].box;
+   float leaf_area = box.surface_area();
+   int best = root;
+   float best_cost = merged(leaf, root).surface_area();
+   queue.clear();
+   queue.push_back(std::make_pair(0.0f, root)); // (inherited growth, node), smallest first
+   auto later = [](const std::pair<float, int>& a, const std::pair<float, int>& b) { return a.first > b.first; };
+   while (!queue.empty()) {
+      std::pop_heap(queue.begin(), queue.end(), later);
+      std::pair<float, int> top = queue.back();
+      queue.pop_back();
+      float inherited = top.first;
+      int n = top.second;
+      if (leaf_area + inherited >= best_cost) break;
+      float direct = merged(leaf, n).surface_area();
+      if (direct + inherited < best_cost) {
+         best_cost = direct + inherited;
+         best = n;
+      }
+      if (is_leaf(n)) continue;
+      float growth = inherited + direct - nodes[n].box.surface_area();
+      if (leaf_area + growth >= best_cost) continue;
+      for (int c = 0; c < 2; c++) {
+         queue.push_back(std::make_pair(growth, nodes[n].child[c]));
+         std::push_heap(queue.begin(), queue.end(), later);
+      }
+   }
+
+   int sibling = best;
+   int old_parent = nodes[sibling].parent;
+   int parent = allocate();
+   nodes[parent].parent = old_parent;
+   nodes[parent].child[0] = sibling;
+   nodes[parent].child[1] = leaf;
+   set_box(parent, merged(sibling, leaf));
+   nodes[sibling].parent = parent;
+   nodes[leaf].parent = parent;
+   if (old_parent < 0) root = parent;
+   else nodes[old_parent].child[nodes[old_parent].child[0] == sibling ? 0 : 1] = parent;
+   refit_from(parent);
+}
+
+// Takes leaf out of the tree; its sibling takes its parent's place
+inline void dynamic_bvh::remove_leaf(int leaf)
+{
+   if (leaf == root) {
+      root = -1;
+      return;
+   }
+   int parent = nodes[leaf].parent;
+   int sibling = nodes[parent].child[nodes[parent].child[0] == leaf ? 1 : 0];
+   int grandparent = nodes[parent].parent;
+   nodes[sibling].parent = grandparent;
+   if (grandparent < 0) root = sibling;
+   else nodes[grandparent].child[nodes[grandparent].child[0] == parent ? 0 : 1] = sibling;
+   release(parent);
+   nodes[leaf].parent = -1;
+   refit_from(grandparent);
+}
+
+// Recomputes the boxes and heights from n to the root, rotating on the way
+inline void dynamic_bvh::refit_from(int n)
+{
+   while (n >= 0) {
+      const node& x = nodes[n];
+      set_box(n, merged(x.child[0], x.child[1]));
+      nodes[n].height = 1 + std::max(nodes[x.child[0]].height, nodes[x.child[1]].height);
+      rotate(n);
+      n = nodes[n].parent;
+   }
+}
+
+// Swaps a child of n with a grandchild on the other side when that shrinks
+// the node between them the most
+inline void dynamic_bvh::rotate(int n)
+{
+   int b = nodes[n].child[0], c = nodes[n].child[1];
+   // (child, grandchild) swaps: b with a child of c, c with a child of b
+   float best_gain = 0.0f;
+   int best_child = -1, best_grandchild = -1;
+   for (int side = 0; side < 2; side++) {
+      int keep = side == 0 ? b : c; // swapped into the other side
+      int other = side == 0 ? c : b;
+      if (is_leaf(other)) continue;
+      float area = nodes[other].box.surface_area();
+      for (int g = 0; g < 2; g++) {
+         int out = nodes[other].child[g];
+         int stay = nodes[other].child[1 - g];
+         float gain = area - merged(keep, stay).surface_area();
+         if (gain > best_gain) {
+            best_gain = gain;
+            best_child = keep;
+            best_grandchild = out;
+         }
+      }
+   }
+   if (best_child < 0) return;
+
+   // best_child and best_grandchild trade places
+   int other = nodes[n].child[0] == best_child ? nodes[n].child[1] : nodes[n].child[0];
+   nodes[n].child[nodes[n].child[0] == best_child ? 0 : 1] = best_grandchild;
+   nodes[best_grandchild].parent = n;
+   nodes[other].child[nodes[other].child[0] == best_grandchild ? 0 : 1] = best_child;
+   nodes[best_child].parent = other;
+   set_box(other, merged(nodes[other].child[0], nodes[other].child[1]));
+   nodes[other].height = 1 + std::max(nodes[nodes[other].child[0]].height, nodes[nodes[other].child[1]].height);
+   nodes[n].height = 1 + std::max(nodes[nodes[n].child[0]].height, nodes[nodes[n].child[1]].height);
+   rotations++;
+}
+
+inline bool dynamic_bvh::hit(const ray& r, float min_t, float max_t, hit_record& rec) const
+{
+   hit_record temp_rec;
+   bool hit_anything = false;
+   float closest_so_far = max_t;
+
+   for (size_t i = 0; i < unbounded.size(); i++) {
+      if (unbounded[i]->hit_interval(r, min_t, closest_so_far, temp_rec)) {
+         hit_anything = true;
+         closest_so_far = temp_rec.t;
+         rec = temp_rec;
+      }
+   }
+   if (root < 0) return hit_anything;
+
+   glm::point3 origin = r.origin();
+   glm::vec3 inv_dir = 1.0f / r.direction();
+
+   // visit children near to far; skip popped nodes that start past the closest hit
+   struct entry { int node; float t; };
+   entry stack[max_height + 2];
+   int top = 0;
+
+   float t_root;
+   if (!nodes[root].box.hit(origin, inv_dir, min_t, closest_so_far, t_root)) return hit_anything;
+   stack[top++] = { root, t_root };
+
+   while (top > 0) {
+      entry e = stack[--top];
+      if (e.t > closest_so_far) continue;
+
+      const node* n = &nodes[e.node];
+      while (n->child[0] >= 0) {
+         int left = n->child[0], right = n->child[1];
+         float t_left, t_right;
+         bool hit_left = nodes[left].box.hit(origin, inv_dir, min_t, closest_so_far, t_left);
+         bool hit_right = nodes[right].box.hit(origin, inv_dir, min_t, closest_so_far, t_right);
+         if (hit_left && hit_right) {
+            if (t_left <= t_right) {
+               stack[top++] = { right, t_right };
+               n = &nodes[left];
+            }
+            else {
+               stack[top++] = { left, t_left };
+               n = &nodes[right];
+            }
+         }
+         else if (hit_left) n = &nodes[left];
+         else if (hit_right) n = &nodes[right];
+         else break;
+      }
+      if (n->child[0] >= 0) continue;
+
+      if (n->object->hit_interval(r, min_t, closest_so_far, temp_rec)) {
+         hit_anything = true;
+         closest_so_far = temp_rec.t;
+         rec = temp_rec;
+      }
+   }
+   return hit_anything;
+}
+
+#endif
@@ -0,0 +1,129 @@
+// environment_map.h, HDR lat-long image lighting the scene from infinitely far
+//
+// Directions map to the image by longitude (u, around +y) and latitude
+// (v, from +y down). The map is importance sampled by its luminance: each
+// row has a conditional CDF over its pixels and a marginal CDF picks the
+// row, with pixels weighted by sin(latitude) to account for the smaller
+// solid angle near the poles. The tables are built once, rows in parallel,
+// and a direction is drawn with two binary searches. Radiance is constant
+// over each pixel, matching the piecewise-constant density exactly.
+
+#ifndef ENVIRONMENT_MAP_H_
+#define ENVIRONMENT_MAP_H_
+
+#include "AGLM.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+class environment_map {
+public:
+   // width x height linear radiance values, row by row from the top (+y)
+   environment_map(int w, int h, const std::vector<glm::color>& radiance, float scale = 1.0f);
+
+   bool empty() const { return pixels.empty(); }
+
+   glm::color eval(const glm::vec3& direction) const {
+      return pixels[pixel_of(direction)];
+   }
+
+   // Draws a direction from two values in [0, 1); returns its solid angle
+   // density (0 if the map is black) and sets the radiance from there
+   float sample(float u1, float u2, glm::vec3& direction, glm::color& radiance) const {
+      if (total <= 0) return 0.0f;
+      int row = (int) (std::upper_bound(marginal.begin(), marginal.end(), u1 * marginal.back()) - marginal.begin());
+      row = std::min(row, height - 1);
+      const float* cdf = &conditional[row * width];
+      int col = (int) (std::upper_bound(cdf, cdf + width, u2 * cdf[width - 1]) - cdf);
+      col = std::min(col, width - 1);
+
+      // a uniform point in the pixel
+      float row_lo = row > 0 ? marginal[row - 1] : 0.0f;
+      float col_lo = col > 0 ? cdf[col - 1] : 0.0f;
+      float dv = (u1 * marginal.back() - row_lo) / std::max(marginal[row] - row_lo, 1e-30f);
+      float du = (u2 * cdf[width - 1] - col_lo) / std::max(cdf[col] - col_lo, 1e-30f);
+      float u = (col + glm::clamp(du, 0.0f, 1.0f)) / width;
+      float v = (row + glm::clamp(dv, 0.0f, 1.0f)) / height;
+
+      float theta = pi * v;
+      float phi = 2.0f * pi * (u - 0.5f);
+      float sin_theta = std::sin(theta);
+      direction = glm::vec3(sin_theta * std::sin(phi), std::cos(theta), -sin_theta * std::cos(phi));
+      radiance = pixels[row * width + col];
+      return pdf_of(row * width + col, sin_theta);
+   }
+
+   // the density sample gives to direction
+   float pdf(const glm::vec3& direction) const {
+      if (total <= 0) return 0.0f;
+      glm::vec3 d = glm::normalize(direction);
+      float sin_theta = std::sqrt(std::max(0.0f, 1.0f - d.y * d.y));
+      return pdf_of(pixel_of(d), sin_theta);
+   }
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "environment: " << width << " x " << height << " map" << std::endl;
+      return ss.str();
+   }
+
+private:
+   int pixel_of(const glm::vec3& direction) const {
+      glm::vec3 d = glm::normalize(direction);
+      float u = 0.5f + std::atan2(d.x, -d.z) / (2.0f * pi);
+      float v = std::acos(glm::clamp(d.y, -1.0f, 1.0f)) / pi;
+      int col = glm::clamp(int(u * width), 0, width - 1);
+      int row = glm::clamp(int(v * height), 0, height - 1);
+      return row * width + col;
+   }
+
+   // pixel probability times pixel count over the solid angle of the
+   // pixel's direction: p(u, v) / (2 pi^2 sin(theta))
+   float pdf_of(int pixel, float sin_theta) const {
+      if (sin_theta <= 0) return 0.0f;
+      float p = weights[pixel] / total * width * height;
+      return p / (2.0f * pi * pi * sin_theta);
+   }
+
+private:
+   int width, height;
+   std::vector<glm::color> pixels;
+   std::vector<float> weights; // luminance times sin(theta) per pixel
+   std::vector<float> conditional; // per row, running sums of weights
+   std::vector<float> marginal; // running sums of the row totals
+   float total;
+};
+
+inline environment_map::environment_map(int w, int h, const std::vector<glm::color>& radiance, float scale) :
+   width(w), height(h), pixels(radiance), weights(w * h), conditional(w * h), marginal(h), total(0)
+{
+   if (w <= 0 || h <= 0 || (int) radiance.size() != w * h) {
+      pixels.clear();
+      return;
+   }
+   for (size_t i = 0; i < pixels.size(); i++) pixels[i] *= scale;
+
+   parallel_for(0, height, 8, [this](int first, int last) {
+      for (int row = first; row < last; row++) {
+         float sin_theta = std::sin(pi * (row + 0.5f) / height);
+         float sum = 0.0f;
+         for (int col = 0; col < width; col++) {
+            const glm::color& c = pixels[row * width + col];
+            float luminance = 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+            weights[row * width + col] = std::max(0.0f, luminance) * sin_theta;
+            sum += weights[row * width + col];
+            conditional[row * width + col] = sum;
+         }
+      }
+   });
+
+   double sum = 0;
+   for (int row = 0; row < height; row++) {
+      sum += conditional[row * width + width - 1];
+      marginal[row] = (float) sum;
+   }
+   total = (float) sum;
+}
+
+#endif
@@ -0,0 +1,239 @@
+// frame_pipeline.h, tonemapping, encoding and writing frames while the next one renders
+//
+// An image sequence rendered on one thread stops tracing after every frame
+// to tonemap its pixels, compress them into a png and write the file, and
+// the cores wait meanwhile. frame_pipeline takes frames as they are
+// rendered and runs those steps on two threads of its own: while the
+// caller renders frame N + 1, the encoder tonemaps and compresses frame N
+// and the writer writes frame N - 1. Frames pass between the stages through
+// bounded queues, and submit blocks while max_in_flight frames are
+// submitted but not yet written, so memory stays bounded however far
+// rendering runs ahead. The stages are threads rather than tasks of the
+// shared pool (thread_pool.h): the renderer keeps that pool busy, and a
+// compression queued behind a frame's tiles would no longer overlap them.
+
+#ifndef FRAME_PIPELINE_H_
+#define FRAME_PIPELINE_H_
+
+#include "AGLM.h"
+#include "ppm_image.h"
+#include "render.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A first in, first out queue of at most capacity items between threads
+template <class T>
+class bounded_queue {
+public:
+   explicit bounded_queue(size_t capacity) : limit(std::max<size_t>(1, capacity)) {}
+
+   // Waits for room; false if the queue is closed
+   bool push(T item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_full.wait(lock, [this]() { return closed || items.size() < limit; });
+      if (closed) return false;
+      items.push_back(std::move(item));
+      not_empty.notify_one();
+      return true;
+   }
+
+   // Waits for an item; false once the queue is closed and empty
+   bool pop(T& item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+      if (items.empty()) return false;
+      item = std::move(items.front());
+      items.pop_front();
+      not_full.notify_one();
+      return true;
+   }
+
+   // items pushed before are still popped
+   void close() {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+      not_empty.notify_all();
+      not_full.notify_all();
+   }
+
+private:
+   size_t limit;
+   bool closed = false;
+   std::deque<T> items;
+   std::mutex mutex;
+   std::condition_variable not_empty, not_full;
+};
+
+// Turns a frame into the bytes of its file; false if it cannot
+typedef std::function<bool(const framebuffer& image, std::vector<unsigned char>& bytes)> frame_encoder;
+
+// A png of every frame, its pixels tonemapped to [0, 1] by tonemap, as
+// ppm_image::save would write it
+inline frame_encoder png_encoder(const std::function<glm::color(const glm::color&)>& tonemap)
+{
+   return [tonemap](const framebuffer& image, std::vector<unsigned char>& bytes) {
+      agl::ppm_image pixels(image.width, image.height);
+      for (int j = 0; j < image.height; j++) {
+         for (int i = 0; i < image.width; i++) pixels.set_vec3(j, i, tonemap(image.at(j, i)));
+      }
+      return pixels.encode_png(bytes);
+   };
+}
+
+class frame_pipeline {
+public:
+   explicit frame_pipeline(const frame_encoder& encoder, int max_in_flight = 2);
+   ~frame_pipeline() { finish(); }
+
+   frame_pipeline(const frame_pipeline&) = delete;
+   frame_pipeline& operator=(const frame_pipeline&) = delete;
+
+   // Hands image over to be encoded and written to filename, in the order
+   // of submission; waits while max_in_flight frames are not yet written.
+   // False after finish.
+   bool submit(framebuffer image, const std::string& filename);
+
+   // Waits until every frame submitted is written and stops the stages;
+   // returns false if any frame could not be encoded or written
+   bool finish();
+
+   int in_flight() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return pending;
+   }
+
+   std::string str() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::ostringstream ss;
+      ss << "frame pipeline: " << written << " frames written, " << failed << " failed, at most "
+         << most_in_flight << " in flight; encode " << encode_time << " s, write " << write_time
+         << " s, rendering waited " << wait_time << " s" << std::endl;
+      return ss.str();
+   }
+
+private:
+   struct job {
+      framebuffer image;
+      std::string filename;
+      std::vector<unsigned char> bytes;
+      bool encoded;
+      job() : image(0, 0), encoded(false) {}
+   };
+
+   static double seconds_since(const std::chrono::steady_clock::time_point& start) {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   }
+
+   void encode_loop();
+   void write_loop();
+
+   frame_encoder encode;
+   int max_frames;
+   bounded_queue<job> to_encode, to_write;
+   mutable std::mutex mutex;
+   std::condition_variable slot_free;
+   int pending = 0; // frames submitted and not yet written
+   int most_in_flight = 0;
+   int written = 0, failed = 0;
+   double encode_time = 0, write_time = 0, wait_time = 0;
+   bool finished = false;
+   std::thread encoder, writer;
+};
+
+//-----------------------------------------------------------------------------
+
+inline frame_pipeline::frame_pipeline(const frame_encoder& e, int max_in_flight) :
+   encode(e), max_frames(std::max(1, max_in_flight)), to_encode(max_frames), to_write(max_frames)
+{
+   encoder = std::thread(&frame_pipeline::encode_loop, this);
+   writer = std::thread(&frame_pipeline::write_loop, this);
+}
+
+inline bool frame_pipeline::submit(framebuffer image, const std::string& filename)
+{
+   auto start = std::chrono::steady_clock::now();
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      slot_free.wait(lock, [this]() { return finished || pending < max_frames; });
+      if (finished) return false;
+      pending++;
+      most_in_flight = std::max(most_in_flight, pending);
+      wait_time += seconds_since(start);
+   }
+   job frame;
+   std::swap(frame.image, image);
+   frame.filename = filename;
+   // pending bounds the frames in the queues: this never waits
+   if (to_encode.push(std::move(frame))) return true;
+   std::lock_guard<std::mutex> lock(mutex);
+   pending--;
+   return false;
+}
+
+inline bool frame_pipeline::finish()
+{
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!finished) {
+         finished = true;
+         to_encode.close();
+      }
+   }
+   if (encoder.joinable()) encoder.join();
+   if (writer.joinable()) writer.join();
+   std::lock_guard<std::mutex> lock(mutex);
+   return failed == 0;
+}
+
+inline void frame_pipeline::encode_loop()
+{
+   job frame;
+   while (to_encode.pop(frame)) {
+      auto start = std::chrono::steady_clock::now();
+      frame.encoded = encode(frame.image, frame.bytes);
+      std::vector<glm::color>().swap(frame.image.radiance); // the floats are not needed past here
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         encode_time += seconds_since(start);
+      }
+      to_write.push(std::move(frame));
+   }
+   to_write.close();
+}
+
+inline void frame_pipeline::write_loop()
+{
+   job frame;
+   while (to_write.pop(frame)) {
+      auto start = std::chrono::steady_clock::now();
+      bool ok = frame.encoded;
+      if (ok) {
+         FILE* file = fopen(frame.filename.c_str(), "wb");
+         ok = file && fwrite(frame.bytes.data(), 1, frame.bytes.size(), file) == frame.bytes.size();
+         if (file) ok = fclose(file) == 0 && ok;
+      }
+      if (!ok) std::cout << "cannot write " << frame.filename << std::endl;
+      std::vector<unsigned char>().swap(frame.bytes);
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         write_time += seconds_since(start);
+         if (ok) written++;
+         else failed++;
+         pending--;
+      }
+      slot_free.notify_all();
+   }
+}
+
+#endif
@@ -0,0 +1,193 @@
+// grid.h, uniform grid traversed with a 3D-DDA (Amanatides & Woo)
+
+#ifndef GRID_H_
+#define GRID_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "accelerator.h"
+#include "hittable.h"
+#include "scene_arena.h"
+#include <memory>
+#include <sstream>
+#include <vector>
+
+class grid : public accelerator {
+public:
+   grid() : dims(0) {}
+   // arena holds the objects made in it (hittable_list::make), if any
+   grid(const std::vector<std::shared_ptr<hittable>>& objects, float density = 4.0f,
+      std::shared_ptr<scene_arena> objects_arena = std::shared_ptr<scene_arena>()) : arena(objects_arena) {
+      build(objects, density);
+   }
+
+   // density is the target number of cells per primitive
+   void build(const std::vector<std::shared_ptr<hittable>>& objects, float density = 4.0f);
+
+   virtual bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const override;
+   virtual std::string name() const override { return "grid"; }
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "grid: " << dims.x << "x" << dims.y << "x" << dims.z << " cells, "
+         << cell_prims.size() << " references" << std::endl;
+      return ss.str();
+   }
+
+public:
+   aabb bounds;
+   glm::ivec3 dims;
+   glm::vec3 cell_size;
+   std::vector<int> cell_start; // cell c holds cell_prims[cell_start[c], cell_start[c + 1])
+   std::vector<int> cell_prims;
+   std::vector<std::shared_ptr<hittable>> primitives;
+   std::vector<std::shared_ptr<hittable>> unbounded;
+   std::shared_ptr<scene_arena> arena; // keeps arena objects alive: their shared_ptrs do not
+
+private:
+   glm::ivec3 cell_of(const glm::point3& p) const {
+      glm::ivec3 c = glm::ivec3((p - bounds.minimum) / cell_size);
+      return glm::clamp(c, glm::ivec3(0), dims - glm::ivec3(1));
+   }
+
+   int cell_index(const glm::ivec3& c) const {
+      return (c.z * dims.y + c.y) * dims.x + c.x;
+   }
+};
+
+inline void grid::build(const std::vector<std::shared_ptr<hittable>>& objects, float density)
+{
+   primitives.clear();
+   unbounded.clear();
+   bounds = aabb();
+
+   std::vector<aabb> prim_bounds;
+   for (size_t i = 0; i < objects.size(); i++) {
+      aabb box;
+      if (objects[i]->bounding_box(box)) {
+         primitives.push_back(objects[i]);
+         prim_bounds.push_back(box);
+         bounds.grow(box);
+      }
+      else {
+         unbounded.push_back(objects[i]);
+      }
+   }
+
+   if (primitives.empty()) {
+      dims = glm::ivec3(0);
+      cell_start.assign(1, 0);
+      cell_prims.clear();
+      return;
+   }
+
+   // cells as close to cubes as the bounds allow, about density per primitive
+   glm::vec3 extent = glm::max(bounds.extent(), glm::vec3(1e-4f));
+   bounds.maximum = bounds.minimum + extent;
+   float volume = extent.x * extent.y * extent.z;
+   float cells_per_unit = std::cbrt(density * primitives.size() / volume);
+   for (int axis = 0; axis < 3; axis++) {
+      dims[axis] = glm::clamp(int(extent[axis] * cells_per_unit), 1, 256);
+   }
+   cell_size = extent / glm::vec3(dims);
+
+   // two passes over the primitives: count references per cell, then fill
+   int num_cells = dims.x * dims.y * dims.z;
+   cell_start.assign(num_cells + 1, 0);
+   for (size_t i = 0; i < prim_bounds.size(); i++) {
+      glm::ivec3 lo = cell_of(prim_bounds[i].minimum);
+      glm::ivec3 hi = cell_of(prim_bounds[i].maximum);
+      for (int z = lo.z; z <= hi.z; z++)
+         for (int y = lo.y; y <= hi.y; y++)
+            for (int x = lo.x; x <= hi.x; x++)
+               cell_start[cell_index(glm::ivec3(x, y, z)) + 1]++;
+   }
+   for (int c = 0; c < num_cells; c++) cell_start[c + 1] += cell_start[c];
+
+   cell_prims.resize(cell_start[num_cells]);
+   std::vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+   for (size_t i = 0; i < prim_bounds.size(); i++) {
+      glm::ivec3 lo = cell_of(prim_bounds[i].minimum);
+      glm::ivec3 hi = cell_of(prim_bounds[i].maximum);
+      for (int z = lo.z; z <= hi.z; z++)
+         for (int y = lo.y; y <= hi.y; y++)
+            for (int x = lo.x; x <= hi.x; x++)
+               cell_prims[fill[cell_index(glm::ivec3(x, y, z))]++] = (int) i;
+   }
+}
+
+inline bool grid::hit(const ray& r, float min_t, float max_t, hit_record& rec) const
+{
+   hit_record temp_rec;
+   bool hit_anything = false;
+   float closest_so_far = max_t;
+
+   for (size_t i = 0; i < unbounded.size(); i++) {
+      if (unbounded[i]->hit_interval(r, min_t, closest_so_far, temp_rec)) {
+         hit_anything = true;
+         closest_so_far = temp_rec.t;
+         rec = temp_rec;
+      }
+   }
+   if (primitives.empty()) return hit_anything;
+
+   glm::point3 origin = r.origin();
+   glm::vec3 dir = r.direction();
+   glm::vec3 inv_dir = 1.0f / dir;
+   float t_enter;
+   if (!bounds.hit(origin, inv_dir, min_t, closest_so_far, t_enter)) return hit_anything;
+
+   // 3D-DDA setup: t of the next cell boundary and t step per cell on each axis
+   glm::ivec3 cell = cell_of(r.at(t_enter));
+   glm::ivec3 step, stop;
+   glm::vec3 t_next, t_delta;
+   for (int axis = 0; axis < 3; axis++) {
+      float cell_lo = bounds.minimum[axis] + cell[axis] * cell_size[axis];
+      if (dir[axis] > 0) {
+         step[axis] = 1;
+         stop[axis] = dims[axis];
+         t_next[axis] = (cell_lo + cell_size[axis] - origin[axis]) * inv_dir[axis];
+         t_delta[axis] = cell_size[axis] * inv_dir[axis];
+      }
+      else if (dir[axis] < 0) {
+         step[axis] = -1;
+         stop[axis] = -1;
+         t_next[axis] = (cell_lo - origin[axis]) * inv_dir[axis];
+         t_delta[axis] = -cell_size[axis] * inv_dir[axis];
+      }
+      else {
+         step[axis] = 0;
+         stop[axis] = -1;
+         t_next[axis] = infinity;
+         t_delta[axis] = infinity;
+      }
+   }
+
+   // a primitive spanning several cells is tested once per ray
+   int mailbox[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+   for (;;) {
+      int c = cell_index(cell);
+      for (int k = cell_start[c]; k < cell_start[c + 1]; k++) {
+         int prim = cell_prims[k];
+         int slot = prim & 7;
+         if (mailbox[slot] == prim) continue;
+         mailbox[slot] = prim;
+         if (primitives[prim]->hit_interval(r, min_t, closest_so_far, temp_rec)) {
+            hit_anything = true;
+            closest_so_far = temp_rec.t;
+            rec = temp_rec;
+         }
+      }
+
+      int axis = t_next.x < t_next.y ?
+         (t_next.x < t_next.z ? 0 : 2) : (t_next.y < t_next.z ? 1 : 2);
+      // hits inside this cell are closer than anything in the cells beyond
+      if (closest_so_far <= t_next[axis]) break;
+      cell[axis] += step[axis];
+      if (cell[axis] == stop[axis]) break;
+      t_next[axis] += t_delta[axis];
+   }
+   return hit_anything;
+}
+
+#endif
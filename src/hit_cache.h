@@ -0,0 +1,288 @@
+// hit_cache.h, camera ray hits kept across renders that only change materials
+//
+// Tweaking the albedo, fuzz or phong coefficients of a material changes
+// nothing the camera rays hit, yet a render traces them again. A hit cache
+// keeps the first hit of every camera sample: position, normal, facing,
+// distance, the index of the object hit in the world and of its material.
+// Its key hashes the geometry of the world (not its materials), the camera
+// and the samples; a render whose key matches starts its paths from the
+// cached hits and intersects no camera ray (render.h), taking materials from
+// the objects as they are now. Otherwise the render records the hits,
+// which can be saved next to the scene and loaded by the next run. Shapes
+// and materials are read again at every render, so objects edited in place
+// change the key. Only worlds of spheres, triangles and planes are hashed;
+// the hits must name them, as a scene cache does once bound to the world
+// (scene_cache.h). Independent samples jitter differently in every render,
+// so renders drawing them never share hits: they neither reuse nor record.
+
+#ifndef HIT_CACHE_H_
+#define HIT_CACHE_H_
+
+#include "AGLM.h"
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "plane.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct cached_hit {
+   glm::point3 p;
+   glm::vec3 normal;
+   float t;
+   int32_t front_face;
+   int32_t object; // index into the world's objects, -1 where the sample hits nothing
+   int32_t material; // index into the world's materials, by first use
+};
+
+struct hit_cache_header {
+   static const uint32_t current_version = 1;
+   static const uint32_t byte_order_mark = 0x01020304;
+
+   char magic[8]; // "RTHITS\0"
+   uint32_t version;
+   uint32_t byte_order;
+   uint64_t key; // of the geometry, camera and samples the hits belong to
+   uint64_t count;
+};
+
+class hit_cache {
+public:
+   // objects are the world's; a world with other objects than spheres,
+   // triangles and planes is never cached
+   explicit hit_cache(const std::vector<std::shared_ptr<hittable>>& objects);
+
+   hit_cache(const hit_cache&) = delete;
+   hit_cache& operator=(const hit_cache&) = delete;
+
+   // Reads the hits of an earlier run; a render uses them if its key
+   // matches. Returns false if path holds no hits.
+   bool load(const std::string& path);
+   // writes the hits recorded or loaded, false if there are none
+   bool save(const std::string& path) const;
+
+   // Called by render for an image of width x height through cam with
+   // samples_per_pixel samples drawn by type with seed: true when the hits are those
+   // of that render, which then starts from them (restore); otherwise the
+   // render records its hits (record), unless the world cannot be cached
+   // or type is independent.
+   bool begin(const camera& cam, int width, int height, int samples_per_pixel, sampler_type type,
+      uint32_t seed = 0);
+   bool recording() const { return state == state_recording; }
+   bool reused() const { return state == state_reused; }
+
+   // The first hit of sample, numbered pixel by pixel and row by row;
+   // t < 0 where it hits nothing
+   void restore(size_t sample, hit_record& rec) const;
+   // stores rec, the first hit of sample, t < 0 for none; thread safe for distinct samples
+   void record(size_t sample, const hit_record& rec);
+   // after a recording render: keeps the hits if every one named an object
+   void end();
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "hit cache: ";
+      if (!cacheable) ss << "world cannot be cached" << std::endl;
+      else if (!complete) ss << "camera hits do not name the world's objects" << std::endl;
+      else if (state == state_reused) ss << "reused " << hits.size() << " camera hits" << std::endl;
+      else if (state == state_recorded) ss << "recorded " << hits.size() << " camera hits" << std::endl;
+      else ss << "no camera hits" << std::endl;
+      return ss.str();
+   }
+
+private:
+   void read_world();
+
+   static void mix(uint64_t& h, const void* data, size_t n) {
+      const unsigned char* p = static_cast<const unsigned char*>(data);
+      for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 1099511628211ull;
+   }
+
+   enum { state_empty, state_loaded, state_recording, state_recorded, state_reused };
+
+   bool cacheable = true;
+   uint64_t geometry = 0; // FNV-1a of the objects' shapes, as of the last begin
+   uint64_t key = 0;
+   int state = state_empty;
+   std::vector<cached_hit> hits;
+   std::atomic<bool> complete;
+   std::vector<const hittable*> objects;
+   std::vector<std::shared_ptr<material>> object_materials; // as of the last begin
+   std::vector<int32_t> material_ids; // of every object
+   std::unordered_map<const hittable*, int32_t> object_ids;
+};
+
+inline hit_cache::hit_cache(const std::vector<std::shared_ptr<hittable>>& world_objects) : complete(true)
+{
+   for (size_t i = 0; i < world_objects.size(); i++) {
+      const hittable* object = world_objects[i].get();
+      object_ids[object] = int32_t(i);
+      objects.push_back(object);
+   }
+   read_world();
+}
+
+// objects may be moved and materials swapped between renders: every begin
+// reads them again
+inline void hit_cache::read_world()
+{
+   std::unordered_map<const material*, int32_t> ids;
+   geometry = 14695981039346656037ull;
+   cacheable = true;
+   object_materials.resize(objects.size());
+   material_ids.resize(objects.size());
+   for (size_t i = 0; i < objects.size(); i++) {
+      const hittable* object = objects[i];
+      std::shared_ptr<material> m;
+      // a tag and the fields that place the shape, all 4 bytes wide
+      if (const sphere* s = dynamic_cast<const sphere*>(object)) {
+         float fields[5] = { 1, s->center.x, s->center.y, s->center.z, s->radius };
+         mix(geometry, fields, sizeof(fields));
+         m = s->mat_ptr;
+      }
+      else if (const triangle* t = dynamic_cast<const triangle*>(object)) {
+         float fields[10] = { 2, t->a.x, t->a.y, t->a.z, t->b.x, t->b.y, t->b.z, t->c.x, t->c.y, t->c.z };
+         mix(geometry, fields, sizeof(fields));
+         m = t->mat_ptr;
+      }
+      else if (const plane* p = dynamic_cast<const plane*>(object)) {
+         float fields[7] = { 3, p->a.x, p->a.y, p->a.z, p->n.x, p->n.y, p->n.z };
+         mix(geometry, fields, sizeof(fields));
+         m = p->mat_ptr;
+      }
+      else {
+         cacheable = false;
+      }
+      material_ids[i] = m ? ids.insert(std::make_pair(m.get(), int32_t(ids.size()))).first->second : -1;
+      object_materials[i].swap(m);
+   }
+}
+
+inline bool hit_cache::load(const std::string& path)
+{
+   std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+   if (!in) return false;
+   uint64_t file_size = uint64_t(in.tellg());
+   in.seekg(0);
+   hit_cache_header header;
+   if (file_size < sizeof(header) || !in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+   if (memcmp(header.magic, "RTHITS", 7) != 0 ||
+       header.version != hit_cache_header::current_version ||
+       header.byte_order != hit_cache_header::byte_order_mark ||
+       header.count != (file_size - sizeof(header)) / sizeof(cached_hit))
+   {
+      return false;
+   }
+   std::vector<cached_hit> read(header.count);
+   if (!in.read(reinterpret_cast<char*>(read.data()), header.count * sizeof(cached_hit))) return false;
+   hits.swap(read);
+   key = header.key;
+   state = state_loaded;
+   return true;
+}
+
+inline bool hit_cache::save(const std::string& path) const
+{
+   if (state != state_recorded && state != state_reused) return false;
+   hit_cache_header header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, "RTHITS", 7);
+   header.version = hit_cache_header::current_version;
+   header.byte_order = hit_cache_header::byte_order_mark;
+   header.key = key;
+   header.count = hits.size();
+
+   // write next to the target and rename, so readers never see half a file
+   std::string temp_path = path + ".tmp";
+   std::ofstream out(temp_path.c_str(), std::ios::binary | std::ios::trunc);
+   if (!out) return false;
+   out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+   out.write(reinterpret_cast<const char*>(hits.data()), hits.size() * sizeof(cached_hit));
+   out.close();
+   if (!out) {
+      std::remove(temp_path.c_str());
+      return false;
+   }
+   std::remove(path.c_str());
+   return std::rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+inline bool hit_cache::begin(const camera& cam, int width, int height, int samples_per_pixel, sampler_type type,
+   uint32_t seed)
+{
+   read_world();
+   if (!cacheable || type == sampler_type::independent) {
+      if (state == state_reused) state = state_recorded; // still the hits of their own key
+      return false;
+   }
+   uint64_t h = geometry;
+   glm::vec3 view[4] = { cam.get_origin(), cam.get_lower_left_corner(), cam.get_horizontal(), cam.get_vertical() };
+   int32_t sampling[5] = { width, height, samples_per_pixel, int32_t(type), int32_t(seed) };
+   mix(h, view, sizeof(view));
+   mix(h, sampling, sizeof(sampling));
+   size_t count = size_t(width) * height * samples_per_pixel;
+
+   if ((state == state_loaded || state == state_recorded || state == state_reused) &&
+      key == h && hits.size() == count)
+   {
+      state = state_reused;
+      return true;
+   }
+   key = h;
+   hits.assign(count, cached_hit());
+   complete = true;
+   state = state_recording;
+   return false;
+}
+
+inline void hit_cache::restore(size_t sample, hit_record& rec) const
+{
+   const cached_hit& c = hits[sample];
+   rec = hit_record();
+   if (c.object < 0) return;
+   rec.p = c.p;
+   rec.normal = c.normal;
+   rec.t = c.t;
+   rec.front_face = c.front_face != 0;
+   rec.object = objects[c.object];
+   rec.mat_ptr = object_materials[c.object];
+}
+
+inline void hit_cache::record(size_t sample, const hit_record& rec)
+{
+   cached_hit& c = hits[sample];
+   c.p = rec.p;
+   c.normal = rec.normal;
+   c.t = rec.t;
+   c.front_face = rec.front_face;
+   c.object = -1;
+   c.material = -1;
+   if (rec.t < 0) return;
+   std::unordered_map<const hittable*, int32_t>::const_iterator it = object_ids.find(rec.object);
+   if (it == object_ids.end()) {
+      complete = false;
+      return;
+   }
+   c.object = it->second;
+   c.material = material_ids[it->second];
+}
+
+inline void hit_cache::end()
+{
+   if (state != state_recording) return;
+   state = complete ? state_recorded : state_empty;
+   if (!complete) hits.clear();
+}
+
+#endif
@@ -5,9 +5,11 @@
 #define HITTABLE_H
 
 #include "ray.h"
+#include "aabb.h"
 #include <sstream>
 
 class material;
+class hittable;
 
 struct hit_record {
    glm::point3 p; // the hit position
@@ -15,6 +17,10 @@ struct hit_record {
    float t = -1.0f; // the time t along the ray at which we hit the object
    bool front_face = false; // whether this is a front or back facing hit point
    std::shared_ptr<material> mat_ptr = 0; // save material of hit object
+   const hittable* object = 0; // the primitive hit, for lights and caches of hits
+   float u = 0.0f, v = 0.0f; // surface coordinates at p, for textures (hittable::surface_coordinates)
+   float uv_density = 0.0f; // change of (u, v) per unit of length on the surface, 0 if unknown
+   float footprint = 0.0f; // width of the ray's footprint at p (render.h), 0 if unknown
 
    inline void set_face_normal(const ray& r, const glm::vec3& outward_normal) {
       front_face = glm::dot(r.direction(), outward_normal) < 0;
@@ -34,6 +40,46 @@ struct hit_record {
 class hittable {
 public:
    virtual bool hit(const ray& r, hit_record& rec) const = 0;
+
+   // hit restricted to min_t <= t <= max_t; aggregates override this to
+   // skip work beyond the closest hit found so far
+   virtual bool hit_interval(const ray& r, float min_t, float max_t, hit_record& rec) const {
+      hit_record temp_rec;
+      if (!hit(r, temp_rec)) return false;
+      if (temp_rec.t < min_t || temp_rec.t > max_t) return false;
+      rec = temp_rec;
+      return true;
+   }
+
+   // bounds of the object; returns false for unbounded objects such as planes
+   virtual bool bounding_box(aabb& output_box) const { return false; }
+
+   // Light sampling (light_tree.h): a direction from o toward the object,
+   // chosen from two values in [0, 1), and its solid angle density; 0 when
+   // the object cannot be sampled from o
+   virtual float sample_direction(const glm::point3& o, float u1, float u2, glm::vec3& direction) const {
+      return 0.0f;
+   }
+
+   // the density sample_direction gives the direction from o to rec.p on the object
+   virtual float direction_pdf(const glm::point3& o, const hit_record& rec) const { return 0.0f; }
+
+   // surface area, 0 for objects that cannot be sampled
+   virtual float area() const { return 0.0f; }
+
+   // Photon emission (photon_map.h): a point uniform over the surface,
+   // chosen from two values in [0, 1), as a hit record with the outward
+   // normal; false for objects that cannot be sampled
+   virtual bool sample_surface(float u1, float u2, hit_record& rec) const { return false; }
+
+   // Sets the texture coordinates of rec, a hit on this object. Computed
+   // only for the hits that are shaded; objects without any leave (0, 0).
+   virtual void surface_coordinates(hit_record& rec) const {}
+
+   // Moves the object by m, a rigid motion with a uniform scale; false for
+   // objects that cannot be moved
+   virtual bool transform(const glm::mat4& m) { return false; }
+
    virtual ~hittable() {}
 };
 
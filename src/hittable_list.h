@@ -4,6 +4,8 @@
 #define HITTABLE_LIST_H
 
 #include "hittable.h"
+#include "accelerator.h"
+#include "scene_arena.h"
 
 #include <memory>
 #include <vector>
@@ -12,7 +14,7 @@
 using std::shared_ptr;
 using std::make_shared;
 
-class hittable_list {
+class hittable_list : public accelerator {
 public:
    hittable_list() {}
    hittable_list(shared_ptr<hittable> object) { add(object); }
@@ -20,10 +22,37 @@ public:
    void clear() { objects.clear(); }
    void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
-   virtual bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const;
+   // Removes object; the last object takes its place. Returns false if the
+   // list does not hold it.
+   bool remove(const hittable* object) {
+      for (size_t i = 0; i < objects.size(); i++) {
+         if (objects[i].get() != object) continue;
+         remove_at(i);
+         return true;
+      }
+      return false;
+   }
+
+   // removes the object at index in constant time; the last object takes its place
+   void remove_at(size_t index) {
+      objects[index].swap(objects.back());
+      objects.pop_back();
+   }
+
+   // Creates a primitive or material in the scene's arena instead of with
+   // make_shared. It lives until the last copy of this list is destroyed.
+   template <class T, class... Args>
+   shared_ptr<T> make(Args&&... args) {
+      if (!arena) arena = make_shared<scene_arena>();
+      return arena->make<T>(std::forward<Args>(args)...);
+   }
+
+   virtual bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const override;
+   virtual std::string name() const override { return "brute force"; }
 
 public:
    std::vector<shared_ptr<hittable>> objects;
+   shared_ptr<scene_arena> arena; // shared by copies of the list
 };
 
 bool hittable_list::hit(const ray& r, float min_t, float max_t, hit_record& rec) const 
@@ -34,14 +63,11 @@ bool hittable_list::hit(const ray& r, float min_t, float max_t, hit_record& rec)
 
    for (const auto& object : objects) 
    {
-      if (object->hit(r, temp_rec)) 
+      if (object->hit_interval(r, min_t, closest_so_far, temp_rec)) 
       {
-         if (temp_rec.t >= min_t && temp_rec.t <= closest_so_far) 
-         {
-            hit_anything = true;
-            closest_so_far = std::min(closest_so_far, temp_rec.t);
-            rec = temp_rec;
-         }
+         hit_anything = true;
+         closest_so_far = temp_rec.t;
+         rec = temp_rec;
       }
    }
 
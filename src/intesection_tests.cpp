@@ -1,4 +1,6 @@
 #include <cassert>
+#include <set>
+#include <tuple>
 #include "AGLM.h"
 #include "material.h"
 #include "ray.h"
@@ -7,6 +9,32 @@
 #include "plane.h"
 #include "triangle.h"
 #include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "grid.h"
+#include "accelerators.h"
+#include "scene_cache.h"
+#include "compressed_mesh.h"
+#include "sphere_cloud.h"
+#include "tile_culling.h"
+#include "visibility_buffer.h"
+#include "sampler.h"
+#include "light_tree.h"
+#include "environment_map.h"
+#include "texture_cache.h"
+#include "photon_map.h"
+#include "irradiance_cache.h"
+#include "path_guiding.h"
+#include "light_tracer.h"
+#include "denoiser.h"
+#include "aov.h"
+#include "hit_cache.h"
+#include "tile_dependencies.h"
+#include "dynamic_bvh.h"
+#include "sequence.h"
+#include "frame_pipeline.h"
+#include "render.h"
 
 using namespace glm;
 using namespace std;
@@ -79,6 +107,1233 @@ void test_triangle(const triangle& tri, const ray& r, bool hits, float t) {
     }
 }
 
+// the bvh must find the same closest hit as testing every object
+void test_bvh(int num_spheres, int num_rays) {
+   shared_ptr<material> empty = 0;
+   hittable_list world;
+   for (int i = 0; i < num_spheres; i++) {
+      world.add(make_shared<sphere>(random_unit_cube() * 50.0f, random_float() + 0.01f, empty));
+   }
+   for (int i = 0; i < num_spheres / 4; i++) {
+      point3 a = random_unit_cube() * 50.0f;
+      world.add(make_shared<triangle>(a, a + random_unit_cube(), a + random_unit_cube(), empty));
+   }
+   world.add(make_shared<triangle>(point3(-60, -60, -60), point3(60, -60, -60), point3(0, 60, -60), empty));
+   world.add(make_shared<plane>(point3(0, -70, 0), vec3(0, 1, 0), empty));
+
+   bvh accel(world.objects);
+   wide_bvh<4> accel4(world.objects);
+   wide_bvh<8> accel8(world.objects);
+   grid cells(world.objects);
+   for (int i = 0; i < num_rays; i++) {
+      vec3 dir = random_unit_vector();
+      if (i % 8 == 0) { // axis aligned: the grid only steps along one axis
+         dir = vec3(0);
+         dir[i / 8 % 3] = 1;
+      }
+      ray r(random_unit_cube() * 80.0f, dir);
+      hit_record expected, actual, actual4, actual8, actual_grid;
+      bool hits = world.hit(r, 0.001f, infinity, expected);
+      check(accel.hit(r, 0.001f, infinity, actual) == hits, "error: bvh hit mismatch", actual, r);
+      check(accel4.hit(r, 0.001f, infinity, actual4) == hits, "error: bvh4 hit mismatch", actual4, r);
+      check(accel8.hit(r, 0.001f, infinity, actual8) == hits, "error: bvh8 hit mismatch", actual8, r);
+      check(cells.hit(r, 0.001f, infinity, actual_grid) == hits, "error: grid hit mismatch", actual_grid, r);
+      if (hits) {
+         check(equals(actual.t, expected.t), "error: bvh hit time incorrect", actual, r);
+         check(equals(actual4.t, expected.t), "error: bvh4 hit time incorrect", actual4, r);
+         check(equals(actual8.t, expected.t), "error: bvh8 hit time incorrect", actual8, r);
+         check(equals(actual_grid.t, expected.t), "error: grid hit time incorrect", actual_grid, r);
+      }
+   }
+}
+
+void test_scene_cache(int num_spheres, int num_rays) {
+   hittable_list world;
+   shared_ptr<material> gray = make_shared<lambertian>(color(0.5f));
+   shared_ptr<material> shiny = make_shared<metal>(color(1, 0, 0), 0.3f);
+   for (int i = 0; i < num_spheres; i++) {
+      world.add(make_shared<sphere>(random_unit_cube() * 50.0f, random_float() + 0.01f, i % 2 ? gray : shiny));
+      point3 a = random_unit_cube() * 50.0f;
+      world.add(make_shared<triangle>(a, a + random_unit_cube(), a + random_unit_cube(), gray));
+   }
+   world.add(make_shared<plane>(point3(0, -70, 0), vec3(0, 1, 0), shiny));
+
+   std::string path = "intesection_tests.scene";
+   std::string source = "intesection_tests.scene.source"; // stands in for the scene's file
+   std::ofstream(source.c_str()) << "spheres, triangles and a plane";
+   uint64_t key = scene_source_key(source);
+   accelerator_report report;
+   shared_ptr<accelerator> built = open_scene_cache(world, path, key, report);
+   shared_ptr<accelerator> reused = open_scene_cache(world, path, key, report);
+   check(built && reused, "error: scene cache not written", hit_record(), ray());
+   check(report.reason == "reused " + path, "error: scene cache not reused", hit_record(), ray());
+   shared_ptr<scene_cache> unbound = open_scene_cache(path, key, report); // no world at hand
+   check(unbound != 0, "error: scene cache not opened on its own", hit_record(), ray());
+
+   for (int i = 0; i < num_rays; i++) {
+      ray r(random_unit_cube() * 80.0f, random_unit_vector());
+      hit_record expected, actual, alone;
+      bool hits = world.hit(r, 0.001f, infinity, expected);
+      check(reused->hit(r, 0.001f, infinity, actual) == hits, "error: scene cache hit mismatch", actual, r);
+      check(unbound->hit(r, 0.001f, infinity, alone) == hits, "error: unbound scene cache hit mismatch", alone, r);
+      if (hits) {
+         check(equals(actual.t, expected.t), "error: scene cache hit time incorrect", actual, r);
+         bool expected_gray = dynamic_cast<lambertian*>(expected.mat_ptr.get()) != 0;
+         bool actual_gray = dynamic_cast<lambertian*>(actual.mat_ptr.get()) != 0;
+         check(actual.mat_ptr && actual_gray == expected_gray, "error: scene cache material incorrect", actual, r);
+         check(actual.object == expected.object, "error: scene cache hit not on the world's object", actual, r);
+
+         // the cache's own objects stand for the primitives: one per primitive, same surface
+         hit_record again;
+         unbound->hit(r, 0.001f, infinity, again);
+         check(alone.object && alone.object == again.object, "error: unbound scene cache object unstable", alone, r);
+         expected.object->surface_coordinates(expected);
+         alone.object->surface_coordinates(alone);
+         check(equals(alone.u, expected.u) && equals(alone.v, expected.v), "error: unbound scene cache uv incorrect", alone, r);
+      }
+   }
+
+   scene_cache stale;
+   check(!stale.open(path, key + 1), "error: scene cache opened with the wrong key", hit_record(), ray());
+   check(!stale.open(path, 0), "error: scene cache opened with no key", hit_record(), ray());
+
+   // a cut file and one whose sections point past its end are rejected
+   std::vector<char> bytes;
+   {
+      std::ifstream in(path.c_str(), std::ios::binary);
+      bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+   }
+   std::ofstream(path.c_str(), std::ios::binary | std::ios::trunc).write(bytes.data(), 16);
+   check(!stale.open(path, key), "error: short scene cache opened", hit_record(), ray());
+   scene_cache_header header;
+   memcpy(&header, bytes.data(), sizeof(header));
+   header.nodes.count = bytes.size();
+   memcpy(&bytes[0], &header, sizeof(header));
+   std::ofstream(path.c_str(), std::ios::binary | std::ios::trunc).write(bytes.data(), bytes.size());
+   check(!stale.open(path, key), "error: scene cache with a section past its end opened", hit_record(), ray());
+
+   // a textured material has no cached form: the world is not cached untextured
+   struct flat_texture : texture {
+      virtual color value(float u, float v, float width) const override { return color(0.5f); }
+   };
+   hittable_list textured;
+   textured.add(make_shared<sphere>(point3(0), 1.0f, make_shared<lambertian>(make_shared<flat_texture>())));
+   check(!open_scene_cache(textured, path, key, report), "error: textured scene cached", hit_record(), ray());
+   std::remove(path.c_str());
+   std::remove(source.c_str());
+}
+
+void test_arena() {
+   hittable_list world;
+   shared_ptr<material> gray = world.make<lambertian>(color(0.5f));
+   for (int i = 0; i < 100000; i++) { // spans several blocks
+      world.add(world.make<sphere>(point3(0, 0, -3 * i), 1.0f, gray));
+   }
+   for (size_t i = 0; i < world.objects.size(); i++) {
+      assert(reinterpret_cast<uintptr_t>(world.objects[i].get()) % alignof(sphere) == 0);
+   }
+   hittable_list copy = world; // copies share the arena
+   world = hittable_list();
+
+   hit_record rec;
+   ray r(point3(0, 0, 3), vec3(0, 0, -1));
+   check(copy.hit(r, 0.001f, infinity, rec) && equals(rec.t, 2.0f), "error: arena sphere hit incorrect", rec, r);
+   check(rec.mat_ptr == gray, "error: arena material incorrect", rec, r);
+   assert(copy.arena->bytes_used() >= 100000 * sizeof(sphere));
+   assert(copy.arena->owning_objects() == 0); // nothing to destroy one by one
+
+   // accelerators keep the arena alive after the list is gone
+   accelerator_type types[] = { accelerator_type::brute_force, accelerator_type::grid, accelerator_type::bvh,
+      accelerator_type::bvh4, accelerator_type::bvh8 };
+   for (accelerator_type type : types) {
+      shared_ptr<accelerator> accel;
+      {
+         hittable_list scene;
+         shared_ptr<material> red = scene.make<lambertian>(color(1, 0, 0));
+         for (int i = 0; i < 100; i++) scene.add(scene.make<sphere>(point3(0, 0, -3 * i), 1.0f, red));
+         accelerator_report report;
+         accel = build_accelerator(scene, type, report);
+      }
+      check(accel->hit(r, 0.001f, infinity, rec) && equals(rec.t, 2.0f) && rec.mat_ptr->albedo_at(rec) == color(1, 0, 0),
+         "error: accelerator outlived by its arena", rec, r);
+   }
+
+   // arena objects holding shared_ptrs from outside release them with the arena
+   shared_ptr<material> outside = make_shared<metal>(color(1), 0.1f);
+   {
+      hittable_list scene;
+      scene.add(scene.make<sphere>(point3(0), 1.0f, outside));
+      assert(outside.use_count() == 2 && scene.arena->owning_objects() == 1);
+   }
+   assert(outside.use_count() == 1);
+}
+
+void test_compressed_mesh(int rings, int segments, int num_rays) {
+   // tessellated sphere of radius 10 as an indexed mesh
+   std::vector<point3> positions;
+   std::vector<int> indices;
+   for (int i = 0; i <= rings; i++) {
+      for (int j = 0; j <= segments; j++) {
+         float theta = ::pi * i / rings;
+         float phi = 2 * ::pi * j / segments;
+         positions.push_back(10.0f * vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+      }
+   }
+   hittable_list world;
+   for (int i = 0; i < rings; i++) {
+      for (int j = 0; j < segments; j++) {
+         int a = i * (segments + 1) + j;
+         int quad[6] = { a, a + 1, a + segments + 1, a + 1, a + segments + 2, a + segments + 1 };
+         for (int k = 0; k < 6; k += 3) {
+            indices.insert(indices.end(), quad + k, quad + k + 3);
+            world.add(make_shared<triangle>(positions[quad[k]], positions[quad[k + 1]], positions[quad[k + 2]], nullptr));
+         }
+      }
+   }
+   compressed_mesh mesh(positions, indices, nullptr);
+   assert(mesh.bytes() * 2 < mesh.indexed_bytes);
+
+   // aim at triangle centers so that quantization cannot turn a hit into a miss
+   for (int i = 0; i < num_rays; i++) {
+      int t = int(random_float() * (indices.size() / 3 - 1));
+      point3 target = (positions[indices[3 * t]] + positions[indices[3 * t + 1]] + positions[indices[3 * t + 2]]) / 3.0f;
+      point3 origin = random_unit_vector() * 30.0f;
+      ray r(origin, target - origin);
+      hit_record expected, actual;
+      bool hits = world.hit(r, 0.001f, infinity, expected);
+      check(mesh.hit_interval(r, 0.001f, infinity, actual) == hits, "error: compressed mesh hit mismatch", actual, r);
+      if (hits) {
+         check(fabs(actual.t - expected.t) < 1e-3f, "error: compressed mesh hit time incorrect", actual, r);
+      }
+   }
+
+   // a vertex shared by several clusters decodes to the same point in each:
+   // no more distinct decoded corners than distinct input vertices
+   std::set<std::tuple<float, float, float>> inputs, decoded;
+   for (size_t v = 0; v < positions.size(); v++) inputs.insert(std::make_tuple(positions[v].x, positions[v].y, positions[v].z));
+   for (size_t n = 0; n < mesh.nodes.size(); n++) {
+      const compressed_mesh::node& leaf = mesh.nodes[n];
+      if (leaf.cluster_count == 0) continue;
+      const compressed_mesh::cluster& c = mesh.clusters[leaf.cluster()];
+      for (int t = leaf.first; t < leaf.first + leaf.count(); t++) {
+         for (int k = 0; k < 3; k++) {
+            point3 p = mesh.vertex(c, mesh.corners[3 * t + k]);
+            decoded.insert(std::make_tuple(p.x, p.y, p.z));
+         }
+      }
+   }
+   assert(mesh.clusters.size() > 100 && decoded.size() <= inputs.size());
+
+   // rays at the shared edges and vertices of a closed surface never slip through
+   for (int i = 0; i < num_rays; i++) {
+      int t = int(random_float() * (indices.size() / 3 - 1));
+      int k = int(random_float() * 3) % 3;
+      point3 a = positions[indices[3 * t + k]], b = positions[indices[3 * t + (k + 1) % 3]];
+      point3 target = i % 2 ? a : 0.5f * (a + b);
+      point3 origin = normalize(target) * 30.0f + random_unit_vector();
+      ray r(origin, target - origin);
+      hit_record actual;
+      check(mesh.hit_interval(r, 0.001f, infinity, actual), "error: compressed mesh crack at a shared edge", actual, r);
+   }
+}
+
+void test_sphere_cloud(int num_spheres, int num_rays) {
+   std::vector<shared_ptr<material>> materials;
+   materials.push_back(make_shared<lambertian>(color(0.5f)));
+   materials.push_back(make_shared<metal>(color(1, 0, 0), 0.3f));
+
+   std::vector<point3> centers;
+   std::vector<float> radii;
+   std::vector<uint16_t> ids;
+   hittable_list world;
+   for (int i = 0; i < num_spheres; i++) {
+      centers.push_back(random_unit_cube() * 50.0f);
+      radii.push_back(int(random_float() * 16 + 1) / 16.0f); // exact in half precision
+      ids.push_back(i % 2);
+      world.add(make_shared<sphere>(centers[i], radii[i], materials[i % 2]));
+   }
+   sphere_cloud cloud(centers, radii, ids, materials);
+   check(cloud.bytes() <= num_spheres * 32 + sizeof(wide_bvh_node<4>), "error: sphere cloud too large", hit_record(), ray());
+
+   for (int i = 0; i < num_rays; i++) {
+      ray r(random_unit_cube() * 80.0f, random_unit_vector());
+      hit_record expected, actual;
+      bool hits = world.hit(r, 0.001f, infinity, expected);
+      check(cloud.hit_interval(r, 0.001f, infinity, actual) == hits, "error: sphere cloud hit mismatch", actual, r);
+      if (hits) {
+         check(equals(actual.t, expected.t), "error: sphere cloud hit time incorrect", actual, r);
+         check(actual.mat_ptr == expected.mat_ptr, "error: sphere cloud material incorrect", actual, r);
+      }
+   }
+}
+
+void test_tile_culling(int num_spheres, int samples_per_pixel) {
+   hittable_list world;
+   for (int i = 0; i < num_spheres; i++) {
+      world.add(make_shared<sphere>(random_unit_cube() * 20.0f, 0.5f * random_float() + 0.01f, nullptr));
+   }
+   world.add(make_shared<plane>(point3(0, -25, 0), vec3(0, 1, 0), nullptr));
+
+   int width = 200, height = 100, tile_size = 16;
+   camera cam(point3(0, 5, 30), point3(0, 0, 0), vec3(0, 1, 0), 60, width / float(height));
+   tile_culler culler(cam, width, height, tile_size);
+   culler.cull(world.objects, samples_per_pixel);
+
+   int tiles_x = (width + tile_size - 1) / tile_size;
+   int tiles_y = (height + tile_size - 1) / tile_size;
+   int through_scene = 0; // tiles whose rays are too few to build a bvh for
+   for (int t = 0; t < tiles_x * tiles_y; t++) through_scene += culler.candidates(t) == 0;
+   assert(samples_per_pixel > 16 ? through_scene == 0 : through_scene > 0);
+   for (int j = 0; j < height; j++) {
+      for (int i = 0; i < width; i++) {
+         float u = float(i + random_float()) / (width - 1);
+         float v = float(height - j - 1 - random_float()) / (height - 1);
+         ray r = cam.get_ray(u, v);
+         const accelerator* candidates = culler.candidates((j / tile_size) * tiles_x + i / tile_size);
+         if (!candidates) candidates = &world; // a bvh would not pay for itself
+         hit_record expected, actual;
+         bool hits = world.hit(r, 0.001f, infinity, expected);
+         check(candidates->hit(r, 0.001f, infinity, actual) == hits, "error: culled object was visible", actual, r);
+         if (hits) check(equals(actual.t, expected.t), "error: culled hit time incorrect", actual, r);
+      }
+   }
+}
+
+void test_visibility_buffer(int num_objects) {
+   hittable_list world;
+   for (int i = 0; i < num_objects; i++) {
+      point3 c = random_unit_cube() * 20.0f;
+      if (i % 2) world.add(make_shared<sphere>(c, 0.5f * random_float() + 0.01f, nullptr));
+      else world.add(make_shared<triangle>(c, c + random_unit_cube() * 2.0f, c + random_unit_cube() * 2.0f, nullptr));
+   }
+   // a floor reaching behind the camera and a plane are tested with their own hit
+   world.add(make_shared<triangle>(point3(-100, -22, -100), point3(100, -22, -100), point3(0, -22, 200), nullptr));
+   world.add(make_shared<plane>(point3(0, -25, 0), vec3(0, 1, 0), nullptr));
+
+   int width = 160, height = 90, tile_size = 16, spp = 3;
+   camera cam(point3(0, 5, 30), point3(0, 0, 0), vec3(0, 1, 0), 60, width / float(height));
+   tile_culler culler(cam, width, height, tile_size);
+   culler.cull(world.objects);
+   primary_rasterizer rasterizer(cam, width, height);
+
+   int tiles_x = (width + tile_size - 1) / tile_size;
+   int tiles_y = (height + tile_size - 1) / tile_size;
+   tile_samples samples;
+   visibility_buffer visible;
+   for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+      int i0 = (tile % tiles_x) * tile_size, j0 = (tile / tiles_x) * tile_size;
+      int i1 = std::min(width, i0 + tile_size), j1 = std::min(height, j0 + tile_size);
+      samples.reset(i0, j0, i1 - i0, j1 - j0, spp);
+      for (int j = j0; j < j1; j++) {
+         for (int i = i0; i < i1; i++) {
+            for (int s = 0; s < spp; s++) {
+               samples.u[samples.first(i, j) + s] = float(i + random_float()) / (width - 1);
+               samples.v[samples.first(i, j) + s] = float(height - j - 1 - random_float()) / (height - 1);
+            }
+         }
+      }
+      rasterizer.rasterize(culler.objects(tile), samples, visible);
+
+      for (int k = 0; k < samples.size(); k++) {
+         ray r = cam.get_ray(samples.u[k], samples.v[k]);
+         const hittable* expected = 0;
+         hit_record closest, rec;
+         closest.t = infinity;
+         for (size_t o = 0; o < world.objects.size(); o++) {
+            if (world.objects[o]->hit_interval(r, 0.001f, closest.t, rec)) {
+               closest = rec;
+               expected = world.objects[o].get();
+            }
+         }
+         // a covered object that misses its ray makes render() trace the ray
+         const hittable* actual = visible.object[k];
+         if (actual && actual != expected) {
+            check(!actual->hit_interval(r, 0.001f, infinity, rec), "error: rasterized object hides the first hit", rec, r);
+            continue;
+         }
+         check(actual == expected, "error: first hit missing from the visibility buffer", closest, r);
+         if (actual) check(abs(visible.depth[k] - closest.t) < 1e-3f * closest.t, "error: rasterized depth incorrect", closest, r);
+      }
+   }
+}
+
+void test_sampler() {
+   // the first 16 points of every pixel fill each elementary interval of
+   // area 1/16 exactly once, in the jitter and in a bounce's dimensions
+   sampler sobol(sampler_type::sobol, 64, 7);
+   for (int pixel = 0; pixel < 20; pixel++) {
+      for (int d = 0; d < 12; d += 4) {
+         for (int cells_x = 1; cells_x <= 16; cells_x *= 2) {
+            int cells_y = 16 / cells_x;
+            std::vector<int> count(16, 0);
+            for (int index = 0; index < 16; index++) {
+               float x = sobol.get(pixel, 3, index, d);
+               float y = sobol.get(pixel, 3, index, d + 1);
+               assert(x >= 0 && x < 1 && y >= 0 && y < 1);
+               count[int(y * cells_y) * cells_x + int(x * cells_x)]++;
+            }
+            for (int c = 0; c < 16; c++) assert(count[c] == 1);
+         }
+      }
+   }
+
+   // the blue-noise tile ranks every pixel exactly once
+   const std::vector<float>& noise = sampler::blue_noise();
+   std::vector<int> ranks(noise.size(), 0);
+   for (size_t p = 0; p < noise.size(); p++) ranks[int(noise[p] * noise.size())]++;
+   for (size_t r = 0; r < ranks.size(); r++) assert(ranks[r] == 1);
+
+   sampler dithered(sampler_type::blue_noise, 64, 7);
+   for (int j = 0; j < 64; j++) {
+      for (int i = 0; i < 64; i++) {
+         float x = dithered.get(i, j, i + j, 5);
+         assert(x >= 0 && x < 1);
+      }
+   }
+}
+
+// mean of f over uniform random directions, times 4 pi: the integral of f over the sphere
+template <class F>
+float integrate_directions(F f, int n) {
+   double sum = 0;
+   for (int i = 0; i < n; i++) sum += f(sample_unit_vector(random_float(), random_float()));
+   return float(4 * ::pi * sum / n);
+}
+
+void test_light_tree(int num_lights) {
+   // the light sampling densities of a sphere and a triangle integrate to one
+   point3 o(0.3f, -0.2f, 0.1f);
+   sphere ball(point3(1, 2, -3), 0.7f, nullptr);
+   triangle tri(point3(-1, 1, -2), point3(2, 1, -2.5f), point3(0, 3, -2), nullptr);
+   for (int k = 0; k < 2; k++) {
+      const hittable& light = k ? (const hittable&) tri : (const hittable&) ball;
+      float total = integrate_directions([&](const vec3& d) {
+         hit_record rec;
+         return light.hit_interval(ray(o, d), 0.001f, infinity, rec) ? light.direction_pdf(o, rec) : 0.0f;
+      }, 400000);
+      assert(fabs(total - 1.0f) < 0.03f);
+   }
+
+   // so do the scatter densities of diffuse and glossy materials, over the
+   // directions scatter keeps
+   hit_record rec;
+   rec.p = point3(0);
+   rec.normal = vec3(0, 1, 0);
+   ray in(point3(-1, 1, 0), vec3(1, -1, 0));
+   lambertian diffuse(color(0.5f));
+   metal glossy(color(0.5f), 0.4f);
+   for (int k = 0; k < 2; k++) {
+      const material& m = k ? (const material&) glossy : (const material&) diffuse;
+      float total = integrate_directions([&](const vec3& d) {
+         color value;
+         float pdf;
+         assert(m.evaluate(in, rec, d, value, pdf));
+         return pdf;
+      }, 400000);
+      int kept = 0;
+      for (int i = 0; i < 100000; i++) {
+         color attenuation;
+         ray scattered;
+         if (m.scatter(in, rec, attenuation, scattered)) kept++;
+      }
+      assert(fabs(total - kept / 100000.0f) < 0.02f);
+   }
+
+   // the tree finds every emitter with the density it reports for it
+   hittable_list world;
+   shared_ptr<material> lamp = make_shared<diffuse_light>(color(4, 3, 2));
+   for (int i = 0; i < num_lights; i++) {
+      point3 c = random_unit_cube() * 10.0f;
+      if (i % 2) world.add(make_shared<sphere>(c, 0.2f * random_float() + 0.01f, lamp));
+      else world.add(make_shared<triangle>(c, c + random_unit_cube(), c + random_unit_cube(), lamp));
+      world.add(make_shared<sphere>(c + vec3(1), 0.3f, make_shared<lambertian>(color(0.5f))));
+   }
+   light_tree lights(world.objects);
+   assert((int) lights.size() == num_lights);
+   for (int i = 0; i < 1000; i++) {
+      point3 p = random_unit_cube() * 12.0f;
+      vec3 direction;
+      const hittable* light = 0;
+      float pdf = lights.sample(p, random_float(), random_float(), random_float(), direction, light);
+      if (pdf == 0) continue;
+      hit_record light_rec;
+      if (!light->hit_interval(ray(p, direction), 0.001f, infinity, light_rec)) continue; // grazing
+      assert(light_rec.object == light);
+      float expected = lights.pdf(p, light_rec);
+      assert(fabs(pdf - expected) <= 1e-3f * expected);
+   }
+}
+
+void test_environment_map(int width, int height) {
+   // the sampling density integrates to one
+   std::vector<color> pixels(width * height);
+   for (int i = 0; i < width * height; i++) pixels[i] = color(random_float(), random_float(), random_float());
+   environment_map noise(width, height, pixels);
+   assert(!noise.empty());
+   float total = integrate_directions([&](const vec3& d) { return noise.pdf(d); }, 400000);
+   assert(fabs(total - 1.0f) < 0.03f);
+
+   // with a small, very bright sun added
+   pixels[(height / 4) * width + width / 3] = color(100000.0f);
+   environment_map sky(width, height, pixels);
+
+   // samples land where the map is bright, with the density pdf reports
+   int sun = 0;
+   for (int i = 0; i < 1000; i++) {
+      vec3 direction;
+      color radiance;
+      float pdf = sky.sample(random_float(), random_float(), direction, radiance);
+      assert(pdf > 0);
+      assert(fabs(length(direction) - 1.0f) < 1e-4f);
+      if (radiance.r > 100.0f) sun++;
+      if (radiance != sky.eval(direction)) continue; // rounded across a pixel border
+      float expected = sky.pdf(direction);
+      assert(fabs(pdf - expected) <= 1e-2f * expected);
+   }
+   assert(sun > 900);
+
+   environment_map black(width, height, std::vector<color>(width * height, color(0)));
+   vec3 direction;
+   color radiance;
+   assert(black.sample(0.5f, 0.5f, direction, radiance) == 0.0f);
+   assert(black.pdf(vec3(0, 1, 0)) == 0.0f);
+}
+
+void test_texture_cache(int width, int height) {
+   std::vector<unsigned char> rgb(3 * width * height);
+   for (size_t i = 0; i < rgb.size(); i++) rgb[i] = (unsigned char) (random_float() * 256);
+   const char* path = "test_texture.tex";
+   assert(texture_cache::write_tiled(path, width, height, rgb));
+
+   // a budget of one tile per shard: most lookups read their tiles again
+   size_t budget = texture_cache::shard_count * texture_cache::tile_bytes;
+   texture_cache small(budget), large;
+   int id = small.open(path);
+   assert(id == 0 && large.open(path) == 0);
+   assert(small.open("missing.tex") == -1);
+
+   // texel centers of the finest level return the texels
+   for (int i = 0; i < 2000; i++) {
+      int x = (int) (random_float() * width), y = (int) (random_float() * height);
+      color c = small.lookup(id, (x + 0.5f) / width, 1.0f - (y + 0.5f) / height, 0.0f);
+      for (int k = 0; k < 3; k++) {
+         float expected = (rgb[3 * (y * width + x) + k] / 255.0f) * (rgb[3 * (y * width + x) + k] / 255.0f);
+         assert(fabs(c[k] - expected) < 1e-3f);
+      }
+   }
+   assert(small.resident_bytes() <= budget);
+
+   // a footprint as wide as the texture returns its average
+   color average(0);
+   for (int i = 0; i < width * height; i++) {
+      for (int k = 0; k < 3; k++) average[k] += (rgb[3 * i + k] / 255.0f) * (rgb[3 * i + k] / 255.0f);
+   }
+   average /= float(width * height);
+   color c = small.lookup(id, 0.3f, 0.7f, 1.0f);
+   for (int k = 0; k < 3; k++) assert(fabs(c[k] - average[k]) < 0.02f);
+
+   // threads evicting each other's tiles see the same texels
+   std::vector<vec3> queries(20000);
+   std::vector<color> expected(queries.size()), found(queries.size());
+   for (size_t i = 0; i < queries.size(); i++) {
+      queries[i] = vec3(random_float() * 3 - 1, random_float() * 3 - 1, random_float() * random_float() * 0.1f);
+      expected[i] = large.lookup(id, queries[i].x, queries[i].y, queries[i].z);
+   }
+   parallel_for(0, (int) queries.size(), 64, [&](int first, int last) {
+      for (int i = first; i < last; i++) found[i] = small.lookup(id, queries[i].x, queries[i].y, queries[i].z);
+   });
+   for (size_t i = 0; i < queries.size(); i++) assert(found[i] == expected[i]);
+   assert(small.resident_bytes() <= budget);
+
+   // image_texture looks up a material's albedo at the hit's coordinates
+   shared_ptr<texture_cache> cache = make_shared<texture_cache>();
+   lambertian textured(make_shared<image_texture>(cache, cache->open(path)));
+   hit_record rec;
+   rec.normal = vec3(0, 1, 0);
+   rec.u = 0.25f;
+   rec.v = 0.5f;
+   color value;
+   float pdf;
+   textured.evaluate(ray(), rec, vec3(0, 1, 0), value, pdf);
+   assert(length(value - large.lookup(id, 0.25f, 0.5f, 0.0f) * pdf) < 1e-5f);
+   std::remove(path);
+}
+
+void test_photon_map(int num_photons) {
+   // the grid finds exactly the photons within the radius
+   std::vector<photon> stored(num_photons);
+   for (int i = 0; i < num_photons; i++) {
+      photon ph = { random_unit_cube() * 2.0f, vec3(0, -1, 0), color(1) };
+      stored[i] = ph;
+   }
+   photon_map map;
+   map.build(stored, 0.1f);
+   for (int i = 0; i < 1000; i++) {
+      point3 p = random_unit_cube() * 2.2f;
+      int expected = 0;
+      for (int k = 0; k < num_photons; k++) {
+         if (length(stored[k].position - p) <= 0.1f) expected++;
+      }
+      int found = 0;
+      map.visit(p, [&](const photon&) { found++; });
+      assert(found == expected);
+   }
+
+   // photons through a glass sphere land on the floor below it; without
+   // the glass, none are stored
+   hittable_list world;
+   shared_ptr<material> floor = make_shared<lambertian>(color(0.5f));
+   world.add(make_shared<sphere>(point3(0, -100, 0), 100, floor));
+   world.add(make_shared<sphere>(point3(0, 3, 0), 0.1f, make_shared<diffuse_light>(color(50))));
+   light_tree lights(world.objects);
+   map.trace(world, lights, 10000, 0.05f);
+   assert(map.empty());
+
+   world.add(make_shared<sphere>(point3(0, 1, 0), 0.5f, make_shared<dielectric>(1.5f)));
+   light_tree same_lights(world.objects);
+   map.trace(world, same_lights, 10000, 0.05f);
+   assert(!map.empty());
+   int on_floor = 0;
+   color total(0);
+   for (int i = 0; i < 1000; i++) {
+      point3 p(random_float(-1, 1), 0, random_float(-1, 1));
+      map.visit(p, [&](const photon& ph) {
+         assert(fabs(ph.position.y) < 0.02f && ph.direction.y < 0); // the floor is a large sphere
+         total += ph.power;
+         on_floor++;
+      });
+   }
+   assert(on_floor > 0 && total.r > 0);
+
+   // a diffuse point under the sphere gathers light, one beside it none
+   hit_record rec;
+   rec.p = point3(0, 0, 0);
+   rec.normal = vec3(0, 1, 0);
+   rec.mat_ptr = floor;
+   ray view(point3(0, 1, 1), vec3(0, -1, -1));
+   assert(map.gather(view, rec).r > 0);
+   rec.p = point3(3, 0, 0);
+   assert(map.gather(view, rec) == color(0));
+}
+
+void test_irradiance_cache(int num_records) {
+   // a wall of radiance 1 at x = 1, seen from points on the floor y = 0
+   auto wall = [](const std::vector<ray>& rays, std::vector<color>& radiance, std::vector<float>& distance) {
+      for (size_t k = 0; k < rays.size(); k++) {
+         vec3 o = rays[k].origin(), d = rays[k].direction();
+         if (d.x <= 0) continue;
+         float t = (1 - o.x) / d.x;
+         point3 p = o + t * d;
+         if (p.y <= 1 && fabs(p.z) < 1) {
+            radiance[k] = color(1);
+            distance[k] = t * length(d);
+         }
+      }
+   };
+   std::vector<shared_ptr<hittable>> bounds;
+   bounds.push_back(make_shared<sphere>(point3(0), 2.0f, shared_ptr<material>()));
+
+   // gradients: extrapolating a record to a moved point or a turned normal
+   // matches computing a record there
+   vec3 up(0, 1, 0), tilted = normalize(vec3(0.05f, 1, 0));
+   float E = 0, moved = 0, turned = 0, moved_extrapolated = 0, turned_extrapolated = 0;
+   for (int run = 0; run < 10; run++) {
+      irradiance_cache cache(bounds, 0.9f, 4096);
+      E += cache.compute(point3(0.5f, 0, 0), up, 10, 100, wall).r;
+      color value;
+      assert(cache.lookup(point3(0.52f, 0, 0), up, value));
+      moved_extrapolated += value.r;
+      assert(cache.lookup(point3(0.5f, 0, 0), tilted, value));
+      turned_extrapolated += value.r;
+      irradiance_cache other(bounds, 0.9f, 4096);
+      moved += other.compute(point3(0.52f, 0, 0), up, 10, 100, wall).r;
+      turned += other.compute(point3(0.5f, 0, 0), tilted, 10, 100, wall).r;
+   }
+   assert(moved - E > 0.1f && fabs(moved_extrapolated - moved) < 0.2f * (moved - E));
+   assert(turned - E > 0.3f && fabs(turned_extrapolated - turned) < 0.2f * (turned - E));
+
+   // records inserted from many threads are all found; a point far from
+   // them has none, and a point outside the octree is never cached
+   irradiance_cache cache(bounds, 0.3f, 64);
+   std::vector<point3> points(num_records);
+   for (int i = 0; i < num_records; i++) points[i] = point3(random_float(-1, 0), 0, random_float(-1, 1));
+   parallel_for(0, num_records, 16, [&](int first, int last) {
+      for (int i = first; i < last; i++) cache.compute(points[i], up, 0.1f, 0.1f, wall);
+   });
+   assert(cache.size() == (size_t) num_records);
+   for (int i = 0; i < num_records; i++) {
+      color value;
+      assert(cache.lookup(points[i], up, value));
+      assert(value.r >= 0 && value.r < 1.6f); // below pi / 2: the wall fills less than half the sky
+   }
+   color value;
+   assert(!cache.lookup(point3(1.5f, 0, 0), up, value));
+   assert(!cache.lookup(point3(-1, 0, 0), vec3(0, -1, 0), value));
+   assert(!cache.lookup(point3(5, 0, 0), up, value));
+   assert(cache.covers(points[0]) && !cache.covers(point3(5, 0, 0)));
+   cache.compute(point3(5, 0, 0), up, 0.1f, 0.1f, wall);
+   assert(cache.size() == (size_t) num_records); // no cell would list it
+}
+
+void test_path_guiding() {
+   // samples of a quadtree follow its density, which integrates to 1
+   direction_tree recorded, learned;
+   auto light = [](vec2 q) { return q.x >= 0.75f && q.y < 0.25f ? 10.0f : 0.1f; };
+   for (int i = 0; i < 100000; i++) {
+      vec2 q(random_float(), random_float());
+      recorded.record(q, light(q));
+   }
+   learned.refine(recorded, 0.01f, 20);
+   assert(learned.size() > 1 && learned.total() == 0);
+   for (int i = 0; i < 100000; i++) {
+      vec2 q(random_float(), random_float());
+      learned.record(q, light(q));
+   }
+   double integral = 0;
+   for (int i = 0; i < 256; i++) {
+      for (int j = 0; j < 256; j++) integral += learned.pdf(vec2((i + 0.5f) / 256, (j + 0.5f) / 256)) / (256 * 256);
+   }
+   assert(fabs(integral - 1) < 1e-3);
+   int bright = 0;
+   for (int i = 0; i < 10000; i++) {
+      float pdf;
+      vec2 q = learned.sample(random_float(), random_float(), pdf);
+      assert(fabs(pdf - learned.pdf(q)) <= 1e-3f * pdf);
+      if (q.x >= 0.75f && q.y < 0.25f) bright++;
+   }
+   assert(bright > 8500); // the corner holds 0.625 of 0.719 of the light
+   float pdf;
+   vec3 w = guiding_field::sample(learned, 0.3f, 0.8f, pdf);
+   assert(fabs(length(w) - 1) < 1e-5f && fabs(pdf - guiding_field::pdf(learned, w)) < 1e-3f * pdf);
+
+   // camera paths onto a floor lit by a small light: once trained, guided
+   // bounces find the light far more often, for the same mean
+   hittable_list world;
+   shared_ptr<material> gray = make_shared<lambertian>(color(0.5f));
+   world.add(make_shared<triangle>(point3(-5, 0, -5), point3(5, 0, -5), point3(5, 0, 5), gray));
+   world.add(make_shared<triangle>(point3(-5, 0, -5), point3(5, 0, 5), point3(-5, 0, 5), gray));
+   world.add(make_shared<sphere>(point3(2, 1, 0), 0.1f, make_shared<diffuse_light>(color(100))));
+   guiding_field field(world.objects);
+   double mean[2], variance[2];
+   for (int pass = 0; pass < 6; pass++) {
+      int n = 8000 << std::min(pass, 3);
+      std::vector<path_state> paths;
+      std::vector<color> radiance(n, color(0));
+      for (int k = 0; k < n; k++) {
+         point3 o(random_float(-0.2f, 0.2f), 1, random_float(-0.2f, 0.2f));
+         path_state path = { ray(o, vec3(0, -1, 0)), color(1), k, 0, 0, k, 0.0f, 0.0f, 0.0f, 0, false, false, -1 };
+         paths.push_back(path);
+      }
+      trace_options guided;
+      guided.guide = &field;
+      trace_paths(world, paths, radiance, 2, false, guided);
+      double sum = 0, sum_sqr = 0;
+      for (int k = 0; k < n; k++) {
+         sum += radiance[k].r;
+         sum_sqr += radiance[k].r * radiance[k].r;
+      }
+      int m = pass == 0 ? 0 : 1;
+      mean[m] = sum / n;
+      variance[m] = sum_sqr / n - mean[m] * mean[m];
+      field.refine(n / 8000);
+   }
+   assert(field.passes() == 6);
+   assert(fabs(mean[1] - mean[0]) < 0.1f * mean[0]);
+   assert(variance[1] < 0.5f * variance[0]);
+}
+
+void test_light_tracer(int num_paths) {
+   // adds from many threads all land
+   splat_buffer splats(8, 6);
+   parallel_for(0, 100000, 1000, [&](int first, int last) {
+      for (int i = first; i < last; i++) splats.add(2, 5, color(1, 2, 0));
+   });
+   assert(splats.at(2, 5) == color(100000, 200000, 0) && splats.at(5, 2) == color(0));
+
+   // points along a camera ray project to the pixel the ray was shot through
+   camera cam(point3(0, 2, 3), point3(0, 0, 0), vec3(0, 1, 0), 50, 8 / 6.0f);
+   for (int j = 0; j < 6; j++) {
+      for (int i = 0; i < 8; i++) {
+         ray r = cam.get_ray((i + 0.3f) / 7, (6 - j - 1 - 0.6f) / 5);
+         int row, col;
+         float importance;
+         assert(project(cam, splats, r.at(2.5f), row, col, importance));
+         assert(row == j && col == i && importance > 0);
+      }
+   }
+   int row, col;
+   float importance;
+   assert(!project(cam, splats, point3(0, 2, 5), row, col, importance)); // behind
+   assert(!project(cam, splats, point3(10, 0, 0), row, col, importance)); // beside
+
+   // without specular surfaces light paths add nothing; with a glass
+   // sphere they replace the caustic's camera paths, for the same image
+   hittable_list world;
+   world.add(make_shared<sphere>(point3(0, -100, 0), 100, make_shared<lambertian>(color(0.7f))));
+   world.add(make_shared<sphere>(point3(0.2f, 2.5f, 0), 0.15f, make_shared<diffuse_light>(color(100))));
+   int w = 32, h = 24;
+   camera view(point3(0, 3, 2), point3(0, 0, 0), vec3(0, 1, 0), 30, w / float(h));
+   render_settings settings;
+   settings.sampler = sampler_type::sobol;
+   settings.samples_per_pixel = 16;
+   auto mean = [&](const framebuffer& image, int spp) {
+      color sum(0);
+      for (size_t k = 0; k < image.radiance.size(); k++) sum += image.radiance[k];
+      return sum / float(spp * image.radiance.size());
+   };
+   render_inputs inputs;
+   {
+      light_tree lights(world.objects);
+      inputs.lights = &lights;
+      framebuffer plain(w, h), splatted(w, h);
+      render(world, view, settings, plain, inputs);
+      settings.light_paths = num_paths;
+      render(world, view, settings, splatted, inputs);
+      assert(plain.radiance == splatted.radiance);
+   }
+   world.add(make_shared<sphere>(point3(0, 0.8f, 0), 0.5f, make_shared<dielectric>(1.5f)));
+   light_tree lights(world.objects);
+   inputs.lights = &lights;
+   framebuffer splatted(w, h), reference(w, h);
+   render(world, view, settings, splatted, inputs);
+   settings.light_paths = 0;
+   settings.samples_per_pixel = 512;
+   settings.sampler = sampler_type::independent;
+   render(world, view, settings, reference, inputs);
+   color a = mean(splatted, 16), b = mean(reference, 512);
+   assert(fabs(a.r - b.r) < 0.02f * b.r);
+}
+
+void test_denoiser() {
+   // a noisy wall, a noisy floor and a strip of sky: denoising removes
+   // most of the noise, keeps the means, and nothing crosses the edge
+   int w = 64, h = 48, spp = 16;
+   framebuffer image(w, h);
+   feature_buffer features(w, h);
+   for (int j = 0; j < h; j++) {
+      for (int i = 0; i < w; i++) {
+         int pixel = j * w + i;
+         if (j < 8) {
+            image.at(j, i) = color(0.5f, 0.7f, 1.0f) * float(spp); // sky: no features
+            continue;
+         }
+         bool wall = i < w / 2;
+         for (int s = 0; s < spp; s++) {
+            float value = (wall ? 0.2f : 0.6f) * (random_float() < 0.5f ? 0.5f : 1.5f);
+            image.at(j, i) += color(value);
+            features.luminance_sqr[pixel] += value * value;
+            features.normal[pixel] += wall ? vec3(1, 0, 0) : vec3(0, 1, 0);
+            features.albedo[pixel] += color(0.5f);
+            features.depth[pixel] += 2.0f;
+         }
+      }
+   }
+   framebuffer noisy = image;
+   denoise(image, features, spp);
+   for (int half = 0; half < 2; half++) {
+      float expected = half ? 0.6f : 0.2f;
+      double sum = 0, noisy_error = 0, error = 0;
+      int count = 0;
+      for (int j = 8; j < h; j++) {
+         for (int i = half * w / 2; i < (half + 1) * w / 2; i++) {
+            float value = image.at(j, i).g / spp, before = noisy.at(j, i).g / spp;
+            sum += value;
+            error += (value - expected) * (value - expected);
+            noisy_error += (before - expected) * (before - expected);
+            count++;
+         }
+      }
+      assert(fabs(sum / count - expected) < 0.02f * expected);
+      assert(error < 0.1f * noisy_error);
+      // the column at the edge keeps its own level
+      for (int j = 8; j < h; j++) {
+         float value = image.at(j, half ? w / 2 : w / 2 - 1).g / spp;
+         assert(fabs(value - expected) < 0.3f * expected);
+      }
+   }
+   for (int j = 0; j < 8; j++) {
+      for (int i = 0; i < w; i++) assert(length(image.at(j, i) - noisy.at(j, i)) < 1e-4f * spp);
+   }
+}
+
+void test_aov() {
+   // a lambertian sphere in front of the camera, sky around it
+   hittable_list world;
+   shared_ptr<material> green = make_shared<lambertian>(color(0, 0.5f, 0));
+   world.add(make_shared<sphere>(point3(0, 0, -3), 1.0f, green));
+   int w = 24, h = 16, spp = 4;
+   camera cam(point3(0), point3(0, 0, -1), vec3(0, 1, 0), 60, w / float(h));
+   render_settings settings;
+   settings.samples_per_pixel = spp;
+   settings.sampler = sampler_type::sobol;
+   framebuffer plain(w, h), image(w, h);
+   feature_buffer features(w, h);
+   render_inputs inputs;
+   inputs.features = &features;
+   render(world, cam, settings, plain);
+   render(world, cam, settings, image, inputs);
+   assert(plain.radiance == image.radiance); // outputs come from the same rays
+
+   std::vector<vec3> beauty = aov_pixels(aov_type::beauty, image, features, false);
+   std::vector<vec3> normal = aov_pixels(aov_type::normal, image, features, false);
+   std::vector<vec3> depth = aov_pixels(aov_type::depth, image, features, false);
+   std::vector<vec3> albedo = aov_pixels(aov_type::albedo, image, features, false);
+   std::vector<vec3> object = aov_pixels(aov_type::object_id, image, features, false);
+   std::vector<vec3> count = aov_pixels(aov_type::sample_count, image, features, true);
+   int center = (h / 2) * w + w / 2, corner = 0;
+   assert(length(beauty[center] - image.radiance[center] / float(spp)) < 1e-6f);
+   assert(normal[center].z > 0.95f && normal[corner] == vec3(0));
+   assert(fabs(depth[center].x - 2.0f) < 0.05f && depth[corner].x == 0);
+   assert(length(albedo[center] - vec3(0, 0.5f, 0)) < 1e-6f && albedo[corner] == vec3(0));
+   assert(object[center] == vec3(1) && object[corner] == vec3(0));
+   for (int k = 0; k < w * h; k++) assert(features.samples[k] == spp && count[k] == vec3(1));
+   std::vector<vec3> shown = aov_pixels(aov_type::normal, image, features, true);
+   for (int k = 0; k < w * h; k++) assert(all(greaterThanEqual(shown[k], vec3(0))) && all(lessThanEqual(shown[k], vec3(1))));
+}
+
+// intersects through world, counting the calls
+struct counting_world {
+   const hittable_list& world;
+   mutable std::atomic<int> calls;
+   counting_world(const hittable_list& w) : world(w), calls(0) {}
+   bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const {
+      calls++;
+      return world.hit(r, min_t, max_t, rec);
+   }
+};
+
+void test_hit_cache() {
+   hittable_list world;
+   shared_ptr<lambertian> green = make_shared<lambertian>(color(0, 0.5f, 0));
+   shared_ptr<metal> red = make_shared<metal>(color(0.8f, 0.2f, 0.2f), 0.3f);
+   world.add(make_shared<sphere>(point3(-0.6f, 0, -3), 0.5f, green));
+   world.add(make_shared<sphere>(point3(0.6f, 0, -3), 0.5f, red));
+   world.add(make_shared<plane>(point3(0, -0.5f, 0), vec3(0, 1, 0), green));
+   int w = 24, h = 16, spp = 4;
+   camera cam(point3(0), point3(0, 0, -1), vec3(0, 1, 0), 60, w / float(h));
+   render_settings settings;
+   settings.samples_per_pixel = spp;
+   settings.sampler = sampler_type::sobol;
+
+   // recording leaves the image as it is
+   hit_cache cache(world.objects);
+   framebuffer plain(w, h), recorded(w, h);
+   render(world, cam, settings, plain);
+   render_inputs recording;
+   recording.primary_hits = &cache;
+   render(world, cam, settings, recorded, recording);
+   assert(plain.radiance == recorded.radiance);
+   assert(!cache.reused());
+   assert(cache.save("test.hits"));
+
+   // edited materials re-shade from the saved hits as a full render would,
+   // without the camera rays
+   green->albedo = color(0.2f, 0.3f, 0.9f);
+   red->fuzz = 0.05f;
+   hit_cache loaded(world.objects);
+   assert(loaded.load("test.hits"));
+   counting_world counted(world), counted_again(world);
+   framebuffer full(w, h), reshaded(w, h);
+   render(counted, cam, settings, full);
+   render_inputs reusing;
+   reusing.primary_hits = &loaded;
+   render(counted_again, cam, settings, reshaded, reusing);
+   assert(loaded.reused());
+   assert(full.radiance == reshaded.radiance);
+   assert(counted.calls - counted_again.calls == w * h * spp);
+
+   // so does a material swapped for another one
+   dynamic_cast<sphere*>(world.objects[1].get())->mat_ptr = make_shared<dielectric>(1.5f);
+   framebuffer swapped_full(w, h), swapped(w, h);
+   render(world, cam, settings, swapped_full);
+   render(world, cam, settings, swapped, reusing);
+   assert(loaded.reused());
+   assert(swapped_full.radiance == swapped.radiance);
+   assert(swapped.radiance != reshaded.radiance);
+
+   // other geometry or another camera records again
+   hittable_list moved;
+   moved.add(make_shared<sphere>(point3(-0.6f, 0.1f, -3), 0.5f, green));
+   moved.add(world.objects[1]);
+   moved.add(world.objects[2]);
+   hit_cache other(moved.objects);
+   assert(other.load("test.hits"));
+   assert(!other.begin(cam, w, h, spp, settings.sampler) && other.recording());
+   camera turned(point3(0), point3(0.1f, 0, -1), vec3(0, 1, 0), 60, w / float(h));
+   assert(!loaded.begin(turned, w, h, spp, settings.sampler));
+
+   // an object moved in place records again too
+   assert(loaded.load("test.hits") && loaded.begin(cam, w, h, spp, settings.sampler));
+   dynamic_cast<sphere*>(world.objects[0].get())->center.y += 0.1f;
+   assert(!loaded.begin(cam, w, h, spp, settings.sampler) && loaded.recording());
+   dynamic_cast<sphere*>(world.objects[0].get())->center.y -= 0.1f;
+
+   // independent samples jitter differently every render: nothing is
+   // recorded or reused
+   render_settings jittered = settings;
+   jittered.sampler = sampler_type::independent;
+   hit_cache unused(world.objects);
+   render_inputs with_unused;
+   with_unused.primary_hits = &unused;
+   framebuffer jittered_image(w, h);
+   render(world, cam, jittered, jittered_image, with_unused);
+   render(world, cam, jittered, jittered_image, with_unused);
+   assert(!unused.recording() && !unused.reused() && !unused.save("test.hits"));
+   assert(!cache.begin(cam, w, h, spp, sampler_type::independent) && !cache.recording() && !cache.reused());
+   std::remove("test.hits");
+}
+
+void test_tile_dependencies() {
+   // a row of spheres on a floor, the small one on the right moved a little
+   hittable_list world;
+   shared_ptr<material> gray = make_shared<lambertian>(color(0.5f));
+   shared_ptr<material> mirror = make_shared<metal>(color(0.9f), 0.0f);
+   world.add(make_shared<plane>(point3(0, -0.5f, 0), vec3(0, 1, 0), gray));
+   world.add(make_shared<sphere>(point3(-1.2f, 0, -3), 0.5f, mirror));
+   world.add(make_shared<sphere>(point3(0, 0, -3), 0.5f, gray));
+   shared_ptr<sphere> small = make_shared<sphere>(point3(1.4f, -0.3f, -2.5f), 0.2f, gray);
+   world.add(small);
+   int w = 64, h = 48, spp = 2;
+   camera cam(point3(0, 0.3f, 0), point3(0, 0, -3), vec3(0, 1, 0), 60, w / float(h));
+   render_settings settings;
+   settings.samples_per_pixel = spp;
+   settings.tile_size = 8;
+   settings.max_depth = 4;
+   settings.sampler = sampler_type::sobol;
+
+   tile_dependencies dependencies(world.objects);
+   framebuffer image(w, h), plain(w, h);
+   render_inputs inputs;
+   inputs.dependencies = &dependencies;
+   render(world, cam, settings, image, inputs);
+   render(world, cam, settings, plain);
+   assert(image.radiance == plain.radiance); // recording leaves the image as it is
+   int tiles = (w / 8) * (h / 8);
+
+   // nothing changed: nothing to trace
+   scene_snapshot before(world.objects);
+   assert(scene_snapshot(world.objects).changes_since(before).empty());
+   assert(dependencies.invalidate(scene_snapshot(world.objects).changes_since(before)) == 0);
+
+   // the edited tiles alone give the image of a full render
+   small->center = point3(1.3f, -0.3f, -2.4f);
+   std::vector<scene_change> changes = scene_snapshot(world.objects).changes_since(before);
+   assert(changes.size() == 1 && changes[0].object == small.get());
+   int dirty = dependencies.invalidate(changes);
+   assert(dirty > 0 && dirty < tiles / 2);
+   render(world, cam, settings, image, inputs);
+   framebuffer full(w, h);
+   render(world, cam, settings, full);
+   assert(image.radiance == full.radiance);
+
+   // the mirror sees the whole row: a change to it reaches more tiles
+   scene_snapshot moved(world.objects);
+   world.objects[1] = make_shared<sphere>(point3(-1.2f, 0.05f, -3), 0.5f, mirror);
+   assert(dependencies.invalidate(scene_snapshot(world.objects).changes_since(moved)) > dirty);
+   render(world, cam, settings, image, inputs);
+   framebuffer again(w, h);
+   render(world, cam, settings, again);
+   assert(image.radiance == again.radiance);
+
+   // planes are unbounded: every tile
+   scene_snapshot last(world.objects);
+   world.objects[0] = make_shared<plane>(point3(0, -0.45f, 0), vec3(0, 1, 0), gray);
+   assert(dependencies.invalidate(scene_snapshot(world.objects).changes_since(last)) == tiles);
+}
+
+void test_dynamic_bvh() {
+   hittable_list world;
+   shared_ptr<material> gray = make_shared<lambertian>(color(0.5f));
+   auto random_sphere = [&]() {
+      return make_shared<sphere>(point3(random_float(-10, 10), random_float(-10, 10), random_float(-10, 10)),
+         random_float(0.05f, 0.5f), gray);
+   };
+   for (int i = 0; i < 1000; i++) world.add(random_sphere());
+   world.add(make_shared<plane>(point3(0, -12, 0), vec3(0, 1, 0), gray));
+   dynamic_bvh tree(world);
+
+   // the tree finds what testing every object finds
+   auto check = [&]() {
+      for (int k = 0; k < 300; k++) {
+         ray r(point3(random_float(-15, 15), random_float(-15, 15), 20), random_unit_vector() - vec3(0, 0, 1));
+         hit_record expected, found;
+         bool hit = world.hit(r, 0.001f, infinity, expected);
+         assert(tree.hit(r, 0.001f, infinity, found) == hit);
+         if (hit) assert(found.t == expected.t && found.object == expected.object);
+      }
+   };
+   check();
+
+   for (int edit = 0; edit < 2000; edit++) {
+      float choice = random_float();
+      const hittable* object = world.objects[int(random_float() * (world.objects.size() - 1))].get();
+      if (choice < 0.2f) tree.insert(random_sphere());
+      else if (choice < 0.35f) {
+         assert(tree.remove(object));
+         assert(std::find_if(world.objects.begin(), world.objects.end(),
+            [&](const shared_ptr<hittable>& o) { return o.get() == object; }) == world.objects.end());
+      }
+      else if (choice < 0.8f) tree.transform(object, glm::translate(mat4(1), random_unit_vector() * 0.05f));
+      else tree.transform(object, glm::translate(mat4(1), random_unit_vector() * 8.0f));
+   }
+   check();
+   assert(!tree.remove(0));
+
+   // a rebuild restores the cost of a fresh tree
+   tree.rebuild();
+   dynamic_bvh fresh(world);
+   assert(tree.sah_cost() == fresh.sah_cost());
+   assert(!tree.optimize());
+   check();
+
+   // the two halves of the scene trade places in small steps, each only
+   // refitting the tree, which grows stale; optimize brings the cost back down
+   float built = tree.sah_cost();
+   std::vector<vec3> steps(world.objects.size(), vec3(0));
+   for (size_t i = 0; i < world.objects.size(); i++) {
+      aabb box;
+      if (world.objects[i]->bounding_box(box)) steps[i].x = box.minimum.x + box.maximum.x < 0 ? 0.25f : -0.25f;
+   }
+   for (int round = 0; round < 60; round++) {
+      for (size_t i = 0; i < world.objects.size(); i++) {
+         tree.transform(world.objects[i].get(), glm::translate(mat4(1), steps[i]));
+      }
+   }
+   float degraded = tree.sah_cost();
+   assert(degraded > 1.3f * built);
+   assert(tree.optimize() && tree.sah_cost() < degraded);
+   check();
+
+   // a rebuild that is no cheaper than the tree it replaces is undone
+   dynamic_bvh eager(world, 0.0f);
+   float kept = eager.sah_cost();
+   assert(!eager.optimize() && eager.sah_cost() == kept);
+}
+
+void test_sequence() {
+   // a path through keys on a line follows the line, and passes through its keys
+   camera_path path;
+   path.add(camera_keyframe{ 2, point3(2, 0, 0), point3(2, 0, -1), vec3(0, 1, 0), 40 });
+   path.add(camera_keyframe{ 0, point3(0, 0, 0), point3(0, 0, -1), vec3(0, 1, 0), 60 });
+   assert(path.start() == 0 && path.end() == 2);
+   camera_keyframe middle = path.at(1);
+   assert(length(middle.lookfrom - point3(1, 0, 0)) < 1e-5f && std::fabs(middle.vfov - 50) < 1e-4f);
+   assert(path.at(-1).lookfrom == point3(0) && path.at(3).lookfrom == point3(2, 0, 0));
+   path.add(camera_keyframe{ 3, point3(2, 1, -1), point3(0, 0, -3), vec3(0, 1, 0), 40 });
+   assert(length(path.at(2).lookfrom - point3(2, 0, 0)) < 1e-5f);
+
+   hittable_list world;
+   shared_ptr<material> gray = make_shared<lambertian>(color(0.5f));
+   world.add(make_shared<plane>(point3(0, -0.5f, 0), vec3(0, 1, 0), gray));
+   world.add(make_shared<sphere>(point3(-1.2f, 0, -3), 0.5f, make_shared<metal>(color(0.9f), 0.2f)));
+   world.add(make_shared<sphere>(point3(0, 0, -3), 0.5f, gray));
+   shared_ptr<sphere> small = make_shared<sphere>(point3(1.4f, -0.3f, -2.5f), 0.2f, gray);
+   world.add(small);
+   int w = 64, h = 48;
+   camera cam(point3(0, 0.3f, 0), point3(0, 0, -3), vec3(0, 1, 0), 60, w / float(h));
+   render_settings settings;
+   settings.samples_per_pixel = 1;
+   settings.tile_size = 8;
+   settings.max_depth = 4;
+   settings.sampler = sampler_type::sobol;
+
+   framebuffer reference(w, h);
+   render_settings converged = settings;
+   converged.samples_per_pixel = 256;
+   render(world, cam, converged, reference);
+   // mean squared error of image against the reference, image averaged over samples
+   auto error = [&](const framebuffer& image, int samples) {
+      double sum = 0;
+      for (int k = 0; k < w * h; k++) {
+         vec3 d = image.radiance[k] / float(samples) - reference.radiance[k] / 256.0f;
+         sum += dot(d, d);
+      }
+      return sum / (w * h);
+   };
+
+   // a still camera: only silhouettes are disoccluded after the first
+   // frame, and frames converge beyond what one frame's samples reach
+   sequence_renderer sequence(w, h, settings);
+   for (int f = 0; f < 8; f++) {
+      sequence.frame(world, cam);
+      assert(sequence.traced() <= size_t(w * h * 3) && sequence.traced() > size_t(w * h * 2));
+   }
+   const std::vector<uint8_t>& states = sequence.states();
+   assert(std::count(states.begin(), states.end(), sequence_renderer::pixel_disoccluded) < w * h / 20);
+   assert(std::count(states.begin(), states.end(), sequence_renderer::pixel_reused) > w * h * 9 / 10);
+   for (const vec2& m : sequence.motion()) assert(length(m) < 1e-3f);
+   framebuffer single(w, h);
+   render_settings same_cost = settings;
+   same_cost.samples_per_pixel = 3;
+   render(world, cam, same_cost, single);
+   double still = error(sequence.image(), 1);
+   assert(still < 0.25 * error(single, 3));
+
+   // a small move to the right keeps most pixels; the last frame saw them farther right
+   camera moved(point3(0.05f, 0.3f, 0), point3(0.05f, 0, -3), vec3(0, 1, 0), 60, w / float(h));
+   sequence.frame(world, moved);
+   long kept = std::count(states.begin(), states.end(), sequence_renderer::pixel_reused);
+   long lost = std::count(states.begin(), states.end(), sequence_renderer::pixel_disoccluded);
+   assert(kept > w * h * 3 / 4 && lost > 0 && lost < w * h / 10);
+   int center = (h / 2) * w + w / 2;
+   assert(sequence.motion()[center].x > 0.1f && std::fabs(sequence.motion()[center].y) < 0.1f);
+   framebuffer moved_reference(w, h);
+   render(world, moved, converged, moved_reference);
+   reference = moved_reference;
+   assert(error(sequence.image(), 1) < 0.5 * error(single, 3));
+
+   // pixels inside a removed object start over
+   feature_buffer features(w, h);
+   framebuffer seen(w, h);
+   render_inputs inputs;
+   inputs.features = &features;
+   render(world, moved, settings, seen, inputs);
+   world.objects.pop_back();
+   sequence.frame(world, moved);
+   int covered = 0;
+   for (int j = 1; j + 1 < h; j++) {
+      for (int i = 1; i + 1 < w; i++) {
+         int k = j * w + i;
+         if (features.object[k] != small.get() || features.object[k - 1] != small.get() ||
+            features.object[k + 1] != small.get() || features.object[k - w] != small.get() ||
+            features.object[k + w] != small.get()) continue;
+         covered++;
+         assert(states[k] != sequence_renderer::pixel_reused);
+      }
+   }
+   assert(covered > 0);
+}
+
+void test_frame_pipeline() {
+   // a slow encoder: every frame becomes the red of its first pixel
+   frame_encoder slow = [](const framebuffer& image, std::vector<unsigned char>& bytes) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      bytes.assign(1, (unsigned char) image.radiance[0].r);
+      return true;
+   };
+   frame_pipeline pipeline(slow, 2);
+   for (int f = 0; f < 8; f++) {
+      framebuffer image(4, 4);
+      image.radiance[0] = color(float(f), 0, 0);
+      assert(pipeline.submit(image, "test_frame_" + std::to_string(f) + ".bin"));
+      assert(pipeline.in_flight() <= 2);
+   }
+   assert(pipeline.finish());
+   assert(pipeline.in_flight() == 0 && !pipeline.submit(framebuffer(4, 4), "test_frame_8.bin"));
+   for (int f = 0; f < 8; f++) {
+      std::string path = "test_frame_" + std::to_string(f) + ".bin";
+      std::ifstream in(path.c_str(), std::ios::binary);
+      assert(in.get() == f && in.get() == EOF);
+      in.close();
+      std::remove(path.c_str());
+   }
+
+   // frames that cannot be written are reported
+   frame_pipeline failing(slow, 1);
+   assert(failing.submit(framebuffer(4, 4), "no_such_directory/frame.bin"));
+   assert(!failing.finish());
+}
+
 int main(int argc, char** argv)
 {
     
@@ -171,4 +1426,33 @@ int main(int argc, char** argv)
    test_triangle(tri,
        ray(point3(1, 1, 5), vec3(-10, -10, 6)), // A ray outside, pointing away from the primitive (misses)
        false, NULL);
+
+   // Test acceleration structures:
+
+   test_bvh(100, 1000);
+   test_bvh(40000, 200); // large enough to bin and partition in parallel
+   test_scene_cache(1000, 1000);
+   test_arena();
+   test_compressed_mesh(100, 200, 1000);
+   test_sphere_cloud(3, 100);
+   test_sphere_cloud(40000, 2000);
+   test_tile_culling(2000, 1);
+   test_tile_culling(2000, 64);
+   test_visibility_buffer(1000);
+   test_sampler();
+   test_light_tree(500);
+   test_environment_map(64, 32);
+   test_texture_cache(256, 128);
+   test_texture_cache(300, 77);
+   test_photon_map(20000);
+   test_irradiance_cache(2000);
+   test_path_guiding();
+   test_light_tracer(100000);
+   test_denoiser();
+   test_aov();
+   test_hit_cache();
+   test_tile_dependencies();
+   test_dynamic_bvh();
+   test_sequence();
+   test_frame_pipeline();
 }
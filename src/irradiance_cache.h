@@ -0,0 +1,334 @@
+// irradiance_cache.h, indirect diffuse light interpolated between sparse records
+//
+// Indirect light on matte surfaces changes slowly, so it is computed only
+// at some points and interpolated in between (Ward et al. 1988). A record
+// holds the irradiance at a point from a stratified hemisphere of rays,
+// the harmonic mean distance R of the surfaces those rays see, and the
+// irradiance's gradients as the point moves along the surface and as the
+// normal turns (Ward and Heckbert 1992). A record is valid up to error * R
+// away, so records crowd where geometry is close, in corners and contact
+// shadows, and spread out in the open. Records live in an octree shared by
+// all render threads: each is listed in the nodes, about twice its valid
+// radius wide, that it overlaps. Children and list entries are added with
+// compare-and-swap and never removed, so readers need no locks.
+
+#ifndef IRRADIANCE_CACHE_H_
+#define IRRADIANCE_CACHE_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "hittable.h"
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+struct irradiance_record {
+   glm::point3 p;
+   glm::vec3 normal;
+   glm::color irradiance;
+   float radius; // harmonic mean distance, clamped
+   glm::vec3 translation[3]; // gradient of each channel as p moves
+   glm::vec3 rotation[3]; // gradient of each channel as the normal turns
+};
+
+class irradiance_cache {
+public:
+   // The octree covers the bounds of objects; points outside (on planes)
+   // hold no records and are left to path tracing. error is the largest interpolation error
+   // allowed, about 0.1 to 0.4; rays is the size of a record's hemisphere.
+   irradiance_cache(const std::vector<std::shared_ptr<hittable>>& objects, float error = 0.3f, int rays = 256);
+   ~irradiance_cache();
+
+   irradiance_cache(const irradiance_cache&) = delete;
+   irradiance_cache& operator=(const irradiance_cache&) = delete;
+
+   float get_error() const { return error; }
+
+   // whether p is inside the octree, where records can be stored and found
+   bool covers(const glm::point3& p) const {
+      glm::vec3 local = (p - origin) / side;
+      return local.x >= 0 && local.y >= 0 && local.z >= 0 && local.x < 1 && local.y < 1 && local.z < 1;
+   }
+
+   // Irradiance at p with normal n interpolated from the records valid
+   // there, false if there are none
+   bool lookup(const glm::point3& p, const glm::vec3& n, glm::color& irradiance) const;
+
+   // Computes and stores a record at p with normal n. trace(rays, radiance,
+   // distance) returns the radiance along each ray and the distance of its
+   // first hit (infinity if none). The record's radius is clamped to
+   // [min_radius, max_radius]. Returns the record's irradiance.
+   template <class F>
+   glm::color compute(const glm::point3& p, const glm::vec3& n, float min_radius, float max_radius, F trace);
+
+   // adds a record, false if it overlaps no cell of the octree; thread safe
+   bool insert(const irradiance_record& record);
+
+   size_t size() const { return count; }
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "irradiance cache: " << count << " records, " << nodes << " octree nodes" << std::endl;
+      return ss.str();
+   }
+
+private:
+   struct entry {
+      const irradiance_record* record;
+      entry* next;
+   };
+
+   struct node {
+      std::atomic<node*> children[8];
+      std::atomic<entry*> records;
+      node() : records(0) { for (int c = 0; c < 8; c++) children[c] = 0; }
+   };
+
+   static const int max_depth = 24;
+
+   // weight of record r at p with normal n, 0 if not valid there
+   float weight(const irradiance_record& r, const glm::point3& p, const glm::vec3& n) const {
+      glm::vec3 d = p - r.p;
+      float valid = error * r.radius;
+      if (glm::dot(d, d) >= valid * valid) return 0.0f;
+      // records in front of p see a different hemisphere
+      if (glm::dot(d, 0.5f * (n + r.normal)) < -0.05f * r.radius) return 0.0f;
+      float e = glm::length(d) / r.radius + std::sqrt(std::max(0.0f, 1.0f - glm::dot(n, r.normal)));
+      if (e >= error) return 0.0f;
+      return 1.0f / std::max(e, 1e-4f) - 1.0f / error;
+   }
+
+   // the node of depth at cell (x, y, z), created if needed
+   node* find_or_create(int depth, int x, int y, int z);
+   void destroy(node* n);
+
+private:
+   glm::point3 origin; // the octree is the cube [origin, origin + side]
+   float side;
+   float error;
+   int rows, columns; // hemisphere strata: rows in theta, columns in phi
+   node root;
+   std::atomic<entry*> all; // every record once, to free them
+   std::atomic<size_t> count;
+   std::atomic<size_t> nodes;
+};
+
+inline irradiance_cache::irradiance_cache(const std::vector<std::shared_ptr<hittable>>& objects,
+   float e, int rays) : error(e), all(0), count(0), nodes(1)
+{
+   aabb bounds;
+   for (size_t i = 0; i < objects.size(); i++) {
+      aabb box;
+      if (objects[i]->bounding_box(box)) bounds.grow(box);
+   }
+   if (bounds.empty()) bounds = aabb(glm::point3(-1), glm::point3(1));
+   glm::vec3 extent = bounds.extent();
+   side = 1.01f * std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-3f));
+   origin = bounds.centroid() - glm::vec3(0.5f * side);
+   // about pi times more columns than rows (Ward and Heckbert 1992)
+   rows = std::max(2, int(std::sqrt(rays / pi) + 0.5f));
+   columns = std::max(3, rays / rows);
+}
+
+inline irradiance_cache::~irradiance_cache()
+{
+   for (int c = 0; c < 8; c++) destroy(root.children[c]);
+   for (entry* e = root.records; e; ) {
+      entry* next = e->next;
+      delete e;
+      e = next;
+   }
+   for (entry* e = all; e; ) {
+      entry* next = e->next;
+      delete e->record;
+      delete e;
+      e = next;
+   }
+}
+
+inline void irradiance_cache::destroy(node* n)
+{
+   if (!n) return;
+   for (int c = 0; c < 8; c++) destroy(n->children[c]);
+   for (entry* e = n->records; e; ) {
+      entry* next = e->next;
+      delete e;
+      e = next;
+   }
+   delete n;
+}
+
+inline irradiance_cache::node* irradiance_cache::find_or_create(int depth, int x, int y, int z)
+{
+   node* n = &root;
+   for (int level = depth - 1; level >= 0; level--) {
+      int c = ((x >> level) & 1) | (((y >> level) & 1) << 1) | (((z >> level) & 1) << 2);
+      node* child = n->children[c].load(std::memory_order_acquire);
+      if (!child) {
+         node* created = new node();
+         if (n->children[c].compare_exchange_strong(child, created, std::memory_order_acq_rel)) {
+            child = created;
+            nodes++;
+         }
+         else {
+            delete created; // another thread added it first; child holds it now
+         }
+      }
+      n = child;
+   }
+   return n;
+}
+
+inline bool irradiance_cache::insert(const irradiance_record& record)
+{
+   // the deepest level whose cells are at least twice the valid radius
+   float valid = error * record.radius;
+   int depth = 0;
+   while (depth < max_depth && side / float(1 << (depth + 1)) >= 2.0f * valid) depth++;
+   int cells = 1 << depth;
+   float cell = side / cells;
+   glm::vec3 lo = (record.p - glm::vec3(valid) - origin) / cell;
+   glm::vec3 hi = (record.p + glm::vec3(valid) - origin) / cell;
+   // no lookup could find a record overlapping no cell
+   if (hi.x < 0 || hi.y < 0 || hi.z < 0 || lo.x >= cells || lo.y >= cells || lo.z >= cells) return false;
+   int x0 = std::max(0, int(std::floor(lo.x))), x1 = std::min(cells - 1, int(std::floor(hi.x)));
+   int y0 = std::max(0, int(std::floor(lo.y))), y1 = std::min(cells - 1, int(std::floor(hi.y)));
+   int z0 = std::max(0, int(std::floor(lo.z))), z1 = std::min(cells - 1, int(std::floor(hi.z)));
+
+   const irradiance_record* stored = new irradiance_record(record);
+   entry* owner = new entry();
+   owner->record = stored;
+   owner->next = all.load(std::memory_order_relaxed);
+   while (!all.compare_exchange_weak(owner->next, owner, std::memory_order_release)) {}
+   count++;
+
+   for (int z = z0; z <= z1; z++) {
+      for (int y = y0; y <= y1; y++) {
+         for (int x = x0; x <= x1; x++) {
+            node* n = find_or_create(depth, x, y, z);
+            entry* e = new entry();
+            e->record = stored;
+            e->next = n->records.load(std::memory_order_relaxed);
+            while (!n->records.compare_exchange_weak(e->next, e, std::memory_order_release)) {}
+         }
+      }
+   }
+   return true;
+}
+
+inline bool irradiance_cache::lookup(const glm::point3& p, const glm::vec3& n, glm::color& irradiance) const
+{
+   if (!covers(p)) return false;
+   glm::vec3 local = (p - origin) / side;
+
+   glm::color sum(0);
+   float total = 0.0f;
+   const node* current = &root;
+   for (int depth = 0; current; depth++) {
+      for (const entry* e = current->records.load(std::memory_order_acquire); e; e = e->next) {
+         const irradiance_record& r = *e->record;
+         float w = weight(r, p, n);
+         if (w <= 0) continue;
+         glm::vec3 turn = glm::cross(r.normal, n);
+         glm::vec3 d = p - r.p;
+         glm::color value;
+         for (int c = 0; c < 3; c++) {
+            value[c] = std::max(0.0f, r.irradiance[c] + glm::dot(turn, r.rotation[c]) + glm::dot(d, r.translation[c]));
+         }
+         sum += w * value;
+         total += w;
+      }
+      if (depth == max_depth) break;
+      // the child containing p
+      glm::vec3 scaled = local * float(2 << depth);
+      int c = (int(scaled.x) & 1) | ((int(scaled.y) & 1) << 1) | ((int(scaled.z) & 1) << 2);
+      current = current->children[c].load(std::memory_order_acquire);
+   }
+   if (total <= 0) return false;
+   irradiance = sum / total;
+   return true;
+}
+
+// Cosine-weighted strata: row j spans sin^2(theta) in [j, j + 1) / rows,
+// column k spans phi in [k, k + 1) * 2 pi / columns. The gradients follow
+// Ward and Heckbert 1992; the edges between columns are weighted by the
+// cosine too, as the irradiance is.
+template <class F>
+glm::color irradiance_cache::compute(const glm::point3& p, const glm::vec3& n, float min_radius,
+   float max_radius, F trace)
+{
+   glm::vec3 a = std::fabs(n.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+   glm::vec3 v = glm::normalize(glm::cross(n, a));
+   glm::vec3 u = glm::cross(v, n);
+
+   int samples = rows * columns;
+   std::vector<ray> rays(samples);
+   std::vector<float> tan_theta(samples);
+   for (int j = 0; j < rows; j++) {
+      for (int k = 0; k < columns; k++) {
+         float sin_sqr = (j + random_float()) / rows;
+         float phi = 2.0f * pi * (k + random_float()) / columns;
+         float sin_theta = std::sqrt(sin_sqr), cos_theta = std::sqrt(1.0f - sin_sqr);
+         glm::vec3 d = sin_theta * (std::cos(phi) * u + std::sin(phi) * v) + cos_theta * n;
+         rays[j * columns + k] = ray(p, d);
+         tan_theta[j * columns + k] = sin_theta / std::max(cos_theta, 1e-3f);
+      }
+   }
+   std::vector<glm::color> radiance(samples, glm::color(0));
+   std::vector<float> distance(samples, infinity);
+   trace(rays, radiance, distance);
+
+   irradiance_record record;
+   record.p = p;
+   record.normal = n;
+   record.irradiance = glm::color(0);
+   float inverse_distance = 0.0f;
+   for (int c = 0; c < 3; c++) record.translation[c] = record.rotation[c] = glm::vec3(0);
+   for (int i = 0; i < samples; i++) {
+      record.irradiance += radiance[i];
+      inverse_distance += 1.0f / distance[i];
+   }
+   record.irradiance *= pi / samples;
+
+   for (int k = 0; k < columns; k++) {
+      float phi_lo = 2.0f * pi * k / columns;
+      float phi_mid = phi_lo + pi / columns;
+      glm::vec3 u_k = std::cos(phi_mid) * u + std::sin(phi_mid) * v; // toward the column's middle
+      glm::vec3 v_k = -std::sin(phi_lo) * u + std::cos(phi_lo) * v; // across its lower edge
+      glm::vec3 w_k = -std::sin(phi_mid) * u + std::cos(phi_mid) * v;
+      int previous = (k + columns - 1) % columns;
+      for (int j = 0; j < rows; j++) {
+         int i = j * columns + k;
+         // rotation: the cosine weighting of the strata tilts with the normal
+         for (int c = 0; c < 3; c++) record.rotation[c] += w_k * (tan_theta[i] * radiance[i][c] * pi / samples);
+
+         // translation: the boundaries between strata move as p does
+         float sin_lo = std::sqrt(float(j) / rows);
+         float cos_lo = std::sqrt(1.0f - float(j) / rows);
+         float sin_hi = std::sqrt(float(j + 1) / rows);
+         if (j > 0) {
+            int below = i - columns;
+            float r = std::min(distance[i], distance[below]);
+            float f = (2.0f * pi / columns) * sin_lo * cos_lo * cos_lo / r;
+            for (int c = 0; c < 3; c++) record.translation[c] += u_k * (f * (radiance[i][c] - radiance[below][c]));
+         }
+         int beside = j * columns + previous;
+         float r = std::min(distance[i], distance[beside]);
+         float f = (sin_hi - sin_lo) / r;
+         for (int c = 0; c < 3; c++) record.translation[c] += v_k * (f * (radiance[i][c] - radiance[beside][c]));
+      }
+   }
+
+   // near a strong gradient, extrapolating over the radius must not change the irradiance by more than itself
+   record.radius = inverse_distance > 0 ? samples / inverse_distance : max_radius;
+   for (int c = 0; c < 3; c++) {
+      float g = glm::length(record.translation[c]);
+      if (g > 0) record.radius = std::min(record.radius, record.irradiance[c] / g);
+   }
+   record.radius = glm::clamp(record.radius, min_radius, max_radius);
+   insert(record);
+   return record.irradiance;
+}
+
+#endif
@@ -0,0 +1,149 @@
+// light_tracer.h, caustics seen directly, traced from the lights to the camera
+//
+// A caustic on a diffuse surface that the camera sees directly (light,
+// one or more specular bounces, diffuse surface, camera) is found by
+// camera paths only when their bounce off the surface passes through the
+// glass and hits the light, which is small. Light paths find it at once:
+// they leave the lights, follow the specular bounces and, at the first
+// diffuse or glossy surface, connect to the camera with a shadow ray. The
+// pixel the surface projects to gets the path's power, times the BSDF
+// toward the camera and the camera's importance; camera paths leave
+// these light paths to the tracer (render.h).
+// Light paths are traced in parallel and land on arbitrary pixels: the
+// splat buffer is a grid of atomic floats, added to without locks.
+
+#ifndef LIGHT_TRACER_H_
+#define LIGHT_TRACER_H_
+
+#include "AGLM.h"
+#include "ray.h"
+#include "camera.h"
+#include "hittable.h"
+#include "light_tree.h"
+#include "material.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <vector>
+
+// Light added to the pixels of an image from many threads at once
+class splat_buffer {
+public:
+   splat_buffer(int w, int h) : width(w), height(h), values(3 * size_t(w) * size_t(h)) { clear(); }
+
+   // adds light to the pixel at row, col; thread safe
+   void add(int row, int col, const glm::color& light) {
+      size_t k = 3 * (size_t(row) * width + col);
+      for (int c = 0; c < 3; c++) {
+         float old = values[k + c].load(std::memory_order_relaxed);
+         while (!values[k + c].compare_exchange_weak(old, old + light[c], std::memory_order_relaxed)) {}
+      }
+   }
+
+   glm::color at(int row, int col) const {
+      size_t k = 3 * (size_t(row) * width + col);
+      return glm::color(values[k].load(), values[k + 1].load(), values[k + 2].load());
+   }
+
+   void clear() {
+      for (size_t k = 0; k < values.size(); k++) values[k].store(0.0f, std::memory_order_relaxed);
+   }
+
+public:
+   int width;
+   int height;
+
+private:
+   std::vector<std::atomic<float>> values;
+};
+
+// The pixel of an image of splats' size that p projects to through cam,
+// false when p is behind the camera or outside the image. importance is
+// the camera's importance toward p times the cosine at the film: the
+// light arriving at the camera from p, times it, is the pixel's value.
+inline bool project(const camera& cam, const splat_buffer& splats, const glm::point3& p,
+   int& row, int& col, float& importance)
+{
+   const glm::vec3& horizontal = cam.get_horizontal();
+   const glm::vec3& vertical = cam.get_vertical();
+   glm::vec3 forward = cam.get_lower_left_corner() - cam.get_origin() + 0.5f * horizontal + 0.5f * vertical;
+   float focal = glm::length(forward);
+   forward /= focal;
+   glm::vec3 d = p - cam.get_origin();
+   float along = glm::dot(d, forward);
+   if (along <= 0) return false;
+
+   // pixel i covers u in [i, i + 1) / (w - 1), as camera samples have it
+   glm::vec3 q = cam.get_origin() + d * (focal / along) - cam.get_lower_left_corner();
+   float s = glm::dot(q, horizontal) / glm::dot(horizontal, horizontal);
+   float t = glm::dot(q, vertical) / glm::dot(vertical, vertical);
+   float x = s * (splats.width - 1);
+   float y = (splats.height - 1) - t * (splats.height - 1);
+   if (!(x >= 0 && y >= 0 && x < splats.width && y < splats.height)) return false;
+   col = int(x);
+   row = int(y);
+
+   // uniform over the pixel's area on the film: focal^2 / (area cos^3)
+   float pixel_area = glm::length(horizontal) / std::max(1, splats.width - 1) *
+      glm::length(vertical) / std::max(1, splats.height - 1);
+   float cosine = along / glm::length(d);
+   importance = focal * focal / (pixel_area * cosine * cosine * cosine);
+   return true;
+}
+
+// Traces count light paths from lights and splats, scaled by scale, the
+// light of those reaching a surface seen by cam after one or more specular
+// bounces. A scale of n adds as much as n samples per pixel would.
+template <class world_t>
+void trace_light_paths(const world_t& world, const camera& cam, const light_tree& lights, int count,
+   float scale, splat_buffer& splats, int max_depth = 10)
+{
+   if (lights.empty() || count <= 0) return;
+   const glm::point3& eye = cam.get_origin();
+   float pixel_angle = glm::length(cam.get_vertical()) / std::max(1, splats.height - 1) /
+      glm::length(cam.get_lower_left_corner() - eye + 0.5f * cam.get_horizontal() + 0.5f * cam.get_vertical());
+
+   parallel_for(0, count, 1024, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+         ray r;
+         glm::color power;
+         if (!lights.emit(r, power)) continue;
+         power *= scale / float(count);
+         bool specular = false;
+         for (int depth = 0; depth < max_depth; depth++) {
+            hit_record rec;
+            if (!world.hit(r, 0.001f, infinity, rec)) break;
+            if (rec.object) rec.object->surface_coordinates(rec);
+            glm::vec3 to_light = -glm::normalize(r.direction());
+            glm::vec3 to_eye = eye - rec.p;
+            float distance = glm::length(to_eye);
+            rec.footprint = pixel_angle * distance;
+            // seen from the camera: the camera ray arrives and the light leaves
+            ray view(eye, rec.p - eye);
+            glm::color value;
+            float pdf;
+            float cosine = glm::dot(rec.normal, to_light);
+            if (rec.mat_ptr->evaluate(view, rec, to_light, value, pdf)) {
+               int row, col;
+               float importance;
+               hit_record blocker;
+               float eye_cosine = glm::dot(rec.normal, to_eye) / distance;
+               if (specular && cosine > 0 && eye_cosine > 0 && value != glm::color(0) &&
+                  project(cam, splats, rec.p, row, col, importance) &&
+                  !world.hit(ray(rec.p, to_eye), 0.001f, 0.999f, blocker)) {
+                  // value is f times the cosine toward the light
+                  splats.add(row, col, power * (value / cosine) * (eye_cosine * importance / (distance * distance)));
+               }
+               break;
+            }
+            ray scattered;
+            glm::color attenuation;
+            if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered)) break;
+            power *= attenuation;
+            r = scattered;
+            specular = true;
+         }
+      }
+   });
+}
+
+#endif
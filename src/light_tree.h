@@ -0,0 +1,237 @@
+// light_tree.h, picks an emissive object to sample from a shading point
+//
+// The emitters of a scene (spheres and triangles with a material that
+// emits) are arranged in a binary tree over their bounds. Each node stores
+// the total power below it. A light is picked by walking down from the
+// root, choosing each child with a probability proportional to its power
+// over its squared distance to the shading point (clamped by the node's
+// size), so nearby and bright lights are sampled more often, in O(log n)
+// per pick. The probability of a given light is recomputed by walking up
+// from its leaf, which multiple importance sampling needs for the lights
+// found by bounces. Other emitters are only found by bounces. Photons and
+// light paths leave the lights by power alone (emit).
+
+#ifndef LIGHT_TREE_H_
+#define LIGHT_TREE_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "material.h"
+#include "sphere.h"
+#include "triangle.h"
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+class light_tree {
+public:
+   light_tree() {}
+   explicit light_tree(const std::vector<std::shared_ptr<hittable>>& objects);
+
+   bool empty() const { return lights.empty(); }
+   size_t size() const { return lights.size(); }
+
+   // emitter k and its power, the luminance of its emission times its area
+   const hittable* object(size_t k) const { return lights[k].object; }
+   float power(size_t k) const { return lights[k].power; }
+
+   bool contains(const hittable* object) const { return index.count(object) > 0; }
+
+   // Picks a light for shading point p with u, then a direction toward it
+   // with u1 and u2 (all in [0, 1)). Returns the density of direction,
+   // the probability of the light times its solid angle density, or 0.
+   float sample(const glm::point3& p, float u, float u1, float u2,
+      glm::vec3& direction, const hittable*& light) const {
+      if (lights.empty()) return 0.0f;
+      float pmf = 1.0f;
+      int n = 0;
+      while (nodes[n].count == 0) {
+         float left = choose_left(p, n);
+         if (u < left) {
+            u = std::min(u / left, 0.99999994f);
+            pmf *= left;
+            n = nodes[n].first;
+         }
+         else {
+            u = std::min((u - left) / (1.0f - left), 0.99999994f);
+            pmf *= 1.0f - left;
+            n = nodes[n].first + 1;
+         }
+      }
+      // within a leaf: by the importance of each light
+      const node& leaf = nodes[n];
+      float total = 0.0f;
+      for (int k = leaf.first; k < leaf.first + leaf.count; k++) total += importance(p, lights[k].box, lights[k].power);
+      int pick = leaf.first + leaf.count - 1;
+      float target = u * total;
+      for (int k = leaf.first; k < leaf.first + leaf.count; k++) {
+         float w = importance(p, lights[k].box, lights[k].power);
+         if (target < w) { pick = k; break; }
+         target -= w;
+      }
+      pmf *= total > 0 ? importance(p, lights[pick].box, lights[pick].power) / total : 1.0f / leaf.count;
+      light = lights[pick].object;
+      return pmf * light->sample_direction(p, u1, u2, direction);
+   }
+
+   // the density sample gives the direction from p to rec.p on rec.object
+   float pdf(const glm::point3& p, const hit_record& rec) const {
+      if (!rec.object || lights.empty()) return 0.0f;
+      std::unordered_map<const hittable*, int>::const_iterator it = index.find(rec.object);
+      if (it == index.end()) return 0.0f;
+      int k = it->second;
+
+      int n = leaf_of[k];
+      const node& leaf = nodes[n];
+      float total = 0.0f;
+      for (int i = leaf.first; i < leaf.first + leaf.count; i++) total += importance(p, lights[i].box, lights[i].power);
+      float pmf = total > 0 ? importance(p, lights[k].box, lights[k].power) / total : 1.0f / leaf.count;
+      for (; parent[n] >= 0; n = parent[n]) {
+         float left = choose_left(p, parent[n]);
+         pmf *= nodes[parent[n]].first == n ? left : 1.0f - left;
+      }
+      return pmf * rec.object->direction_pdf(p, rec);
+   }
+
+   // A photon leaving the lights: an emitter picked by power, a uniform
+   // point of its surface and a cosine distributed direction; both sides of
+   // triangles emit. power is the photon's flux, the light's emitted power
+   // over the probability of picking it. False if no point was found.
+   bool emit(ray& r, glm::color& power) const;
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "lights: " << lights.size() << " emitters in " << nodes.size() << " nodes" << std::endl;
+      return ss.str();
+   }
+
+private:
+   struct light {
+      const hittable* object;
+      aabb box;
+      float power; // luminance of the emission times area
+   };
+
+   struct node {
+      aabb box;
+      float power;
+      int first; // as in bvh_node
+      int count;
+   };
+
+   static float importance(const glm::point3& p, const aabb& box, float power) {
+      glm::vec3 d = box.centroid() - p;
+      glm::vec3 e = box.extent();
+      return power / std::max(glm::dot(d, d), 0.25f * glm::dot(e, e));
+   }
+
+   // probability of the left child of interior node n
+   float choose_left(const glm::point3& p, int n) const {
+      const node& left = nodes[nodes[n].first];
+      const node& right = nodes[nodes[n].first + 1];
+      float l = importance(p, left.box, left.power);
+      float r = importance(p, right.box, right.power);
+      return l + r > 0 ? l / (l + r) : 0.5f;
+   }
+
+private:
+   std::vector<light> lights; // in leaf order
+   std::vector<node> nodes;
+   std::vector<int> parent; // per node, -1 for the root
+   std::vector<int> leaf_of; // per light
+   std::unordered_map<const hittable*, int> index;
+};
+
+inline light_tree::light_tree(const std::vector<std::shared_ptr<hittable>>& objects)
+{
+   std::vector<light> found;
+   for (size_t i = 0; i < objects.size(); i++) {
+      const hittable* object = objects[i].get();
+      const material* m = 0;
+      if (const sphere* s = dynamic_cast<const sphere*>(object)) m = s->mat_ptr.get();
+      else if (const triangle* t = dynamic_cast<const triangle*>(object)) m = t->mat_ptr.get();
+      if (!m) continue;
+
+      glm::color e = m->emitted(ray(), hit_record());
+      float luminance = 0.2126f * e.r + 0.7152f * e.g + 0.0722f * e.b;
+      light l;
+      l.object = object;
+      l.power = luminance * object->area();
+      if (l.power <= 0 || !object->bounding_box(l.box)) continue;
+      found.push_back(l);
+   }
+   if (found.empty()) return;
+
+   std::vector<aabb> bounds(found.size());
+   for (size_t i = 0; i < found.size(); i++) bounds[i] = found[i].box;
+   bvh_builder builder(bounds, 1);
+   std::vector<bvh_node> tree = builder.build();
+
+   lights.resize(found.size());
+   for (size_t i = 0; i < found.size(); i++) lights[i] = found[builder.indices[i]];
+   nodes.resize(tree.size());
+   parent.assign(tree.size(), -1);
+   leaf_of.resize(lights.size());
+   // children come after their parent: sum the power bottom up
+   for (int n = (int) tree.size() - 1; n >= 0; n--) {
+      node& dst = nodes[n];
+      dst.box = tree[n].box;
+      dst.first = tree[n].first;
+      dst.count = tree[n].count;
+      dst.power = 0.0f;
+      if (dst.count > 0) {
+         for (int k = dst.first; k < dst.first + dst.count; k++) {
+            dst.power += lights[k].power;
+            leaf_of[k] = n;
+         }
+      }
+      else {
+         dst.power = nodes[dst.first].power + nodes[dst.first + 1].power;
+         parent[dst.first] = parent[dst.first + 1] = n;
+      }
+   }
+   for (size_t k = 0; k < lights.size(); k++) index[lights[k].object] = (int) k;
+}
+
+inline bool light_tree::emit(ray& r, glm::color& power) const
+{
+   if (lights.empty() || nodes[0].power <= 0) return false;
+   // down the tree by power alone
+   float u = random_float() * nodes[0].power;
+   int n = 0;
+   while (nodes[n].count == 0) {
+      float left = nodes[nodes[n].first].power;
+      if (u < left) n = nodes[n].first;
+      else {
+         u -= left;
+         n = nodes[n].first + 1;
+      }
+   }
+   int k = nodes[n].first + nodes[n].count - 1;
+   for (int i = nodes[n].first; i < nodes[n].first + nodes[n].count; i++) {
+      if (u < lights[i].power) {
+         k = i;
+         break;
+      }
+      u -= lights[i].power;
+   }
+
+   const hittable* light = lights[k].object;
+   hit_record rec;
+   if (!light->sample_surface(random_float(), random_float(), rec)) return false;
+   glm::vec3 normal = rec.normal;
+   float sides = dynamic_cast<const triangle*>(light) ? 2.0f : 1.0f;
+   if (sides > 1 && random_float() < 0.5f) normal = -normal;
+   glm::vec3 direction = normal + random_unit_vector();
+   if (near_zero(direction)) direction = normal;
+   // emitted power pi * area * radiance (per side) over the probability of the light
+   float pick = lights[k].power / nodes[0].power;
+   power = rec.mat_ptr->emitted(ray(), rec) * (pi * light->area() * sides / pick);
+   r = ray(rec.p, direction);
+   return true;
+}
+
+#endif
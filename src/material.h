@@ -1,21 +1,73 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <algorithm>
 #include <cmath>
 #include "AGLM.h"
 #include "ray.h"
 #include "hittable.h"
+#include "texture.h"
 
 class material {
 public:
   virtual bool scatter(const ray& r_in, const hit_record& rec, 
      glm::color& attenuation, ray& scattered) const = 0;
+
+  // scatter driven by a sampler (sampler.h): u holds the values of this
+  // bounce's dimensions, in [0, 1). Materials that sample nothing ignore it.
+  virtual bool scatter_sampled(const ray& r_in, const hit_record& rec,
+     glm::color& attenuation, ray& scattered, const glm::vec3& u) const
+  {
+     return scatter(r_in, rec, attenuation, scattered);
+  }
+
+  // light leaving the surface by itself toward the origin of r_in
+  virtual glm::color emitted(const ray& r_in, const hit_record& rec) const
+  {
+     return glm::color(0);
+  }
+
+  // For light sampling: value is the BSDF times the cosine for scattering
+  // r_in into direction, pdf the solid angle density with which scatter
+  // picks that direction. Returns false for materials that scatter into
+  // single directions (mirrors, glass) or do not scatter; lights are not
+  // sampled at those.
+  virtual bool evaluate(const ray& r_in, const hit_record& rec, const glm::vec3& direction,
+     glm::color& value, float& pdf) const
+  {
+     return false;
+  }
+
+  // the color scattering multiplies light by at rec, for denoising; 1 for
+  // materials without one
+  virtual glm::color albedo_at(const hit_record& rec) const
+  {
+     return glm::color(1);
+  }
+
   virtual ~material() {}
 };
 
+// direction uniform on the unit sphere from two values in [0, 1)
+inline glm::vec3 sample_unit_vector(float u1, float u2)
+{
+   float z = 1.0f - 2.0f * u1;
+   float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+   float phi = 2.0f * pi * u2;
+   return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// point uniform in the unit ball from three values in [0, 1)
+inline glm::vec3 sample_unit_sphere(const glm::vec3& u)
+{
+   return sample_unit_vector(u.x, u.y) * std::cbrt(u.z);
+}
+
 class lambertian : public material {
 public:
   lambertian(const glm::color& a) : albedo(a) {}
+  // albedo looked up in t at the hit's surface coordinates
+  lambertian(std::shared_ptr<texture> t) : albedo(1), albedo_map(t) {}
 
   virtual bool scatter(const ray& r_in, const hit_record& rec, 
      glm::color& attenuation, ray& scattered) const override 
@@ -28,7 +80,7 @@ public:
       vec3 scatter_direction = rec.p + rec.normal + random_unit_vector();
       if (near_zero(scatter_direction)) scatter_direction = rec.normal;
       scattered = ray(rec.p, scatter_direction - rec.p);
-      attenuation = albedo;
+      attenuation = albedo_at(rec);
       return true; // bounce
 
       /* // lambertian version 1
@@ -41,8 +93,37 @@ public:
       */
   }
 
+  // the same distribution as scatter: normal plus a uniform unit vector
+  virtual bool scatter_sampled(const ray& r_in, const hit_record& rec,
+     glm::color& attenuation, ray& scattered, const glm::vec3& u) const override
+  {
+      glm::vec3 scatter_direction = rec.normal + sample_unit_vector(u.x, u.y);
+      if (near_zero(scatter_direction)) scatter_direction = rec.normal;
+      scattered = ray(rec.p, scatter_direction);
+      attenuation = albedo_at(rec);
+      return true;
+  }
+
+  // normal plus a unit vector is cosine distributed: f * cos = albedo * cos / pi
+  virtual bool evaluate(const ray& r_in, const hit_record& rec, const glm::vec3& direction,
+     glm::color& value, float& pdf) const override
+  {
+      float cosine = glm::dot(rec.normal, glm::normalize(direction));
+      pdf = cosine > 0 ? cosine / pi : 0.0f;
+      value = albedo_at(rec) * pdf;
+      return true;
+  }
+
+  // filtered over the ray's footprint on the surface
+  virtual glm::color albedo_at(const hit_record& rec) const override
+  {
+      if (!albedo_map) return albedo;
+      return albedo * albedo_map->value(rec.u, rec.v, rec.footprint * rec.uv_density);
+  }
+
 public:
   glm::color albedo;
+  std::shared_ptr<texture> albedo_map;
 };
 
 class phong : public material {
@@ -124,6 +205,41 @@ public:
        return (dot(scattered.direction(), rec.normal) > 0);
    }
 
+   virtual bool scatter_sampled(const ray& r_in, const hit_record& rec,
+      glm::color& attenuation, ray& scattered, const glm::vec3& u) const override
+   {
+       glm::vec3 reflected = reflect(normalize(r_in.direction()), rec.normal);
+       scattered = ray(rec.p, reflected + fuzz * sample_unit_sphere(u));
+       attenuation = albedo;
+       return (dot(scattered.direction(), rec.normal) > 0);
+   }
+
+   // scatter picks reflected + fuzz * (a point in the unit ball): the
+   // density of a direction is the ball's volume along it, seen from rec.p,
+   // and every direction above the surface is weighted by albedo
+   virtual bool evaluate(const ray& r_in, const hit_record& rec, const glm::vec3& direction,
+      glm::color& value, float& pdf) const override
+   {
+       if (fuzz <= 0) return false;
+       glm::vec3 w = glm::normalize(direction);
+       glm::vec3 reflected = reflect(normalize(r_in.direction()), rec.normal);
+       float c = glm::dot(w, reflected);
+       float disc = c * c - glm::dot(reflected, reflected) + fuzz * fuzz;
+       pdf = 0;
+       if (disc > 0 && glm::dot(w, rec.normal) > 0) {
+          float t_far = c + std::sqrt(disc);
+          float t_near = std::max(0.0f, c - std::sqrt(disc));
+          if (t_far > 0) pdf = (t_far * t_far * t_far - t_near * t_near * t_near) / (4.0f * pi * fuzz * fuzz * fuzz);
+       }
+       value = albedo * pdf;
+       return true;
+   }
+
+   virtual glm::color albedo_at(const hit_record& rec) const override
+   {
+       return albedo;
+   }
+
 public:
    glm::color albedo;
    float fuzz;
@@ -153,5 +269,35 @@ public:
 };
 
 
+// Emits emit from both sides and scatters nothing; found by bounces and,
+// with a light_tree, by light sampling
+class diffuse_light : public material {
+public:
+  diffuse_light(const glm::color& e) : emit(e) {}
+
+  virtual bool scatter(const ray& r_in, const hit_record& rec,
+     glm::color& attenuation, ray& scattered) const override
+  {
+     attenuation = glm::color(0);
+     return false;
+  }
+
+  virtual glm::color emitted(const ray& r_in, const hit_record& rec) const override
+  {
+     return emit;
+  }
+
+public:
+  glm::color emit;
+};
+
+// Whether a material in a scene arena (scene_arena.h) owns anything outside
+// it: only a texture with a control block does
+inline bool owns_outside_arena(const lambertian& m) { return m.albedo_map.use_count() > 0; }
+inline bool owns_outside_arena(const phong&) { return false; }
+inline bool owns_outside_arena(const metal&) { return false; }
+inline bool owns_outside_arena(const dielectric&) { return false; }
+inline bool owns_outside_arena(const diffuse_light&) { return false; }
+
 #endif
 
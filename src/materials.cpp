@@ -10,36 +10,22 @@
 #include "camera.h"
 #include "material.h"
 #include "hittable_list.h"
+#include "accelerators.h"
+#include "scene_cache.h"
+#include "render.h"
+#include "denoiser.h"
+#include "aov.h"
+#include "sequence.h"
+#include "frame_pipeline.h"
+#include "texture_cache.h"
+#include <chrono>
+#include <fstream>
 
 using namespace glm;
 using namespace agl;
 using namespace std;
 
 
-color ray_color(const ray& r, const hittable_list& world, int depth)
-{
-   hit_record rec;
-   if (depth <= 0)
-   {
-      return color(0);
-   }
-
-   if (world.hit(r, 0.001f, infinity, rec))
-   {
-      ray scattered;
-      color attenuation;
-      if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-      {
-         color recurseColor = ray_color(scattered, world, depth - 1);
-         return attenuation * recurseColor;
-      }
-      return attenuation;
-   }
-   vec3 unit_direction = normalize(r.direction());
-   auto t = 0.5f * (unit_direction.y + 1.0f);
-   return (1.0f - t) * color(1, 1, 1) + t * color(0.5f, 0.7f, 1.0f);
-}
-
 color normalize_color(const color& c, int samples_per_pixel)
 {
    // todo: implement me!
@@ -62,8 +48,15 @@ void ray_trace(ppm_image& image)
    int height = image.height();
    int width = image.width();
    float aspect = width / float(height);
-   int samples_per_pixel = 10; // higher => more anti-aliasing
-   int max_depth = 10; // higher => less shadow acne
+   render_settings settings;
+   settings.samples_per_pixel = 10; // higher => more anti-aliasing
+   settings.max_depth = 10; // higher => less shadow acne
+   settings.sort_secondary_rays = true; // reorder bounce rays for cache locality
+   settings.cull_primary_rays = false; // camera rays test only the objects in their tile; pays off for many samples per camera
+   settings.rasterize_primary = false; // first hits from a visibility buffer of the tile's objects
+   settings.sampler = sampler_type::sobol; // or independent, blue_noise
+   settings.caustic_photons = 0; // e.g. 200000 photons per pass for caustics of emissive objects through glass
+   settings.light_paths = 0; // e.g. 200000 paths per pass from emissive objects, for caustics seen directly
 
    // Camera
    vec3 camera_pos(0, 0, 6);
@@ -73,34 +66,166 @@ void ray_trace(ppm_image& image)
    camera cam(camera_pos, viewport_height, aspect, focal_length);
 
    // World
-   shared_ptr<material> gray = make_shared<lambertian>(color(0.5f));
-   shared_ptr<material> matteGreen = make_shared<lambertian>(color(0, 0.5f, 0));
-   shared_ptr<material> metalRed = make_shared<metal>(color(1, 0, 0), 0.3f);
-   shared_ptr<material> glass = make_shared<dielectric>(1.5f);
-   shared_ptr<material> phongDefault = make_shared<phong>(camera_pos);
+   hittable_list world; // primitives and materials are allocated in its arena
+   shared_ptr<material> gray = world.make<lambertian>(color(0.5f));
+   shared_ptr<material> matteGreen = world.make<lambertian>(color(0, 0.5f, 0));
+   shared_ptr<material> metalRed = world.make<metal>(color(1, 0, 0), 0.3f);
+   shared_ptr<material> glass = world.make<dielectric>(1.5f);
+   shared_ptr<material> phongDefault = world.make<phong>(camera_pos);
+
+   // textures are read tile by tile from converted files, under a memory budget
+   shared_ptr<texture_cache> textures = make_shared<texture_cache>(size_t(2) << 30);
+   string ground_texture_path = ""; // e.g. "../checker.png", an albedo image for the ground
+   if (!ground_texture_path.empty())
+   {
+      string tiled_path = ground_texture_path + ".tex"; // converted on first use
+      if (ifstream(tiled_path.c_str()) || texture_cache::convert(ground_texture_path, tiled_path))
+      {
+         gray = make_shared<lambertian>(make_shared<image_texture>(textures, textures->open(tiled_path)));
+      }
+   }
    
-   hittable_list world;
-   world.add(make_shared<sphere>(point3(-2.25, 0, -1), 0.5f, phongDefault));
-   world.add(make_shared<sphere>(point3(-0.75, 0, -1), 0.5f, glass));
-   world.add(make_shared<sphere>(point3(2.25, 0, -1), 0.5f, metalRed));
-   world.add(make_shared<sphere>(point3(0.75, 0, -1), 0.5f, matteGreen));
-   world.add(make_shared<sphere>(point3(0, -100.5, -1), 100, gray));
+   world.add(world.make<sphere>(point3(-2.25, 0, -1), 0.5f, phongDefault));
+   world.add(world.make<sphere>(point3(-0.75, 0, -1), 0.5f, glass));
+   world.add(world.make<sphere>(point3(2.25, 0, -1), 0.5f, metalRed));
+   world.add(world.make<sphere>(point3(0.75, 0, -1), 0.5f, matteGreen));
+   world.add(world.make<sphere>(point3(0, -100.5, -1), 100, gray));
    
-   // Ray trace
+   // Acceleration structure and ray trace
+   accelerator_type accel_type = accelerator_type::automatic; // or brute_force, grid, bvh, bvh4, bvh8
+   string scene_cache_path = ""; // e.g. "../materials.scene" to reuse the built scene across runs
+   accelerator_report report;
+   shared_ptr<accelerator> accel;
+   // the scene is described by this file; the cache is rebuilt when it changes
+   if (!scene_cache_path.empty()) accel = open_scene_cache(world, scene_cache_path, scene_source_key(__FILE__), report);
+   if (!accel) accel = build_accelerator(world, accel_type, report);
+   cout << report.str();
+
+   framebuffer radiance(width, height);
+   auto start = chrono::steady_clock::now();
+   tile_culler culler(cam, width, height, settings.tile_size);
+   if (settings.cull_primary_rays)
+   {
+      culler.cull(world.objects, settings.samples_per_pixel);
+      cout << culler.str();
+   }
+   light_tree lights(world.objects); // emitters sampled at every diffuse and glossy bounce
+   cout << lights.str();
+
+   string environment_path = ""; // e.g. "../sky.hdr", a lat-long HDR image replacing the sky gradient
+   shared_ptr<environment_map> environment;
+   int environment_width, environment_height;
+   vector<color> environment_pixels;
+   if (!environment_path.empty() &&
+      load_hdr(environment_path, environment_width, environment_height, environment_pixels))
+   {
+      environment = make_shared<environment_map>(environment_width, environment_height, environment_pixels);
+      cout << environment->str();
+   }
+   bool cache_irradiance = false; // interpolate indirect light on matte surfaces between sparse records
+   shared_ptr<irradiance_cache> irradiance;
+   if (cache_irradiance) irradiance = make_shared<irradiance_cache>(world.objects);
+   bool guide_paths = false; // learn where indirect light comes from over passes and sample it
+   shared_ptr<guiding_field> guide;
+   if (guide_paths) guide = make_shared<guiding_field>(world.objects);
+   bool denoise_image = false; // smooth the noise of few samples, guided by what the camera rays hit first
+   bool write_outputs = false; // also write normal, depth, albedo, id and sample count images of the same rays
+   bool need_features = denoise_image || write_outputs;
+   feature_buffer features(need_features ? width : 0, need_features ? height : 0);
+   string hit_cache_path = ""; // e.g. "../materials.hits", camera ray hits reused while only materials change
+   shared_ptr<hit_cache> primary_hits;
+   if (!hit_cache_path.empty())
+   {
+      primary_hits = make_shared<hit_cache>(world.objects);
+      primary_hits->load(hit_cache_path);
+   }
+   bool edit_scene = false; // then move the green sphere and trace again only the tiles it changes
+   tile_dependencies dependencies(world.objects);
+   render_inputs inputs;
+   inputs.culler = settings.cull_primary_rays ? &culler : 0;
+   inputs.lights = &lights;
+   inputs.environment = environment.get();
+   inputs.irradiance = irradiance.get();
+   inputs.guide = guide.get();
+   inputs.features = need_features ? &features : 0;
+   inputs.primary_hits = primary_hits.get();
+   inputs.dependencies = edit_scene ? &dependencies : 0;
+   render(*accel, cam, settings, radiance, inputs);
+   cout << "trace: " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+   if (primary_hits)
+   {
+      if (!primary_hits->reused()) primary_hits->save(hit_cache_path);
+      cout << primary_hits->str();
+   }
+   if (edit_scene)
+   {
+      auto edit_start = chrono::steady_clock::now();
+      scene_snapshot before(world.objects);
+      dynamic_cast<sphere*>(world.objects[3].get())->center += vec3(0, 0.25f, 0);
+      accel = build_accelerator(world, accel_type, report);
+      if (settings.cull_primary_rays) culler.cull(world.objects, settings.samples_per_pixel);
+      dependencies.invalidate(scene_snapshot(world.objects).changes_since(before));
+      render(*accel, cam, settings, radiance, inputs);
+      cout << "edit: " << chrono::duration<double>(chrono::steady_clock::now() - edit_start).count() << " s" << endl;
+      cout << dependencies.str();
+   }
+   int sequence_frames = 0; // e.g. 48, then fly along a camera path, each frame reusing the last one
+   if (sequence_frames > 0)
+   {
+      camera_path path;
+      float vfov = 2 * degrees(atan(0.5f * viewport_height / focal_length)); // that of cam
+      path.add(camera_keyframe{ 0, camera_pos, point3(0, 0, -1), vec3(0, 1, 0), vfov });
+      path.add(camera_keyframe{ 1, point3(1.5f, 0.75f, 5), point3(0.5f, 0, -1), vec3(0, 1, 0), vfov });
+      path.add(camera_keyframe{ 2, point3(-1.5f, 0.5f, 4.5f), point3(-0.5f, 0, -1), vec3(0, 1, 0), vfov });
+      render_settings frame_settings = settings;
+      frame_settings.samples_per_pixel = 2; // every frame adds about twice as many where they are needed
+      sequence_renderer sequence(width, height, frame_settings);
+      // frames are tonemapped, encoded and written while the next ones render
+      int frames_in_flight = 2;
+      frame_pipeline output(png_encoder([](const color& c) { return normalize_color(c, 1); }), frames_in_flight);
+      for (int f = 0; f < sequence_frames; f++)
+      {
+         auto frame_start = chrono::steady_clock::now();
+         float time = path.start() + (path.end() - path.start()) * f / std::max(1, sequence_frames - 1);
+         camera frame_cam = path.get_camera(time, aspect);
+         tile_culler frame_culler(frame_cam, width, height, settings.tile_size);
+         if (settings.cull_primary_rays) frame_culler.cull(world.objects, frame_settings.samples_per_pixel);
+         sequence.frame(*accel, frame_cam, settings.cull_primary_rays ? &frame_culler : 0, &lights,
+            environment.get());
+         char filename[64];
+         snprintf(filename, sizeof(filename), "../materials_%03d.png", f);
+         output.submit(sequence.image(), filename);
+         cout << "frame " << f << ": " << chrono::duration<double>(chrono::steady_clock::now() - frame_start).count()
+            << " s, " << sequence.str();
+      }
+      output.finish();
+      cout << output.str();
+   }
+   if (write_outputs)
+   {
+      aov_type outputs[] = { aov_type::normal, aov_type::depth, aov_type::albedo, aov_type::object_id,
+         aov_type::material_id, aov_type::sample_count };
+      for (aov_type output : outputs)
+      {
+         write_aov(string("../materials_") + aov_name(output) + ".png", output, radiance, features);
+      }
+      write_aov("../materials_beauty.pfm", aov_type::beauty, radiance, features); // linear, before denoising
+   }
+   if (denoise_image)
+   {
+      auto denoise_start = chrono::steady_clock::now();
+      denoise(radiance, features, settings.samples_per_pixel);
+      cout << "denoise: " << chrono::duration<double>(chrono::steady_clock::now() - denoise_start).count() << " s" << endl;
+   }
+   cout << textures->str();
+   if (irradiance) cout << irradiance->str();
+   if (guide) cout << guide->str();
+
    for (int j = 0; j < height; j++)
    {
       for (int i = 0; i < width; i++)
       {
-         color c(0, 0, 0);
-         for (int s = 0; s < samples_per_pixel; s++) // antialias
-         {
-            float u = float(i + random_float()) / (width - 1);
-            float v = float(height - j - 1 - random_float()) / (height - 1);
-
-            ray r = cam.get_ray(u, v);
-            c += ray_color(r, world, max_depth);
-         }
-         c = normalize_color(c, samples_per_pixel);
+         color c = normalize_color(radiance.at(j, i), settings.samples_per_pixel);
          image.set_vec3(j, i, c);
       }
    }
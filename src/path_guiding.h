@@ -0,0 +1,308 @@
+// path_guiding.h, bounce directions learned from the light paths carry
+//
+// A lambertian surface scatters into a cosine lobe around its normal, but
+// in a room lit through a doorway most of that lobe sees dark walls. The
+// guiding field learns where incident light comes from, per region of
+// space, and bounces sample it (practical path guiding, Mueller et al.
+// 2017). Space is a binary tree, split in half along alternating axes; each
+// leaf holds a quadtree over the sphere of directions, mapped to the unit
+// square by (cos theta, phi), which preserves areas. Quadtree nodes store
+// the light recorded in each quarter, times the cosine at the surface that
+// received it, and are split where light concentrates.
+// Rendering runs in passes (render.h): during a pass, paths sample the
+// quadtrees learned so far and record what they find into a second set,
+// with atomic adds; after it, refine makes the recorded set the sampled
+// one and splits busy regions and bright directions for the next pass.
+
+#ifndef PATH_GUIDING_H_
+#define PATH_GUIDING_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "hittable.h"
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+// Light arriving from the directions of the unit square, a quadtree
+class direction_tree {
+public:
+   direction_tree() : nodes(1) {}
+
+   float total() const { return nodes[0].total(); }
+   int size() const { return (int) nodes.size(); }
+
+   // adds value at q in the unit square; thread safe
+   void record(glm::vec2 q, float value) {
+      int n = 0;
+      for (;;) {
+         int c = quadrant(q);
+         add(nodes[n].sum[c], value);
+         if (!nodes[n].child[c]) return;
+         n = nodes[n].child[c];
+      }
+   }
+
+   // a point of the unit square with density proportional to the light
+   // recorded, from u1 and u2 in [0, 1); pdf is its density on the square
+   glm::vec2 sample(float u1, float u2, float& pdf) const {
+      glm::vec2 origin(0), u(u1, u2);
+      float scale = 1.0f;
+      pdf = 1.0f;
+      int n = 0;
+      for (;;) {
+         const node& current = nodes[n];
+         float total = current.total();
+         if (total <= 0) break;
+         // x half by its share, then y half within it
+         float left = (current.sum[0] + current.sum[2]) / total;
+         int cx = u.x < left ? 0 : 1;
+         u.x = cx ? (u.x - left) / (1.0f - left) : u.x / left;
+         float bottom = current.sum[cx] / (current.sum[cx] + current.sum[cx + 2]);
+         int cy = u.y < bottom ? 0 : 1;
+         u.y = cy ? (u.y - bottom) / (1.0f - bottom) : u.y / bottom;
+         u = glm::min(u, glm::vec2(0.99999994f));
+         int c = cx | (cy << 1);
+         pdf *= 4.0f * current.sum[c] / total;
+         scale *= 0.5f;
+         origin += scale * glm::vec2(float(cx), float(cy));
+         if (!current.child[c]) break;
+         n = current.child[c];
+      }
+      return origin + scale * u;
+   }
+
+   // density of sample at q
+   float pdf(glm::vec2 q) const {
+      float pdf = 1.0f;
+      int n = 0;
+      for (;;) {
+         const node& current = nodes[n];
+         float total = current.total();
+         if (total <= 0) return pdf;
+         int c = quadrant(q);
+         pdf *= 4.0f * current.sum[c] / total;
+         if (!current.child[c] || pdf <= 0) return pdf;
+         n = current.child[c];
+      }
+   }
+
+   // An empty tree whose leaves hold about fraction of the light of
+   // recorded or less, at most max_depth levels deep
+   void refine(const direction_tree& recorded, float fraction, int max_depth) {
+      nodes.assign(1, node());
+      float total = recorded.total();
+      if (total > 0) build(recorded, 0, 0, total, 1, fraction * total, max_depth);
+   }
+
+private:
+   struct node {
+      std::atomic<float> sum[4];
+      int child[4]; // 0 for none: the quarter is uniform
+
+      node() {
+         for (int c = 0; c < 4; c++) {
+            sum[c] = 0.0f;
+            child[c] = 0;
+         }
+      }
+      node(const node& other) {
+         for (int c = 0; c < 4; c++) {
+            sum[c] = other.sum[c].load(std::memory_order_relaxed);
+            child[c] = other.child[c];
+         }
+      }
+      node& operator=(const node& other) {
+         for (int c = 0; c < 4; c++) {
+            sum[c] = other.sum[c].load(std::memory_order_relaxed);
+            child[c] = other.child[c];
+         }
+         return *this;
+      }
+      float total() const { return sum[0] + sum[1] + sum[2] + sum[3]; }
+   };
+
+   // the quarter of the unit square holding q, and q within it
+   static int quadrant(glm::vec2& q) {
+      int cx = q.x >= 0.5f, cy = q.y >= 0.5f;
+      q = glm::clamp(2.0f * q - glm::vec2(float(cx), float(cy)), glm::vec2(0), glm::vec2(0.99999994f));
+      return cx | (cy << 1);
+   }
+
+   static void add(std::atomic<float>& sum, float value) {
+      float old = sum.load(std::memory_order_relaxed);
+      while (!sum.compare_exchange_weak(old, old + value, std::memory_order_relaxed)) {}
+   }
+
+   // node to mirrors node from of recorded, or a part of it of uniform
+   // light (from -1); quarters above limit get children
+   void build(const direction_tree& recorded, int from, int to, float light, int depth, float limit, int max_depth) {
+      for (int c = 0; c < 4; c++) {
+         float quarter = from >= 0 ? recorded.nodes[from].sum[c].load() : 0.25f * light;
+         if (quarter <= limit || depth >= max_depth) continue;
+         int child = (int) nodes.size();
+         nodes.push_back(node());
+         nodes[to].child[c] = child;
+         int below = from >= 0 ? recorded.nodes[from].child[c] : 0;
+         build(recorded, below ? below : -1, child, quarter, depth + 1, limit, max_depth);
+      }
+   }
+
+private:
+   std::vector<node> nodes;
+};
+
+class guiding_field {
+public:
+   // The field covers the bounds of objects; points outside are not guided
+   explicit guiding_field(const std::vector<std::shared_ptr<hittable>>& objects);
+
+   // Direction distribution learned at p, null if none yet
+   const direction_tree* find(const glm::point3& p) const {
+      int n = leaf(p);
+      if (n < 0) return 0;
+      const direction_tree& sampled = regions[nodes[n].region]->sampled;
+      return sampled.total() > 0 ? &sampled : 0;
+   }
+
+   // a direction drawn from tree with u1, u2 in [0, 1), and its solid angle density
+   static glm::vec3 sample(const direction_tree& tree, float u1, float u2, float& pdf) {
+      glm::vec2 q = tree.sample(u1, u2, pdf);
+      pdf /= 4.0f * pi;
+      float z = 2.0f * q.x - 1.0f;
+      float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+      float phi = 2.0f * pi * q.y;
+      return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+   }
+
+   static float pdf(const direction_tree& tree, const glm::vec3& direction) {
+      return tree.pdf(to_square(glm::normalize(direction))) / (4.0f * pi);
+   }
+
+   // Records light of luminance value, estimated along direction from p
+   // with a sample of density pdf; thread safe
+   void record(const glm::point3& p, const glm::vec3& direction, float value, float pdf) {
+      int n = leaf(p);
+      if (n < 0 || !(value >= 0) || pdf <= 0) return;
+      region& r = *regions[nodes[n].region];
+      r.samples++;
+      if (value > 0) r.recorded.record(to_square(glm::normalize(direction)), value / pdf);
+   }
+
+   // After a pass of pass_samples samples per pixel: samples the light just
+   // recorded from now on, and splits regions that recorded many paths
+   void refine(int pass_samples);
+
+   int passes() const { return refinements; }
+
+   std::string str() const {
+      std::ostringstream ss;
+      size_t directions = 0;
+      for (size_t k = 0; k < regions.size(); k++) directions += regions[k]->sampled.size();
+      ss << "path guiding: " << regions.size() << " regions, " << directions << " direction nodes after "
+         << refinements << " passes" << std::endl;
+      return ss.str();
+   }
+
+private:
+   struct region {
+      direction_tree sampled;
+      direction_tree recorded;
+      std::atomic<int> samples;
+      region() : samples(0) {}
+   };
+
+   struct node {
+      int child; // first of two, 0 for a leaf
+      int axis;
+      int region;
+   };
+
+   static glm::vec2 to_square(const glm::vec3& w) {
+      float phi = std::atan2(w.y, w.x);
+      if (phi < 0) phi += 2.0f * pi;
+      return glm::clamp(glm::vec2(0.5f * (w.z + 1.0f), phi / (2.0f * pi)), glm::vec2(0), glm::vec2(0.99999994f));
+   }
+
+   // the leaf of the spatial tree holding p, -1 outside the field
+   int leaf(const glm::point3& p) const {
+      glm::vec3 local = (p - origin) / side;
+      if (local.x < 0 || local.y < 0 || local.z < 0 || local.x >= 1 || local.y >= 1 || local.z >= 1) return -1;
+      int n = 0;
+      while (nodes[n].child) {
+         int axis = nodes[n].axis;
+         local[axis] *= 2.0f;
+         int c = local[axis] >= 1.0f;
+         local[axis] -= float(c);
+         n = nodes[n].child + c;
+      }
+      return n;
+   }
+
+private:
+   glm::point3 origin; // the field is the cube [origin, origin + side]
+   float side;
+   std::vector<node> nodes;
+   std::vector<std::unique_ptr<region>> regions;
+   int refinements = 0;
+};
+
+inline guiding_field::guiding_field(const std::vector<std::shared_ptr<hittable>>& objects)
+{
+   aabb bounds;
+   for (size_t i = 0; i < objects.size(); i++) {
+      aabb box;
+      if (objects[i]->bounding_box(box)) bounds.grow(box);
+   }
+   if (bounds.empty()) bounds = aabb(glm::point3(-1), glm::point3(1));
+   glm::vec3 extent = bounds.extent();
+   side = 1.01f * std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-3f));
+   origin = bounds.centroid() - glm::vec3(0.5f * side);
+   nodes.push_back(node{ 0, 0, 0 });
+   regions.emplace_back(new region());
+}
+
+// Mueller et al.: a region is halved while it records more than
+// c * sqrt(2^k) paths in pass k, with 2^k samples per pixel, each half
+// counting half of them; halves start from copies of its directions.
+// Quarters of the sampled quadtrees holding more than 1% of the light are
+// split, up to 20 levels.
+inline void guiding_field::refine(int pass_samples)
+{
+   const float split_paths = 4000.0f;
+   const float fraction = 0.01f;
+   const int max_depth = 20;
+   const size_t max_nodes = size_t(1) << 20;
+   float threshold = split_paths * std::sqrt(float(std::max(1, pass_samples)));
+
+   std::vector<std::pair<int, int>> leaves; // node, paths recorded
+   for (size_t n = 0; n < nodes.size(); n++) {
+      if (nodes[n].child) continue;
+      region& r = *regions[nodes[n].region];
+      r.sampled = r.recorded;
+      r.recorded.refine(r.sampled, fraction, max_depth);
+      leaves.push_back(std::make_pair(int(n), r.samples.exchange(0)));
+   }
+   while (!leaves.empty()) {
+      int n = leaves.back().first, paths = leaves.back().second;
+      leaves.pop_back();
+      if (paths <= threshold || nodes.size() >= max_nodes) continue;
+      // n splits along its axis, its halves along the next one
+      const region& r = *regions[nodes[n].region];
+      int child = (int) nodes.size();
+      int axis = (nodes[n].axis + 1) % 3;
+      nodes.push_back(node{ 0, axis, nodes[n].region });
+      nodes.push_back(node{ 0, axis, (int) regions.size() });
+      regions.emplace_back(new region());
+      regions.back()->sampled = r.sampled;
+      regions.back()->recorded = r.recorded;
+      nodes[n].child = child;
+      leaves.push_back(std::make_pair(child, paths / 2));
+      leaves.push_back(std::make_pair(child + 1, paths / 2));
+   }
+   refinements++;
+}
+
+#endif
@@ -0,0 +1,206 @@
+// photon_map.h, caustics by photon tracing from the lights
+//
+// Light that reaches a diffuse surface through glass or a mirror (light,
+// one or more specular bounces, diffuse surface) is hard to find from the
+// camera: a diffuse bounce has to happen to pass through the glass and hit
+// the light, which is small. Instead, photons are traced from the emitters
+// of a light_tree, and those reaching a diffuse or glossy surface after at
+// least one specular bounce are stored where they land. Camera paths then
+// estimate this light at their diffuse vertices from the density of nearby
+// photons, and no longer count emitters they reach through specular
+// bounces after a diffuse one (render.h).
+// Photons are traced and hashed into a uniform grid in parallel. Each
+// render pass traces a new set with a smaller radius (progressive photon
+// mapping, Knaus and Zwicker 2011): averaged over passes, the blur of the
+// estimate vanishes while its noise stays bounded.
+
+#ifndef PHOTON_MAP_H_
+#define PHOTON_MAP_H_
+
+#include "AGLM.h"
+#include "hittable.h"
+#include "light_tree.h"
+#include "material.h"
+#include "thread_pool.h"
+#include "triangle.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <vector>
+
+struct photon {
+   glm::point3 position;
+   glm::vec3 direction; // unit, the way the photon traveled
+   glm::color power;
+};
+
+class photon_map {
+public:
+   photon_map() {}
+
+   // Replaces the photons with count photons emitted from lights, stored
+   // for gathering within radius
+   template <class world_t>
+   void trace(const world_t& world, const light_tree& lights, int count, float radius, int max_depth = 10);
+
+   // Replaces the photons with given ones (for tests)
+   void build(const std::vector<photon>& stored, float radius);
+
+   bool empty() const { return photons.empty(); }
+   float radius() const { return gather_radius; }
+
+   // calls f for every photon within radius of p
+   template <class F>
+   void visit(const glm::point3& p, F f) const;
+
+   // Light of the photons around rec.p scattered toward the origin of r_in:
+   // the material's BSDF times the photons' power over the gather disc
+   glm::color gather(const ray& r_in, const hit_record& rec) const {
+      if (photons.empty()) return glm::color(0);
+      glm::color sum(0);
+      const material& m = *rec.mat_ptr;
+      visit(rec.p, [&](const photon& ph) {
+         float cosine = -glm::dot(ph.direction, rec.normal);
+         if (cosine <= 0) return; // from behind the surface
+         glm::color value;
+         float pdf;
+         if (m.evaluate(r_in, rec, -ph.direction, value, pdf)) sum += value * ph.power / cosine;
+      });
+      return sum / (pi * gather_radius * gather_radius);
+   }
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "caustics: " << photons.size() << " of " << emitted << " photons stored, radius "
+         << gather_radius << std::endl;
+      return ss.str();
+   }
+
+private:
+   uint32_t bucket(const glm::ivec3& cell) const {
+      uint32_t h = uint32_t(cell.x) * 73856093u ^ uint32_t(cell.y) * 19349663u ^ uint32_t(cell.z) * 83492791u;
+      return h & mask;
+   }
+
+   glm::ivec3 cell_of(const glm::point3& p) const {
+      return glm::ivec3(glm::floor(p / cell_size));
+   }
+
+private:
+   std::vector<photon> photons; // sorted by bucket
+   std::vector<int> start; // first photon of each bucket, and the end
+   uint32_t mask = 0; // buckets - 1, a power of two minus one
+   float gather_radius = 0.0f;
+   float cell_size = 1.0f; // twice the radius: a query touches at most 2 x 2 x 2 cells
+   int emitted = 0;
+};
+
+template <class F>
+void photon_map::visit(const glm::point3& p, F f) const
+{
+   if (photons.empty()) return;
+   float r_sqr = gather_radius * gather_radius;
+   glm::ivec3 lo = cell_of(p - glm::vec3(gather_radius));
+   glm::ivec3 hi = cell_of(p + glm::vec3(gather_radius));
+   // distinct cells may share a bucket: visit each bucket once, the
+   // distance test drops the photons of other cells. Rounding can make
+   // the range three cells wide.
+   uint32_t visited[27];
+   int num_visited = 0;
+   for (int z = lo.z; z <= hi.z; z++) {
+      for (int y = lo.y; y <= hi.y; y++) {
+         for (int x = lo.x; x <= hi.x; x++) {
+            uint32_t b = bucket(glm::ivec3(x, y, z));
+            if (std::find(visited, visited + num_visited, b) != visited + num_visited) continue;
+            visited[num_visited++] = b;
+            for (int k = start[b]; k < start[b + 1]; k++) {
+               glm::vec3 d = photons[k].position - p;
+               if (glm::dot(d, d) <= r_sqr) f(photons[k]);
+            }
+         }
+      }
+   }
+}
+
+// A counting sort by bucket: counts and slots are taken with atomics
+inline void photon_map::build(const std::vector<photon>& stored, float radius)
+{
+   gather_radius = radius;
+   cell_size = 2.0f * radius;
+   photons.clear();
+   start.clear();
+   if (stored.empty()) return;
+
+   int n = (int) stored.size();
+   size_t buckets = 1;
+   while (buckets < 2 * stored.size()) buckets *= 2;
+   mask = uint32_t(buckets - 1);
+   start.assign(buckets + 1, 0);
+   std::vector<uint32_t> keys(n);
+   std::vector<std::atomic<int>> counts(buckets);
+   for (size_t b = 0; b < buckets; b++) counts[b] = 0;
+   parallel_for(0, n, 4096, [&](int first, int last) {
+      for (int i = first; i < last; i++) {
+         keys[i] = bucket(cell_of(stored[i].position));
+         counts[keys[i]]++;
+      }
+   });
+   for (size_t b = 0; b < buckets; b++) start[b + 1] = start[b] + counts[b];
+   for (size_t b = 0; b < buckets; b++) counts[b] = start[b];
+   photons.resize(n);
+   parallel_for(0, n, 4096, [&](int first, int last) {
+      for (int i = first; i < last; i++) photons[counts[keys[i]]++] = stored[i];
+   });
+}
+
+// Photons leave the lights as light_tree::emit has them. A photon is
+// stored at the first diffuse or glossy surface it reaches, if it went
+// through a specular bounce first, and dropped otherwise.
+template <class world_t>
+void photon_map::trace(const world_t& world, const light_tree& lights, int count, float radius, int max_depth)
+{
+   emitted = count;
+   if (lights.empty() || count <= 0) {
+      build(std::vector<photon>(), radius);
+      return;
+   }
+
+   const int grain = 1024;
+   std::vector<std::vector<photon>> found((count + grain - 1) / grain);
+   parallel_for(0, count, grain, [&](int first, int last) {
+      std::vector<photon>& out = found[first / grain];
+      for (int i = first; i < last; i++) {
+         ray r;
+         glm::color power;
+         if (!lights.emit(r, power)) continue;
+         power /= float(count);
+         bool specular = false;
+         for (int depth = 0; depth < max_depth; depth++) {
+            hit_record hit;
+            if (!world.hit(r, 0.001f, infinity, hit)) break;
+            glm::color value;
+            float pdf;
+            if (hit.mat_ptr->evaluate(r, hit, hit.normal, value, pdf)) {
+               if (specular) {
+                  photon ph = { hit.p, glm::normalize(r.direction()), power };
+                  out.push_back(ph);
+               }
+               break;
+            }
+            ray scattered;
+            glm::color attenuation;
+            if (!hit.mat_ptr->scatter(r, hit, attenuation, scattered)) break;
+            power *= attenuation;
+            r = scattered;
+            specular = true;
+         }
+      }
+   });
+
+   std::vector<photon> stored;
+   for (size_t b = 0; b < found.size(); b++) stored.insert(stored.end(), found[b].begin(), found[b].end());
+   build(stored, radius);
+}
+
+#endif
@@ -22,6 +22,7 @@ public:
        rec.t = (t / length(r.direction())); // save the time when we hit the object
        rec.p = r.at(t / length(r.direction())); // ray.origin + t * ray.direction
        rec.mat_ptr = mat_ptr;
+       rec.object = this;
 
        // save normal
        glm::vec3 outward_normal = normalize(n); // compute unit length normal
@@ -30,10 +31,20 @@ public:
        return true;
    }
 
+   virtual bool transform(const glm::mat4& m) override
+   {
+      a = glm::point3(m * glm::vec4(a, 1.0f));
+      n = glm::normalize(glm::mat3(m) * n) * glm::length(n);
+      return true;
+   }
+
 public:
    glm::vec3 a;
    glm::vec3 n;
    std::shared_ptr<material> mat_ptr;
 };
 
+// a plane owns nothing outside a scene arena unless its material has a control block
+inline bool owns_outside_arena(const plane& p) { return p.mat_ptr.use_count() > 0; }
+
 #endif
@@ -1,8 +1,19 @@
 // alinen, 2021
 #include "ppm_image.h"
 #include <cassert>
+#include <cstdio>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION
+// stb_image.h puts statements after one-line loops on the same line
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmisleading-indentation"
+#endif
+#include "stb/stb_image.h"
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
 
 using namespace agl;
 using namespace std;
@@ -45,6 +56,17 @@ bool ppm_image::save(const std::string& filename) const
     return (result == 1);
 }
 
+bool ppm_image::encode_png(std::vector<unsigned char>& png) const
+{
+    int length = 0;
+    unsigned char* bytes = stbi_write_png_to_mem((unsigned char*) myData, myWidth*3,
+        myWidth, myHeight, 3, &length);
+    if (!bytes) return false;
+    png.assign(bytes, bytes + length);
+    STBIW_FREE(bytes);
+    return true;
+}
+
 ppm_pixel ppm_image::get(int row, int col) const
 {
     assert(row >= 0 && row < myHeight);
@@ -79,3 +101,55 @@ void ppm_image::set_vec3(int i, int j, const vec3 & c)
    myData[idx].g = (unsigned char) (c[1] * 255.999);
    myData[idx].b = (unsigned char) (c[2] * 255.999);
 }
+
+bool agl::load_hdr(const std::string& filename, int& width, int& height, std::vector<vec3>& pixels)
+{
+   int channels = 0;
+   float* data = stbi_loadf(filename.c_str(), &width, &height, &channels, 3);
+   if (!data)
+   {
+      cout << "cannot load " << filename << ": " << stbi_failure_reason() << endl;
+      return false;
+   }
+   pixels.resize(width * height);
+   for (int i = 0; i < width * height; i++)
+   {
+      pixels[i] = vec3(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+   }
+   stbi_image_free(data);
+   return true;
+}
+
+bool agl::load_rgb(const std::string& filename, int& width, int& height, std::vector<unsigned char>& pixels)
+{
+   int channels = 0;
+   unsigned char* data = stbi_load(filename.c_str(), &width, &height, &channels, 3);
+   if (!data)
+   {
+      cout << "cannot load " << filename << ": " << stbi_failure_reason() << endl;
+      return false;
+   }
+   pixels.assign(data, data + 3 * width * height);
+   stbi_image_free(data);
+   return true;
+}
+
+bool agl::save_pfm(const std::string& filename, int width, int height, const std::vector<vec3>& pixels)
+{
+   FILE* file = fopen(filename.c_str(), "wb");
+   if (!file)
+   {
+      cout << "cannot write " << filename << endl;
+      return false;
+   }
+   // a negative scale marks little endian floats; rows go from the bottom
+   fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+   bool written = true;
+   for (int row = height - 1; row >= 0 && written; row--)
+   {
+      written = fwrite(&pixels[row * width], sizeof(vec3), width, file) == size_t(width);
+   }
+   written = fclose(file) == 0 && written;
+   if (!written) cout << "cannot write " << filename << endl;
+   return written;
+}
@@ -3,6 +3,7 @@
 #define image_H_
 
 #include <iostream>
+#include <vector>
 #include "AGLM.h"
 
 // This is a placeholder class
@@ -30,6 +31,9 @@ namespace agl
         // save the given filename
         bool save(const std::string& filename) const;
 
+        // the bytes of the png that save writes
+        bool encode_png(std::vector<unsigned char>& png) const;
+
         // return the current width
         inline int width() const { return myWidth; }
 
@@ -56,6 +60,18 @@ namespace agl
         unsigned int myWidth;
         unsigned int myHeight;
     };
+
+    // Load a floating point image (Radiance .hdr) as linear RGB, row by row
+    // from the top; returns false if the file cannot be read
+    bool load_hdr(const std::string& filename, int& width, int& height, std::vector<glm::vec3>& pixels);
+
+    // Load an 8-bit image (png, jpg, ...) as rgb bytes, row by row from the
+    // top; returns false if the file cannot be read
+    bool load_rgb(const std::string& filename, int& width, int& height, std::vector<unsigned char>& pixels);
+
+    // Save a floating point image (.pfm) of RGB values, given row by row
+    // from the top; returns false if the file cannot be written
+    bool save_pfm(const std::string& filename, int width, int height, const std::vector<glm::vec3>& pixels);
 }
 
 #endif
@@ -0,0 +1,107 @@
+// ray_sort.h, reorders batches of rays so that neighbours in memory
+// touch neighbouring parts of the scene
+
+#ifndef RAY_SORT_H_
+#define RAY_SORT_H_
+
+#include "ray.h"
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// spread the low 10 bits of v so that there are two zero bits between each
+inline uint32_t expand_bits(uint32_t v)
+{
+   v &= 0x3ff;
+   v = (v | (v << 16)) & 0x030000ff;
+   v = (v | (v << 8)) & 0x0300f00f;
+   v = (v | (v << 4)) & 0x030c30c3;
+   v = (v | (v << 2)) & 0x09249249;
+   return v;
+}
+
+// 30 bit morton code for a point with components in [0, 1]
+inline uint32_t morton3(const glm::vec3& p)
+{
+   glm::vec3 q = glm::clamp(p * 1024.0f, glm::vec3(0), glm::vec3(1023));
+   return (expand_bits(uint32_t(q.x)) << 2) |
+      (expand_bits(uint32_t(q.y)) << 1) |
+      expand_bits(uint32_t(q.z));
+}
+
+// interleave the low 6 bits of x and y
+inline uint32_t morton2_6(uint32_t x, uint32_t y)
+{
+   uint32_t code = 0;
+   for (int i = 0; i < 6; i++)
+   {
+      code |= ((x >> i) & 1u) << (2 * i + 1);
+      code |= ((y >> i) & 1u) << (2 * i);
+   }
+   return code;
+}
+
+// Sort key for a ray: the morton code of its origin (relative to the given
+// bounds) in the high bits, followed by its direction quantized on an
+// octahedral map. Rays that start close together and point the same way end
+// up next to each other.
+inline uint64_t ray_sort_key(const ray& r, const glm::vec3& lo, const glm::vec3& inv_extent)
+{
+   uint64_t origin_key = morton3((r.origin() - lo) * inv_extent);
+
+   glm::vec3 d = r.direction();
+   float len = fabs(d.x) + fabs(d.y) + fabs(d.z);
+   if (len > 0) d /= len;
+   float ox = d.x;
+   float oy = d.y;
+   if (d.z < 0)
+   {
+      ox = (1.0f - fabs(d.y)) * (d.x >= 0 ? 1.0f : -1.0f);
+      oy = (1.0f - fabs(d.x)) * (d.y >= 0 ? 1.0f : -1.0f);
+   }
+   uint32_t qx = uint32_t(glm::clamp((ox * 0.5f + 0.5f) * 64.0f, 0.0f, 63.0f));
+   uint32_t qy = uint32_t(glm::clamp((oy * 0.5f + 0.5f) * 64.0f, 0.0f, 63.0f));
+
+   return (origin_key << 12) | morton2_6(qx, qy);
+}
+
+// Reorder items (anything with a public ray member r) by ray_sort_key.
+// Origins are quantized relative to the bounds of the batch itself, so no
+// scene bounds are needed. Callers that care about the original order must
+// carry it in the items (e.g. a pixel index).
+template <class T>
+void sort_by_ray_key(std::vector<T>& items)
+{
+   if (items.size() < 2) return;
+
+   glm::vec3 lo(infinity);
+   glm::vec3 hi(-infinity);
+   for (size_t i = 0; i < items.size(); i++)
+   {
+      lo = glm::min(lo, items[i].r.origin());
+      hi = glm::max(hi, items[i].r.origin());
+   }
+   glm::vec3 extent = hi - lo;
+   glm::vec3 inv_extent(
+      extent.x > 0 ? 1.0f / extent.x : 0.0f,
+      extent.y > 0 ? 1.0f / extent.y : 0.0f,
+      extent.z > 0 ? 1.0f / extent.z : 0.0f);
+
+   std::vector<std::pair<uint64_t, uint32_t>> keys(items.size());
+   for (size_t i = 0; i < items.size(); i++)
+   {
+      keys[i] = std::make_pair(ray_sort_key(items[i].r, lo, inv_extent), uint32_t(i));
+   }
+   std::sort(keys.begin(), keys.end());
+
+   std::vector<T> sorted;
+   sorted.reserve(items.size());
+   for (size_t i = 0; i < keys.size(); i++)
+   {
+      sorted.push_back(items[keys[i].second]);
+   }
+   items.swap(sorted);
+}
+
+#endif
@@ -0,0 +1,685 @@
+// render.h, batched (wavefront) path tracing used by the materials renderer
+
+#ifndef RENDER_H_
+#define RENDER_H_
+
+#include "AGLM.h"
+#include "ray.h"
+#include "hittable.h"
+#include "light_tree.h"
+#include "photon_map.h"
+#include "material.h"
+#include "ray_sort.h"
+#include "sampler.h"
+#include "camera.h"
+#include "environment_map.h"
+#include "hit_cache.h"
+#include "irradiance_cache.h"
+#include "light_tracer.h"
+#include "path_guiding.h"
+#include "thread_pool.h"
+#include "tile_culling.h"
+#include "tile_dependencies.h"
+#include "visibility_buffer.h"
+#include <memory>
+#include <vector>
+
+// One light path in flight. pixel indexes the radiance buffer passed to
+// trace_paths, so paths can be reordered freely between bounces. x, y and
+// sample identify the camera sample the path started from, for the sampler.
+// pdf is the density with which the last bounce picked r, 0 after camera
+// and specular bounces. The path carries a ray cone for texture filtering:
+// its width at r's origin and its spread angle, the angle of a pixel from
+// the camera, kept as is by every bounce (as a flat mirror would).
+// caustic tells whether the path made a diffuse or glossy bounce (1) that
+// was followed by specular ones only (2), and direct_caustic whether that
+// bounce was at the first hit of a camera path. skip_lights is set when r left a
+// vertex that sampled the lights and the environment with full weight:
+// reaching them adds nothing. vertex indexes the guided vertex r left from,
+// -1 for none: light found later is recorded there for path guiding.
+struct path_state {
+   ray r;
+   glm::color throughput;
+   int pixel;
+   int x, y;
+   int sample;
+   float pdf;
+   float cone_width;
+   float cone_spread;
+   int caustic;
+   bool direct_caustic;
+   bool skip_lights;
+   int vertex;
+};
+
+// A lambertian vertex of a path when guiding: the light found after it,
+// divided by the path's throughput up to and including its bounce, is the
+// light that arrived along direction
+struct guided_vertex {
+   glm::point3 p;
+   glm::vec3 direction;
+   glm::color throughput;
+   float pdf; // of direction, over its cosine: the field learns light times cosine
+   int parent; // the guided vertex before it, -1 for none
+   glm::color radiance;
+};
+
+// What a camera sample sees first, for the denoiser and output variables:
+// the normal, albedo and distance of its first hit, and what it hit; zero
+// where it hits nothing
+struct primary_hit {
+   glm::vec3 normal;
+   glm::color albedo;
+   float depth;
+   const hittable* object;
+   const material* mat;
+};
+
+// power heuristic weight of a sample drawn with density pdf against
+// another strategy that draws it with density other
+inline float mis_weight(float pdf, float other)
+{
+   if (other <= 0) return 1.0f;
+   return pdf * pdf / (pdf * pdf + other * other);
+}
+
+inline glm::color background(const ray& r)
+{
+   glm::vec3 unit_direction = glm::normalize(r.direction());
+   float t = 0.5f * (unit_direction.y + 1.0f);
+   return (1.0f - t) * glm::color(1, 1, 1) + t * glm::color(0.5f, 0.7f, 1.0f);
+}
+
+// What trace_paths uses besides the world; every member may be left unset
+struct trace_options {
+   // replaces the world for the first bounce: camera rays of a tile only
+   // need the objects in the tile's frustum
+   const accelerator* primary = 0;
+   // the rasterized first object of every path (visibility_buffer.h): only
+   // it is tested, and the path is traced when it turns out to miss it
+   const std::vector<const hittable*>* visible = 0;
+   const sampler* values = 0; // draws the bounces' directions, unless independent
+   // sampled at every vertex whose material can be evaluated (next-event
+   // estimation), weighed against bounces that find them by multiple
+   // importance sampling
+   const light_tree* lights = 0;
+   const environment_map* environment = 0; // replaces the background, sampled as lights are
+   // photons from the same lights, gathered at diffuse and glossy vertices;
+   // lights reached from them through specular bounces only are left to them
+   const photon_map* caustics = 0;
+   // camera paths end at their first lambertian hit, where indirect light
+   // is interpolated from the cache's records or a new record is computed
+   irradiance_cache* cache = 0;
+   // lambertian bounces also sample the directions it learned, and record
+   // the light their paths find
+   guiding_field* guide = 0;
+   // light paths (light_tracer.h) cover the caustics seen directly: camera
+   // paths do not gather photons at their first hit nor count lights they
+   // reach through specular bounces after it
+   bool splatted = false;
+   std::vector<primary_hit>* hits = 0; // receives the first hit of every path, at its pixel
+   // receives the first hit of every path, by index, t < 0 where it hits
+   // nothing; with reuse_first_hits it holds them and camera rays are not
+   // intersected
+   std::vector<hit_record>* first_hits = 0;
+   bool reuse_first_hits = false;
+   // receives the distance to the first hit of every path, by index,
+   // infinity where it hits nothing
+   std::vector<float>* distances = 0;
+};
+
+// Trace a batch of paths through the world, bounce by bounce, adding the
+// light each one finds to radiance[path.pixel]; paths end after max_depth
+// bounces. With sort_secondary, the rays of every bounce after the first
+// are sorted by ray_sort_key so that consecutive rays visit the same parts
+// of the scene.
+template <class world_t>
+void trace_paths(const world_t& world, std::vector<path_state>& paths,
+   std::vector<glm::color>& radiance, int max_depth, bool sort_secondary,
+   const trace_options& options = trace_options())
+{
+   const accelerator* primary = options.primary;
+   const std::vector<const hittable*>* visible = options.visible;
+   const sampler* values = options.values;
+   const light_tree* lights = options.lights;
+   const environment_map* environment = options.environment;
+   const photon_map* caustics = options.caustics;
+   irradiance_cache* cache = options.cache;
+   guiding_field* guide = options.guide;
+   bool splatted = options.splatted;
+   std::vector<primary_hit>* hits = options.hits;
+   std::vector<hit_record>* first_hits = options.first_hits;
+   bool reuse_first_hits = options.reuse_first_hits;
+   std::vector<float>* distances = options.distances;
+
+   bool sampled = values && values->get_type() != sampler_type::independent;
+   if (lights && lights->empty()) lights = 0;
+   if (environment && environment->empty()) environment = 0;
+   if (!lights) caustics = 0;
+   if (!lights) splatted = false;
+   std::vector<path_state> next;
+   next.reserve(paths.size());
+   std::vector<guided_vertex> vertices;
+   // adds light reaching the camera along path, and to the light arriving at its guided vertices
+   auto add = [&](const path_state& path, const glm::color& light) {
+      radiance[path.pixel] += light;
+      for (int v = path.vertex; v >= 0; v = vertices[v].parent) {
+         const glm::color& t = vertices[v].throughput;
+         vertices[v].radiance += glm::color(t.r > 0 ? light.r / t.r : 0.0f, t.g > 0 ? light.g / t.g : 0.0f,
+            t.b > 0 ? light.b / t.b : 0.0f);
+      }
+   };
+
+   for (int depth = 0; depth < max_depth && !paths.empty(); depth++)
+   {
+      if (depth > 0 && sort_secondary)
+      {
+         sort_by_ray_key(paths);
+      }
+
+      next.clear();
+      for (size_t i = 0; i < paths.size(); i++)
+      {
+         const path_state& path = paths[i];
+         hit_record rec;
+         const hittable* first = depth == 0 && visible ? (*visible)[i] : 0;
+         bool hit;
+         if (depth == 0 && first_hits && reuse_first_hits) {
+            rec = (*first_hits)[i];
+            hit = rec.t >= 0;
+         }
+         else if (depth == 0 && visible && !first) hit = false; // no object covers the sample
+         else if (first && first->hit_interval(path.r, 0.001f, infinity, rec)) hit = true;
+         else hit = depth == 0 && primary ?
+            primary->hit(path.r, 0.001f, infinity, rec) : world.hit(path.r, 0.001f, infinity, rec);
+         if (depth == 0 && first_hits && !reuse_first_hits) (*first_hits)[i] = hit ? rec : hit_record();
+         if (depth == 0 && distances) (*distances)[i] = hit ? rec.t * glm::length(path.r.direction()) : infinity;
+         if (!hit)
+         {
+            if (path.skip_lights && environment) continue;
+            if (!environment)
+            {
+               add(path, path.throughput * background(path.r));
+               continue;
+            }
+            float environment_pdf = path.pdf > 0 ? environment->pdf(path.r.direction()) : 0.0f;
+            add(path, path.throughput * environment->eval(path.r.direction()) *
+               mis_weight(path.pdf, environment_pdf));
+            continue;
+         }
+
+         if (rec.object) rec.object->surface_coordinates(rec);
+         rec.footprint = path.cone_width + path.cone_spread * glm::length(rec.p - path.r.origin());
+         if (depth == 0 && hits)
+         {
+            primary_hit& first_hit = (*hits)[path.pixel];
+            first_hit.normal = rec.normal;
+            first_hit.albedo = rec.mat_ptr->albedo_at(rec);
+            first_hit.depth = rec.t * glm::length(path.r.direction());
+            first_hit.object = rec.object;
+            first_hit.mat = rec.mat_ptr.get();
+         }
+
+         glm::color emitted = rec.mat_ptr->emitted(path.r, rec);
+         bool sampled_light = lights && lights->contains(rec.object);
+         bool caustic = path.caustic == 2 && (caustics || (splatted && path.direct_caustic));
+         if (emitted != glm::color(0) && !(sampled_light && (path.skip_lights || caustic)))
+         {
+            // light sampling at the previous vertex could have found this emitter too
+            float light_pdf = lights && path.pdf > 0 ? lights->pdf(path.r.origin(), rec) : 0.0f;
+            add(path, path.throughput * emitted * mis_weight(path.pdf, light_pdf));
+         }
+
+         int dimension = dimension_bounce + depth * dimensions_per_bounce;
+         // outside the cache's octree no record could be found again
+         bool cached = cache && depth == 0 && dynamic_cast<const lambertian*>(rec.mat_ptr.get()) &&
+            cache->covers(rec.p);
+         // half the bounces follow the light learned here, if any, half the BSDF
+         bool guided = guide && !cached && dynamic_cast<const lambertian*>(rec.mat_ptr.get());
+         const direction_tree* learned = guided ? guide->find(rec.p) : 0;
+         float guided_fraction = learned ? 0.5f : 0.0f;
+         // density of the bounce toward direction, which BSDF sampling alone picks with scatter_pdf
+         auto bounce_pdf = [&](const glm::vec3& direction, float scatter_pdf) {
+            if (cached) return 0.0f;
+            if (!learned) return scatter_pdf;
+            return guided_fraction * guiding_field::pdf(*learned, direction) + (1.0f - guided_fraction) * scatter_pdf;
+         };
+         if (lights)
+         {
+            glm::vec3 u = sampled ? values->get3(path.x, path.y, path.sample, dimension + bounce_light) :
+               glm::vec3(random_float(), random_float(), random_float());
+            glm::vec3 direction;
+            const hittable* light;
+            float light_pdf = lights->sample(rec.p, u.x, u.y, u.z, direction, light);
+            glm::color value;
+            float scatter_pdf;
+            if (light_pdf > 0 && rec.mat_ptr->evaluate(path.r, rec, direction, value, scatter_pdf) &&
+               value != glm::color(0))
+            {
+               ray shadow(rec.p, direction);
+               hit_record light_rec, blocker;
+               if (light->hit_interval(shadow, 0.001f, infinity, light_rec) &&
+                  !world.hit(shadow, 0.001f, light_rec.t * 0.999f, blocker))
+               {
+                  add(path, path.throughput * value * light_rec.mat_ptr->emitted(shadow, light_rec) *
+                     (mis_weight(light_pdf, bounce_pdf(direction, scatter_pdf)) / light_pdf));
+               }
+            }
+         }
+
+         if (environment)
+         {
+            glm::vec3 u = sampled ? values->get3(path.x, path.y, path.sample, dimension + bounce_environment) :
+               glm::vec3(random_float(), random_float(), 0.0f);
+            glm::vec3 direction;
+            glm::color sky;
+            float environment_pdf = environment->sample(u.x, u.y, direction, sky);
+            glm::color value;
+            float scatter_pdf;
+            if (environment_pdf > 0 && rec.mat_ptr->evaluate(path.r, rec, direction, value, scatter_pdf) &&
+               value != glm::color(0))
+            {
+               hit_record blocker;
+               if (!world.hit(ray(rec.p, direction), 0.001f, infinity, blocker))
+               {
+                  add(path, path.throughput * value * sky *
+                     (mis_weight(environment_pdf, bounce_pdf(direction, scatter_pdf)) / environment_pdf));
+               }
+            }
+         }
+
+         if (caustics && !(splatted && depth == 0 && path.caustic == 0))
+         {
+            add(path, path.throughput * caustics->gather(path.r, rec));
+         }
+
+         if (cached)
+         {
+            glm::color irradiance;
+            if (!cache->lookup(rec.p, rec.normal, irradiance))
+            {
+               // records are valid over a few to a few tens of pixels
+               float spacing = rec.footprint / cache->get_error();
+               irradiance = cache->compute(rec.p, rec.normal, 1.5f * spacing, 20.0f * spacing,
+                  [&](const std::vector<ray>& rays, std::vector<glm::color>& light, std::vector<float>& distance) {
+                     std::vector<path_state> hemisphere;
+                     for (size_t k = 0; k < rays.size(); k++)
+                     {
+                        path_state ray_path = { rays[k], glm::color(1), (int) k, path.x, path.y, path.sample,
+                           0.0f, rec.footprint, path.cone_spread, 1, true, true, -1 };
+                        hemisphere.push_back(ray_path);
+                     }
+                     trace_options bounce;
+                     bounce.lights = lights;
+                     bounce.environment = environment;
+                     bounce.caustics = caustics;
+                     bounce.splatted = splatted;
+                     bounce.distances = &distance;
+                     trace_paths(world, hemisphere, light, max_depth - 1, sort_secondary, bounce);
+                  });
+            }
+            // lambertian: f = albedo / pi
+            glm::color value;
+            float pdf;
+            rec.mat_ptr->evaluate(path.r, rec, rec.normal, value, pdf);
+            add(path, path.throughput * value * irradiance);
+            continue;
+         }
+
+         ray scattered;
+         glm::color attenuation;
+         if (guided)
+         {
+            // either strategy is weighted by the density of both
+            glm::vec3 u = sampled ? values->get3(path.x, path.y, path.sample, dimension) :
+               glm::vec3(random_float(), random_float(), random_float());
+            glm::vec3 direction;
+            float guide_pdf;
+            if (u.z < guided_fraction) direction = guiding_field::sample(*learned, u.x, u.y, guide_pdf);
+            else
+            {
+               rec.mat_ptr->scatter_sampled(path.r, rec, attenuation, scattered, u);
+               direction = scattered.direction();
+            }
+            glm::color value;
+            float scatter_pdf;
+            rec.mat_ptr->evaluate(path.r, rec, direction, value, scatter_pdf);
+            float pdf = bounce_pdf(direction, scatter_pdf);
+            if (pdf <= 0 || value == glm::color(0)) continue;
+
+            path_state bounce = path;
+            bounce.r = ray(rec.p, direction);
+            bounce.throughput = path.throughput * value / pdf;
+            bounce.cone_width = rec.footprint;
+            bounce.skip_lights = false;
+            bounce.pdf = lights || environment ? pdf : 0.0f;
+            bounce.caustic = 1;
+            bounce.direct_caustic = depth == 0 && path.caustic == 0;
+            bounce.vertex = (int) vertices.size();
+            float cosine = glm::dot(rec.normal, glm::normalize(direction));
+            guided_vertex vertex = { rec.p, direction, bounce.throughput, pdf / std::max(cosine, 1e-6f), path.vertex,
+               glm::color(0) };
+            vertices.push_back(vertex);
+            next.push_back(bounce);
+            continue;
+         }
+
+         bool scatters = sampled ?
+            rec.mat_ptr->scatter_sampled(path.r, rec, attenuation, scattered,
+               values->get3(path.x, path.y, path.sample, dimension)) :
+            rec.mat_ptr->scatter(path.r, rec, attenuation, scattered);
+         if (scatters)
+         {
+            path_state bounce = path;
+            bounce.r = scattered;
+            bounce.throughput = path.throughput * attenuation;
+            bounce.cone_width = rec.footprint;
+            bounce.skip_lights = false;
+            glm::color value;
+            bool evaluated = (lights || environment) &&
+               rec.mat_ptr->evaluate(path.r, rec, scattered.direction(), value, bounce.pdf);
+            if (!evaluated) bounce.pdf = 0.0f;
+            bounce.caustic = evaluated ? 1 : (path.caustic ? 2 : 0);
+            bounce.direct_caustic = evaluated ? depth == 0 && path.caustic == 0 : path.direct_caustic;
+            next.push_back(bounce);
+         }
+         else
+         {
+            add(path, path.throughput * attenuation);
+         }
+      }
+      paths.swap(next);
+   }
+   // paths still alive after max_depth bounces contribute nothing
+   paths.clear();
+
+   for (size_t v = 0; v < vertices.size(); v++) {
+      const glm::color& light = vertices[v].radiance;
+      guide->record(vertices[v].p, vertices[v].direction, 0.2126f * light.r + 0.7152f * light.g + 0.0722f * light.b,
+         vertices[v].pdf);
+   }
+}
+
+struct render_settings {
+   int samples_per_pixel = 10; // higher => more anti-aliasing
+   int max_depth = 10; // higher => less shadow acne
+   int tile_size = 32; // tiles are traced as one batch, in parallel
+   bool sort_secondary_rays = true; // reorder bounce rays for cache locality
+   bool cull_primary_rays = false; // camera rays test only the objects in their tile's frustum (tile_culling.h)
+   bool rasterize_primary = false; // first hits from a visibility buffer; needs the tile culler
+   sampler_type sampler = sampler_type::independent; // or sobol, blue_noise: lower error for the same samples
+   uint32_t seed = 0; // scrambles sobol and blue_noise: renders with other seeds draw other samples
+   int caustic_photons = 0; // photons traced from the lights per pass for caustics, 0 for none; needs lights
+   int photon_passes = 8; // samples are split into passes, each with new photons and a smaller radius
+   float photon_radius = 0.05f; // photon gather radius of the first pass
+   int light_paths = 0; // paths traced from the lights per pass for caustics seen directly, 0 for none; needs lights
+};
+
+// Sum of the radiance samples of every pixel, stored row by row
+class framebuffer {
+public:
+   framebuffer(int w, int h) : width(w), height(h), radiance(w * h, glm::color(0)) {}
+
+   glm::color& at(int row, int col) { return radiance[row * width + col]; }
+   const glm::color& at(int row, int col) const { return radiance[row * width + col]; }
+
+public:
+   int width;
+   int height;
+   std::vector<glm::color> radiance;
+};
+
+// Sums over the samples of every pixel of what the denoiser is guided by:
+// the normal, albedo and distance of the first hits, and the squared
+// luminance of the samples, from which it estimates their variance. Also
+// the number of samples, and the object and material the first one hit,
+// for output variables (aov.h).
+class feature_buffer {
+public:
+   feature_buffer(int w, int h) : width(w), height(h), normal(w * h, glm::vec3(0)), albedo(w * h, glm::color(0)),
+      depth(w * h, 0.0f), luminance_sqr(w * h, 0.0f), samples(w * h, 0), object(w * h, (const hittable*) 0),
+      mat(w * h, (const material*) 0) {}
+
+public:
+   int width;
+   int height;
+   std::vector<glm::vec3> normal;
+   std::vector<glm::color> albedo;
+   std::vector<float> depth;
+   std::vector<float> luminance_sqr;
+   std::vector<int> samples;
+   std::vector<const hittable*> object; // null where the first sample hit nothing
+   std::vector<const material*> mat;
+};
+
+// What render uses besides the world, camera and settings; every member
+// may be left null
+struct render_inputs {
+   // built for the same camera, image and tile size: per-tile candidates
+   // for camera rays; with settings.rasterize_primary they are rasterized
+   // into a visibility buffer and the paths start from its hits
+   const tile_culler* culler = 0;
+   // sampled at every diffuse and glossy vertex, as is the environment;
+   // settings.caustic_photons and settings.light_paths trace from them
+   const light_tree* lights = 0;
+   const environment_map* environment = 0;
+   // caches indirect light at first lambertian hits; it may be kept across
+   // renders of the same scene
+   irradiance_cache* irradiance = 0;
+   // passes have 1, 2, 4 ... samples per pixel, the last one the rest: the
+   // field learns from each pass and guides the next
+   guiding_field* guide = 0;
+   // receives the sums the denoiser and output variables need, from the
+   // same camera rays
+   feature_buffer* features = 0;
+   // holds the camera rays' first hits if they are those of this render,
+   // and the paths start from them; otherwise it records them
+   hit_cache* primary_hits = 0;
+   // only the tiles it marks dirty are cleared and traced again, recording
+   // what their paths touch; the image and features keep the previous
+   // render's values elsewhere
+   tile_dependencies* dependencies = 0;
+};
+
+// Trace all tiles of the image on the shared thread pool, adding every
+// sample's radiance to its pixel. With settings.caustic_photons, the
+// samples of every pixel are split into photon passes, each tracing new
+// photons from the lights before its tiles. With settings.light_paths,
+// every pass also traces light paths, splatted to the image after the
+// last one. Photons, light paths, irradiance caching and guiding share
+// what tiles trace across tiles: renders with them trace every tile, even
+// with dependencies.
+template <class world_t>
+void render(const world_t& world, const camera& cam, const render_settings& settings,
+   framebuffer& image, const render_inputs& inputs = render_inputs())
+{
+   const tile_culler* culler = inputs.culler;
+   const light_tree* lights = inputs.lights;
+   const environment_map* environment = inputs.environment;
+   irradiance_cache* irradiance = inputs.irradiance;
+   guiding_field* guide = inputs.guide;
+   feature_buffer* features = inputs.features;
+   hit_cache* primary_hits = inputs.primary_hits;
+   tile_dependencies* dependencies = inputs.dependencies;
+
+   int width = image.width;
+   int height = image.height;
+   int tile_size = settings.tile_size;
+   int tiles_x = (width + tile_size - 1) / tile_size;
+   int tiles_y = (height + tile_size - 1) / tile_size;
+
+   primary_rasterizer rasterizer(cam, width, height);
+   sampler values(settings.sampler, width, settings.seed);
+   // visibility buffer hits are not seen by the recording of dependencies
+   bool rasterize = settings.rasterize_primary && culler && !dependencies;
+   glm::vec3 forward = cam.get_lower_left_corner() - cam.get_origin() +
+      0.5f * cam.get_horizontal() + 0.5f * cam.get_vertical();
+   float pixel_angle = glm::length(cam.get_vertical()) / std::max(1, height - 1) / glm::length(forward);
+   int spp = settings.samples_per_pixel;
+   bool reuse = primary_hits && primary_hits->begin(cam, width, height, spp, settings.sampler, settings.seed);
+   bool record = primary_hits && primary_hits->recording();
+
+   bool photons = settings.caustic_photons > 0 && lights && !lights->empty();
+   std::vector<int> pass_start(1, 0); // first sample of every pass, and the end
+   if (guide) {
+      // a pass takes the rest when the one after it would have fewer samples
+      for (int n = 1; pass_start.back() < spp; n *= 2) {
+         pass_start.push_back(spp - pass_start.back() < 3 * n ? spp : pass_start.back() + n);
+      }
+   }
+   else {
+      int passes = photons ? glm::clamp(settings.photon_passes, 1, spp) : 1;
+      for (int pass = 0; pass < passes; pass++) pass_start.push_back(spp * (pass + 1) / passes);
+   }
+   bool splat = settings.light_paths > 0 && lights && !lights->empty();
+   bool incremental = dependencies && !photons && !splat && !irradiance && !guide;
+   if (dependencies) {
+      dependencies->begin(cam, width, height, tile_size, spp, settings.max_depth, settings.sampler,
+         settings.seed);
+      if (!incremental) dependencies->invalidate_all();
+      for (int tile = 0; tile < tiles_x * tiles_y; tile++) {
+         if (!dependencies->dirty(tile)) continue;
+         dependencies->clear(tile);
+         int i0 = (tile % tiles_x) * tile_size, j0 = (tile / tiles_x) * tile_size;
+         for (int j = j0; j < std::min(height, j0 + tile_size); j++) {
+            for (int i = i0; i < std::min(width, i0 + tile_size); i++) {
+               int pixel = j * width + i;
+               image.radiance[pixel] = glm::color(0);
+               if (!features) continue;
+               features->normal[pixel] = glm::vec3(0);
+               features->albedo[pixel] = glm::color(0);
+               features->depth[pixel] = 0.0f;
+               features->luminance_sqr[pixel] = 0.0f;
+               features->samples[pixel] = 0;
+               features->object[pixel] = 0;
+               features->mat[pixel] = 0;
+            }
+         }
+      }
+   }
+   splat_buffer splats(splat ? width : 0, splat ? height : 0);
+   photon_map caustics;
+   float radius = settings.photon_radius;
+   for (size_t pass = 0; pass + 1 < pass_start.size(); pass++) {
+      int first_sample = pass_start[pass];
+      int pass_samples = pass_start[pass + 1] - first_sample;
+      if (photons) {
+         caustics.trace(world, *lights, settings.caustic_photons, radius);
+         radius *= std::sqrt((pass + 1 + 2.0f / 3.0f) / (pass + 2)); // r^2 shrinks by (i + alpha) / (i + 1)
+      }
+
+      parallel_for(0, tiles_x * tiles_y, 1, [&](int first, int last) {
+         std::vector<path_state> paths;
+         std::vector<glm::color> radiance;
+         std::vector<primary_hit> hits;
+         std::vector<hit_record> first_hits;
+         tile_samples samples;
+         visibility_buffer visible;
+         for (int tile = first; tile < last; tile++) {
+            if (dependencies && !dependencies->dirty(tile)) continue;
+            int i0 = (tile % tiles_x) * tile_size;
+            int j0 = (tile / tiles_x) * tile_size;
+            int i1 = std::min(width, i0 + tile_size);
+            int j1 = std::min(height, j0 + tile_size);
+            int tile_width = i1 - i0;
+
+            samples.reset(i0, j0, tile_width, j1 - j0, pass_samples);
+            for (int j = j0; j < j1; j++) {
+               for (int i = i0; i < i1; i++) {
+                  for (int s = 0; s < pass_samples; s++) { // antialias
+                     int k = samples.first(i, j) + s;
+                     int index = first_sample + s;
+                     samples.u[k] = float(i + values.get(i, j, index, dimension_jitter)) / (width - 1);
+                     samples.v[k] = float(height - j - 1 - values.get(i, j, index, dimension_jitter + 1)) / (height - 1);
+                  }
+               }
+            }
+
+            // radiance per sample, summed into the pixels after tracing
+            radiance.assign(samples.size(), glm::color(0));
+            if (features) hits.assign(samples.size(), primary_hit());
+            // the cache numbers samples pixel by pixel, the tile by its pixels
+            auto cached_sample = [&](int k) {
+               int pixel = k / pass_samples;
+               return (size_t(j0 + pixel / tile_width) * width + i0 + pixel % tile_width) * spp +
+                  first_sample + k % pass_samples;
+            };
+            if (reuse || record) first_hits.resize(samples.size());
+            if (reuse) {
+               for (int k = 0; k < samples.size(); k++) primary_hits->restore(cached_sample(k), first_hits[k]);
+            }
+            paths.clear();
+            for (int k = 0; k < samples.size(); k++) {
+               int pixel = k / pass_samples;
+               path_state path = { cam.get_ray(samples.u[k], samples.v[k]), glm::color(1), k,
+                  i0 + pixel % tile_width, j0 + pixel / tile_width, first_sample + k % pass_samples,
+                  0.0f, 0.0f, pixel_angle, 0, false, false, -1 };
+               paths.push_back(path);
+            }
+
+            const accelerator* primary = culler ? culler->candidates(tile) : 0;
+            tracked_world<world_t> tracked(world, dependencies, tile);
+            std::unique_ptr<tracked_accelerator> tracked_primary;
+            if (dependencies && primary) {
+               tracked_primary.reset(new tracked_accelerator(*primary, *dependencies, tile));
+               primary = tracked_primary.get();
+            }
+            if (dependencies && reuse) {
+               for (int k = 0; k < samples.size(); k++) {
+                  const hit_record& rec = first_hits[k];
+                  dependencies->record(tile, paths[k].r, 0.001f, rec.t >= 0 ? rec.t : infinity, rec.t >= 0, rec.object);
+               }
+            }
+            if (rasterize && !reuse) rasterizer.rasterize(culler->objects(tile), samples, visible);
+            trace_options options;
+            options.primary = primary;
+            options.visible = rasterize && !reuse ? &visible.object : 0;
+            options.values = &values;
+            options.lights = lights;
+            options.environment = environment;
+            options.caustics = photons ? &caustics : 0;
+            options.cache = irradiance;
+            options.guide = guide;
+            options.splatted = splat;
+            options.hits = features ? &hits : 0;
+            options.first_hits = reuse || record ? &first_hits : 0;
+            options.reuse_first_hits = reuse;
+            trace_paths(tracked, paths, radiance, settings.max_depth, settings.sort_secondary_rays, options);
+            if (record) {
+               for (int k = 0; k < samples.size(); k++) primary_hits->record(cached_sample(k), first_hits[k]);
+            }
+
+            for (int j = j0; j < j1; j++) {
+               for (int i = i0; i < i1; i++) {
+                  int pixel = j * width + i;
+                  for (int k = samples.first(i, j); k < samples.first(i, j) + pass_samples; k++) {
+                     image.at(j, i) += radiance[k];
+                     if (!features) continue;
+                     const glm::color& c = radiance[k];
+                     float luminance = 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+                     features->luminance_sqr[pixel] += luminance * luminance;
+                     features->normal[pixel] += hits[k].normal;
+                     features->albedo[pixel] += hits[k].albedo;
+                     features->depth[pixel] += hits[k].depth;
+                     if (features->samples[pixel]++ == 0) {
+                        features->object[pixel] = hits[k].object;
+                        features->mat[pixel] = hits[k].mat;
+                     }
+                  }
+               }
+            }
+         }
+      });
+      if (splat) trace_light_paths(world, cam, *lights, settings.light_paths, float(pass_samples), splats);
+      if (guide) guide->refine(pass_samples);
+   }
+   if (record) primary_hits->end();
+   if (dependencies) dependencies->end(incremental);
+   if (splat) {
+      for (int j = 0; j < height; j++) {
+         for (int i = 0; i < width; i++) image.at(j, i) += splats.at(j, i);
+      }
+   }
+}
+
+#endif
@@ -0,0 +1,252 @@
+// sampler.h, sample values for the camera jitter and the bounces of a path
+//
+// Every sample of a pixel is a point in a high-dimensional unit cube: its
+// first dimensions place the sample in the pixel, the following ones choose
+// the direction of each bounce. Values are looked up by (pixel, sample
+// index, dimension), so paths can be traced in any order.
+//  - independent: uniform random numbers, as before
+//  - sobol: Owen-scrambled Sobol points (hash-based scrambling, Burley 2020),
+//    seeded per pixel; dimensions come in 4D Sobol sets, each scrambled
+//    and shuffled with its own seed
+//  - blue_noise: the same scrambled Sobol points for every pixel, shifted
+//    per pixel and dimension by a void-and-cluster blue-noise tile, so the
+//    error of neighboring pixels is spread as blue noise (dithered sampling)
+
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include "AGLM.h"
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class sampler_type { independent, sobol, blue_noise };
+
+// Dimensions of a camera path. The lens dimensions are reserved: the camera
+// is a pinhole for now. Each bounce gets three 4D sets: to scatter
+// (materials use up to three dimensions), to sample a light and to sample
+// the environment.
+enum sample_dimension {
+   dimension_jitter = 0, // two dimensions
+   dimension_lens = 2, // two dimensions
+   dimension_bounce = 4,
+   dimensions_per_bounce = 12,
+   bounce_light = 4, // offset of the light sample within a bounce: light, then two for the point
+   bounce_environment = 8 // two dimensions
+};
+
+class sampler {
+public:
+   static const int blue_noise_size = 64; // tile of blue_noise_size^2 pixels
+
+   explicit sampler(sampler_type t = sampler_type::independent, int image_width = 1, uint32_t s = 0) :
+      type(t), width(image_width), seed(s) {}
+
+   sampler_type get_type() const { return type; }
+
+   std::string name() const {
+      switch (type) {
+      case sampler_type::sobol: return "sobol";
+      case sampler_type::blue_noise: return "blue noise";
+      default: return "independent";
+      }
+   }
+
+   // dimension d of sample index of image pixel (i, j), in [0, 1)
+   float get(int i, int j, uint32_t index, int d) const {
+      if (type == sampler_type::independent) return random_float();
+      if (type == sampler_type::sobol) return to_float(owen_sobol(index, d, hash(j * width + i, seed)));
+      const std::vector<float>& noise = blue_noise();
+      uint32_t shift = hash(d, seed ^ 0x9e3779b9u);
+      int x = (i + int(shift & 63)) & (blue_noise_size - 1);
+      int y = (j + int((shift >> 6) & 63)) & (blue_noise_size - 1);
+      float value = to_float(owen_sobol(index, d, seed)) + noise[y * blue_noise_size + x];
+      return value >= 1.0f ? value - 1.0f : value;
+   }
+
+   glm::vec3 get3(int i, int j, uint32_t index, int d) const {
+      float x = get(i, j, index, d);
+      float y = get(i, j, index, d + 1);
+      float z = get(i, j, index, d + 2);
+      return glm::vec3(x, y, z);
+   }
+
+   // dimension d of Owen-scrambled Sobol point index
+   static uint32_t owen_sobol(uint32_t index, int d, uint32_t pixel_seed) {
+      uint32_t set_seed = hash(d / 4, pixel_seed);
+      uint32_t shuffled = nested_uniform_scramble(index, set_seed);
+      return nested_uniform_scramble(sobol(shuffled, d % 4), hash(d % 4, set_seed));
+   }
+
+   // dimensions 0 - 3 of the Sobol sequence (Joe-Kuo direction numbers)
+   static uint32_t sobol(uint32_t index, int d) {
+      if (d == 0) return reverse_bits(index);
+      const uint32_t* v = directions() + 32 * d;
+      uint32_t x = 0;
+      for (int bit = 0; index; index >>= 1, bit++) {
+         x ^= v[bit] & (0u - (index & 1)); // shuffled indices use all bits: no branch
+      }
+      return x;
+   }
+
+   // blue_noise_size^2 ranks from void and cluster (Ulichney 1993), as
+   // values (rank + 0.5) / count, row by row
+   static const std::vector<float>& blue_noise() {
+      static const std::vector<float> noise = void_and_cluster(blue_noise_size, 1.5f);
+      return noise;
+   }
+
+   static std::vector<float> void_and_cluster(int size, float sigma);
+
+private:
+   static float to_float(uint32_t x) {
+      return std::min(float(x) * (1.0f / 4294967296.0f), 0.99999994f);
+   }
+
+   static uint32_t hash(uint32_t x, uint32_t s) {
+      x ^= s * 0x9e3779b9u;
+      x ^= x >> 16; x *= 0x7feb352du;
+      x ^= x >> 15; x *= 0x846ca68bu;
+      x ^= x >> 16;
+      return x;
+   }
+
+   static uint32_t reverse_bits(uint32_t x) {
+      x = (x << 16) | (x >> 16);
+      x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+      x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+      x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+      x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+      return x;
+   }
+
+   // Laine-Karras permutation: each bit is flipped depending on the bits below it
+   static uint32_t laine_karras(uint32_t x, uint32_t s) {
+      x += s;
+      x ^= x * 0x6c50b47cu;
+      x ^= x * 0xb82f1e52u;
+      x ^= x * 0xc7afe638u;
+      x ^= x * 0x8d22f6e6u;
+      return x;
+   }
+
+   // Owen scrambling: each bit is flipped depending on the bits above it
+   static uint32_t nested_uniform_scramble(uint32_t x, uint32_t s) {
+      return reverse_bits(laine_karras(reverse_bits(x), s));
+   }
+
+   static const uint32_t* directions() {
+      struct table {
+         uint32_t v[4 * 32];
+         table() {
+            // degree, coefficients and initial numbers of the primitive polynomials
+            const int degree[4] = { 0, 1, 2, 3 };
+            const uint32_t coefficients[4] = { 0, 0, 1, 1 };
+            const uint32_t initial[4][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+            for (int bit = 0; bit < 32; bit++) v[bit] = 1u << (31 - bit);
+            for (int d = 1; d < 4; d++) {
+               uint32_t* w = v + 32 * d;
+               int s = degree[d];
+               for (int bit = 0; bit < 32; bit++) {
+                  if (bit < s) {
+                     w[bit] = initial[d][bit] << (31 - bit);
+                     continue;
+                  }
+                  w[bit] = w[bit - s] ^ (w[bit - s] >> s);
+                  for (int k = 1; k < s; k++) {
+                     if ((coefficients[d] >> (s - 1 - k)) & 1) w[bit] ^= w[bit - k];
+                  }
+               }
+            }
+         }
+      };
+      static const table t;
+      return t.v;
+   }
+
+private:
+   sampler_type type;
+   int width;
+   uint32_t seed;
+};
+
+// Ranks pixels of a toroidal size x size tile so that every prefix of the
+// ranking is spread evenly: each new pixel goes to the largest void of the
+// previous ones, measured with a Gaussian energy of width sigma
+inline std::vector<float> sampler::void_and_cluster(int size, float sigma)
+{
+   int count = size * size;
+   std::vector<float> kernel(count);
+   for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+         int dx = std::min(x, size - x), dy = std::min(y, size - y);
+         kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+      }
+   }
+
+   // energy[p]: sum of the kernel over the pixels set in pattern
+   std::vector<char> pattern(count, 0);
+   std::vector<float> energy(count, 0.0f);
+   auto toggle = [&](int p, float sign) {
+      pattern[p] = sign > 0;
+      int px = p % size, py = p / size;
+      for (int y = 0; y < size; y++) {
+         const float* row = &kernel[((y - py + size) % size) * size];
+         for (int x = 0; x < size; x++) energy[y * size + x] += sign * row[(x - px + size) % size];
+      }
+   };
+   // tightest cluster of the pixels set to value, or largest void of those that are not
+   auto extreme = [&](char value, bool highest) {
+      int best = 0;
+      float best_energy = highest ? -infinity : infinity;
+      for (int p = 0; p < count; p++) {
+         if (pattern[p] != value) continue;
+         if (highest ? energy[p] > best_energy : energy[p] < best_energy) {
+            best = p;
+            best_energy = energy[p];
+         }
+      }
+      return best;
+   };
+
+   // initial binary pattern: a tenth of the pixels, spread by moving the
+   // tightest cluster into the largest void until that changes nothing
+   std::mt19937 generator(1);
+   int initial = count / 10;
+   for (int n = 0; n < initial; ) {
+      int p = (int) (generator() % count);
+      if (!pattern[p]) { toggle(p, 1.0f); n++; }
+   }
+   for (;;) {
+      int cluster = extreme(1, true);
+      toggle(cluster, -1.0f);
+      int gap = extreme(0, false);
+      toggle(gap, 1.0f);
+      if (gap == cluster) break;
+   }
+   std::vector<char> initial_pattern = pattern;
+   std::vector<float> initial_energy = energy;
+
+   std::vector<int> rank(count, 0);
+   // ranks below the initial pattern: remove its tightest clusters
+   for (int r = initial - 1; r >= 0; r--) {
+      int cluster = extreme(1, true);
+      toggle(cluster, -1.0f);
+      rank[cluster] = r;
+   }
+   // ranks above it: fill the largest voids
+   pattern = initial_pattern;
+   energy = initial_energy;
+   for (int r = initial; r < count; r++) {
+      int gap = extreme(0, false);
+      toggle(gap, 1.0f);
+      rank[gap] = r;
+   }
+
+   std::vector<float> values(count);
+   for (int p = 0; p < count; p++) values[p] = (rank[p] + 0.5f) / count;
+   return values;
+}
+
+#endif
@@ -0,0 +1,96 @@
+// scene_arena.h, bump allocator for the primitives and materials of a scene
+//
+// Objects are placed one after another in large blocks and released all at
+// once, block by block, when the arena goes away. The shared_ptrs handed out
+// have no control block, so copying them costs no allocation or atomic
+// reference count, and they do not keep the arena alive: they are valid as
+// long as the arena is. Objects that own something outside the arena (a
+// material or texture made with make_shared) have their destructors
+// recorded and run, newest first, before the blocks are freed. Whether an
+// object does is asked of owns_outside_arena: primitives and materials
+// overload it to check their shared_ptrs (sphere.h, material.h), so a
+// scene made entirely in its arena is freed block by block without running
+// a destructor. Other types are recorded unless trivially destructible.
+// Allocation is not thread safe; scenes are built on one thread.
+
+#ifndef SCENE_ARENA_H_
+#define SCENE_ARENA_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// whether object must be destroyed with the arena; overloaded by types that can tell
+template <class T>
+inline bool owns_outside_arena(const T&) { return !std::is_trivially_destructible<T>::value; }
+
+class scene_arena {
+public:
+   explicit scene_arena(size_t block_bytes = 1 << 20) :
+      next(0), end(0), block_size(block_bytes), used(0) {}
+
+   ~scene_arena() {
+      for (size_t i = destructors.size(); i-- > 0;) destructors[i].destroy(destructors[i].object);
+      for (size_t i = 0; i < blocks.size(); i++) std::free(blocks[i]);
+   }
+
+   void* allocate(size_t size, size_t align) {
+      char* p = align_up(next, align);
+      if (!next || p + size > end) {
+         // objects larger than a block get a block of their own
+         size_t bytes = std::max(block_size, size + align);
+         char* block = static_cast<char*>(std::malloc(bytes));
+         if (!block) throw std::bad_alloc();
+         blocks.push_back(block);
+         next = block;
+         end = block + bytes;
+         p = align_up(next, align);
+      }
+      next = p + size;
+      used += size;
+      return p;
+   }
+
+   template <class T, class... Args>
+   std::shared_ptr<T> make(Args&&... args) {
+      T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+      if (owns_outside_arena(*object)) {
+         destructor d = { &destroy<T>, object };
+         destructors.push_back(d);
+      }
+      return std::shared_ptr<T>(std::shared_ptr<T>(), object); // aliases nothing: no control block
+   }
+
+   size_t bytes_used() const { return used; }
+   size_t owning_objects() const { return destructors.size(); } // destroyed with the arena
+
+private:
+   scene_arena(const scene_arena&);
+   scene_arena& operator=(const scene_arena&);
+
+   struct destructor {
+      void (*destroy)(void*);
+      void* object;
+   };
+
+   template <class T>
+   static void destroy(void* object) { static_cast<T*>(object)->~T(); }
+
+   static char* align_up(char* p, size_t align) {
+      return reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(p) + align - 1) & ~uintptr_t(align - 1));
+   }
+
+   std::vector<char*> blocks;
+   std::vector<destructor> destructors;
+   char* next;
+   char* end;
+   size_t block_size;
+   size_t used;
+};
+
+#endif
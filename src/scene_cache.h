@@ -0,0 +1,677 @@
+// scene_cache.h, built scenes stored on disk and memory mapped at startup
+//
+// A cache file holds the flattened primitives, the material table and the
+// BVH nodes of a scene. Sections are addressed by offsets from the start of
+// the file, so a mapped file is traced in place: no parsing, no pointers to
+// fix up, and the OS pages geometry in on demand, which lets scenes larger
+// than memory render. The header stores a key of the scene source, the
+// file the scene is described by (scene_source_key), so a cache is checked
+// without building or hashing the world; one whose key does not match is
+// rebuilt. Every primitive record keeps the index of the object it was
+// flattened from: a cache bound to that world reports hits on its objects,
+// and one opened on its own makes an object for a primitive the first time
+// it is hit, so hits always carry an object for textures, ids and caches.
+
+#ifndef SCENE_CACHE_H_
+#define SCENE_CACHE_H_
+
+#include "AGLM.h"
+#include "accelerators.h"
+#include "bvh.h"
+#include "material.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "plane.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+enum cached_material_type { cached_lambertian, cached_metal, cached_dielectric, cached_phong };
+
+struct cached_material {
+   int32_t type;
+   float params[19]; // fields of the material, in declaration order
+};
+
+struct cached_sphere {
+   glm::point3 center;
+   float radius;
+   int32_t material; // index into the material table, -1 for none
+   int32_t source; // index of the object in the world it was flattened from
+};
+
+struct cached_triangle {
+   glm::point3 a, b, c;
+   int32_t material;
+   int32_t source;
+};
+
+struct cached_plane {
+   glm::point3 a;
+   glm::vec3 n;
+   int32_t material;
+   int32_t source;
+};
+
+struct cached_section {
+   uint64_t offset; // from the start of the file, 64-byte aligned
+   uint64_t count;
+};
+
+struct scene_cache_header {
+   static const uint32_t current_version = 2;
+   static const uint32_t byte_order_mark = 0x01020304;
+
+   char magic[8]; // "RTSCENE\0"
+   uint32_t version;
+   uint32_t byte_order;
+   uint64_t source_key; // scene_source_key of the scene the cache was written from
+   uint64_t source_objects; // objects in that world
+   uint64_t file_size;
+   cached_section materials;
+   cached_section spheres;
+   cached_section triangles;
+   cached_section planes;
+   cached_section nodes; // bvh_node, as built by bvh_builder
+   cached_section refs; // leaf-ordered primitives: sphere i or ~i for triangle i
+};
+
+// The scene as plain arrays, ready to write
+struct flat_scene {
+   std::vector<cached_material> materials;
+   std::vector<cached_sphere> spheres;
+   std::vector<cached_triangle> triangles;
+   std::vector<cached_plane> planes;
+   size_t source_objects = 0;
+
+   // returns false if the world holds an object or material with no cached form
+   bool flatten(const hittable_list& world);
+
+private:
+   int32_t material_index(const std::shared_ptr<material>& m, bool& ok);
+
+   std::map<const material*, int32_t> material_ids;
+};
+
+// Read-only view of a file, mapped into the address space
+class mapped_file {
+public:
+   mapped_file() : data(0), size(0) {}
+   ~mapped_file() { close(); }
+
+   bool open(const std::string& path);
+   void close();
+
+public:
+   const char* data;
+   size_t size;
+
+private:
+   mapped_file(const mapped_file&);
+   mapped_file& operator=(const mapped_file&);
+#ifdef _WIN32
+   HANDLE file = INVALID_HANDLE_VALUE;
+   HANDLE mapping = 0;
+#endif
+};
+
+// A key for the scene described by the file at path, from its path, size and
+// modification time; 0 if the file cannot be read, which no cache matches
+inline uint64_t scene_source_key(const std::string& path);
+
+class scene_cache : public accelerator {
+public:
+   scene_cache() : proxies(num_shards) {}
+
+   // maps path and checks it against the key of the scene source; the
+   // world is not needed
+   bool open(const std::string& path, uint64_t source_key);
+
+   // reports hits on the objects of world, the one the cache was written
+   // from; false if its number of objects differs
+   bool bind(const hittable_list& world);
+
+   // builds the BVH of scene and writes everything to path
+   static bool write(const std::string& path, const flat_scene& scene, uint64_t source_key);
+
+   virtual bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const override;
+   virtual std::string name() const override { return "cached bvh"; }
+
+private:
+   enum primitive_kind { cached_sphere_kind, cached_triangle_kind, cached_plane_kind };
+   static const size_t num_shards = 64;
+
+   // objects made for primitives hit while no world is bound, under one
+   // lock per shard of primitives
+   struct proxy_shard {
+      std::mutex mutex;
+      std::unordered_map<uint64_t, std::shared_ptr<hittable>> objects;
+   };
+
+   template <class T>
+   const T* section(const cached_section& s) const {
+      return reinterpret_cast<const T*>(file.data + s.offset);
+   }
+
+   template <class T>
+   bool fits(const cached_section& s) const {
+      return s.offset % alignof(T) == 0 && s.offset <= file.size && s.count <= (file.size - s.offset) / sizeof(T);
+   }
+
+   const hittable* object(int kind, int32_t index) const;
+
+   mapped_file file;
+   std::vector<std::shared_ptr<material>> materials;
+   const cached_sphere* spheres = 0;
+   const cached_triangle* triangles = 0;
+   const cached_plane* planes = 0;
+   const bvh_node* nodes = 0;
+   const int32_t* refs = 0;
+   size_t num_spheres = 0;
+   size_t num_triangles = 0;
+   size_t num_planes = 0;
+   size_t num_nodes = 0;
+   size_t num_refs = 0;
+   uint64_t source_objects = 0;
+   std::vector<std::shared_ptr<hittable>> sources; // the bound world's objects, by source index
+   std::shared_ptr<scene_arena> source_arena; // keeps those made in its arena alive
+   mutable std::vector<proxy_shard> proxies;
+};
+
+// Opens the cache at path if it was written from the scene source with
+// source_key, without building the world; hits are reported on objects the
+// cache makes for the primitives hit. Returns null if there is no such cache.
+inline std::shared_ptr<scene_cache> open_scene_cache(const std::string& path, uint64_t source_key,
+   accelerator_report& report);
+
+// Opens the cache at path if it was written from source_key, otherwise
+// flattens world and writes it first; hits are reported on the objects of
+// world. Returns null if the world cannot be cached.
+inline std::shared_ptr<accelerator> open_scene_cache(const hittable_list& world,
+   const std::string& path, uint64_t source_key, accelerator_report& report);
+
+//-----------------------------------------------------------------------------
+
+inline int32_t flat_scene::material_index(const std::shared_ptr<material>& m, bool& ok)
+{
+   if (!m) return -1;
+   std::map<const material*, int32_t>::iterator it = material_ids.find(m.get());
+   if (it != material_ids.end()) return it->second;
+
+   cached_material rec;
+   memset(&rec, 0, sizeof(rec));
+   float* p = rec.params;
+   if (const lambertian* l = dynamic_cast<const lambertian*>(m.get())) {
+      if (l->albedo_map) { // textures have no cached form
+         ok = false;
+         return -1;
+      }
+      rec.type = cached_lambertian;
+      memcpy(p, &l->albedo, sizeof(glm::color));
+   }
+   else if (const metal* mt = dynamic_cast<const metal*>(m.get())) {
+      rec.type = cached_metal;
+      memcpy(p, &mt->albedo, sizeof(glm::color));
+      p[3] = mt->fuzz;
+   }
+   else if (const dielectric* d = dynamic_cast<const dielectric*>(m.get())) {
+      rec.type = cached_dielectric;
+      p[0] = d->ir;
+   }
+   else if (const phong* ph = dynamic_cast<const phong*>(m.get())) {
+      rec.type = cached_phong;
+      const glm::vec3* v[5] = { &ph->diffuseColor, &ph->specColor, &ph->ambientColor, &ph->lightPos, &ph->viewPos };
+      for (int k = 0; k < 5; k++) memcpy(p + 3 * k, v[k], sizeof(glm::vec3));
+      p[15] = ph->kd;
+      p[16] = ph->ks;
+      p[17] = ph->ka;
+      p[18] = ph->shininess;
+   }
+   else {
+      ok = false;
+      return -1;
+   }
+
+   int32_t id = (int32_t) materials.size();
+   materials.push_back(rec);
+   material_ids[m.get()] = id;
+   return id;
+}
+
+inline bool flat_scene::flatten(const hittable_list& world)
+{
+   bool ok = world.objects.size() <= size_t(INT32_MAX);
+   source_objects = world.objects.size();
+   for (size_t i = 0; i < world.objects.size() && ok; i++) {
+      const hittable* object = world.objects[i].get();
+      int32_t source = (int32_t) i;
+      if (const sphere* s = dynamic_cast<const sphere*>(object)) {
+         cached_sphere c = { s->center, s->radius, material_index(s->mat_ptr, ok), source };
+         spheres.push_back(c);
+      }
+      else if (const triangle* t = dynamic_cast<const triangle*>(object)) {
+         cached_triangle c = { t->a, t->b, t->c, material_index(t->mat_ptr, ok), source };
+         triangles.push_back(c);
+      }
+      else if (const plane* p = dynamic_cast<const plane*>(object)) {
+         cached_plane c = { p->a, p->n, material_index(p->mat_ptr, ok), source };
+         planes.push_back(c);
+      }
+      else {
+         ok = false;
+      }
+   }
+   return ok;
+}
+
+// FNV-1a over the path, size and modification time; the cache layout
+// version is mixed in so a new layout never matches an old file
+inline uint64_t scene_source_key(const std::string& path)
+{
+   struct stat st;
+   if (stat(path.c_str(), &st) != 0) return 0;
+   uint64_t h = 14695981039346656037ull;
+   struct mix {
+      static void bytes(uint64_t& h, const void* data, size_t n) {
+         const unsigned char* p = static_cast<const unsigned char*>(data);
+         for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 1099511628211ull;
+      }
+   };
+   uint64_t fields[3] = { scene_cache_header::current_version, (uint64_t) st.st_size, (uint64_t) st.st_mtime };
+   mix::bytes(h, path.data(), path.size());
+   mix::bytes(h, fields, sizeof(fields));
+   return h == 0 ? 1 : h;
+}
+
+#ifdef _WIN32
+
+inline bool mapped_file::open(const std::string& path)
+{
+   close();
+   file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+      FILE_FLAG_RANDOM_ACCESS, 0);
+   if (file == INVALID_HANDLE_VALUE) return false;
+   LARGE_INTEGER file_size;
+   if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+      close();
+      return false;
+   }
+   mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+   if (mapping) data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+   if (!data) {
+      close();
+      return false;
+   }
+   size = (size_t) file_size.QuadPart;
+   return true;
+}
+
+inline void mapped_file::close()
+{
+   if (data) UnmapViewOfFile(data);
+   if (mapping) CloseHandle(mapping);
+   if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+   data = 0;
+   size = 0;
+   mapping = 0;
+   file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+inline bool mapped_file::open(const std::string& path)
+{
+   close();
+   int fd = ::open(path.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   struct stat st;
+   if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return false;
+   }
+   void* p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   ::close(fd); // the mapping keeps the file alive
+   if (p == MAP_FAILED) return false;
+   madvise(p, st.st_size, MADV_RANDOM); // rays touch scattered pages; do not read ahead
+   data = static_cast<const char*>(p);
+   size = st.st_size;
+   return true;
+}
+
+inline void mapped_file::close()
+{
+   if (data) munmap(const_cast<char*>(data), size);
+   data = 0;
+   size = 0;
+}
+
+#endif
+
+inline bool scene_cache::open(const std::string& path, uint64_t source_key)
+{
+   sources.clear();
+   source_arena.reset();
+   for (size_t i = 0; i < proxies.size(); i++) proxies[i].objects.clear();
+   if (source_key == 0 || !file.open(path)) return false;
+
+   scene_cache_header header;
+   if (file.size < sizeof(header)) {
+      file.close();
+      return false;
+   }
+   memcpy(&header, file.data, sizeof(header));
+   if (memcmp(header.magic, "RTSCENE", 8) != 0 ||
+       header.version != scene_cache_header::current_version ||
+       header.byte_order != scene_cache_header::byte_order_mark ||
+       header.source_key != source_key ||
+       header.file_size != file.size ||
+       !fits<cached_material>(header.materials) || !fits<cached_sphere>(header.spheres) ||
+       !fits<cached_triangle>(header.triangles) || !fits<cached_plane>(header.planes) ||
+       !fits<bvh_node>(header.nodes) || !fits<int32_t>(header.refs) ||
+       header.spheres.count > size_t(INT32_MAX) || header.triangles.count > size_t(INT32_MAX))
+   {
+      file.close();
+      return false;
+   }
+
+   // materials are the only records turned back into objects; there are few
+   materials.clear();
+   const cached_material* m = section<cached_material>(header.materials);
+   for (uint64_t i = 0; i < header.materials.count; i++) {
+      const float* p = m[i].params;
+      switch (m[i].type) {
+      case cached_lambertian:
+         materials.push_back(std::make_shared<lambertian>(glm::color(p[0], p[1], p[2])));
+         break;
+      case cached_metal:
+         materials.push_back(std::make_shared<metal>(glm::color(p[0], p[1], p[2]), p[3]));
+         break;
+      case cached_dielectric:
+         materials.push_back(std::make_shared<dielectric>(p[0]));
+         break;
+      default:
+         materials.push_back(std::make_shared<phong>(glm::color(p[0], p[1], p[2]),
+            glm::color(p[3], p[4], p[5]), glm::color(p[6], p[7], p[8]),
+            glm::point3(p[9], p[10], p[11]), glm::point3(p[12], p[13], p[14]),
+            p[15], p[16], p[17], p[18]));
+         break;
+      }
+   }
+
+   spheres = section<cached_sphere>(header.spheres);
+   triangles = section<cached_triangle>(header.triangles);
+   planes = section<cached_plane>(header.planes);
+   nodes = section<bvh_node>(header.nodes);
+   refs = section<int32_t>(header.refs);
+   num_spheres = header.spheres.count;
+   num_triangles = header.triangles.count;
+   num_planes = header.planes.count;
+   num_nodes = header.nodes.count;
+   num_refs = header.refs.count;
+   source_objects = header.source_objects;
+#ifndef _WIN32
+   // the upper levels of the tree are touched by every ray
+   uint64_t page_start = header.nodes.offset & ~uint64_t(4095);
+   uint64_t prefetch = std::min<uint64_t>(header.nodes.count, 1 << 16) * sizeof(bvh_node);
+   madvise(const_cast<char*>(file.data) + page_start, header.nodes.offset - page_start + prefetch, MADV_WILLNEED);
+#endif
+   return true;
+}
+
+inline bool scene_cache::bind(const hittable_list& world)
+{
+   if (!file.data || world.objects.size() != source_objects) return false;
+   sources = world.objects;
+   source_arena = world.arena;
+   return true;
+}
+
+inline bool scene_cache::write(const std::string& path, const flat_scene& scene, uint64_t source_key)
+{
+   int num_spheres = (int) scene.spheres.size();
+   std::vector<aabb> bounds(num_spheres + scene.triangles.size());
+   for (int i = 0; i < num_spheres; i++) {
+      const cached_sphere& s = scene.spheres[i];
+      bounds[i] = aabb(s.center - glm::vec3(s.radius), s.center + glm::vec3(s.radius));
+   }
+   for (size_t i = 0; i < scene.triangles.size(); i++) {
+      const cached_triangle& t = scene.triangles[i];
+      bounds[num_spheres + i] = aabb(glm::min(t.a, glm::min(t.b, t.c)), glm::max(t.a, glm::max(t.b, t.c)));
+   }
+
+   bvh_builder builder(bounds, 4);
+   std::vector<bvh_node> tree = builder.build();
+   std::vector<int32_t> leaf_refs(builder.indices.size());
+   for (size_t k = 0; k < leaf_refs.size(); k++) {
+      int i = builder.indices[k];
+      leaf_refs[k] = i < num_spheres ? i : ~(i - num_spheres);
+   }
+
+   scene_cache_header header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, "RTSCENE", 8);
+   header.version = scene_cache_header::current_version;
+   header.byte_order = scene_cache_header::byte_order_mark;
+   header.source_key = source_key;
+   header.source_objects = scene.source_objects;
+
+   uint64_t offset = sizeof(header);
+   struct layout {
+      static cached_section next(uint64_t& offset, size_t count, size_t size) {
+         offset = (offset + 63) & ~uint64_t(63);
+         cached_section s = { offset, count };
+         offset += count * size;
+         return s;
+      }
+   };
+   header.materials = layout::next(offset, scene.materials.size(), sizeof(cached_material));
+   header.spheres = layout::next(offset, scene.spheres.size(), sizeof(cached_sphere));
+   header.triangles = layout::next(offset, scene.triangles.size(), sizeof(cached_triangle));
+   header.planes = layout::next(offset, scene.planes.size(), sizeof(cached_plane));
+   header.nodes = layout::next(offset, tree.size(), sizeof(bvh_node));
+   header.refs = layout::next(offset, leaf_refs.size(), sizeof(int32_t));
+   header.file_size = offset;
+
+   // write next to the target and rename, so readers never see half a file
+   std::string temp_path = path + ".tmp";
+   std::ofstream out(temp_path.c_str(), std::ios::binary | std::ios::trunc);
+   if (!out) return false;
+   struct writer {
+      static void section(std::ofstream& out, const cached_section& s, const void* data, size_t size) {
+         static const char zeros[64] = { 0 };
+         out.write(zeros, s.offset - (uint64_t) out.tellp());
+         out.write(static_cast<const char*>(data), s.count * size);
+      }
+   };
+   out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+   writer::section(out, header.materials, scene.materials.data(), sizeof(cached_material));
+   writer::section(out, header.spheres, scene.spheres.data(), sizeof(cached_sphere));
+   writer::section(out, header.triangles, scene.triangles.data(), sizeof(cached_triangle));
+   writer::section(out, header.planes, scene.planes.data(), sizeof(cached_plane));
+   writer::section(out, header.nodes, tree.data(), sizeof(bvh_node));
+   writer::section(out, header.refs, leaf_refs.data(), sizeof(int32_t));
+   out.close();
+   if (!out) {
+      std::remove(temp_path.c_str());
+      return false;
+   }
+
+   std::remove(path.c_str());
+   return std::rename(temp_path.c_str(), path.c_str()) == 0;
+}
+
+inline bool scene_cache::hit(const ray& r, float min_t, float max_t, hit_record& rec) const
+{
+   // intersect through stack copies of the primitives so results match the
+   // scene exactly; the material and object are filled in after the closest
+   // hit is known
+   hit_record temp_rec;
+   bool hit_anything = false;
+   float closest_so_far = max_t;
+   int32_t hit_material = -1;
+   int hit_kind = cached_plane_kind;
+   int32_t hit_index = -1;
+
+   for (size_t i = 0; i < num_planes; i++) {
+      plane p(planes[i].a, planes[i].n, 0);
+      if (p.hit_interval(r, min_t, closest_so_far, temp_rec)) {
+         hit_anything = true;
+         closest_so_far = temp_rec.t;
+         rec = temp_rec;
+         hit_material = planes[i].material;
+         hit_index = (int32_t) i;
+      }
+   }
+
+   if (num_nodes > 0) {
+      glm::point3 origin = r.origin();
+      glm::vec3 inv_dir = 1.0f / r.direction();
+
+      struct entry { int node; float t; };
+      entry stack[bvh_builder::max_depth + 2];
+      int top = 0;
+
+      float t_root;
+      if (nodes[0].box.hit(origin, inv_dir, min_t, closest_so_far, t_root)) stack[top++] = { 0, t_root };
+
+      while (top > 0) {
+         entry e = stack[--top];
+         if (e.t > closest_so_far) continue;
+
+         const bvh_node* n = &nodes[e.node];
+         while (n->count == 0) {
+            int left = n->first;
+            float t_left, t_right;
+            bool hit_left = nodes[left].box.hit(origin, inv_dir, min_t, closest_so_far, t_left);
+            bool hit_right = nodes[left + 1].box.hit(origin, inv_dir, min_t, closest_so_far, t_right);
+            if (hit_left && hit_right) {
+               if (t_left <= t_right) {
+                  stack[top++] = { left + 1, t_right };
+                  n = &nodes[left];
+               }
+               else {
+                  stack[top++] = { left, t_left };
+                  n = &nodes[left + 1];
+               }
+            }
+            else if (hit_left) n = &nodes[left];
+            else if (hit_right) n = &nodes[left + 1];
+            else break;
+         }
+         if (n->count == 0) continue;
+
+         for (int k = n->first; k < n->first + n->count; k++) {
+            int32_t ref = refs[k];
+            bool hit_prim;
+            int32_t prim_material;
+            if (ref >= 0) {
+               const cached_sphere& c = spheres[ref];
+               sphere s(c.center, c.radius, 0);
+               hit_prim = s.hit_interval(r, min_t, closest_so_far, temp_rec);
+               prim_material = c.material;
+            }
+            else {
+               const cached_triangle& c = triangles[~ref];
+               triangle t(c.a, c.b, c.c, 0);
+               hit_prim = t.hit_interval(r, min_t, closest_so_far, temp_rec);
+               prim_material = c.material;
+            }
+            if (hit_prim) {
+               hit_anything = true;
+               closest_so_far = temp_rec.t;
+               rec = temp_rec;
+               hit_material = prim_material;
+               hit_kind = ref >= 0 ? cached_sphere_kind : cached_triangle_kind;
+               hit_index = ref >= 0 ? ref : ~ref;
+            }
+         }
+      }
+   }
+
+   if (!hit_anything) return false;
+   rec.mat_ptr = hit_material >= 0 ? materials[hit_material] : std::shared_ptr<material>();
+   rec.object = object(hit_kind, hit_index); // not the stack copy
+   return true;
+}
+
+inline const hittable* scene_cache::object(int kind, int32_t index) const
+{
+   int32_t source = kind == cached_sphere_kind ? spheres[index].source :
+      kind == cached_triangle_kind ? triangles[index].source : planes[index].source;
+   if (source >= 0 && (size_t) source < sources.size()) return sources[source].get();
+
+   uint64_t id = (uint64_t(kind) << 32) | uint32_t(index);
+   proxy_shard& shard = proxies[id % num_shards];
+   std::lock_guard<std::mutex> lock(shard.mutex);
+   std::shared_ptr<hittable>& proxy = shard.objects[id];
+   if (!proxy) {
+      struct table {
+         static std::shared_ptr<material> at(const std::vector<std::shared_ptr<material>>& m, int32_t i) {
+            return i >= 0 ? m[i] : std::shared_ptr<material>();
+         }
+      };
+      if (kind == cached_sphere_kind) {
+         const cached_sphere& c = spheres[index];
+         proxy = std::make_shared<sphere>(c.center, c.radius, table::at(materials, c.material));
+      }
+      else if (kind == cached_triangle_kind) {
+         const cached_triangle& c = triangles[index];
+         proxy = std::make_shared<triangle>(c.a, c.b, c.c, table::at(materials, c.material));
+      }
+      else {
+         const cached_plane& c = planes[index];
+         proxy = std::make_shared<plane>(c.a, c.n, table::at(materials, c.material));
+      }
+   }
+   return proxy.get();
+}
+
+inline std::shared_ptr<scene_cache> open_scene_cache(const std::string& path, uint64_t source_key,
+   accelerator_report& report)
+{
+   auto start = std::chrono::steady_clock::now();
+   std::shared_ptr<scene_cache> cache = std::make_shared<scene_cache>();
+   if (!cache->open(path, source_key)) return std::shared_ptr<scene_cache>();
+   report.reason = "reused " + path;
+   report.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   report.name = cache->name();
+   return cache;
+}
+
+inline std::shared_ptr<accelerator> open_scene_cache(const hittable_list& world,
+   const std::string& path, uint64_t source_key, accelerator_report& report)
+{
+   auto start = std::chrono::steady_clock::now();
+   std::shared_ptr<scene_cache> cache = std::make_shared<scene_cache>();
+   report.reason = "reused " + path;
+   if (!cache->open(path, source_key) || !cache->bind(world)) {
+      // the world is flattened only when the cache is missing or stale
+      report.reason = "rebuilt " + path;
+      flat_scene scene;
+      if (!scene.flatten(world) || !scene_cache::write(path, scene, source_key) ||
+          !cache->open(path, source_key) || !cache->bind(world))
+      {
+         return std::shared_ptr<accelerator>();
+      }
+   }
+   report.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   report.name = cache->name();
+   return cache;
+}
+
+#endif
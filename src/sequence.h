@@ -0,0 +1,430 @@
+// sequence.h, frames along a keyframed camera path that reuse the last one
+//
+// A flythrough renders one scene from a camera that moves a little between
+// frames. camera_path interpolates keyframes of the look-at camera:
+// Catmull-Rom splines through the positions and targets, the up vector and
+// field of view linearly. sequence_renderer traces its frames through one
+// world and accelerator, built once, and keeps the last frame's converged
+// radiance per pixel along with the surface it belongs to. Every frame
+// traces a few samples per pixel with render (render.h), from which it also
+// takes the first hits. Each pixel's hit is projected into the last camera
+// (its motion vector) and the history there is kept where the last frame
+// saw the same surface: the same object, with normals and positions that
+// agree. Elsewhere the pixel is disoccluded and starts over, as do pixels
+// on silhouettes, whose samples see more than one surface: their history
+// would leave a trail wherever the surfaces move apart.
+// History whose mean the new samples contradict beyond their noise is
+// unstable (a moving highlight, a changed light): it keeps fill_samples at
+// most. A fixed budget of further samples goes to disoccluded and unstable
+// pixels first, then to those whose estimate is least certain, so that
+// every frame costs about the same.
+// History is capped at max_history samples, so stale light fades.
+// Photons and light paths are not traced: they need every sample of a pass.
+
+#ifndef SEQUENCE_H_
+#define SEQUENCE_H_
+
+#include "AGLM.h"
+#include "camera.h"
+#include "render.h"
+#include "sampler.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct camera_keyframe {
+   float time;
+   glm::point3 lookfrom;
+   glm::point3 lookat;
+   glm::vec3 vup;
+   float vfov; // vertical field of view in degrees
+};
+
+class camera_path {
+public:
+   // keys may be added in any order; a key at the time of another replaces it
+   void add(const camera_keyframe& key);
+
+   bool empty() const { return keys.empty(); }
+   float start() const { return keys.empty() ? 0.0f : keys.front().time; }
+   float end() const { return keys.empty() ? 0.0f : keys.back().time; }
+
+   // the camera at time, held at the first and last keys outside the path
+   camera_keyframe at(float time) const;
+   camera get_camera(float time, float aspect_ratio) const {
+      camera_keyframe key = at(time);
+      return camera(key.lookfrom, key.lookat, key.vup, key.vfov, aspect_ratio);
+   }
+
+private:
+   std::vector<camera_keyframe> keys;
+};
+
+struct sequence_settings {
+   float extra_samples = 2.0f; // per pixel on average, every frame, traced where they help most
+   int fill_samples = 8; // disoccluded and unstable pixels get up to this many samples first
+   int max_extra = 16; // further samples of one pixel in one frame at most
+   int max_history = 64; // samples a pixel keeps from earlier frames at most
+   float position_tolerance = 2.0f; // positions agree along the normal within this many pixels at their distance
+   float normal_tolerance = 0.9f; // least cosine between the normals of the same surface
+   float sigma_luminance = 4.0f; // new samples contradict history beyond this many standard deviations
+};
+
+class sequence_renderer {
+public:
+   enum pixel_state : uint8_t { pixel_reused, pixel_disoccluded, pixel_unstable };
+
+   // Frames of width x height; render_settings.samples_per_pixel samples of
+   // every pixel every frame, drawn with a new seed per frame
+   sequence_renderer(int width, int height, const render_settings& r = render_settings(),
+      const sequence_settings& s = sequence_settings());
+
+   // Renders the next frame through cam. culler, when given, is built for
+   // cam; world, lights and environment are those of every frame.
+   template <class world_t>
+   void frame(const world_t& world, const camera& cam, const tile_culler* culler = 0,
+      const light_tree* lights = 0, const environment_map* environment = 0);
+
+   // forgets the history: the next frame starts over
+   void reset() { frames = 0; }
+
+   // the radiance of every pixel, averaged: normalize it as 1 sample
+   const framebuffer& image() const { return output; }
+   // per pixel, where its surface was in the last frame, in pixels
+   const std::vector<glm::vec2>& motion() const { return motion_vectors; }
+   const std::vector<uint8_t>& states() const { return state; }
+   // samples traced by the last frame: render's and at most extra_samples per pixel more
+   size_t traced() const { return traced_samples; }
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "sequence: frame " << frames << ", " << reused << " pixels reused, " << disoccluded
+         << " disoccluded, " << unstable << " unstable, " << traced_samples << " samples" << std::endl;
+      return ss.str();
+   }
+
+private:
+   struct history {
+      glm::color mean; // radiance per sample
+      float luminance_sqr; // mean squared luminance of the samples
+      float samples;
+      glm::vec3 position; // of the first hit, or the direction of the ray where it hit nothing
+      glm::vec3 normal;
+      const hittable* object; // of the first sample
+      bool edge; // the samples saw more than one surface: history neither kept nor given
+   };
+
+   static float luminance(const glm::color& c) { return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b; }
+
+   // the direction of the ray through the center of pixel (i, j)
+   glm::vec3 center_direction(const camera& cam, int i, int j) const {
+      return cam.get_lower_left_corner() + (i + 0.5f) / (width - 1) * cam.get_horizontal() +
+         (height - j - 1.5f) / (height - 1) * cam.get_vertical() - cam.get_origin();
+   }
+
+   // the angle of a pixel from the camera, as render takes it
+   float pixel_angle(const camera& cam) const {
+      glm::vec3 forward = cam.get_lower_left_corner() - cam.get_origin() +
+         0.5f * cam.get_horizontal() + 0.5f * cam.get_vertical();
+      return glm::length(cam.get_vertical()) / std::max(1, height - 1) / glm::length(forward);
+   }
+
+   void allocate(std::vector<int>& extra) const;
+   template <class world_t>
+   void trace_extra(const world_t& world, const camera& cam, const std::vector<int>& extra,
+      const light_tree* lights, const environment_map* environment, std::vector<glm::color>& sums,
+      std::vector<float>& luminance_sqr);
+
+   int width;
+   int height;
+   render_settings settings;
+   sequence_settings sequence;
+   int frames = 0;
+   glm::point3 last_origin;
+   glm::mat3 last_inverse; // from directions to (u, v, 1) on the last camera's image plane, scaled
+   std::vector<history> last, next;
+   framebuffer output;
+   std::vector<glm::vec2> motion_vectors;
+   std::vector<uint8_t> state;
+   std::vector<float> error; // of every pixel's estimate, as displayed, before the further samples
+   int reused = 0, disoccluded = 0, unstable = 0;
+   size_t traced_samples = 0;
+};
+
+//-----------------------------------------------------------------------------
+
+inline void camera_path::add(const camera_keyframe& key)
+{
+   std::vector<camera_keyframe>::iterator it = keys.begin();
+   while (it != keys.end() && it->time < key.time) ++it;
+   if (it != keys.end() && it->time == key.time) *it = key;
+   else keys.insert(it, key);
+}
+
+inline camera_keyframe camera_path::at(float time) const
+{
+   if (keys.empty()) return camera_keyframe{ time, glm::point3(0), glm::point3(0, 0, -1), glm::vec3(0, 1, 0), 90 };
+   if (time <= keys.front().time) return keys.front();
+   if (time >= keys.back().time) return keys.back();
+   size_t k = 1;
+   while (keys[k].time < time) k++;
+   const camera_keyframe& k1 = keys[k - 1];
+   const camera_keyframe& k2 = keys[k];
+   const camera_keyframe& k0 = k >= 2 ? keys[k - 2] : k1;
+   const camera_keyframe& k3 = k + 1 < keys.size() ? keys[k + 1] : k2;
+   float span = k2.time - k1.time;
+   float s = (time - k1.time) / span;
+
+   // cubic Hermite with Catmull-Rom tangents, scaled to keys unevenly spaced in time
+   float s2 = s * s, s3 = s2 * s;
+   float h00 = 2 * s3 - 3 * s2 + 1, h10 = s3 - 2 * s2 + s, h01 = -2 * s3 + 3 * s2, h11 = s3 - s2;
+   auto spline = [&](const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, const glm::vec3& p3) {
+      glm::vec3 m1 = (p2 - p0) / std::max(1e-6f, k2.time - k0.time) * span;
+      glm::vec3 m2 = (p3 - p1) / std::max(1e-6f, k3.time - k1.time) * span;
+      return h00 * p1 + h10 * m1 + h01 * p2 + h11 * m2;
+   };
+   camera_keyframe key;
+   key.time = time;
+   key.lookfrom = spline(k0.lookfrom, k1.lookfrom, k2.lookfrom, k3.lookfrom);
+   key.lookat = spline(k0.lookat, k1.lookat, k2.lookat, k3.lookat);
+   key.vup = glm::mix(k1.vup, k2.vup, s);
+   key.vfov = k1.vfov + (k2.vfov - k1.vfov) * s;
+   return key;
+}
+
+inline sequence_renderer::sequence_renderer(int w, int h, const render_settings& r, const sequence_settings& s) :
+   width(w), height(h), settings(r), sequence(s), last(w * h), next(w * h), output(w, h),
+   motion_vectors(w * h, glm::vec2(0)), state(w * h, pixel_disoccluded), error(w * h, 0.0f)
+{
+   settings.caustic_photons = 0;
+   settings.light_paths = 0;
+}
+
+template <class world_t>
+void sequence_renderer::frame(const world_t& world, const camera& cam, const tile_culler* culler,
+   const light_tree* lights, const environment_map* environment)
+{
+   // new samples of every pixel, with their first hits
+   render_settings current = settings;
+   current.seed = settings.seed + uint32_t(frames) * 0x9e3779b9u;
+   framebuffer image(width, height);
+   feature_buffer features(width, height);
+   render_inputs inputs;
+   inputs.culler = culler;
+   inputs.lights = lights;
+   inputs.environment = environment;
+   inputs.features = &features;
+   render(world, cam, current, image, inputs);
+
+   // each pixel's history, from the last frame where it saw the same surface;
+   // a first hit is known up to the pixel's width at its depth
+   float tolerance = sequence.position_tolerance * pixel_angle(cam);
+   parallel_for(0, height, 1, [&](int first, int last_row) {
+      for (int j = first; j < last_row; j++) {
+         for (int i = 0; i < width; i++) {
+            int pixel = j * width + i;
+            int count = features.samples[pixel];
+            history& h = next[pixel];
+            h.object = features.object[pixel];
+            glm::vec3 direction = glm::normalize(center_direction(cam, i, j));
+            float depth = count > 0 ? features.depth[pixel] / count : 0.0f;
+            float normal_length = glm::length(features.normal[pixel]);
+            h.normal = normal_length > 0 ? features.normal[pixel] / normal_length : glm::vec3(0);
+            h.position = h.object ? cam.get_origin() + direction * depth : direction;
+            // samples that hit nothing add no normal, and those on other surfaces other ones
+            h.edge = h.object ? normal_length < sequence.normal_tolerance * count : normal_length > 0;
+            h.mean = glm::color(0);
+            h.luminance_sqr = 0;
+            h.samples = 0;
+            motion_vectors[pixel] = glm::vec2(0);
+            state[pixel] = pixel_disoccluded;
+            if (frames == 0 || h.edge) continue;
+
+            // where the surface was on the last image, in pixels from the top left corner
+            glm::vec3 x = last_inverse * (h.object ? h.position - last_origin : h.position);
+            if (x.z <= 0) continue;
+            float fx = x.x / x.z * (width - 1) - 0.5f;
+            float fy = (height - 1) * (1 - x.y / x.z) - 0.5f;
+            motion_vectors[pixel] = glm::vec2(fx - i, fy - j);
+            int i0 = int(std::floor(fx)), j0 = int(std::floor(fy));
+            float ax = fx - i0, ay = fy - j0;
+            float total = 0;
+            for (int tap = 0; tap < 4; tap++) {
+               int ti = i0 + (tap & 1), tj = j0 + (tap >> 1);
+               if (ti < 0 || tj < 0 || ti >= width || tj >= height) continue;
+               const history& p = last[tj * width + ti];
+               if (p.samples <= 0 || p.edge || p.object != h.object) continue;
+               // the last hit lies on the plane of this one, as far as depths are known
+               if (h.object && (glm::dot(p.normal, h.normal) < sequence.normal_tolerance ||
+                  std::fabs(glm::dot(p.position - h.position, h.normal)) > tolerance * depth)) {
+                  continue;
+               }
+               float weight = ((tap & 1) ? ax : 1 - ax) * ((tap >> 1) ? ay : 1 - ay);
+               h.mean += weight * p.mean;
+               h.luminance_sqr += weight * p.luminance_sqr;
+               h.samples += weight * p.samples;
+               total += weight;
+            }
+            if (total < 0.01f) {
+               h.mean = glm::color(0);
+               h.luminance_sqr = 0;
+               h.samples = 0;
+               continue;
+            }
+            h.mean /= total;
+            h.luminance_sqr /= total;
+            h.samples = std::min(h.samples / total, float(sequence.max_history));
+            state[pixel] = pixel_reused;
+            if (count == 0) continue;
+
+            // new samples that the history's noise does not explain
+            float mean = luminance(h.mean);
+            float variance = std::max(0.0f, h.luminance_sqr - mean * mean);
+            float difference = std::fabs(luminance(image.radiance[pixel]) / count - mean);
+            float allowed = sequence.sigma_luminance * std::sqrt(variance * (1.0f / count + 1.0f / h.samples)) +
+               0.02f * mean;
+            if (difference > allowed) {
+               h.samples = std::min(h.samples, float(sequence.fill_samples));
+               state[pixel] = pixel_unstable;
+            }
+         }
+      }
+   });
+
+   // the error of every estimate, in the gamma 2 of the materials renderer
+   reused = disoccluded = unstable = 0;
+   for (int pixel = 0; pixel < width * height; pixel++) {
+      const history& h = next[pixel];
+      int count = features.samples[pixel];
+      float n = h.samples + count;
+      reused += state[pixel] == pixel_reused;
+      disoccluded += state[pixel] == pixel_disoccluded;
+      unstable += state[pixel] == pixel_unstable;
+      if (n <= 0) {
+         error[pixel] = 0;
+         continue;
+      }
+      float mean = (luminance(h.mean) * h.samples + luminance(image.radiance[pixel])) / n;
+      float square = (h.luminance_sqr * h.samples + features.luminance_sqr[pixel]) / n;
+      float variance = std::max(0.0f, square - mean * mean);
+      error[pixel] = std::sqrt(variance / n) / (2 * std::sqrt(std::max(mean, 0.0f) + 0.01f));
+   }
+
+   std::vector<int> extra;
+   allocate(extra);
+   trace_extra(world, cam, extra, lights, environment, image.radiance, features.luminance_sqr);
+   traced_samples = size_t(width) * height * settings.samples_per_pixel;
+   for (size_t pixel = 0; pixel < extra.size(); pixel++) traced_samples += extra[pixel];
+
+   // blend history and new samples; they are the history of the next frame
+   for (int pixel = 0; pixel < width * height; pixel++) {
+      history& h = next[pixel];
+      float count = float(features.samples[pixel] + extra[pixel]);
+      float n = h.samples + count;
+      if (n > 0) {
+         h.mean = (h.mean * h.samples + image.radiance[pixel]) / n;
+         h.luminance_sqr = (h.luminance_sqr * h.samples + features.luminance_sqr[pixel]) / n;
+      }
+      h.samples = std::min(n, float(sequence.max_history));
+      output.radiance[pixel] = h.mean;
+   }
+   last.swap(next);
+
+   glm::mat3 basis(cam.get_horizontal(), cam.get_vertical(), cam.get_lower_left_corner() - cam.get_origin());
+   last_inverse = glm::inverse(basis);
+   last_origin = cam.get_origin();
+   frames++;
+}
+
+// The budget goes to disoccluded and unstable pixels up to fill_samples,
+// shared evenly if it is short, then in proportion to the error of every
+// pixel, max_extra at most per pixel
+inline void sequence_renderer::allocate(std::vector<int>& extra) const
+{
+   int pixels = width * height;
+   extra.assign(pixels, 0);
+   long budget = std::lround(sequence.extra_samples * pixels);
+   int fill = std::min(std::max(0, sequence.fill_samples - settings.samples_per_pixel), sequence.max_extra);
+   if (budget <= 0) return;
+
+   long wanted = long(fill) * (disoccluded + unstable);
+   float share = wanted > 0 ? std::min(1.0f, float(budget) / wanted) : 0.0f;
+   float carry = 0;
+   for (int pixel = 0; pixel < pixels && wanted > 0; pixel++) {
+      if (state[pixel] == pixel_reused) continue;
+      carry += fill * share;
+      int n = std::min(int(carry), fill);
+      extra[pixel] = n;
+      carry -= n;
+      budget -= n;
+   }
+
+   double total = 0;
+   for (int pixel = 0; pixel < pixels; pixel++) total += error[pixel];
+   if (budget <= 0 || total <= 0) return;
+   double per_error = budget / total;
+   double left = 0;
+   for (int pixel = 0; pixel < pixels && budget > 0; pixel++) {
+      left += error[pixel] * per_error;
+      int n = std::min(int(left), sequence.max_extra - extra[pixel]);
+      n = int(std::min<long>(n, budget));
+      if (n <= 0) continue;
+      extra[pixel] += n;
+      left -= n;
+      budget -= n;
+   }
+}
+
+// Adds the further samples of every pixel to sums, their squared
+// luminances to luminance_sqr; the samples follow the frame's own in the
+// sampler's sequence
+template <class world_t>
+void sequence_renderer::trace_extra(const world_t& world, const camera& cam, const std::vector<int>& extra,
+   const light_tree* lights, const environment_map* environment, std::vector<glm::color>& sums,
+   std::vector<float>& luminance_sqr)
+{
+   std::vector<int> pixels;
+   for (int pixel = 0; pixel < width * height; pixel++) {
+      if (extra[pixel] > 0) pixels.push_back(pixel);
+   }
+   sampler values(settings.sampler, width, settings.seed + uint32_t(frames) * 0x9e3779b9u);
+   float angle = pixel_angle(cam);
+   int first_sample = settings.samples_per_pixel;
+
+   // a pixel's samples are traced together, by one task
+   parallel_for(0, int(pixels.size()), 256, [&](int first, int last_pixel) {
+      std::vector<path_state> paths;
+      std::vector<glm::color> radiance;
+      for (int p = first; p < last_pixel; p++) {
+         int pixel = pixels[p];
+         int i = pixel % width, j = pixel / width;
+         for (int s = 0; s < extra[pixel]; s++) {
+            int index = first_sample + s;
+            float u = float(i + values.get(i, j, index, dimension_jitter)) / (width - 1);
+            float v = float(height - j - 1 - values.get(i, j, index, dimension_jitter + 1)) / (height - 1);
+            path_state path = { cam.get_ray(u, v), glm::color(1), int(paths.size()), i, j, index,
+               0.0f, 0.0f, angle, 0, false, false, -1 };
+            paths.push_back(path);
+         }
+      }
+      radiance.assign(paths.size(), glm::color(0));
+      std::vector<path_state> traced = paths;
+      trace_options options;
+      options.values = &values;
+      options.lights = lights;
+      options.environment = environment;
+      trace_paths(world, traced, radiance, settings.max_depth, settings.sort_secondary_rays, options);
+      for (size_t k = 0; k < paths.size(); k++) {
+         int pixel = paths[k].y * width + paths[k].x;
+         float l = luminance(radiance[k]);
+         sums[pixel] += radiance[k];
+         luminance_sqr[pixel] += l * l;
+      }
+   });
+}
+
+#endif
@@ -0,0 +1,139 @@
+// simd.h, minimal 4-wide float vectors (SSE when available) and aligned storage
+
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SSE 1
+#include <emmintrin.h>
+#endif
+
+// with -mavx or /arch:AVX (the RT_ENABLE_AVX option of CMakeLists.txt)
+#if defined(__AVX__)
+#define RT_AVX 1
+#include <immintrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+struct float4 {
+#ifdef RT_SSE
+   __m128 v;
+   float4() {}
+   float4(__m128 x) : v(x) {}
+   explicit float4(float x) : v(_mm_set1_ps(x)) {}
+   static float4 load(const float* p) { return float4(_mm_load_ps(p)); }
+   static float4 loadu(const float* p) { return float4(_mm_loadu_ps(p)); }
+   void store(float* p) const { _mm_store_ps(p, v); }
+#else
+   float v[4];
+   float4() {}
+   explicit float4(float x) { v[0] = v[1] = v[2] = v[3] = x; }
+   static float4 load(const float* p) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = p[i]; return r; }
+   static float4 loadu(const float* p) { return load(p); }
+   void store(float* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+#endif
+};
+
+#ifdef RT_SSE
+inline float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+inline float4 min(float4 a, float4 b) { return _mm_min_ps(a.v, b.v); }
+inline float4 max(float4 a, float4 b) { return _mm_max_ps(a.v, b.v); }
+inline float4 sqrt(float4 a) { return _mm_sqrt_ps(a.v); }
+inline float4 abs(float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+// comparisons return lane masks, combined with & | and read with movemask
+inline float4 operator<(float4 a, float4 b) { return _mm_cmplt_ps(a.v, b.v); }
+inline float4 operator<=(float4 a, float4 b) { return _mm_cmple_ps(a.v, b.v); }
+inline float4 operator>(float4 a, float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline float4 operator>=(float4 a, float4 b) { return _mm_cmpge_ps(a.v, b.v); }
+inline float4 operator&(float4 a, float4 b) { return _mm_and_ps(a.v, b.v); }
+inline float4 operator|(float4 a, float4 b) { return _mm_or_ps(a.v, b.v); }
+inline float4 andnot(float4 mask, float4 a) { return _mm_andnot_ps(mask.v, a.v); }
+inline float4 select(float4 mask, float4 a, float4 b) {
+   return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+inline int movemask(float4 mask) { return _mm_movemask_ps(mask.v); }
+#else
+#define RT_FLOAT4_OP(op) \
+   inline float4 operator op(float4 a, float4 b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] op b.v[i]; return r; }
+RT_FLOAT4_OP(+)
+RT_FLOAT4_OP(-)
+RT_FLOAT4_OP(*)
+RT_FLOAT4_OP(/)
+#undef RT_FLOAT4_OP
+inline float4 min(float4 a, float4 b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i]; return r; }
+inline float4 max(float4 a, float4 b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return r; }
+inline float4 sqrt(float4 a) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = std::sqrt(a.v[i]); return r; }
+inline float4 abs(float4 a) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = std::fabs(a.v[i]); return r; }
+// masks are stored as 0 / 1 per lane in the scalar fallback
+#define RT_FLOAT4_CMP(op) \
+   inline float4 operator op(float4 a, float4 b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = a.v[i] op b.v[i] ? 1.0f : 0.0f; return r; }
+RT_FLOAT4_CMP(<)
+RT_FLOAT4_CMP(<=)
+RT_FLOAT4_CMP(>)
+RT_FLOAT4_CMP(>=)
+#undef RT_FLOAT4_CMP
+inline float4 operator&(float4 a, float4 b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = (a.v[i] != 0 && b.v[i] != 0) ? 1.0f : 0.0f; return r; }
+inline float4 operator|(float4 a, float4 b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = (a.v[i] != 0 || b.v[i] != 0) ? 1.0f : 0.0f; return r; }
+inline float4 andnot(float4 mask, float4 a) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = mask.v[i] != 0 ? 0.0f : a.v[i]; return r; }
+inline float4 select(float4 mask, float4 a, float4 b) { float4 r; for (int i = 0; i < 4; i++) r.v[i] = mask.v[i] != 0 ? a.v[i] : b.v[i]; return r; }
+inline int movemask(float4 mask) { int m = 0; for (int i = 0; i < 4; i++) if (mask.v[i] != 0) m |= 1 << i; return m; }
+#endif
+
+// index of the lowest set bit of a non-zero mask
+inline int first_lane(int mask)
+{
+   int lane = 0;
+   while (!(mask & 1)) { mask >>= 1; lane++; }
+   return lane;
+}
+
+// std::vector allocator honoring alignments above alignof(std::max_align_t)
+template <class T, size_t Align = 64>
+struct aligned_allocator {
+   typedef T value_type;
+   template <class U> struct rebind { typedef aligned_allocator<U, Align> other; };
+
+   aligned_allocator() {}
+   template <class U> aligned_allocator(const aligned_allocator<U, Align>&) {}
+
+   T* allocate(size_t n) {
+      void* p = 0;
+#if defined(_WIN32)
+      p = _aligned_malloc(n * sizeof(T), Align);
+#else
+      if (posix_memalign(&p, Align, n * sizeof(T)) != 0) p = 0;
+#endif
+      if (!p) throw std::bad_alloc();
+      return static_cast<T*>(p);
+   }
+
+   void deallocate(T* p, size_t) {
+#if defined(_WIN32)
+      _aligned_free(p);
+#else
+      free(p);
+#endif
+   }
+};
+
+template <class T, class U, size_t A>
+bool operator==(const aligned_allocator<T, A>&, const aligned_allocator<U, A>&) { return true; }
+template <class T, class U, size_t A>
+bool operator!=(const aligned_allocator<T, A>&, const aligned_allocator<U, A>&) { return false; }
+
+template <class T>
+using aligned_vector = std::vector<T, aligned_allocator<T>>;
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "hittable.h"
 #include "AGLM.h"
+#include <algorithm>
 
 class sphere : public hittable {
 public:
@@ -13,12 +14,81 @@ public:
 
    virtual bool hit(const ray& r, hit_record& rec) const override;
 
+   virtual bool bounding_box(aabb& output_box) const override {
+      output_box = aabb(center - glm::vec3(radius), center + glm::vec3(radius));
+      return true;
+   }
+
+   virtual bool transform(const glm::mat4& m) override {
+      center = glm::point3(m * glm::vec4(center, 1.0f));
+      radius *= glm::length(glm::vec3(m[0]));
+      return true;
+   }
+
+   // uniform over the cone of directions in which the sphere is seen from o
+   virtual float sample_direction(const glm::point3& o, float u1, float u2, glm::vec3& direction) const override {
+      glm::vec3 to_center = center - o;
+      float dist_sqr = glm::dot(to_center, to_center);
+      float one_minus_cos = cone_one_minus_cos(dist_sqr);
+      if (one_minus_cos <= 0.0f) return 0.0f;
+
+      float cos_theta = 1.0f - u1 * one_minus_cos;
+      float sin_theta = std::sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+      float phi = 2.0f * pi * u2;
+      glm::vec3 w = to_center / std::sqrt(dist_sqr);
+      glm::vec3 a = std::fabs(w.x) > 0.9f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+      glm::vec3 v = glm::normalize(glm::cross(w, a));
+      glm::vec3 u = glm::cross(w, v);
+      direction = (std::cos(phi) * sin_theta) * u + (std::sin(phi) * sin_theta) * v + cos_theta * w;
+      return 1.0f / (2.0f * pi * one_minus_cos);
+   }
+
+   virtual float direction_pdf(const glm::point3& o, const hit_record& rec) const override {
+      glm::vec3 to_center = center - o;
+      float one_minus_cos = cone_one_minus_cos(glm::dot(to_center, to_center));
+      return one_minus_cos > 0.0f ? 1.0f / (2.0f * pi * one_minus_cos) : 0.0f;
+   }
+
+   virtual float area() const override { return 4.0f * pi * radius * radius; }
+
+   virtual bool sample_surface(float u1, float u2, hit_record& rec) const override {
+      float z = 1.0f - 2.0f * u1;
+      float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+      glm::vec3 n(r * std::cos(2.0f * pi * u2), r * std::sin(2.0f * pi * u2), z);
+      rec.p = center + radius * n;
+      rec.normal = n;
+      rec.front_face = true;
+      rec.mat_ptr = mat_ptr;
+      rec.object = this;
+      return true;
+   }
+
+   // longitude around y from -x, latitude from -y
+   virtual void surface_coordinates(hit_record& rec) const override {
+      glm::vec3 n = (rec.p - center) / radius;
+      rec.u = (std::atan2(-n.z, n.x) + pi) / (2.0f * pi);
+      rec.v = std::acos(glm::clamp(-n.y, -1.0f, 1.0f)) / pi;
+      rec.uv_density = 1.0f / (pi * radius);
+   }
+
+private:
+   // 1 - cos of the half angle of the cone the sphere fills, seen from
+   // dist_sqr away; 0 from inside. Written to stay accurate for far spheres.
+   float cone_one_minus_cos(float dist_sqr) const {
+      float sin_sqr = radius * radius / dist_sqr;
+      if (sin_sqr >= 1.0f) return 0.0f;
+      return sin_sqr / (1.0f + std::sqrt(1.0f - sin_sqr));
+   }
+
 public:
    glm::point3 center;
    float radius;
    std::shared_ptr<material> mat_ptr;
 };
 
+// a sphere owns nothing outside a scene arena unless its material has a control block
+inline bool owns_outside_arena(const sphere& s) { return s.mat_ptr.use_count() > 0; }
+
 bool sphere::hit(const ray& r, hit_record& rec) const {
 
    /* // analytical method:
@@ -55,6 +125,7 @@ bool sphere::hit(const ray& r, hit_record& rec) const {
    rec.t = (t / length(r.direction())); // save the time when we hit the object
    rec.p = r.at(t / length(r.direction())); // ray.origin + t * ray.direction
    rec.mat_ptr = mat_ptr; 
+   rec.object = this;
 
    // save normal
    glm::vec3 outward_normal = normalize(rec.p - center); // compute unit length normal
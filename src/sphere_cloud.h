@@ -0,0 +1,320 @@
+// sphere_cloud.h, millions of spheres in one primitive, 16 bytes each
+//
+// Centers are stored as separate x, y and z arrays and each sphere's radius
+// (as a half float) shares a 32-bit word with its material id, so a sphere
+// takes 16 bytes, with no vtable, material pointer or allocation of its own.
+// The spheres are ordered by a BVH built over them and collapsed to 4-wide
+// nodes; leaves hold up to 16 consecutive spheres, tested four at a time.
+
+#ifndef SPHERE_CLOUD_H_
+#define SPHERE_CLOUD_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "hittable.h"
+#include "simd.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+class sphere_cloud : public hittable {
+public:
+   static const int max_leaf_size = 16;
+
+   // material_ids index materials; radii are rounded to half precision
+   sphere_cloud(const std::vector<glm::point3>& centers, const std::vector<float>& radii,
+      const std::vector<uint16_t>& material_ids, const std::vector<std::shared_ptr<material>>& materials);
+
+   virtual bool hit(const ray& r, hit_record& rec) const override {
+      return hit_interval(r, 0.0f, infinity, rec);
+   }
+   virtual bool hit_interval(const ray& r, float min_t, float max_t, hit_record& rec) const override;
+
+   virtual bool bounding_box(aabb& output_box) const override {
+      output_box = bounds;
+      return !bounds.empty();
+   }
+
+   int size() const { return num_spheres; }
+   glm::point3 center(int i) const { return glm::point3(x[i], y[i], z[i]); }
+   float radius(int i) const { return half_to_float(radius_material[i] >> 16); }
+   int material_id(int i) const { return radius_material[i] & 0xffff; }
+
+   size_t bytes() const {
+      return nodes.size() * sizeof(wide_bvh_node<4>) +
+         x.size() * (3 * sizeof(float) + sizeof(uint32_t));
+   }
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "sphere cloud: " << num_spheres << " spheres, " << nodes.size() << " nodes, "
+         << bytes() / (1024 * 1024) << " MB" << std::endl;
+      return ss.str();
+   }
+
+   // positive normal half floats only, which is all a radius needs
+   static uint16_t float_to_half(float f) {
+      f = glm::clamp(f, 6.1035156e-5f, 65504.0f);
+      uint32_t bits;
+      memcpy(&bits, &f, sizeof(bits));
+      bits += 0x0fff + ((bits >> 13) & 1); // round to nearest even
+      return (uint16_t) ((bits >> 13) - (112 << 10));
+   }
+
+   static float half_to_float(uint32_t h) {
+      uint32_t bits = (h << 13) + (112 << 23);
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      return f;
+   }
+
+public:
+   aabb bounds;
+   aligned_vector<wide_bvh_node<4>> nodes;
+   // spheres in leaf order, padded by 3 so that every leaf can load 4 lanes
+   aligned_vector<float> x, y, z;
+   aligned_vector<uint32_t> radius_material; // half radius << 16 | material id
+   std::vector<std::shared_ptr<material>> materials;
+   int num_spheres;
+
+private:
+   // a child is a node index, or ~(first << 5 | count) for a leaf
+   static int leaf_child(int first, int count) { return ~(first << 5 | count); }
+
+   int collapse(int tree_node, const std::vector<bvh_node>& tree,
+      const std::vector<int>& begin, const std::vector<int>& end);
+   int split(int first, int count);
+   void hit_leaf(int first, int count, const simd_ray& sr, float min_t,
+      float& closest_so_far, int& closest) const;
+};
+
+inline sphere_cloud::sphere_cloud(const std::vector<glm::point3>& centers, const std::vector<float>& radii,
+   const std::vector<uint16_t>& material_ids, const std::vector<std::shared_ptr<material>>& mats) :
+   materials(mats), num_spheres((int) centers.size())
+{
+   std::vector<uint16_t> half_radii(num_spheres);
+   std::vector<aabb> sphere_bounds(num_spheres);
+   for (int i = 0; i < num_spheres; i++) {
+      half_radii[i] = float_to_half(radii[i]);
+      glm::vec3 extent(half_to_float(half_radii[i])); // bounds of the sphere as stored
+      sphere_bounds[i] = aabb(centers[i] - extent, centers[i] + extent);
+      bounds.grow(sphere_bounds[i]);
+   }
+
+   bvh_builder builder(sphere_bounds, max_leaf_size);
+   std::vector<bvh_node> tree = builder.build();
+   if (tree.empty()) return;
+
+   x.resize(num_spheres + 3, 0.0f);
+   y.resize(num_spheres + 3, 0.0f);
+   z.resize(num_spheres + 3, 0.0f);
+   radius_material.resize(num_spheres + 3, 0);
+   for (int k = 0; k < num_spheres; k++) {
+      int i = builder.indices[k];
+      x[k] = centers[i].x;
+      y[k] = centers[i].y;
+      z[k] = centers[i].z;
+      radius_material[k] = uint32_t(half_radii[i]) << 16 | material_ids[i];
+   }
+
+   // spheres under each tree node; children always come after their parent
+   std::vector<int> begin(tree.size()), end(tree.size());
+   for (int n = (int) tree.size() - 1; n >= 0; n--) {
+      begin[n] = tree[n].count > 0 ? tree[n].first : begin[tree[n].first];
+      end[n] = tree[n].count > 0 ? tree[n].first + tree[n].count : end[tree[n].first + 1];
+   }
+
+   int root = collapse(0, tree, begin, end);
+   if (root < 0) {
+      // a single leaf still gets a root node so traversal has one entry point
+      wide_bvh_node<4> node;
+      for (int k = 0; k < 4; k++) {
+         node.lo_x[k] = node.lo_y[k] = node.lo_z[k] = infinity;
+         node.hi_x[k] = node.hi_y[k] = node.hi_z[k] = infinity;
+         node.child[k] = 0;
+      }
+      node.lo_x[0] = bounds.minimum.x; node.lo_y[0] = bounds.minimum.y; node.lo_z[0] = bounds.minimum.z;
+      node.hi_x[0] = bounds.maximum.x; node.hi_y[0] = bounds.maximum.y; node.hi_z[0] = bounds.maximum.z;
+      node.child[0] = root;
+      node.num_children = 1;
+      nodes.push_back(node);
+   }
+}
+
+// Returns the child code of a tree node: subtrees small enough become one
+// leaf, others a 4-wide node made by opening the largest children first.
+inline int sphere_cloud::collapse(int tree_node, const std::vector<bvh_node>& tree,
+   const std::vector<int>& begin, const std::vector<int>& end)
+{
+   int count = end[tree_node] - begin[tree_node];
+   if (tree[tree_node].count > 0) return split(begin[tree_node], count);
+   if (count <= max_leaf_size) return leaf_child(begin[tree_node], count);
+
+   std::vector<int> kids;
+   kids.push_back(tree[tree_node].first);
+   kids.push_back(tree[tree_node].first + 1);
+   while (kids.size() < 4) {
+      int widest = -1;
+      float widest_area = -1;
+      for (size_t k = 0; k < kids.size(); k++) {
+         int n = kids[k];
+         if (tree[n].count == 0 && end[n] - begin[n] > max_leaf_size &&
+             tree[n].box.surface_area() > widest_area)
+         {
+            widest = (int) k;
+            widest_area = tree[n].box.surface_area();
+         }
+      }
+      if (widest < 0) break;
+      int opened = kids[widest];
+      kids[widest] = tree[opened].first;
+      kids.push_back(tree[opened].first + 1);
+   }
+
+   int index = (int) nodes.size();
+   nodes.push_back(wide_bvh_node<4>());
+   for (int k = 0; k < 4; k++) {
+      wide_bvh_node<4>& node = nodes[index];
+      if (k < (int) kids.size()) {
+         const aabb& box = tree[kids[k]].box;
+         node.lo_x[k] = box.minimum.x; node.lo_y[k] = box.minimum.y; node.lo_z[k] = box.minimum.z;
+         node.hi_x[k] = box.maximum.x; node.hi_y[k] = box.maximum.y; node.hi_z[k] = box.maximum.z;
+      }
+      else {
+         node.lo_x[k] = node.lo_y[k] = node.lo_z[k] = infinity;
+         node.hi_x[k] = node.hi_y[k] = node.hi_z[k] = infinity;
+         node.child[k] = 0;
+      }
+   }
+   nodes[index].num_children = (int) kids.size();
+   for (size_t k = 0; k < kids.size(); k++) {
+      int child = collapse(kids[k], tree, begin, end);
+      nodes[index].child[k] = child; // nodes may have grown: index again
+   }
+   return index;
+}
+
+// Child code for spheres [first, first + count) of a builder leaf. Leaves
+// larger than a cloud leaf only come from the builder's depth limit; they
+// are cut into four pieces until they fit.
+inline int sphere_cloud::split(int first, int count)
+{
+   if (count <= max_leaf_size) return leaf_child(first, count);
+
+   int index = (int) nodes.size();
+   nodes.push_back(wide_bvh_node<4>());
+   nodes[index].num_children = 4;
+   for (int k = 0; k < 4; k++) {
+      int lo = first + count * k / 4;
+      int hi = first + count * (k + 1) / 4;
+      aabb box;
+      for (int i = lo; i < hi; i++) {
+         glm::vec3 extent(radius(i));
+         box.grow(aabb(center(i) - extent, center(i) + extent));
+      }
+      int child = split(lo, hi - lo);
+      wide_bvh_node<4>& node = nodes[index]; // nodes may have grown
+      node.lo_x[k] = box.minimum.x; node.lo_y[k] = box.minimum.y; node.lo_z[k] = box.minimum.z;
+      node.hi_x[k] = box.maximum.x; node.hi_y[k] = box.maximum.y; node.hi_z[k] = box.maximum.z;
+      node.child[k] = child;
+   }
+   return index;
+}
+
+// geometric method, as in sphere::hit, four spheres at a time
+inline void sphere_cloud::hit_leaf(int first, int count, const simd_ray& sr, float min_t,
+   float& closest_so_far, int& closest) const
+{
+   alignas(16) float r[4];
+   alignas(16) float t[4];
+   const float4 zero(0.0f);
+   for (int g = first; g < first + count; g += 4) {
+      for (int lane = 0; lane < 4; lane++) r[lane] = half_to_float(radius_material[g + lane] >> 16);
+      float4 elx = float4::loadu(&x[g]) - sr.ox;
+      float4 ely = float4::loadu(&y[g]) - sr.oy;
+      float4 elz = float4::loadu(&z[g]) - sr.oz;
+      float4 radius = float4::load(r);
+      float4 s = elx * sr.nx + ely * sr.ny + elz * sr.nz;
+      float4 el_sqr = elx * elx + ely * ely + elz * elz;
+      float4 r_sqr = radius * radius;
+      float4 m_sqr = el_sqr - s * s;
+      float4 outside = el_sqr > r_sqr;
+      float4 miss = ((s < zero) & outside) | (m_sqr > r_sqr);
+      float4 q = sqrt(max(r_sqr - m_sqr, zero));
+      float4 tt = select(outside, s - q, s + q) * float4(sr.inv_length);
+      float4 ok = andnot(miss, (tt >= float4(min_t)) & (tt <= float4(closest_so_far)));
+      int mask = movemask(ok) & ((1 << std::min(4, first + count - g)) - 1);
+      if (!mask) continue;
+
+      tt.store(t);
+      while (mask) {
+         int lane = first_lane(mask);
+         mask &= mask - 1;
+         if (t[lane] <= closest_so_far) {
+            closest_so_far = t[lane];
+            closest = g + lane;
+         }
+      }
+   }
+}
+
+inline bool sphere_cloud::hit_interval(const ray& r, float min_t, float max_t, hit_record& rec) const
+{
+   if (nodes.empty()) return false;
+
+   simd_ray sr(r);
+   float closest_so_far = max_t;
+   int closest = -1;
+
+   struct entry { int child; float t; };
+   entry stack[(bvh_builder::max_depth + 34) * 4];
+   int top = 0;
+   stack[top++] = { 0, -infinity };
+
+   alignas(16) float t_near[4];
+   entry hits[4];
+   while (top > 0) {
+      entry e = stack[--top];
+      if (e.t > closest_so_far) continue;
+
+      if (e.child < 0) {
+         hit_leaf(~e.child >> 5, ~e.child & 31, sr, min_t, closest_so_far, closest);
+         continue;
+      }
+
+      const wide_bvh_node<4>& node = nodes[e.child];
+      int mask = intersect_children<4>(node, sr, min_t, closest_so_far, t_near);
+      mask &= (1 << node.num_children) - 1;
+      if (!mask) continue;
+
+      // push far children first so the nearest is visited next
+      int count = 0;
+      for (int k = 0; k < 4; k++) {
+         if (!(mask & (1 << k))) continue;
+         entry h = { node.child[k], t_near[k] };
+         int pos = count++;
+         while (pos > 0 && hits[pos - 1].t < h.t) {
+            hits[pos] = hits[pos - 1];
+            pos--;
+         }
+         hits[pos] = h;
+      }
+      for (int k = 0; k < count; k++) stack[top++] = hits[k];
+   }
+   if (closest < 0) return false;
+
+   // only the closest sphere fills in the record
+   rec.t = closest_so_far;
+   rec.p = r.at(closest_so_far);
+   rec.set_face_normal(r, glm::normalize(rec.p - center(closest)));
+   int id = material_id(closest);
+   rec.mat_ptr = id < (int) materials.size() ? materials[id] : 0;
+   rec.object = this;
+   return true;
+}
+
+#endif
@@ -0,0 +1,19 @@
+// texture.h, colors that vary over a surface
+//
+// Textures are looked up at the surface coordinates (u, v) of a hit
+// (hit_record::u, v) and filtered over width, the size of the ray's
+// footprint in the same coordinates, so distant surfaces are not aliased.
+
+#ifndef TEXTURE_H_
+#define TEXTURE_H_
+
+#include "AGLM.h"
+
+class texture {
+public:
+   virtual glm::color value(float u, float v, float width) const = 0;
+
+   virtual ~texture() {}
+};
+
+#endif
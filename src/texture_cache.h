@@ -0,0 +1,346 @@
+// texture_cache.h, image textures paged in tile by tile under a memory budget
+//
+// Textures are converted once (convert, write_tiled) into a file holding
+// their mip pyramid cut into tiles of tile_size^2 8-bit rgb texels. Renders
+// open these files and read a tile only when a lookup first touches it, so
+// the textures of a scene can be much larger than memory. Tiles live in a
+// pool of fixed total size shared by all render threads: the pool is split
+// into shards, each with its own lock, its own least recently used list and
+// an equal part of the budget, and a tile's shard is picked by hashing its
+// key, so threads rarely wait on each other. Disk reads happen outside the
+// shard locks. Lookups filter trilinearly between the two mip levels whose
+// texels best match the width of the ray's footprint.
+
+#ifndef TEXTURE_CACHE_H_
+#define TEXTURE_CACHE_H_
+
+#include "AGLM.h"
+#include "ppm_image.h"
+#include "texture.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class texture_cache {
+public:
+   static const int tile_size = 64; // texels per side of a tile
+   static const int tile_bytes = tile_size * tile_size * 3;
+   static const int shard_count = 64;
+
+   // max_bytes bounds the texels kept in memory; every shard keeps at least one tile
+   explicit texture_cache(size_t max_bytes = size_t(2) << 30) :
+      shard_capacity(std::max<size_t>(1, max_bytes / tile_bytes / shard_count)), shards(shard_count) {}
+
+   texture_cache(const texture_cache&) = delete;
+   texture_cache& operator=(const texture_cache&) = delete;
+
+   // Opens a file written by write_tiled, returns its id or -1. Not thread
+   // safe: open the textures before rendering.
+   int open(const std::string& path);
+
+   // Color of texture id at (u, v), repeated outside [0, 1), filtered over
+   // a footprint of width in the same coordinates. Thread safe.
+   glm::color lookup(int id, float u, float v, float width) const;
+
+   // Writes the mip pyramid of a w x h image of rgb bytes (row by row from
+   // the top) as a tiled texture file
+   static bool write_tiled(const std::string& path, int w, int h, const std::vector<unsigned char>& rgb);
+
+   // write_tiled for an image file (png, jpg, ...)
+   static bool convert(const std::string& image_path, const std::string& tiled_path) {
+      int w, h;
+      std::vector<unsigned char> rgb;
+      return agl::load_rgb(image_path, w, h, rgb) && write_tiled(tiled_path, w, h, rgb);
+   }
+
+   size_t resident_bytes() const {
+      size_t tiles = 0;
+      for (size_t i = 0; i < shards.size(); i++) {
+         std::lock_guard<std::mutex> lock(shards[i].mutex);
+         tiles += shards[i].tiles.size();
+      }
+      return tiles * tile_bytes;
+   }
+
+   std::string str() const {
+      size_t hits = 0, misses = 0, evictions = 0;
+      for (size_t i = 0; i < shards.size(); i++) {
+         std::lock_guard<std::mutex> lock(shards[i].mutex);
+         hits += shards[i].hits;
+         misses += shards[i].misses;
+         evictions += shards[i].evictions;
+      }
+      std::ostringstream ss;
+      ss << "textures: " << textures.size() << " open, " << resident_bytes() / (1 << 20) << " of "
+         << shard_capacity * shard_count * tile_bytes / (1 << 20) << " MB resident, "
+         << misses << " tiles read, " << evictions << " evicted, "
+         << (hits + misses ? 100.0 * hits / (hits + misses) : 0.0) << "% hits" << std::endl;
+      return ss.str();
+   }
+
+private:
+   struct texture_file {
+      mutable std::ifstream in;
+      mutable std::mutex io; // one read at a time per file
+      int width, height, levels;
+      std::vector<int> level_width, level_height, tiles_x;
+      std::vector<long long> level_offset; // file offset of each level's first tile
+   };
+
+   struct tile {
+      unsigned char texels[tile_bytes];
+   };
+   typedef std::shared_ptr<const tile> tile_ptr;
+
+   struct entry {
+      tile_ptr data;
+      std::list<uint64_t>::iterator position;
+   };
+
+   struct shard {
+      mutable std::mutex mutex;
+      std::unordered_map<uint64_t, entry> tiles;
+      std::list<uint64_t> lru; // most recently used first
+      size_t hits = 0, misses = 0, evictions = 0;
+      char padding[64]; // keep the locks of neighboring shards on their own cache lines
+   };
+
+   static const int header_bytes = 20; // "RTX1", width, height, levels, tile_size
+
+   static uint64_t tile_key(int id, int level, int tx, int ty) {
+      return (uint64_t(id) << 48) | (uint64_t(level) << 42) | (uint64_t(ty) << 21) | uint64_t(tx);
+   }
+
+   static uint64_t hash(uint64_t x) {
+      x ^= x >> 33; x *= 0xff51afd7ed558ccdull;
+      x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ull;
+      x ^= x >> 33;
+      return x;
+   }
+
+   // 8-bit texels are stored with the gamma of the images we write (sqrt)
+   static const float* decode() {
+      struct table {
+         float v[256];
+         table() { for (int i = 0; i < 256; i++) v[i] = (i / 255.0f) * (i / 255.0f); }
+      };
+      static const table t;
+      return t.v;
+   }
+
+   static unsigned char encode(float linear) {
+      return (unsigned char) (std::sqrt(glm::clamp(linear, 0.0f, 1.0f)) * 255.0f + 0.5f);
+   }
+
+   tile_ptr fetch(int id, int level, int tx, int ty) const;
+   tile_ptr load(int id, int level, int tx, int ty) const;
+   glm::color bilinear(int id, int level, float u, float v) const;
+
+private:
+   size_t shard_capacity; // tiles per shard
+   mutable std::vector<shard> shards;
+   std::vector<std::unique_ptr<texture_file>> textures;
+};
+
+// Albedo from a texture of a cache
+class image_texture : public texture {
+public:
+   image_texture(std::shared_ptr<texture_cache> c, int texture_id) : cache(c), id(texture_id) {}
+
+   virtual glm::color value(float u, float v, float width) const override {
+      if (id < 0) return glm::color(1, 0, 1); // missing textures stand out
+      return cache->lookup(id, u, v, width);
+   }
+
+private:
+   std::shared_ptr<texture_cache> cache;
+   int id;
+};
+
+inline int texture_cache::open(const std::string& path)
+{
+   std::unique_ptr<texture_file> t(new texture_file());
+   t->in.open(path.c_str(), std::ios::binary);
+   char magic[4] = { 0 };
+   int32_t header[4] = { 0 };
+   t->in.read(magic, 4);
+   t->in.read((char*) header, sizeof(header));
+   if (!t->in || std::memcmp(magic, "RTX1", 4) != 0 || header[3] != tile_size ||
+      header[0] <= 0 || header[1] <= 0 || header[2] <= 0 || header[2] > 32)
+   {
+      std::cout << "cannot open texture " << path << std::endl;
+      return -1;
+   }
+   t->width = header[0];
+   t->height = header[1];
+   t->levels = header[2];
+   long long offset = header_bytes;
+   int w = t->width, h = t->height;
+   for (int level = 0; level < t->levels; level++) {
+      t->level_width.push_back(w);
+      t->level_height.push_back(h);
+      t->tiles_x.push_back((w + tile_size - 1) / tile_size);
+      t->level_offset.push_back(offset);
+      offset += (long long) t->tiles_x.back() * ((h + tile_size - 1) / tile_size) * tile_bytes;
+      w = std::max(1, (w + 1) / 2);
+      h = std::max(1, (h + 1) / 2);
+   }
+   textures.push_back(std::move(t));
+   return (int) textures.size() - 1;
+}
+
+inline texture_cache::tile_ptr texture_cache::fetch(int id, int level, int tx, int ty) const
+{
+   uint64_t key = tile_key(id, level, tx, ty);
+   shard& s = shards[hash(key) % shard_count];
+   {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      std::unordered_map<uint64_t, entry>::iterator it = s.tiles.find(key);
+      if (it != s.tiles.end()) {
+         s.lru.splice(s.lru.begin(), s.lru, it->second.position);
+         s.hits++;
+         return it->second.data;
+      }
+   }
+
+   tile_ptr loaded = load(id, level, tx, ty);
+   std::lock_guard<std::mutex> lock(s.mutex);
+   s.misses++;
+   std::unordered_map<uint64_t, entry>::iterator it = s.tiles.find(key);
+   if (it != s.tiles.end()) return it->second.data; // another thread read it meanwhile
+   while (s.tiles.size() >= shard_capacity) {
+      // readers still holding the evicted tile keep it alive until they are done
+      s.tiles.erase(s.lru.back());
+      s.lru.pop_back();
+      s.evictions++;
+   }
+   s.lru.push_front(key);
+   entry e = { loaded, s.lru.begin() };
+   s.tiles[key] = e;
+   return loaded;
+}
+
+// Reads a tile from disk; a tile that cannot be read is black
+inline texture_cache::tile_ptr texture_cache::load(int id, int level, int tx, int ty) const
+{
+   const texture_file& t = *textures[id];
+   std::shared_ptr<tile> result = std::make_shared<tile>();
+   long long offset = t.level_offset[level] + (long long) (ty * t.tiles_x[level] + tx) * tile_bytes;
+   std::lock_guard<std::mutex> lock(t.io);
+   t.in.clear();
+   t.in.seekg(offset);
+   t.in.read((char*) result->texels, tile_bytes);
+   if (!t.in) std::memset(result->texels, 0, tile_bytes);
+   return result;
+}
+
+inline glm::color texture_cache::bilinear(int id, int level, float u, float v) const
+{
+   const texture_file& t = *textures[id];
+   int w = t.level_width[level], h = t.level_height[level];
+   float x = u * w - 0.5f, y = (1.0f - v) * h - 0.5f; // v = 0 is the bottom row
+   int x0 = (int) std::floor(x), y0 = (int) std::floor(y);
+   float fx = x - x0, fy = y - y0;
+   int xs[2] = { ((x0 % w) + w) % w, 0 };
+   int ys[2] = { ((y0 % h) + h) % h, 0 };
+   xs[1] = (xs[0] + 1) % w;
+   ys[1] = (ys[0] + 1) % h;
+
+   const float* linear = decode();
+   glm::color texels[4];
+   tile_ptr current;
+   int current_tx = -1, current_ty = -1;
+   for (int k = 0; k < 4; k++) {
+      int tx = xs[k & 1] / tile_size, ty = ys[k >> 1] / tile_size;
+      if (tx != current_tx || ty != current_ty) {
+         current = fetch(id, level, tx, ty);
+         current_tx = tx;
+         current_ty = ty;
+      }
+      const unsigned char* texel = current->texels +
+         3 * ((ys[k >> 1] % tile_size) * tile_size + xs[k & 1] % tile_size);
+      texels[k] = glm::color(linear[texel[0]], linear[texel[1]], linear[texel[2]]);
+   }
+   return glm::mix(glm::mix(texels[0], texels[1], fx), glm::mix(texels[2], texels[3], fx), fy);
+}
+
+inline glm::color texture_cache::lookup(int id, float u, float v, float width) const
+{
+   const texture_file& t = *textures[id];
+   u -= std::floor(u);
+   v -= std::floor(v);
+   // the level whose texels are as wide as the footprint
+   float lod = std::log2(std::max(width * std::max(t.width, t.height), 1.0f));
+   lod = std::min(lod, float(t.levels - 1));
+   int level = (int) lod;
+   float blend = lod - level;
+   glm::color c = bilinear(id, level, u, v);
+   if (blend > 0 && level + 1 < t.levels) c = glm::mix(c, bilinear(id, level + 1, u, v), blend);
+   return c;
+}
+
+// Levels are halved (rounding up) down to 1 x 1 by averaging 2 x 2 texels
+// in linear space; tiles at the right and bottom edges are padded
+inline bool texture_cache::write_tiled(const std::string& path, int w, int h,
+   const std::vector<unsigned char>& rgb)
+{
+   if (w <= 0 || h <= 0 || (int) rgb.size() != 3 * w * h) return false;
+   std::ofstream out(path.c_str(), std::ios::binary);
+   if (!out) {
+      std::cout << "cannot write texture " << path << std::endl;
+      return false;
+   }
+   int levels = 1;
+   for (int size = std::max(w, h); size > 1; size = (size + 1) / 2) levels++;
+   int32_t header[4] = { w, h, levels, tile_size };
+   out.write("RTX1", 4);
+   out.write((const char*) header, sizeof(header));
+
+   const float* linear = decode();
+   std::vector<glm::color> texels(w * h);
+   for (int i = 0; i < w * h; i++) {
+      texels[i] = glm::color(linear[rgb[3 * i]], linear[rgb[3 * i + 1]], linear[rgb[3 * i + 2]]);
+   }
+   std::vector<unsigned char> block(tile_bytes);
+   for (int level = 0; level < levels; level++) {
+      int tiles_x = (w + tile_size - 1) / tile_size, tiles_y = (h + tile_size - 1) / tile_size;
+      for (int ty = 0; ty < tiles_y; ty++) {
+         for (int tx = 0; tx < tiles_x; tx++) {
+            for (int y = 0; y < tile_size; y++) {
+               for (int x = 0; x < tile_size; x++) {
+                  int sx = std::min(tx * tile_size + x, w - 1), sy = std::min(ty * tile_size + y, h - 1);
+                  const glm::color& c = texels[sy * w + sx];
+                  unsigned char* dst = &block[3 * (y * tile_size + x)];
+                  dst[0] = encode(c.r); dst[1] = encode(c.g); dst[2] = encode(c.b);
+               }
+            }
+            out.write((const char*) block.data(), tile_bytes);
+         }
+      }
+
+      int nw = std::max(1, (w + 1) / 2), nh = std::max(1, (h + 1) / 2);
+      std::vector<glm::color> next(nw * nh);
+      for (int y = 0; y < nh; y++) {
+         for (int x = 0; x < nw; x++) {
+            int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+            int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+            next[y * nw + x] = 0.25f * (texels[y0 * w + x0] + texels[y0 * w + x1] +
+               texels[y1 * w + x0] + texels[y1 * w + x1]);
+         }
+      }
+      texels.swap(next);
+      w = nw;
+      h = nh;
+   }
+   return (bool) out;
+}
+
+#endif
@@ -0,0 +1,129 @@
+// thread_pool.h, a small task pool shared by rendering and scene construction
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool {
+public:
+   explicit thread_pool(int num_threads) : stopping(false) {
+      for (int i = 0; i < num_threads; i++) {
+         workers.push_back(std::thread(&thread_pool::worker_loop, this));
+      }
+   }
+
+   ~thread_pool() {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         stopping = true;
+      }
+      wake.notify_all();
+      for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+   }
+
+   // the process-wide pool, one worker per hardware thread
+   static thread_pool& instance() {
+      static thread_pool pool(std::max(1u, std::thread::hardware_concurrency()));
+      return pool;
+   }
+
+   int size() const { return (int) workers.size(); }
+
+   void submit(const std::function<void()>& task) {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         tasks.push_back(task);
+      }
+      wake.notify_one();
+   }
+
+   // Run one queued task on the calling thread. Threads that wait on a
+   // task_group call this so that nested parallelism cannot deadlock.
+   bool run_pending_task() {
+      std::function<void()> task;
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         if (tasks.empty()) return false;
+         task = tasks.back();
+         tasks.pop_back();
+      }
+      task();
+      return true;
+   }
+
+private:
+   void worker_loop() {
+      for (;;) {
+         std::function<void()> task;
+         {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping && tasks.empty()) wake.wait(lock);
+            if (tasks.empty()) return; // stopping
+            task = tasks.front();
+            tasks.pop_front();
+         }
+         task();
+      }
+   }
+
+   std::vector<std::thread> workers;
+   std::deque<std::function<void()>> tasks;
+   std::mutex mutex;
+   std::condition_variable wake;
+   bool stopping;
+};
+
+// A set of tasks that can be waited on together. Tasks may themselves
+// create task_groups (recursive, fork-join style parallelism).
+class task_group {
+public:
+   task_group(thread_pool& p = thread_pool::instance()) : pool(p), pending(0) {}
+   ~task_group() { wait(); }
+
+   void run(const std::function<void()>& task) {
+      pending++;
+      std::atomic<int>* counter = &pending;
+      pool.submit([task, counter]() {
+         task();
+         (*counter)--;
+      });
+   }
+
+   void wait() {
+      while (pending > 0) {
+         if (!pool.run_pending_task()) std::this_thread::yield();
+      }
+   }
+
+private:
+   thread_pool& pool;
+   std::atomic<int> pending;
+};
+
+// Call body(begin, end) over [first, last) in chunks of at most grain items,
+// in parallel, and return when all chunks are done.
+inline void parallel_for(int first, int last, int grain,
+   const std::function<void(int, int)>& body)
+{
+   grain = std::max(1, grain);
+   if (last - first <= grain) {
+      if (last > first) body(first, last);
+      return;
+   }
+   task_group group;
+   for (int begin = first; begin < last; begin += grain) {
+      int end = std::min(last, begin + grain);
+      group.run([&body, begin, end]() { body(begin, end); });
+   }
+   group.wait();
+}
+
+#endif
@@ -0,0 +1,148 @@
+// tile_culling.h, per-tile candidate lists for camera rays
+//
+// Every camera ray of a tile starts at the camera origin and passes through
+// the tile's rectangle of the image plane (lower_left_corner + u * horizontal
+// + v * vertical), so it stays inside the frustum spanned by that rectangle.
+// Objects whose bounds do not reach into a tile's frustum cannot be the
+// first hit of its camera rays. Each object's bounds are projected onto the
+// image plane once and the object is added to the tiles it overlaps. Tiles
+// left with many objects get a bvh of their own, smaller than the scene's,
+// when they have enough camera rays to pay for building it; the rays of the
+// others go through the scene's accelerator. Culling costs a projection of
+// every object per camera, so it is worth it when a camera is kept for many
+// samples, not for one frame of a moving camera.
+
+#ifndef TILE_CULLING_H_
+#define TILE_CULLING_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include <cmath>
+#include <sstream>
+#include <vector>
+
+// Pixel rectangle [i0, i1] x [j0, j1] that camera rays of the image can
+// only hit the box from, false if the box is entirely off screen. Boxes
+// reaching behind the image plane cover the whole image.
+inline bool project_bounds(const camera& cam, int width, int height, const aabb& box,
+   int& i0, int& i1, int& j0, int& j1)
+{
+   glm::vec3 to_corner = cam.get_lower_left_corner() - cam.get_origin();
+   glm::vec3 h = cam.get_horizontal();
+   glm::vec3 v = cam.get_vertical();
+   glm::vec3 forward = to_corner + 0.5f * h + 0.5f * v; // to the center of the image plane
+   float forward_sqr = glm::dot(forward, forward);
+
+   float u_lo = infinity, u_hi = -infinity, v_lo = infinity, v_hi = -infinity;
+   for (int c = 0; c < 8; c++) {
+      glm::point3 p((c & 1) ? box.maximum.x : box.minimum.x,
+                    (c & 2) ? box.maximum.y : box.minimum.y,
+                    (c & 4) ? box.maximum.z : box.minimum.z);
+      glm::vec3 d = p - cam.get_origin();
+      float depth = glm::dot(d, forward) / forward_sqr; // 1 on the image plane
+      if (depth <= 1e-4f) {
+         // the projection of the box is unbounded
+         i0 = 0; i1 = width - 1; j0 = 0; j1 = height - 1;
+         return true;
+      }
+      glm::vec3 q = d / depth - to_corner;
+      float u = glm::dot(q, h) / glm::dot(h, h);
+      float w = glm::dot(q, v) / glm::dot(v, v);
+      u_lo = std::min(u_lo, u); u_hi = std::max(u_hi, u);
+      v_lo = std::min(v_lo, w); v_hi = std::max(v_hi, w);
+   }
+
+   // u = (i + jitter) / (width - 1), v = (height - j - 1 - jitter) / (height - 1)
+   float x_lo = u_lo * (width - 1), x_hi = u_hi * (width - 1);
+   float y_lo = (height - 1) - v_hi * (height - 1), y_hi = (height - 1) - v_lo * (height - 1);
+   if (x_hi < -1 || x_lo > width || y_hi < -1 || y_lo > height) return false;
+   x_lo = std::max(x_lo, -1.0f); x_hi = std::min(x_hi, float(width));
+   y_lo = std::max(y_lo, -1.0f); y_hi = std::min(y_hi, float(height));
+   i0 = std::max(0, int(std::floor(x_lo)) - 1);
+   i1 = std::min(width - 1, int(std::floor(x_hi)) + 1);
+   j0 = std::max(0, int(std::floor(y_lo)) - 1);
+   j1 = std::min(height - 1, int(std::ceil(y_hi)) + 1);
+   return true;
+}
+
+class tile_culler {
+public:
+   // tiles are laid out as in render(): tile_size squares, row by row from the top
+   tile_culler(const camera& c, int w, int h, int tile, int max_list = 32, int rays_per_object = 16) :
+      cam(c), width(w), height(h), tile_size(tile), max_candidates(max_list),
+      min_rays_per_object(rays_per_object), tiles_x((w + tile - 1) / tile), tiles_y((h + tile - 1) / tile) {}
+
+   // samples_per_pixel camera rays are traced through every pixel
+   void cull(const std::vector<std::shared_ptr<hittable>>& objects, int samples_per_pixel = 1);
+
+   // objects that camera rays of the tile can hit: a list, or a bvh over it
+   // when the list is longer than max_candidates; null when a bvh would cost
+   // more to build than the tile's rays save, to use the scene's instead
+   const accelerator* candidates(int tile) const {
+      if ((int) tiles[tile].objects.size() > max_candidates && !tile_bvhs[tile]) return 0;
+      if (tile_bvhs[tile]) return tile_bvhs[tile].get();
+      return &tiles[tile];
+   }
+
+   const std::vector<std::shared_ptr<hittable>>& objects(int tile) const {
+      return tiles[tile].objects;
+   }
+
+   std::string str() const {
+      size_t total = 0;
+      int with_bvh = 0, uncut = 0;
+      for (size_t t = 0; t < tiles.size(); t++) {
+         total += tiles[t].objects.size();
+         if (tile_bvhs[t]) with_bvh++;
+         else if ((int) tiles[t].objects.size() > max_candidates) uncut++;
+      }
+      std::ostringstream ss;
+      ss << "primary culling: " << float(total) / std::max<size_t>(1, tiles.size()) << " of "
+         << num_objects << " objects per tile, " << with_bvh << " of " << tiles.size()
+         << " tiles with a bvh, " << uncut << " traced through the scene's" << std::endl;
+      return ss.str();
+   }
+
+private:
+   camera cam;
+   int width, height, tile_size, max_candidates;
+   int min_rays_per_object; // camera rays per object a tile needs to build a bvh
+   int tiles_x, tiles_y;
+   int num_objects = 0;
+   std::vector<hittable_list> tiles;
+   std::vector<std::shared_ptr<bvh>> tile_bvhs;
+};
+
+inline void tile_culler::cull(const std::vector<std::shared_ptr<hittable>>& objects, int samples_per_pixel)
+{
+   num_objects = (int) objects.size();
+   tiles.assign(tiles_x * tiles_y, hittable_list());
+   for (size_t k = 0; k < objects.size(); k++) {
+      aabb box;
+      int i0 = 0, i1 = width - 1, j0 = 0, j1 = height - 1;
+      if (objects[k]->bounding_box(box) && !project_bounds(cam, width, height, box, i0, i1, j0, j1)) continue;
+      for (int ty = j0 / tile_size; ty <= j1 / tile_size; ty++) {
+         for (int tx = i0 / tile_size; tx <= i1 / tile_size; tx++) {
+            tiles[ty * tiles_x + tx].add(objects[k]);
+         }
+      }
+   }
+
+   tile_bvhs.assign(tiles.size(), std::shared_ptr<bvh>());
+   parallel_for(0, (int) tiles.size(), 1, [this, samples_per_pixel](int first, int last) {
+      for (int t = first; t < last; t++) {
+         int tx = t % tiles_x, ty = t / tiles_x;
+         long long rays = (long long) std::min(tile_size, width - tx * tile_size) *
+            std::min(tile_size, height - ty * tile_size) * std::max(1, samples_per_pixel);
+         long long size = (long long) tiles[t].objects.size();
+         if (size > max_candidates && rays >= size * min_rays_per_object) {
+            tile_bvhs[t] = std::make_shared<bvh>(tiles[t].objects);
+         }
+      }
+   });
+}
+
+#endif
@@ -0,0 +1,369 @@
+// tile_dependencies.h, what the paths of every tile touched, to re-render edits
+//
+// Moving one object changes few tiles of the image: those whose paths hit
+// it, seen directly, through reflections or as the blocker of a shadow ray,
+// and those whose rays pass where it is now. While rendering, every ray a
+// tile's paths trace is recorded: the object it hits, and the cells of a
+// coarse grid over the scene that its segment crosses. An edit is the
+// difference of two snapshots of the world's objects; a tile is traced
+// again when it touched a changed object or crossed the cells of its new
+// bounds. render (render.h) clears those tiles of the previous image and
+// traces them alone; the others keep their pixels. Edits to emitters, to
+// unbounded objects and past the grid re-render every tile.
+
+#ifndef TILE_DEPENDENCIES_H_
+#define TILE_DEPENDENCIES_H_
+
+#include "AGLM.h"
+#include "aabb.h"
+#include "accelerator.h"
+#include "camera.h"
+#include "hittable.h"
+#include "material.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "plane.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// An object that moved, changed shape or material, appeared or disappeared
+struct scene_change {
+   const hittable* object;
+   aabb after; // empty where the object was removed
+   bool unbounded; // before or after
+   bool emitter; // before or after
+};
+
+// The objects of a world, to compare with the same world after an edit
+class scene_snapshot {
+public:
+   explicit scene_snapshot(const std::vector<std::shared_ptr<hittable>>& objects);
+
+   // what changed from before to this snapshot
+   std::vector<scene_change> changes_since(const scene_snapshot& before) const;
+
+private:
+   struct entry {
+      aabb box;
+      bool bounded;
+      bool emitter;
+      uint64_t shape; // FNV-1a of the fields that place primitives, and their material
+   };
+
+   std::unordered_map<const hittable*, entry> entries;
+};
+
+class tile_dependencies {
+public:
+   // The grid covers the bounded objects with a margin, resolution cells
+   // along each axis; objects far larger than most (a ground sphere) are
+   // left out so that the cells stay small, and edits to them re-render
+   // every tile
+   explicit tile_dependencies(const std::vector<std::shared_ptr<hittable>>& objects, int resolution = 16);
+
+   // Called by render with the camera, image and settings it traces: the
+   // tiles to trace are those invalidated since the last render with the
+   // same ones, every tile otherwise
+   void begin(const camera& cam, int width, int height, int tile_size, int samples_per_pixel, int max_depth,
+      sampler_type type, uint32_t seed = 0);
+   bool dirty(int tile) const { return tiles[tile].dirty; }
+   // Called by render when done: complete is false when what tiles traced
+   // also depends on other tiles (shared caches), so the next render is full
+   void end(bool complete);
+
+   // marks the tiles that changes affect; returns their number
+   int invalidate(const std::vector<scene_change>& changes);
+   void invalidate_all();
+
+   // Recording by the thread tracing tile: clear before its first sample,
+   // then every ray from min_t to max_t and the object it hit, if any
+   void clear(int tile);
+   void record(int tile, const ray& r, float min_t, float max_t, bool hit, const hittable* object);
+
+   std::string str() const {
+      std::ostringstream ss;
+      ss << "tile dependencies: traced " << traced << " of " << tiles.size() << " tiles" << std::endl;
+      return ss.str();
+   }
+
+private:
+   struct tile_record {
+      bool dirty = true;
+      bool untracked = false; // hit something that is not named
+      const hittable* last = 0;
+      std::unordered_set<const hittable*> touched;
+      std::vector<uint64_t> cells; // one bit per grid cell crossed
+   };
+
+   // cell coordinates of p, unclamped
+   glm::vec3 to_grid(const glm::point3& p) const { return (p - bounds.min()) * cell_scale; }
+
+   int resolution;
+   aabb bounds;
+   glm::vec3 cell_scale;
+   uint64_t key = 0;
+   int traced = 0;
+   std::vector<tile_record> tiles;
+};
+
+// Intersects through world, recording every ray into tile of dependencies when given
+template <class world_t>
+class tracked_world {
+public:
+   tracked_world(const world_t& w, tile_dependencies* d, int t) : world(w), dependencies(d), tile(t) {}
+
+   bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const {
+      bool found = world.hit(r, min_t, max_t, rec);
+      if (dependencies) dependencies->record(tile, r, min_t, found ? rec.t : max_t, found, rec.object);
+      return found;
+   }
+
+private:
+   const world_t& world;
+   tile_dependencies* dependencies;
+   int tile;
+};
+
+// The same for the accelerator of a tile's camera rays
+class tracked_accelerator : public accelerator {
+public:
+   tracked_accelerator(const accelerator& a, tile_dependencies& d, int t) : primary(a), dependencies(d), tile(t) {}
+
+   virtual bool hit(const ray& r, float min_t, float max_t, hit_record& rec) const override {
+      bool found = primary.hit(r, min_t, max_t, rec);
+      dependencies.record(tile, r, min_t, found ? rec.t : max_t, found, rec.object);
+      return found;
+   }
+   virtual std::string name() const override { return primary.name(); }
+
+private:
+   const accelerator& primary;
+   tile_dependencies& dependencies;
+   int tile;
+};
+
+//-----------------------------------------------------------------------------
+
+inline scene_snapshot::scene_snapshot(const std::vector<std::shared_ptr<hittable>>& objects)
+{
+   struct mix {
+      static void bytes(uint64_t& h, const void* data, size_t n) {
+         const unsigned char* p = static_cast<const unsigned char*>(data);
+         for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 1099511628211ull;
+      }
+   };
+   for (size_t i = 0; i < objects.size(); i++) {
+      const hittable* object = objects[i].get();
+      entry e;
+      e.bounded = object->bounding_box(e.box);
+      e.shape = 14695981039346656037ull;
+      const material* m = 0;
+      if (const sphere* s = dynamic_cast<const sphere*>(object)) {
+         float fields[4] = { s->center.x, s->center.y, s->center.z, s->radius };
+         mix::bytes(e.shape, fields, sizeof(fields));
+         m = s->mat_ptr.get();
+      }
+      else if (const triangle* t = dynamic_cast<const triangle*>(object)) {
+         float fields[9] = { t->a.x, t->a.y, t->a.z, t->b.x, t->b.y, t->b.z, t->c.x, t->c.y, t->c.z };
+         mix::bytes(e.shape, fields, sizeof(fields));
+         m = t->mat_ptr.get();
+      }
+      else if (const plane* p = dynamic_cast<const plane*>(object)) {
+         float fields[6] = { p->a.x, p->a.y, p->a.z, p->n.x, p->n.y, p->n.z };
+         mix::bytes(e.shape, fields, sizeof(fields));
+         m = p->mat_ptr.get();
+      }
+      else if (e.bounded) {
+         // other objects are known by their bounds alone
+         glm::point3 corners[2] = { e.box.min(), e.box.max() };
+         mix::bytes(e.shape, corners, sizeof(corners));
+      }
+      mix::bytes(e.shape, &m, sizeof(m));
+      // emitters as the light tree finds them
+      glm::color emitted = m ? m->emitted(ray(), hit_record()) : glm::color(0);
+      e.emitter = emitted != glm::color(0);
+      entries[object] = e;
+   }
+}
+
+inline std::vector<scene_change> scene_snapshot::changes_since(const scene_snapshot& before) const
+{
+   std::vector<scene_change> changes;
+   for (const auto& now : entries) {
+      auto old = before.entries.find(now.first);
+      if (old != before.entries.end() && old->second.shape == now.second.shape) continue;
+      scene_change c;
+      c.object = now.first;
+      c.after = now.second.box;
+      c.unbounded = !now.second.bounded || (old != before.entries.end() && !old->second.bounded);
+      c.emitter = now.second.emitter || (old != before.entries.end() && old->second.emitter);
+      changes.push_back(c);
+   }
+   for (const auto& old : before.entries) {
+      if (entries.count(old.first)) continue;
+      scene_change c = { old.first, aabb(), !old.second.bounded, old.second.emitter };
+      changes.push_back(c);
+   }
+   return changes;
+}
+
+inline tile_dependencies::tile_dependencies(const std::vector<std::shared_ptr<hittable>>& objects, int res) :
+   resolution(glm::clamp(res, 1, 256))
+{
+   std::vector<aabb> boxes;
+   std::vector<float> sizes;
+   auto size = [](const aabb& box) {
+      glm::vec3 d = box.extent();
+      return std::max(d.x, std::max(d.y, d.z));
+   };
+   for (size_t i = 0; i < objects.size(); i++) {
+      aabb box;
+      if (!objects[i]->bounding_box(box)) continue;
+      boxes.push_back(box);
+      sizes.push_back(size(box));
+   }
+   if (!sizes.empty()) {
+      std::nth_element(sizes.begin(), sizes.begin() + sizes.size() / 2, sizes.end());
+      float largest = 16.0f * sizes[sizes.size() / 2];
+      for (const aabb& box : boxes) {
+         if (size(box) <= largest) bounds.grow(box);
+      }
+   }
+   if (bounds.empty()) bounds = aabb(glm::point3(-1), glm::point3(1));
+   // room for objects to move a little past the scene
+   glm::vec3 margin = 0.25f * bounds.extent() + glm::vec3(1e-3f);
+   bounds = aabb(bounds.min() - margin, bounds.max() + margin);
+   cell_scale = float(resolution) / bounds.extent();
+}
+
+inline void tile_dependencies::begin(const camera& cam, int width, int height, int tile_size, int samples_per_pixel,
+   int max_depth, sampler_type type, uint32_t seed)
+{
+   uint64_t h = 14695981039346656037ull;
+   glm::vec3 view[4] = { cam.get_origin(), cam.get_lower_left_corner(), cam.get_horizontal(), cam.get_vertical() };
+   int32_t settings[7] = { width, height, tile_size, samples_per_pixel, max_depth, int32_t(type), int32_t(seed) };
+   const unsigned char* p = reinterpret_cast<const unsigned char*>(view);
+   for (size_t i = 0; i < sizeof(view); i++) h = (h ^ p[i]) * 1099511628211ull;
+   p = reinterpret_cast<const unsigned char*>(settings);
+   for (size_t i = 0; i < sizeof(settings); i++) h = (h ^ p[i]) * 1099511628211ull;
+
+   size_t count = size_t((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size);
+   if (h != key || tiles.size() != count) {
+      tiles.clear();
+      tiles.resize(count);
+      key = h;
+   }
+   traced = 0;
+   for (size_t t = 0; t < tiles.size(); t++) traced += tiles[t].dirty;
+}
+
+inline void tile_dependencies::end(bool complete)
+{
+   for (size_t t = 0; t < tiles.size(); t++) tiles[t].dirty = !complete;
+}
+
+inline int tile_dependencies::invalidate(const std::vector<scene_change>& changes)
+{
+   // cells of the changed objects' new bounds, the lowest and highest per change
+   std::vector<glm::ivec3> lows, highs;
+   std::unordered_set<const hittable*> changed;
+   for (const scene_change& c : changes) {
+      changed.insert(c.object);
+      if (c.emitter || c.unbounded) {
+         invalidate_all();
+         return int(tiles.size());
+      }
+      if (c.after.empty()) continue;
+      glm::vec3 lo = to_grid(c.after.min()), hi = to_grid(c.after.max());
+      if (glm::any(glm::lessThan(lo, glm::vec3(0))) || glm::any(glm::greaterThanEqual(hi, glm::vec3(resolution)))) {
+         invalidate_all();
+         return int(tiles.size());
+      }
+      lows.push_back(glm::ivec3(glm::floor(lo)));
+      highs.push_back(glm::ivec3(glm::floor(hi)));
+   }
+
+   int count = 0;
+   for (tile_record& tile : tiles) {
+      bool affected = tile.dirty || tile.untracked;
+      for (auto it = changed.begin(); it != changed.end() && !affected; ++it) affected = tile.touched.count(*it) > 0;
+      for (size_t c = 0; c < lows.size() && !affected && !tile.cells.empty(); c++) {
+         for (int z = lows[c].z; z <= highs[c].z && !affected; z++) {
+            for (int y = lows[c].y; y <= highs[c].y && !affected; y++) {
+               for (int x = lows[c].x; x <= highs[c].x && !affected; x++) {
+                  size_t cell = (size_t(z) * resolution + y) * resolution + x;
+                  affected = (tile.cells[cell >> 6] >> (cell & 63)) & 1;
+               }
+            }
+         }
+      }
+      tile.dirty = affected;
+      count += affected;
+   }
+   return count;
+}
+
+inline void tile_dependencies::invalidate_all()
+{
+   for (size_t t = 0; t < tiles.size(); t++) tiles[t].dirty = true;
+}
+
+inline void tile_dependencies::clear(int tile)
+{
+   tile_record& t = tiles[tile];
+   t.untracked = false;
+   t.last = 0;
+   t.touched.clear();
+   t.cells.assign((size_t(resolution) * resolution * resolution + 63) / 64, 0);
+}
+
+inline void tile_dependencies::record(int tile, const ray& r, float min_t, float max_t, bool hit,
+   const hittable* object)
+{
+   tile_record& t = tiles[tile];
+   if (hit && !object) t.untracked = true;
+   if (hit && object && object != t.last) {
+      t.touched.insert(object);
+      t.last = object;
+   }
+
+   // the segment inside the grid, in cell coordinates
+   float t_enter;
+   glm::vec3 inv_dir = 1.0f / r.direction();
+   if (!bounds.hit(r.origin(), inv_dir, min_t, max_t, t_enter)) return;
+   glm::vec3 t0 = (bounds.min() - r.origin()) * inv_dir, t1 = (bounds.max() - r.origin()) * inv_dir;
+   glm::vec3 t_far = glm::max(t0, t1);
+   float t_exit = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, max_t));
+   glm::vec3 from = to_grid(r.at(t_enter)), to = to_grid(r.at(t_exit));
+
+   // cells along the segment (Amanatides and Woo)
+   glm::ivec3 cell = glm::clamp(glm::ivec3(glm::floor(from)), glm::ivec3(0), glm::ivec3(resolution - 1));
+   glm::ivec3 last = glm::clamp(glm::ivec3(glm::floor(to)), glm::ivec3(0), glm::ivec3(resolution - 1));
+   glm::vec3 d = to - from;
+   glm::ivec3 step;
+   glm::vec3 next, delta;
+   for (int a = 0; a < 3; a++) {
+      step[a] = d[a] > 0 ? 1 : (d[a] < 0 ? -1 : 0);
+      delta[a] = step[a] ? 1.0f / std::fabs(d[a]) : infinity;
+      float boundary = float(step[a] > 0 ? cell[a] + 1 : cell[a]);
+      next[a] = step[a] ? (boundary - from[a]) / d[a] : infinity;
+   }
+   for (int n = 0; n < 3 * resolution + 3; n++) {
+      size_t k = (size_t(cell.z) * resolution + cell.y) * resolution + cell.x;
+      t.cells[k >> 6] |= uint64_t(1) << (k & 63);
+      if (cell == last) break;
+      int a = next.x < next.y ? (next.x < next.z ? 0 : 2) : (next.y < next.z ? 1 : 2);
+      cell[a] += step[a];
+      if (cell[a] < 0 || cell[a] >= resolution) break;
+      next[a] += delta[a];
+   }
+}
+
+#endif
@@ -10,6 +10,9 @@ public:
    triangle() : a(0), b(0), c(0), mat_ptr(0) {}
    triangle(const glm::point3& v0, const glm::point3& v1, const glm::point3& v2, 
       std::shared_ptr<material> m) : a(v0), b(v1), c(v2), mat_ptr(m) {};
+   triangle(const glm::point3& v0, const glm::point3& v1, const glm::point3& v2,
+      const glm::vec2& t0, const glm::vec2& t1, const glm::vec2& t2, std::shared_ptr<material> m) :
+      a(v0), b(v1), c(v2), mat_ptr(m), ta(t0), tb(t1), tc(t2) {};
 
    virtual bool hit(const ray& r, hit_record& rec) const override
    {
@@ -37,6 +40,7 @@ public:
       rec.t = t; // save the time when we hit the object
       rec.p = r.at(t); // ray.origin + t * ray.direction
       rec.mat_ptr = mat_ptr;
+      rec.object = this;
 
       // save normal
       glm::vec3 outward_normal = normalize(cross(e1, e2)); // compute unit length normal
@@ -45,11 +49,81 @@ public:
       return true;
    }
 
+   virtual bool bounding_box(aabb& output_box) const override
+   {
+      output_box = aabb(glm::min(a, glm::min(b, c)), glm::max(a, glm::max(b, c)));
+      return true;
+   }
+
+   virtual bool transform(const glm::mat4& m) override
+   {
+      a = glm::point3(m * glm::vec4(a, 1.0f));
+      b = glm::point3(m * glm::vec4(b, 1.0f));
+      c = glm::point3(m * glm::vec4(c, 1.0f));
+      return true;
+   }
+
+   // uniform over the area of the triangle, converted to solid angle at o
+   virtual float sample_direction(const glm::point3& o, float u1, float u2, glm::vec3& direction) const override
+   {
+      float s = std::sqrt(u1);
+      glm::point3 p = a * (1.0f - s) + b * (s * (1.0f - u2)) + c * (s * u2);
+      direction = p - o;
+      return solid_angle_pdf(direction);
+   }
+
+   virtual float direction_pdf(const glm::point3& o, const hit_record& rec) const override
+   {
+      return solid_angle_pdf(rec.p - o);
+   }
+
+   virtual float area() const override { return 0.5f * glm::length(cross(b - a, c - a)); }
+
+   virtual bool sample_surface(float u1, float u2, hit_record& rec) const override
+   {
+      float s = std::sqrt(u1);
+      rec.p = a * (1.0f - s) + b * (s * (1.0f - u2)) + c * (s * u2);
+      rec.normal = normalize(cross(b - a, c - a));
+      rec.front_face = true;
+      rec.mat_ptr = mat_ptr;
+      rec.object = this;
+      return true;
+   }
+
+   // texture coordinates interpolated from the vertices
+   virtual void surface_coordinates(hit_record& rec) const override
+   {
+      glm::vec3 n = cross(b - a, c - a);
+      float n_sqr = dot(n, n);
+      if (n_sqr <= 0) return;
+      float wb = dot(cross(rec.p - a, c - a), n) / n_sqr;
+      float wc = dot(cross(b - a, rec.p - a), n) / n_sqr;
+      glm::vec2 uv = ta + wb * (tb - ta) + wc * (tc - ta);
+      rec.u = uv.x;
+      rec.v = uv.y;
+      glm::vec2 eb = tb - ta, ec = tc - ta;
+      rec.uv_density = std::sqrt(fabs(eb.x * ec.y - eb.y * ec.x) / std::sqrt(n_sqr));
+   }
+
+private:
+   // area density 1 / area seen along to_point: distance^2 / (cos * area)
+   float solid_angle_pdf(const glm::vec3& to_point) const
+   {
+      glm::vec3 n = cross(b - a, c - a); // length is twice the area
+      float dist_sqr = dot(to_point, to_point);
+      float cos_area = fabs(dot(n, to_point)) * 0.5f / std::sqrt(dist_sqr);
+      return cos_area > 0 ? dist_sqr / cos_area : 0.0f;
+   }
+
 public:
    glm::point3 a;
    glm::point3 b;
    glm::point3 c;
    std::shared_ptr<material> mat_ptr;
+   glm::vec2 ta = glm::vec2(0, 0), tb = glm::vec2(1, 0), tc = glm::vec2(0, 1); // texture coordinates
 };
 
+// a triangle owns nothing outside a scene arena unless its material has a control block
+inline bool owns_outside_arena(const triangle& t) { return t.mat_ptr.use_count() > 0; }
+
 #endif
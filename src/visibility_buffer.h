@@ -0,0 +1,247 @@
+// visibility_buffer.h, first hits of camera rays by rasterization
+//
+// Every camera ray of a tile starts at the camera origin and goes through a
+// known, jittered point (u, v) of the image plane. Instead of tracing these
+// rays, the tile's candidate objects (tile_culling.h) are rasterized over
+// the sample points: triangles fully in front of the camera with edge
+// functions on the image plane, and spheres as impostors, a ray-sphere test
+// over their projected bounds; both four samples at a time. Other objects
+// are tested with their own hit over their projected bounds. Each sample
+// keeps the closest object and the t of its ray at that object.
+// Coverage tests are inflated by a small tolerance and depths are measured
+// along the sample's own ray, so the object kept is the one tracing finds.
+// render() then asks that object alone for the hit record, and traces the
+// ray as usual when it misses (a sample on an inflated edge).
+
+#ifndef VISIBILITY_BUFFER_H_
+#define VISIBILITY_BUFFER_H_
+
+#include "AGLM.h"
+#include "camera.h"
+#include "hittable.h"
+#include "simd.h"
+#include "sphere.h"
+#include "tile_culling.h"
+#include "triangle.h"
+#include <memory>
+#include <vector>
+
+// Camera samples of one tile, pixel by pixel (row by row from the top) with
+// per_pixel samples each, in the order render() creates its paths. u and v
+// are what is passed to camera::get_ray; both are padded by 3 so that any
+// sample can start a group of four.
+struct tile_samples {
+   int i0 = 0, j0 = 0; // first pixel of the tile
+   int width = 0, height = 0;
+   int per_pixel = 1;
+   aligned_vector<float> u, v;
+
+   void reset(int first_i, int first_j, int w, int h, int spp) {
+      i0 = first_i; j0 = first_j; width = w; height = h; per_pixel = spp;
+      int n = size();
+      u.assign(n + 3, 0.0f);
+      v.assign(n + 3, 0.0f);
+   }
+
+   int size() const { return width * height * per_pixel; }
+
+   // index of the first sample of image pixel (i, j)
+   int first(int i, int j) const { return ((j - j0) * width + (i - i0)) * per_pixel; }
+};
+
+// Closest object per sample, null when no object covers it
+struct visibility_buffer {
+   std::vector<const hittable*> object;
+   aligned_vector<float> depth; // t along the sample's camera ray
+
+   void reset(int n) {
+      object.assign(n, (const hittable*) 0);
+      depth.assign(n + 3, infinity);
+   }
+};
+
+class primary_rasterizer {
+public:
+   // min_t is the smallest t of a first hit, as passed to hit when tracing
+   primary_rasterizer(const camera& c, int w, int h, float min_t = 0.001f) :
+      cam(c), width(w), height(h), min_t(min_t) {}
+
+   void rasterize(const std::vector<std::shared_ptr<hittable>>& objects,
+      const tile_samples& samples, visibility_buffer& vb) const;
+
+private:
+   // coverage tolerance: a hundredth of a pixel on the image plane
+   float edge_tolerance() const { return 0.01f / std::max(width, height); }
+
+   bool rasterize_triangle(const triangle& tri, int i0, int i1, int j0, int j1,
+      const tile_samples& samples, visibility_buffer& vb) const;
+   void rasterize_sphere(const sphere& s, int i0, int i1, int j0, int j1,
+      const tile_samples& samples, visibility_buffer& vb) const;
+   void rasterize_object(const hittable& object, int i0, int i1, int j0, int j1,
+      const tile_samples& samples, visibility_buffer& vb) const;
+
+   // keep the covered lanes of samples [k, k + 4) that are closer than what
+   // the buffer holds
+   static void resolve(int k, int end, float4 covered, float4 t, const hittable* object,
+      visibility_buffer& vb) {
+      float4 closer = covered & (t < float4::loadu(&vb.depth[k]));
+      int mask = movemask(closer) & ((1 << std::min(4, end - k)) - 1);
+      if (!mask) return;
+      alignas(16) float ts[4];
+      t.store(ts);
+      for (int lane = 0; lane < 4; lane++) {
+         if (mask & (1 << lane)) {
+            vb.depth[k + lane] = ts[lane];
+            vb.object[k + lane] = object;
+         }
+      }
+   }
+
+   // the image plane point (u, v) of a point in front of the camera, false otherwise
+   bool project(const glm::point3& p, float& u, float& v) const {
+      glm::vec3 to_corner = cam.get_lower_left_corner() - cam.get_origin();
+      glm::vec3 forward = to_corner + 0.5f * cam.get_horizontal() + 0.5f * cam.get_vertical();
+      glm::vec3 d = p - cam.get_origin();
+      float depth = glm::dot(d, forward) / glm::dot(forward, forward);
+      if (depth <= 1e-4f) return false;
+      glm::vec3 q = d / depth - to_corner;
+      u = glm::dot(q, cam.get_horizontal()) / glm::dot(cam.get_horizontal(), cam.get_horizontal());
+      v = glm::dot(q, cam.get_vertical()) / glm::dot(cam.get_vertical(), cam.get_vertical());
+      return true;
+   }
+
+private:
+   camera cam;
+   int width, height;
+   float min_t;
+};
+
+inline void primary_rasterizer::rasterize(const std::vector<std::shared_ptr<hittable>>& objects,
+   const tile_samples& samples, visibility_buffer& vb) const
+{
+   vb.reset(samples.size());
+   int tile_i1 = samples.i0 + samples.width - 1;
+   int tile_j1 = samples.j0 + samples.height - 1;
+   for (size_t k = 0; k < objects.size(); k++) {
+      const hittable* object = objects[k].get();
+      aabb box;
+      int i0 = 0, i1 = width - 1, j0 = 0, j1 = height - 1;
+      if (object->bounding_box(box) && !project_bounds(cam, width, height, box, i0, i1, j0, j1)) continue;
+      i0 = std::max(i0, samples.i0); i1 = std::min(i1, tile_i1);
+      j0 = std::max(j0, samples.j0); j1 = std::min(j1, tile_j1);
+      if (i0 > i1 || j0 > j1) continue;
+
+      if (const triangle* tri = dynamic_cast<const triangle*>(object)) {
+         if (rasterize_triangle(*tri, i0, i1, j0, j1, samples, vb)) continue;
+      }
+      else if (const sphere* s = dynamic_cast<const sphere*>(object)) {
+         rasterize_sphere(*s, i0, i1, j0, j1, samples, vb);
+         continue;
+      }
+      rasterize_object(*object, i0, i1, j0, j1, samples, vb);
+   }
+}
+
+// Edge functions of the projected triangle; false when a vertex is behind
+// the camera or the triangle is seen edge-on, and it has to be traced
+inline bool primary_rasterizer::rasterize_triangle(const triangle& tri, int i0, int i1, int j0, int j1,
+   const tile_samples& samples, visibility_buffer& vb) const
+{
+   float pu[3], pv[3];
+   if (!project(tri.a, pu[0], pv[0]) || !project(tri.b, pu[1], pv[1]) || !project(tri.c, pu[2], pv[2])) {
+      return false;
+   }
+   float area = (pu[1] - pu[0]) * (pv[2] - pv[0]) - (pv[1] - pv[0]) * (pu[2] - pu[0]);
+   if (std::fabs(area) < 1e-12f) return false;
+   float orientation = area > 0 ? 1.0f : -1.0f;
+
+   // inside edge e when eu * v - ev * u + ec >= 0; ec moves the edge out by the tolerance
+   float4 eu[3], ev[3], ec[3];
+   for (int e = 0; e < 3; e++) {
+      int n = (e + 1) % 3;
+      float du = (pu[n] - pu[e]) * orientation;
+      float dv = (pv[n] - pv[e]) * orientation;
+      eu[e] = float4(du);
+      ev[e] = float4(dv);
+      ec[e] = float4(dv * pu[e] - du * pv[e] + edge_tolerance() * std::sqrt(du * du + dv * dv));
+   }
+
+   // the camera ray through (u, v) meets the triangle's plane at
+   // t = n.(a - origin) / n.(to_corner + u * horizontal + v * vertical)
+   glm::vec3 n = glm::cross(tri.b - tri.a, tri.c - tri.a);
+   float4 n_corner(glm::dot(n, cam.get_lower_left_corner() - cam.get_origin()));
+   float4 n_h(glm::dot(n, cam.get_horizontal()));
+   float4 n_v(glm::dot(n, cam.get_vertical()));
+   float4 n_a(glm::dot(n, tri.a - cam.get_origin()));
+   float4 lo(min_t), zero(0.0f);
+
+   for (int j = j0; j <= j1; j++) {
+      int end = samples.first(i1, j) + samples.per_pixel;
+      for (int k = samples.first(i0, j); k < end; k += 4) {
+         float4 u = float4::loadu(&samples.u[k]);
+         float4 v = float4::loadu(&samples.v[k]);
+         float4 covered = (eu[0] * v - ev[0] * u + ec[0] >= zero) &
+                          (eu[1] * v - ev[1] * u + ec[1] >= zero) &
+                          (eu[2] * v - ev[2] * u + ec[2] >= zero);
+         if (!movemask(covered)) continue;
+         float4 t = n_a / (n_corner + u * n_h + v * n_v);
+         resolve(k, end, covered & (t >= lo), t, &tri, vb);
+      }
+   }
+   return true;
+}
+
+// The geometric ray-sphere test of sphere::hit, with the miss distance
+// compared against a slightly larger radius
+inline void primary_rasterizer::rasterize_sphere(const sphere& s, int i0, int i1, int j0, int j1,
+   const tile_samples& samples, visibility_buffer& vb) const
+{
+   glm::vec3 corner = cam.get_lower_left_corner() - cam.get_origin();
+   glm::vec3 h = cam.get_horizontal();
+   glm::vec3 vv = cam.get_vertical();
+   glm::vec3 el = s.center - cam.get_origin();
+   float el_sqr = glm::dot(el, el);
+   float r_sqr = s.radius * s.radius;
+   bool outside = el_sqr > r_sqr;
+   float4 m_max(r_sqr + 1e-4f * r_sqr + 1e-6f * el_sqr);
+   float4 lo(min_t), zero(0.0f);
+
+   for (int j = j0; j <= j1; j++) {
+      int end = samples.first(i1, j) + samples.per_pixel;
+      for (int k = samples.first(i0, j); k < end; k += 4) {
+         float4 u = float4::loadu(&samples.u[k]);
+         float4 v = float4::loadu(&samples.v[k]);
+         float4 dx = float4(corner.x) + u * float4(h.x) + v * float4(vv.x);
+         float4 dy = float4(corner.y) + u * float4(h.y) + v * float4(vv.y);
+         float4 dz = float4(corner.z) + u * float4(h.z) + v * float4(vv.z);
+         float4 length = sqrt(dx * dx + dy * dy + dz * dz);
+         float4 sd = (float4(el.x) * dx + float4(el.y) * dy + float4(el.z) * dz) / length;
+         float4 m_sqr = float4(el_sqr) - sd * sd;
+         float4 covered = m_sqr <= m_max;
+         if (outside) covered = covered & (sd >= zero);
+         if (!movemask(covered)) continue;
+         float4 q = sqrt(max(float4(r_sqr) - m_sqr, zero));
+         float4 t = (outside ? sd - q : sd + q) / length;
+         resolve(k, end, covered & (t >= lo), t, &s, vb);
+      }
+   }
+}
+
+// Any other object: its own hit for each sample of its projected bounds
+inline void primary_rasterizer::rasterize_object(const hittable& object, int i0, int i1, int j0, int j1,
+   const tile_samples& samples, visibility_buffer& vb) const
+{
+   hit_record rec;
+   for (int j = j0; j <= j1; j++) {
+      int end = samples.first(i1, j) + samples.per_pixel;
+      for (int k = samples.first(i0, j); k < end; k++) {
+         ray r = cam.get_ray(samples.u[k], samples.v[k]);
+         if (object.hit_interval(r, min_t, vb.depth[k], rec) && rec.t < vb.depth[k]) {
+            vb.depth[k] = rec.t;
+            vb.object[k] = &object;
+         }
+      }
+   }
+}
+
+#endif